@@ -0,0 +1,361 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "animation.hpp"
+#include "image.hpp"
+#include "renderer.hpp"
+#include "reproject.hpp"
+#include "scenefile.hpp"
+#include "sceneparser.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/* Animation implementation */
+
+Animation::Animation() : frames(0) {}
+
+// where `frame` falls between keys lo and lo + 1 (of those for one
+// object, or the camera's), as a fraction of the way from one to the other
+template <typename Key>
+static void bracket(const std::vector<Key> &keys, size_t begin, size_t end, int frame, size_t &lo, double &f) {
+	lo = begin;
+	f = 0.0;
+	if (frame <= keys[begin].frame)
+		return;
+	while (lo + 1 < end && keys[lo + 1].frame <= frame)
+		lo++;
+	if (lo + 1 < end)
+		f = static_cast<double>(frame - keys[lo].frame) / (keys[lo + 1].frame - keys[lo].frame);
+}
+
+static double lerp(double a, double b, double f) {
+	return a + (b - a) * f;
+}
+
+static vec3 lerp(const vec3 &a, const vec3 &b, double f) {
+	return a + (b - a).scaled(f);
+}
+
+bool Animation::cameraAt(int frame, Camera &cam) const {
+	if (camera.empty())
+		return false;
+
+	size_t lo;
+	double f;
+	bracket(camera, 0, camera.size(), frame, lo, f);
+	const CameraKey &a = camera[lo];
+	const CameraKey &b = camera[std::min(lo + 1, camera.size() - 1)];
+
+	cam = Camera(lerp(a.position, b.position, f));
+	cam.rotateY(lerp(a.rotate_y, b.rotate_y, f));
+	cam.rotateX(lerp(a.rotate_x, b.rotate_x, f));
+	return true;
+}
+
+vec3 Animation::offsetAt(int object, int frame) const {
+	size_t begin = 0;
+	while (begin < moves.size() && moves[begin].object < object)
+		begin++;
+	size_t end = begin;
+	while (end < moves.size() && moves[end].object == object)
+		end++;
+	if (begin == end)
+		return vec3(0.0, 0.0, 0.0);
+
+	size_t lo;
+	double f;
+	bracket(moves, begin, end, frame, lo, f);
+	return lerp(moves[lo].offset, moves[std::min(lo + 1, end - 1)].offset, f);
+}
+
+void loadAnimation(const std::string &path, Animation &anim) {
+	std::ifstream in(path.c_str());
+	if (!in)
+		throw SceneFileException(path, "cannot open");
+
+	anim = Animation();
+	std::string line;
+	size_t line_no = 0;
+	while (std::getline(in, line)) {
+		line_no++;
+		std::istringstream words(line.substr(0, line.find('#')));
+		std::string directive;
+		if (!(words >> directive))
+			continue;
+
+		if (directive == "frames") {
+			if (!(words >> anim.frames) || anim.frames < 1)
+				throw SceneParseException(path, line_no, "expected a number of frames");
+		}
+		else if (directive == "camera") {
+			int frame;
+			double x, y, z, rotate_y, rotate_x;
+			if (!(words >> frame >> x >> y >> z >> rotate_y >> rotate_x) || frame < 0)
+				throw SceneParseException(path, line_no, "expected camera <frame> <x> <y> <z> <rotate_y> <rotate_x>");
+			CameraKey k = { frame, vec3(x, y, z), rotate_y, rotate_x };
+			anim.camera.push_back(k);
+		}
+		else if (directive == "move") {
+			int object, frame;
+			double x, y, z;
+			if (!(words >> object >> frame >> x >> y >> z) || object < 0 || frame < 0)
+				throw SceneParseException(path, line_no, "expected move <object> <frame> <dx> <dy> <dz>");
+			MoveKey k = { object, frame, vec3(x, y, z) };
+			anim.moves.push_back(k);
+		}
+		else
+			throw SceneParseException(path, line_no, "unknown directive '" + directive + "'");
+
+		std::string extra;
+		if (words >> extra)
+			throw SceneParseException(path, line_no, "unexpected '" + extra + "'");
+	}
+
+	if (anim.frames == 0)
+		throw SceneParseException(path, line_no, "no frames line");
+
+	// keys can come in any order in the file
+	std::stable_sort(anim.camera.begin(), anim.camera.end(),
+		[](const CameraKey &a, const CameraKey &b) { return a.frame < b.frame; });
+	std::stable_sort(anim.moves.begin(), anim.moves.end(),
+		[](const MoveKey &a, const MoveKey &b) {
+			return a.object != b.object ? a.object < b.object : a.frame < b.frame;
+		});
+}
+
+/* rendering */
+
+AnimationOptions::AnimationOptions() : first_frame(0), last_frame(-1), threads(0), pipelined(true), reproject(false) {}
+
+namespace {
+
+struct FinishedFrame {
+	Image *image;
+	int frame;
+};
+
+/* FrameWriter
+ *
+ * encodes and writes frames on a thread of its own, handing each image
+ * back once it's written */
+class FrameWriter {
+private:
+	std::string prefix;
+	std::mutex lock;
+	std::condition_variable changed;
+	std::deque<FinishedFrame> queue;
+	std::vector<Image *> idle;
+	bool stopping;
+	std::string error;		// the first write that failed
+	double busy;			// seconds spent encoding and writing
+	std::thread worker;
+
+	void run() {
+		std::vector<char> bytes;
+		std::unique_lock<std::mutex> guard(lock);
+		for (;;) {
+			changed.wait(guard, [this] { return stopping || !queue.empty(); });
+			if (queue.empty())
+				return;
+			FinishedFrame f = queue.front();
+			queue.pop_front();
+
+			guard.unlock();
+			std::string failed;
+			const Clock::time_point start = Clock::now();
+			if (!writeFrame(prefix, *f.image, f.frame, bytes))
+				failed = framePath(prefix, f.frame);
+			const double took = secondsSince(start);
+			guard.lock();
+
+			busy += took;
+			if (!failed.empty() && error.empty())
+				error = failed;
+			idle.push_back(f.image);
+			changed.notify_all();
+		}
+	}
+
+public:
+	FrameWriter(const std::string &out_prefix, Image *a, Image *b)
+		: prefix(out_prefix), stopping(false), busy(0.0) {
+		idle.push_back(a);
+		idle.push_back(b);
+		worker = std::thread(&FrameWriter::run, this);
+	}
+
+	~FrameWriter() {
+		stop();
+	}
+
+	static std::string framePath(const std::string &prefix, int frame) {
+		char number[16];
+		snprintf(number, sizeof(number), "%04d", frame);
+		return prefix + number + ".ppm";
+	}
+
+	static bool writeFrame(const std::string &prefix, const Image &img, int frame, std::vector<char> &bytes) {
+		img.encodePPM(bytes);
+		std::ofstream out(framePath(prefix, frame).c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		out.write(&bytes[0], static_cast<std::streamsize>(bytes.size()));
+		return static_cast<bool>(out);
+	}
+
+	// an image that isn't waiting to be written, once there is one
+	Image *take() {
+		std::unique_lock<std::mutex> guard(lock);
+		changed.wait(guard, [this] { return !idle.empty(); });
+		Image *img = idle.back();
+		idle.pop_back();
+		return img;
+	}
+
+	void write(Image *img, int frame) {
+		std::lock_guard<std::mutex> guard(lock);
+		queue.push_back(FinishedFrame{ img, frame });
+		changed.notify_all();
+	}
+
+	// waits for every frame to be written
+	void stop() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+			changed.notify_all();
+		}
+		if (worker.joinable())
+			worker.join();
+	}
+
+	// stop, throwing if any frame couldn't be written
+	void finish() {
+		stop();
+		if (!error.empty()) {
+			std::string path = error;
+			error.clear();
+			throw SceneFileException(path, "write failed");
+		}
+	}
+
+	double busySeconds() const {
+		return busy;
+	}
+};
+
+}
+
+void renderAnimation(const std::string &scene_path, const std::string &anim_path,
+		const std::string &out_prefix, const AnimationOptions &opts) {
+	Animation anim;
+	loadAnimation(anim_path, anim);
+
+	const int first = std::max(0, opts.first_frame);
+	const int last = opts.last_frame < 0 ? anim.frames - 1 : std::min(opts.last_frame, anim.frames - 1);
+	if (first > last)
+		throw SceneParseException(anim_path, 0, "no frames between " + std::to_string(first) + " and " + std::to_string(last));
+
+	World world(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec());
+	loadScene(scene_path, world);
+
+	// numbered before the hierarchy is built, as EditSession does
+	std::vector<SceneObject*> objects;
+	world.numberObjects();
+	world.collectObjects(objects);
+	world.buildHierarchy();
+
+	std::vector<int> moving;
+	for (size_t k = 0; k < anim.moves.size(); k++) {
+		const int id = anim.moves[k].object;
+		if (id >= static_cast<int>(objects.size()))
+			throw GeometryException("There is no object " + std::to_string(id));
+		if (moving.empty() || moving.back() != id)
+			moving.push_back(id);
+	}
+	std::vector<vec3> placed(moving.size(), vec3(0.0, 0.0, 0.0));
+
+	std::unique_ptr<ReprojectionCache> cache;
+	if (opts.reproject)
+		cache.reset(new ReprojectionCache(world));
+
+	RenderEngine engine(opts.threads);
+	const int w = world.viewport.pixelsWide();
+	const int h = world.viewport.pixelsTall();
+	Image a(w, h), b(w, h);
+	FrameWriter writer(out_prefix, &a, &b);
+	std::vector<char> bytes;
+
+	const Clock::time_point start = Clock::now();
+	double tracing = 0.0, writing = 0.0;
+
+	for (int frame = first; frame <= last; frame++) {
+		Image *img = opts.pipelined ? writer.take() : &a;
+
+		const Clock::time_point trace_start = Clock::now();
+		bool moved = false;
+		for (size_t m = 0; m < moving.size(); m++) {
+			const vec3 offset = anim.offsetAt(moving[m], frame);
+			const vec3 step = offset - placed[m];
+			if (step.dot(step) > 0.0) {
+				objects[moving[m]]->translate(step);
+				placed[m] = offset;
+				moved = true;
+			}
+		}
+		if (moved)
+			world.refitHierarchy();
+
+		Camera cam = world.camera();
+		anim.cameraAt(frame, cam);
+		RenderJob job(world, cam, world.viewport, world.ss_level, *img);
+		if (cache) {
+			// hits can only be carried over while nothing but the camera moves
+			if (moved)
+				cache->invalidate();
+			cache->beginFrame(cam, world.viewport);
+			ReprojectionCache *c = cache.get();
+			job.tileRenderer = [c](RenderJob &j, const Tile &t, RenderStats &s) { c->renderTile(j, t, s); };
+		}
+		engine.render(job);
+		if (cache)
+			cache->endFrame();
+		world.renderStats.merge(job.stats);
+		tracing += secondsSince(trace_start);
+
+		if (opts.pipelined)
+			writer.write(img, frame);
+		else {
+			const Clock::time_point write_start = Clock::now();
+			if (!FrameWriter::writeFrame(out_prefix, *img, frame, bytes))
+				throw SceneFileException(FrameWriter::framePath(out_prefix, frame), "write failed");
+			writing += secondsSince(write_start);
+		}
+	}
+	writer.finish();
+	if (opts.pipelined)
+		writing = writer.busySeconds();
+
+	const double total = secondsSince(start);
+	const int count = last - first + 1;
+	world.renderStats.summarise();
+	if (cache) {
+		const long carried = cache->pixelsCarried(), traced = cache->pixelsTraced();
+		std::cout << "Reprojection: " << carried << " pixels carried over, " << traced << " traced ("
+			<< 100.0 * carried / std::max(1L, carried + traced) << "% carried)" << std::endl;
+	}
+	std::cout << "Rendered frames " << first << " to " << last << " in " << total << "s ("
+		<< count / total << " frames/s), " << tracing << "s tracing, " << writing << "s writing"
+		<< (opts.pipelined ? " alongside" : "") << std::endl;
+}
@@ -0,0 +1,87 @@
+/* animation.hpp
+ *
+ * rendering a sequence of frames of one scene
+ *
+ * an animation file says how long the sequence is and where things are
+ * on the frames that matter, one directive per line (`#` starts a
+ * comment):
+ *
+ * 	frames <n>
+ * 	camera <frame> <x> <y> <z> <rotate_y> <rotate_x>
+ * 	move <object> <frame> <dx> <dy> <dz>
+ *
+ * camera keys replace the scene's camera: it's put at (x, y, z) and
+ * turned as the scene file's rotate_y and rotate_x would. move keys say
+ * how far an object is from where the scene file put it, objects being
+ * numbered in the order they appear in the scene (as in EditSession).
+ * between keys everything moves in a straight line, and before the
+ * first key or after the last it stays put.
+ *
+ * the scene is loaded once, and one RenderEngine renders every frame,
+ * so nothing is set up again between frames: moving an object is a
+ * translate and a refit of the hierarchy. frames are written out as
+ * <prefix>0000.ppm, <prefix>0001.ppm, ... by a writer thread of their
+ * own, which encodes and writes frame n while frame n + 1 is being
+ * traced. there are two images, so tracing only waits on the writer if
+ * writing a frame takes longer than tracing one.
+ *
+ * with `reproject`, frames are previews (one ray per pixel) rendered
+ * through a ReprojectionCache, so each frame only re-traces what the
+ * camera move has brought into view. a frame where an object moves is
+ * traced in full.
+ */
+
+#ifndef ANIMATION_HEADER_WARRIOR
+#define ANIMATION_HEADER_WARRIOR
+
+#include <string>
+#include <vector>
+
+#include "world.hpp"
+
+struct CameraKey {
+	int frame;
+	vec3 position;
+	double rotate_y;
+	double rotate_x;
+};
+
+struct MoveKey {
+	int object;
+	int frame;
+	vec3 offset;
+};
+
+struct Animation {
+	int frames;
+	std::vector<CameraKey> camera;		// by frame
+	std::vector<MoveKey> moves;		// by object, then frame
+
+	Animation();
+
+	// the camera at `frame`, or false if there are no camera keys
+	bool cameraAt(int frame, Camera &cam) const;
+
+	// how far `object` has moved by `frame`, (0, 0, 0) if it never does
+	vec3 offsetAt(int object, int frame) const;
+};
+
+// reads an animation file, throwing SceneParseException if it's wrong
+void loadAnimation(const std::string &path, Animation &anim);
+
+struct AnimationOptions {
+	int first_frame;
+	int last_frame;		// -1 for the animation's last frame
+	int threads;		// 0 for one per hardware thread
+	bool pipelined;		// false to write each frame before tracing the next
+	bool reproject;		// preview, carrying first hits over between frames (see reproject.hpp)
+
+	AnimationOptions();
+};
+
+// renders frames first_frame to last_frame of the animation, writing
+// each to out_prefix + the frame number (4 digits) + ".ppm"
+void renderAnimation(const std::string &scene_path, const std::string &anim_path,
+		const std::string &out_prefix, const AnimationOptions &opts);
+
+#endif
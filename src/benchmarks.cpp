@@ -0,0 +1,787 @@
+#include "benchmarks.hpp"
+
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <atomic>
+
+#include "world.hpp"
+#include "sceneparser.hpp"
+#include "renderer.hpp"
+#include "denoise.hpp"
+#include "coherent.hpp"
+#include "incremental.hpp"
+#include "numa.hpp"
+#include "hdr.hpp"
+
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double secondsSince(bench_clock::time_point start) {
+	return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// `num_objects` random spheres and a floor, in front of the demo's
+// camera. clusters of 1000 spheres are written out for the parser to
+// deal with, but they are spread over the whole scene, so for
+// rendering it's much better to leave World::buildHierarchy to it
+static std::string sphereScene(int num_objects, bool clusters)
+{
+	std::string text;
+	text.reserve(static_cast<size_t>(num_objects) * 64 + 1024);
+	text += "viewport 1000 800 0.1 0.25\ncamera -8.8 4.5 -0.1\nrotate_y 0.3\nrotate_x -0.08\n";
+	text += "light 1.0 5.0 5.0 0.9 0.9 0.9\n";
+
+	char buf[160];
+	for (int m = 0; m < 8; m++) {
+		snprintf(buf, sizeof(buf), "material m%d %.3f %.3f %.3f 0.2 0.2 0.2 0.0 0.0 reflective\n", m, m / 8.0, 0.5, 1.0 - m / 8.0);
+		text += buf;
+	}
+	text += "plane 0 1 0 2.0 m0\n";
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<double> pos(-100.0, 100.0);
+	for (int i = 0; i < num_objects; i++) {
+		if (clusters && i % 1000 == 0) text += (i == 0 ? "cluster {\n" : "}\ncluster {\n");
+		snprintf(buf, sizeof(buf), "\tsphere %.6f %.6f %.6f %.4f m%d\n", pos(rng), pos(rng), pos(rng) + 200.0, 0.1 + (i % 7) * 0.05, i % 8);
+		text += buf;
+	}
+	if (clusters && num_objects > 0) text += "}\n";
+	return text;
+}
+
+void bench_parser(int num_objects)
+{
+	std::cout << "---> scene parser benchmark: " << num_objects << " spheres <---" << std::endl;
+
+	std::string text = sphereScene(num_objects, true);
+
+	double mb = text.size() / (1024.0 * 1024.0);
+	std::cout << "scene text: " << mb << " MB" << std::endl;
+
+	// best of a few runs, so page faults in the first one don't dominate
+	double best = 0.0;
+	for (int run = 0; run < 3; run++) {
+		World world(Viewport(1, 1, 0.1, 0.25), vec3(0.0, 0.0, 0.0), RGBVec());
+		bench_clock::time_point start = bench_clock::now();
+		parseScene(text.data(), text.size(), world, "<benchmark>");
+		double secs = secondsSince(start);
+		if (run == 0 || secs < best) best = secs;
+	}
+
+	// the same spheres made and clustered straight from the numbers,
+	// which is the part of the parse that isn't reading text
+	std::vector<double> coords(3 * static_cast<size_t>(num_objects));
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<double> pos(-100.0, 100.0);
+	for (size_t k = 0; k < coords.size(); k++)
+		coords[k] = pos(rng);
+	std::vector<Material> materials(8, Material(RGBVec(0.5, 0.5, 0.5), RGBVec(0.2, 0.2, 0.2), 0.0, 0.0, true));
+
+	double objects = 0.0;
+	for (int run = 0; run < 3; run++) {
+		World world(Viewport(1, 1, 0.1, 0.25), vec3(0.0, 0.0, 0.0), RGBVec());
+		bench_clock::time_point start = bench_clock::now();
+		Cluster *cluster = NULL;
+		for (int i = 0; i < num_objects; i++) {
+			if (i % 1000 == 0) {
+				if (cluster) world.adoptObject(cluster);
+				cluster = new Cluster();
+			}
+			const double *p = &coords[3 * static_cast<size_t>(i)];
+			cluster->adoptObject(new Sphere(vec3(p[0], p[1], p[2] + 200.0), 0.1 + (i % 7) * 0.05, materials[i % 8]));
+		}
+		if (cluster) world.adoptObject(cluster);
+		double secs = secondsSince(start);
+		if (run == 0 || secs < objects) objects = secs;
+	}
+
+	std::cout << "parse time: " << best * 1000.0 << " ms (" << objects * 1000.0 << " ms of it making the objects)" << std::endl;
+	std::cout << "throughput: " << mb / best << " MB/s, " << num_objects / best / 1e6 << " M objects/s" << std::endl;
+	std::cout << "text alone: " << mb / (best - objects) << " MB/s" << std::endl;
+}
+
+#define BENCH_REFERENCE_GRID 16	// reference samples per pixel, each way
+#define BENCH_DENOISE_GRAIN 0.07f	// the deviation of the noise added to x4, in 0..1 colour
+
+// root mean square difference from the reference, over every channel
+static double rmsError(const Image &img, const std::vector<float> &reference) {
+	double sum = 0.0;
+	size_t k = 0;
+	for (int i = 0; i < img.width; i++) {
+		for (int j = 0; j < img.height; j++) {
+			for (int ch = 0; ch < 3; ch++, k++) {
+				double d = static_cast<unsigned char>(img[i][j].colour[ch]) / 255.0 - reference[k];
+				sum += d * d;
+			}
+		}
+	}
+	return std::sqrt(sum / k);
+}
+
+static void reportQuality(const std::string &name, double secs, double rmse) {
+	std::cout << name << ": " << secs * 1000.0 << " ms, rmse " << rmse
+		<< ", psnr " << 20.0 * std::log10(1.0 / rmse) << " dB" << std::endl;
+}
+
+void bench_denoise(const std::string &scene_path, int width, int height)
+{
+	World world(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec());
+	loadScene(scene_path, world);
+	world.numberObjects();
+	world.buildHierarchy();
+
+	Viewport vp = width > 0 && height > 0 ? world.viewport.resized(width, height) : world.viewport;
+	width = vp.pixelsWide();
+	height = vp.pixelsTall();
+	std::cout << "---> denoiser benchmark: " << scene_path << " at " << width << "x" << height << " <---" << std::endl;
+
+	RenderEngine engine;
+	Image img(width, height);
+
+	// the reference is a plain grid of samples, one in the middle of
+	// each cell, so it doesn't depend on any of the sampling modes
+	std::vector<float> reference(3 * static_cast<size_t>(width) * height);
+	RenderJob ref(world, world.camera(), vp, 1, img);
+	ref.tileRenderer = [&reference, height](RenderJob &r, const Tile &t, RenderStats &) {
+		const int n = BENCH_REFERENCE_GRID;
+		for (int i = t.x0; i < t.x1; i++) {
+			for (int j = t.y0; j < t.y1; j++) {
+				double sum[3] = { 0.0, 0.0, 0.0 };
+				for (int a = 0; a < n; a++) {
+					for (int b = 0; b < n; b++) {
+						RGBVec c = r.world->sampleAt(r.camera, r.viewport, i + (a + 0.5) / n, j + (b + 0.5) / n);
+						sum[0] += c.r();
+						sum[1] += c.g();
+						sum[2] += c.b();
+					}
+				}
+				for (int ch = 0; ch < 3; ch++)
+					reference[3 * (static_cast<size_t>(i) * height + j) + ch] = sum[ch] / (n * n);
+			}
+		}
+	};
+	bench_clock::time_point start = bench_clock::now();
+	engine.render(ref);
+	std::cout << "reference (x" << BENCH_REFERENCE_GRID * BENCH_REFERENCE_GRID << "): " << secondsSince(start) * 1000.0 << " ms" << std::endl;
+
+	for (int ss = 2; ss <= 4; ss++) {
+		RenderJob job(world, world.camera(), vp, ss, img);
+		start = bench_clock::now();
+		engine.render(job);
+		reportQuality("x" + std::to_string(1 << (2 * (ss - 1))), secondsSince(start), rmsError(img, reference));
+	}
+
+	GBuffer g(width, height);
+	RenderJob job(world, world.camera(), vp, 2, img);
+	recordGBuffer(job, g);
+	start = bench_clock::now();
+	engine.render(job);
+	double render_secs = secondsSince(start);
+	reportQuality("x4 (recording the G-buffer)", render_secs, rmsError(img, reference));
+
+	bench_clock::time_point filter_start = bench_clock::now();
+	denoise(engine, job, g, DenoiseOptions());
+	double filter_secs = secondsSince(filter_start);
+	reportQuality("x4 + denoiser", render_secs + filter_secs, rmsError(img, reference));
+	std::cout << "denoiser alone: " << filter_secs * 1000.0 << " ms" << std::endl;
+
+	// x4 on a regular grid is only ever wrong at edges, which the filter
+	// leaves alone. samples at random places in the pixel, the way
+	// progressive renders take them, are noisy wherever they land on
+	// more than one surface or shade
+	RenderJob noisy(world, world.camera(), vp, 1, img);
+	noisy.tileRenderer = [](RenderJob &r, const Tile &t, RenderStats &) {
+		for (int i = t.x0; i < t.x1; i++) {
+			for (int j = t.y0; j < t.y1; j++) {
+				unsigned int seed = static_cast<unsigned int>(i) * 73856093u ^ static_cast<unsigned int>(j) * 19349663u;
+				RGBVec sum;
+				for (int k = 0; k < 4; k++) {
+					double x = i + rand_r(&seed) / (RAND_MAX + 1.0);
+					double y = j + rand_r(&seed) / (RAND_MAX + 1.0);
+					sum += r.world->sampleAt(r.camera, r.viewport, x, y).scaled(0.25);
+				}
+				(*r.image)[i][j] = RGBColour(sum);
+			}
+		}
+	};
+	recordGBuffer(noisy, g);
+	start = bench_clock::now();
+	engine.render(noisy);
+	render_secs = secondsSince(start);
+	reportQuality("4 random samples", render_secs, rmsError(img, reference));
+
+	filter_start = bench_clock::now();
+	denoise(engine, noisy, g, DenoiseOptions());
+	reportQuality("4 random samples + denoiser", render_secs + secondsSince(filter_start), rmsError(img, reference));
+
+	// what the filter is for: x4 with noise all over it, the way noisier
+	// lighting would leave it
+	RenderJob grainy(world, world.camera(), vp, 2, img);
+	recordGBuffer(grainy, g);
+	start = bench_clock::now();
+	engine.render(grainy);
+	render_secs = secondsSince(start);
+	std::mt19937 rng(7);
+	std::normal_distribution<float> grain(0.0f, BENCH_DENOISE_GRAIN);
+	const size_t n = g.pixels();
+	for (int i = 0; i < width; i++) {
+		for (int j = 0; j < height; j++) {
+			float c[3];
+			for (int ch = 0; ch < 3; ch++) {
+				float &v = g.colour[ch * n + g.index(i, j)];
+				v = std::min(1.0f, std::max(0.0f, v + grain(rng)));
+				c[ch] = v;
+			}
+			img[i][j] = RGBColour(RGBVec(c[0], c[1], c[2]));
+		}
+	}
+	reportQuality("x4 with noise added", render_secs, rmsError(img, reference));
+
+	filter_start = bench_clock::now();
+	denoise(engine, grainy, g, DenoiseOptions());
+	reportQuality("x4 with noise added + denoiser", render_secs + secondsSince(filter_start), rmsError(img, reference));
+}
+
+/* CacheCounters
+ *
+ * counts cache misses in this process, and in any threads it starts
+ * while the counters are open (their counts are added in as they exit).
+ * the kernel may not allow it, or the hardware counters may not be
+ * there at all (in a VM, say), in which case they count -1 */
+class CacheCounters {
+private:
+	int fds[2];
+
+public:
+	CacheCounters() {
+		// last level cache references (on most x86 chips, that's
+		// every L2 miss) and misses
+		const unsigned long long events[2] = { PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES };
+		for (int k = 0; k < 2; k++) {
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = events[k];
+			attr.inherit = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fds[k] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+		}
+	}
+
+	~CacheCounters() {
+		for (int k = 0; k < 2; k++)
+			if (fds[k] >= 0) close(fds[k]);
+	}
+
+	long long read(int k) const {
+		long long count;
+		if (fds[k] < 0 || ::read(fds[k], &count, sizeof(count)) != sizeof(count))
+			return -1;
+		return count;
+	}
+};
+
+static std::string countString(long long n) {
+	if (n < 0) return "n/a";
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.1fM", n / 1e6);
+	return buf;
+}
+
+void bench_order(int num_objects, int width, int height)
+{
+	World world(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec());
+	std::string text = sphereScene(num_objects, false);
+	parseScene(text.data(), text.size(), world, "<benchmark>");
+	world.buildHierarchy();
+	text.clear();
+
+	Viewport vp = world.viewport.resized(width, height);
+	Image img(width, height);
+	std::cout << "---> pixel order benchmark: " << num_objects << " spheres at " << width << "x" << height << " <---" << std::endl;
+
+	struct Order {
+		const char *name;
+		TileOrder tiles;
+		PixelOrder pixels;
+	};
+	const Order orders[] = {
+		{ "snake tiles, columns", tile_order_snake, pixel_order_columns },
+		{ "snake tiles, morton pixels", tile_order_snake, pixel_order_morton },
+		{ "morton tiles, morton pixels", tile_order_morton, pixel_order_morton },
+		{ "hilbert tiles, morton pixels", tile_order_hilbert, pixel_order_morton },
+	};
+
+	const int hardware = static_cast<int>(std::thread::hardware_concurrency());
+	const int thread_counts[2] = { 1, hardware > 1 ? hardware : 1 };
+	for (int t = 0; t < 2; t++) {
+		if (t == 1 && thread_counts[1] == 1) {
+			std::cout << "(only one hardware thread, so no multi-threaded runs)" << std::endl;
+			break;
+		}
+		std::cout << thread_counts[t] << " thread" << (thread_counts[t] > 1 ? "s" : "") << ":" << std::endl;
+
+		for (size_t o = 0; o < sizeof(orders) / sizeof(orders[0]); o++) {
+			// the counters have to be open before the engine starts its
+			// threads, and are read once it has stopped them
+			double secs;
+			long long refs, misses;
+			{
+				CacheCounters counters;
+				{
+					RenderEngine engine(thread_counts[t]);
+					RenderJob job(world, world.camera(), vp, 1, img);
+					job.tile_order = orders[o].tiles;
+					job.pixel_order = orders[o].pixels;
+					bench_clock::time_point start = bench_clock::now();
+					engine.render(job);
+					secs = secondsSince(start);
+				}
+				refs = counters.read(0);
+				misses = counters.read(1);
+			}
+
+			std::cout << "\t" << orders[o].name << ": " << secs * 1000.0 << " ms, LLC references "
+				<< countString(refs) << ", LLC misses " << countString(misses) << std::endl;
+		}
+	}
+}
+
+// `num_objects` mirrored spheres packed into a box in front of the
+// camera, with rays followed through up to 8 reflections
+static std::string mirrorScene(int num_objects)
+{
+	std::string text;
+	text.reserve(static_cast<size_t>(num_objects) * 64 + 1024);
+	text += "viewport 1000 800 0.1 0.25\ncamera -8.8 4.5 -0.1\nrotate_y 0.3\nrotate_x -0.08\n";
+	text += "background 0.3 0.3 0.5\nreflection_depth 8\n";
+	text += "light 1.0 8.0 5.0 0.9 0.9 0.9\n";
+
+	char buf[160];
+	for (int m = 0; m < 8; m++) {
+		snprintf(buf, sizeof(buf), "material m%d %.3f %.3f %.3f 0.8 0.8 0.8 40 0.05 reflective\n", m, m / 8.0, 0.5, 1.0 - m / 8.0);
+		text += buf;
+	}
+	text += "plane 0 1 0 2.0 m0\n";
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<double> pos(-6.0, 6.0);
+	for (int i = 0; i < num_objects; i++) {
+		snprintf(buf, sizeof(buf), "sphere %.6f %.6f %.6f %.4f m%d\n", pos(rng), pos(rng) + 4.0, pos(rng) + 30.0, 0.2 + (i % 5) * 0.1, i % 8);
+		text += buf;
+	}
+	return text;
+}
+
+// how many pixels of two images of the same size aren't exactly the same
+static long pixelsDiffering(const Image &a, const Image &b) {
+	long differing = 0;
+	for (int i = 0; i < a.width; i++)
+		for (int j = 0; j < a.height; j++)
+			if (memcmp(a[i][j].colour, b[i][j].colour, 3) != 0)
+				differing++;
+	return differing;
+}
+
+void bench_sort(int num_objects, int width, int height)
+{
+	World world(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec());
+	std::string text = mirrorScene(num_objects);
+	parseScene(text.data(), text.size(), world, "<benchmark>");
+	world.buildHierarchy();
+
+	Viewport vp = world.viewport.resized(width, height);
+	std::cout << "---> ray sorting benchmark: " << num_objects << " mirrored spheres at " << width << "x" << height << " <---" << std::endl;
+
+	// one thread, so the timings are of tracing alone
+	RenderEngine engine(1);
+
+	// shadow rays aren't sorted, so the difference shows best without them
+	for (int run = 0; run < 4; run++) {
+		const int ss = 1 + run % 2;
+		world.shadows_enabled = run >= 2;
+
+		// a path recorder sees every camera and reflection ray
+		std::atomic<long> rays(0);
+		Image counted(width, height);
+		RenderJob count(world, world.camera(), vp, ss, counted);
+		count.tileRenderer = [&rays](RenderJob &r, const Tile &t, RenderStats &stats) {
+			PathRecorder rec;
+			for (int i = t.x0; i < t.x1; i++)
+				for (int j = t.y0; j < t.y1; j++)
+					r.world->colourForPixelAt(r.camera, r.viewport, r.ss_level, i, j, stats, &rec);
+			rays += static_cast<long>(rec.vertices.size());
+		};
+		engine.render(count);
+		std::cout << (ss == 1 ? "x1" : "x4 (adaptive)") << ", " << (world.shadows_enabled ? "with" : "no") << " shadows, "
+			<< rays / 1e6 << "M camera and reflection rays:" << std::endl;
+
+		Image plain(width, height), sorted(width, height);
+		RenderJob one(world, world.camera(), vp, ss, plain);
+		bench_clock::time_point start = bench_clock::now();
+		engine.render(one);
+		double plain_secs = secondsSince(start);
+
+		RenderJob two(world, world.camera(), vp, ss, sorted);
+		two.tileRenderer = renderCoherent;
+		start = bench_clock::now();
+		engine.render(two);
+		double sorted_secs = secondsSince(start);
+
+		std::cout << "\tpixel by pixel: " << plain_secs * 1000.0 << " ms, " << rays / plain_secs / 1e6 << "M rays/s" << std::endl;
+		std::cout << "\tsorted bounces: " << sorted_secs * 1000.0 << " ms, " << rays / sorted_secs / 1e6 << "M rays/s"
+			<< (pixelsDiffering(plain, sorted) == 0 ? "" : " (images differ!)") << std::endl;
+	}
+}
+
+// how much is allocated on the heap right now, in bytes. unlike the
+// resident size this goes down again when things are freed, so one
+// scene doesn't hide in what the last one left behind
+static double heapBytes() {
+	struct mallinfo2 info = mallinfo2();
+	return static_cast<double>(info.uordblks + info.hblkhd);
+}
+
+void bench_scaling(const SceneGenOptions &base, long max_primitives, int width, int height)
+{
+	std::cout << "---> scaling benchmark: " << distributionName(base.distribution) << " scenes of up to "
+		<< max_primitives << " primitives at " << width << "x" << height << " <---" << std::endl;
+
+	const ScratchFile scratch("scaling");
+	const std::string &path = scratch.path();
+
+	RenderEngine engine;
+	Image img(width, height);
+	std::cout << "primitives,generate_ms,load_ms,build_ms,render_ms,heap_mb" << std::endl;
+
+	// 10, 30, 100, 300, ...
+	for (long n = 10; n <= max_primitives; n = n % 3 == 0 ? n / 3 * 10 : n * 3) {
+		SceneGenOptions opts = base;
+		opts.primitives = n;
+
+		bench_clock::time_point start = bench_clock::now();
+		generateSceneFile(opts, path);
+		const double generate_secs = secondsSince(start);
+
+		const double before = heapBytes();
+		double load_secs, build_secs, render_secs, heap;
+		{
+			World world(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec());
+			start = bench_clock::now();
+			loadScene(path, world);
+			load_secs = secondsSince(start);
+
+			start = bench_clock::now();
+			world.buildHierarchy();
+			build_secs = secondsSince(start);
+			heap = heapBytes() - before;
+
+			RenderJob job(world, world.camera(), world.viewport.resized(width, height), 1, img);
+			start = bench_clock::now();
+			engine.render(job);
+			render_secs = secondsSince(start);
+		}
+
+		printf("%ld,%.2f,%.2f,%.2f,%.2f,%.1f\n", n, generate_secs * 1000.0, load_secs * 1000.0,
+			build_secs * 1000.0, render_secs * 1000.0, heap / (1024.0 * 1024.0));
+		fflush(stdout);
+	}
+}
+
+void bench_numa(long primitives, int width, int height)
+{
+	const NumaTopology topo = NumaTopology::detect();
+	std::cout << "---> NUMA benchmark: " << primitives << " primitives at " << width << "x" << height << ", "
+		<< topo.nodes() << " node" << (topo.nodes() > 1 ? "s" : "") << " (";
+	for (int n = 0; n < topo.nodes(); n++)
+		std::cout << (n ? ", " : "") << topo.cpus[n].size() << " CPUs";
+	std::cout << ") <---" << std::endl;
+
+	const ScratchFile scratch("numa");
+	const std::string &path = scratch.path();
+
+	SceneGenOptions opts;
+	opts.primitives = primitives;
+	generateSceneFile(opts, path);
+
+	World world(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec());
+	loadScene(path, world);
+	world.numberObjects();
+	world.buildHierarchy();
+	SceneReplicas replicas(path, world, topo);
+
+	const Viewport vp = world.viewport.resized(width, height);
+	const int hardware = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	double one_thread = 0.0;
+	std::cout << "threads,free_ms,pinned_ms,replicated_ms,free_speedup,pinned_speedup,replicated_speedup" << std::endl;
+	for (int threads = 1; ; threads = std::min(threads * 2, hardware)) {
+		double secs[3];
+		for (int mode = 0; mode < 3; mode++) {
+			// a new image each time, so its pages are first touched by
+			// this run's threads
+			RenderEngine engine(threads, mode > 0);
+			Image img(width, height);
+			RenderJob job(world, world.camera(), vp, 1, img);
+			if (mode == 2)
+				job.replicas = replicas.byNode();
+			bench_clock::time_point start = bench_clock::now();
+			engine.render(job);
+			secs[mode] = secondsSince(start);
+		}
+		if (threads == 1)
+			one_thread = secs[0];
+
+		printf("%d,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n", threads, secs[0] * 1000.0, secs[1] * 1000.0, secs[2] * 1000.0,
+			one_thread / secs[0], one_thread / secs[1], one_thread / secs[2]);
+		fflush(stdout);
+		if (threads == hardware)
+			break;
+	}
+}
+
+void bench_encode(const std::string &scene_path, int width, int height)
+{
+	World world(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec());
+	loadScene(scene_path, world);
+	world.buildHierarchy();
+
+	const Viewport vp = world.viewport.resized(width, height);
+	std::cout << "---> encoding benchmark: " << scene_path << " at " << width << "x" << height << " <---" << std::endl;
+
+	Image img(width, height);
+	FloatImage hdr(width, height);
+	RenderEngine engine;
+	RenderJob job(world, world.camera(), vp, world.ss_level, img);
+	job.hdr = &hdr;
+	bench_clock::time_point start = bench_clock::now();
+	engine.render(job);
+	const double render_secs = secondsSince(start);
+	std::cout << "	render:                " << render_secs * 1000.0 << " ms" << std::endl;
+
+	const ScratchFile scratch("encode");
+
+	const int all = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	for (int threads = 1; threads <= all; threads = threads == all ? all + 1 : std::min(all, threads * 2)) {
+		ToneMapOptions opts;
+		opts.threads = threads;
+		opts.curve = tone_reinhard;
+		opts.srgb = true;
+
+		std::vector<unsigned char> rgb;
+		start = bench_clock::now();
+		toneMap(hdr, opts, rgb);
+		const double tone_secs = secondsSince(start);
+
+		start = bench_clock::now();
+		writeToneMappedPNG(hdr, opts, scratch.path());
+		const double png_secs = secondsSince(start);
+
+		std::cout << "	" << threads << " thread" << (threads > 1 ? "s: " : ":  ") << "tone map " << tone_secs * 1000.0
+			<< " ms, tone map + PNG " << png_secs * 1000.0 << " ms (" << 100.0 * png_secs / render_secs << "% of the render)" << std::endl;
+	}
+
+	start = bench_clock::now();
+	writePFM(hdr, scratch.path());
+	std::cout << "	PFM:                   " << secondsSince(start) * 1000.0 << " ms" << std::endl;
+	start = bench_clock::now();
+	img.writeToFile(scratch.path());
+	std::cout << "	PPM (8 bit):           " << secondsSince(start) * 1000.0 << " ms" << std::endl;
+}
+
+static vec3 randomDirection(std::mt19937 &rng) {
+	std::normal_distribution<double> normal;
+	vec3 d(normal(rng), normal(rng), normal(rng));
+	return d.normalised();
+}
+
+void bench_shade(int hits)
+{
+	std::cout << "---> batch shading benchmark: " << hits << " hits <---" << std::endl;
+
+	// diffuse only, then specular exponents from dull to mirror-like
+	std::vector<Material> palette;
+	palette.push_back(Material(RGBVec(0.8, 0.3, 0.2), 0.1));
+	const double exponents[5] = { 2.0, 7.5, 20.0, 64.0, 250.0 };
+	for (int e = 0; e < 5; e++)
+		palette.push_back(Material(RGBVec(0.2, 0.5, 0.7), RGBVec(0.9, 0.9, 0.8), exponents[e], 0.05));
+	std::vector<const Material *> materials;
+	for (size_t m = 0; m < palette.size(); m++)
+		materials.push_back(&palette[m]);
+	const Light light(vec3(0.0, 10.0, 0.0), RGBVec(1.0, 0.95, 0.9));
+
+	// l is mostly on the same side as n, as it is at a lit hit
+	std::mt19937 rng(1);
+	std::uniform_int_distribution<int> pick(0, static_cast<int>(palette.size()) - 1);
+	std::vector<double> n[3], v[3], l[3], batch_out[3];
+	std::vector<int> material(hits);
+	for (int a = 0; a < 3; a++) {
+		n[a].resize(hits);
+		v[a].resize(hits);
+		l[a].resize(hits);
+		batch_out[a].resize(hits);
+	}
+	for (int h = 0; h < hits; h++) {
+		const vec3 nh = randomDirection(rng), vh = randomDirection(rng);
+		vec3 lh = randomDirection(rng);
+		if (lh.dot(nh) < 0.0 && h % 8 != 0)
+			lh = lh.scaled(-1.0);
+		n[0][h] = nh.x(); n[1][h] = nh.y(); n[2][h] = nh.z();
+		v[0][h] = vh.x(); v[1][h] = vh.y(); v[2][h] = vh.z();
+		l[0][h] = lh.x(); l[1][h] = lh.y(); l[2][h] = lh.z();
+		material[h] = pick(rng);
+	}
+
+	// the best of a few runs of each, as the first pays for the page faults
+	std::vector<RGBVec> scalar_out(hits);
+	double scalar_secs = INFINITY;
+	for (int run = 0; run < 5; run++) {
+		bench_clock::time_point start = bench_clock::now();
+		for (int h = 0; h < hits; h++)
+			scalar_out[h] = materials[material[h]]->shade(light, vec3(n[0][h], n[1][h], n[2][h]),
+				vec3(v[0][h], v[1][h], v[2][h]), vec3(l[0][h], l[1][h], l[2][h]));
+		scalar_secs = std::min(scalar_secs, secondsSince(start));
+	}
+
+	ShadeBatch batch;
+	batch.count = hits;
+	batch.nx = &n[0][0]; batch.ny = &n[1][0]; batch.nz = &n[2][0];
+	batch.vx = &v[0][0]; batch.vy = &v[1][0]; batch.vz = &v[2][0];
+	batch.lx = &l[0][0]; batch.ly = &l[1][0]; batch.lz = &l[2][0];
+	batch.material = &material[0];
+	double batch_secs = INFINITY;
+	for (int run = 0; run < 5; run++) {
+		bench_clock::time_point start = bench_clock::now();
+		shadeBatch(light, &materials[0], batch, &batch_out[0][0], &batch_out[1][0], &batch_out[2][0]);
+		batch_secs = std::min(batch_secs, secondsSince(start));
+	}
+
+	double worst = 0.0;
+	for (int h = 0; h < hits; h++) {
+		worst = std::max(worst, std::fabs(batch_out[0][h] - scalar_out[h].r()));
+		worst = std::max(worst, std::fabs(batch_out[1][h] - scalar_out[h].g()));
+		worst = std::max(worst, std::fabs(batch_out[2][h] - scalar_out[h].b()));
+	}
+
+	std::cout << "\tMaterial::shade: " << scalar_secs * 1e9 / hits << " ns a hit" << std::endl;
+	std::cout << "\tshadeBatch:      " << batch_secs * 1e9 / hits << " ns a hit (" << scalar_secs / batch_secs << "x)" << std::endl;
+	std::cout << "\tlargest difference " << worst << (worst <= SHADE_BATCH_TOLERANCE ? " (within " : " (OUTSIDE ")
+		<< SHADE_BATCH_TOLERANCE << ")" << std::endl;
+}
+
+void bench_grid(long primitives, int width, int height)
+{
+	std::cout << "---> grid benchmark: " << primitives << " primitives at " << width << "x" << height << " <---" << std::endl;
+
+	const ScratchFile scratch("grid");
+	const std::string &path = scratch.path();
+
+	const SceneDistribution distributions[] = { distribution_uniform, distribution_clustered };
+	const Accelerator accelerators[] = { accelerator_hierarchy, accelerator_grid, accelerator_two_level_grid };
+	RenderEngine engine;
+	std::cout << "distribution,accelerator,build_ms,render_ms,speedup,pixels_differing" << std::endl;
+
+	for (int d = 0; d < 2; d++) {
+		SceneGenOptions opts;
+		opts.primitives = primitives;
+		opts.distribution = distributions[d];
+		generateSceneFile(opts, path);
+
+		Image reference(width, height);
+		double hierarchy_secs = 0.0;
+		for (int a = 0; a < 3; a++) {
+			World world(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec());
+			loadScene(path, world);
+			world.accelerator = accelerators[a];
+			world.numberObjects();
+			bench_clock::time_point start = bench_clock::now();
+			world.buildHierarchy();
+			const double build_secs = secondsSince(start);
+
+			Image img(width, height);
+			RenderJob job(world, world.camera(), world.viewport.resized(width, height), 1, a == 0 ? reference : img);
+			start = bench_clock::now();
+			engine.render(job);
+			const double render_secs = secondsSince(start);
+
+			// the same hits should win either way, so the images should match
+			long differing = 0;
+			if (a == 0)
+				hierarchy_secs = render_secs;
+			else
+				differing = pixelsDiffering(reference, img);
+
+			printf("%s,%s,%.2f,%.2f,%.2f,%ld\n", distributionName(distributions[d]), acceleratorName(accelerators[a]),
+				build_secs * 1000.0, render_secs * 1000.0, hierarchy_secs / render_secs, differing);
+			fflush(stdout);
+		}
+	}
+}
+
+void bench_lazy(long primitives, int width, int height)
+{
+	std::cout << "---> lazy build benchmark: " << primitives << " primitives at " << width << "x" << height << " <---" << std::endl;
+
+	const ScratchFile scratch("lazy");
+	const std::string &path = scratch.path();
+
+	SceneGenOptions opts;
+	opts.primitives = primitives;
+	generateSceneFile(opts, path);
+
+	RenderEngine engine;
+	std::cout << "view,build,build_ms,first_tile_ms,render_ms,pixels_differing" << std::endl;
+
+	// the whole scene, and a close-up of the middle of it with most of
+	// the scene out of view
+	for (int zoomed = 0; zoomed < 2; zoomed++) {
+		Image reference(width, height);
+		for (int lazy = 0; lazy < 2; lazy++) {
+			World world(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec());
+			loadScene(path, world);
+			world.lazy_build = lazy != 0;
+			world.numberObjects();
+
+			Viewport vp = world.viewport.resized(width, height);
+			if (zoomed)
+				vp = Viewport(width, height, (vp.uAt(width) - vp.uAt(0)) / 8.0, vp.getViewingDistance());
+
+			// time to the first pixel counts from the start of the build
+			bench_clock::time_point start = bench_clock::now();
+			world.buildHierarchy();
+			const double build_secs = secondsSince(start);
+
+			Image img(width, height);
+			RenderJob job(world, world.camera(), vp, 1, lazy ? img : reference);
+			std::atomic<bool> first(true);
+			double first_secs = 0.0;
+			job.onTile = [&](RenderJob &, const Tile &) {
+				if (first.exchange(false))
+					first_secs = secondsSince(start);
+			};
+			bench_clock::time_point render_start = bench_clock::now();
+			engine.render(job);
+			const double render_secs = secondsSince(render_start);
+
+			// the clusters come out the same either way, and so should the image
+			const long differing = lazy ? pixelsDiffering(reference, img) : 0;
+
+			printf("%s,%s,%.2f,%.2f,%.2f,%ld\n", zoomed ? "close-up" : "whole", lazy ? "lazy" : "full",
+				build_secs * 1000.0, first_secs * 1000.0, render_secs * 1000.0, differing);
+			fflush(stdout);
+		}
+	}
+}
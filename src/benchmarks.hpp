@@ -0,0 +1,71 @@
+/* benchmarks.hpp
+ *
+ * micro-benchmarks for individual parts of traceify
+ * (the whole-render profiler lives in traceify.cpp)
+ */
+
+#ifndef BENCHMARKS_HEADER_WARRIOR
+#define BENCHMARKS_HEADER_WARRIOR
+
+#include <string>
+
+#include "scenegen.hpp"
+
+// generates a scene with `num_objects` spheres (in clusters of 1000) and
+// times how long it takes to parse it into a World. making the same
+// spheres without any text is timed too, to show what the text costs
+void bench_parser(int num_objects);
+
+// renders a scene at x4, x16 and x64, and at x4, with 4 random samples
+// and at x4 with noise added, each with and without the denoiser, and
+// measures how far each is from a reference render with 256 samples a
+// pixel. the image is resized to width x height (0 keeps the scene's)
+void bench_denoise(const std::string &scene_path, int width, int height);
+
+// renders a scene of `num_objects` random spheres with tiles and the
+// pixels in them taken in each order (see renderer.hpp), on one thread
+// and on all of them, timing each and counting cache misses where the
+// hardware counters can be read
+void bench_order(int num_objects, int width, int height);
+
+// renders a scene of `num_objects` mirrored spheres pixel by pixel and
+// with coherent.hpp's sorted bounces, on one thread, and compares how
+// many camera and reflection rays a second each gets through
+void bench_sort(int num_objects, int width, int height);
+
+// generates scenes like `base` (see scenegen.hpp) with 10, 30, 100, ...
+// up to `max_primitives` primitives, and times loading, building the
+// hierarchy over and rendering each, along with how much heap it takes
+// (mesh arrays are used in place in the mapped file, so aren't counted).
+// the results are printed as CSV, one scene to a line
+void bench_scaling(const SceneGenOptions &base, long max_primitives, int width, int height);
+
+// renders a generated scene of `primitives` primitives with 1, 2, 4, ...
+// threads up to one per hardware thread, with the threads left to the
+// scheduler, pinned to NUMA nodes, and pinned with the scene replicated
+// on each node (see numa.hpp), and prints how each scales
+void bench_numa(long primitives, int width, int height);
+
+// shades `hits` random hits with Material::shade one at a time and with
+// shadeBatch (see material.hpp), timing each and checking that they
+// agree to within SHADE_BATCH_TOLERANCE
+void bench_shade(int hits);
+
+// renders a scene at width x height into a float image as well (see
+// hdr.hpp), then times tone mapping it and writing it out as a PNG on
+// one thread and on all of them, and as a PPM, against the render
+void bench_encode(const std::string &scene_path, int width, int height);
+
+// renders generated scenes of `primitives` primitives, spread uniformly
+// and in clusters, with the hierarchy and with one and two-level grids
+// (see grid.hpp), timing building each and rendering with it, and
+// checking that the images come out the same
+void bench_grid(long primitives, int width, int height);
+
+// builds the hierarchy over a generated scene of `primitives` primitives
+// in full and lazily (see World::lazy_build), and renders it whole and
+// close up, timing the build, the first tile (from the start of the
+// build) and the render, and checking the images come out the same
+void bench_lazy(long primitives, int width, int height);
+
+#endif
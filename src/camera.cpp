@@ -0,0 +1,29 @@
+#include "camera.hpp"
+
+Camera::Camera(const vec3 &pos) :
+	position(pos),
+	uAxis(1.0,0.0,0.0), // default basis: looking down +z
+	vAxis(0.0,1.0,0.0),
+	wAxis(0.0,0.0,-1.0) {}
+
+void Camera::rotateY(double theta) {
+	double sin_theta = sin(theta);
+	double cos_theta = cos(theta);
+	vec3 uPrime = uAxis.scaled(cos_theta) + wAxis.scaled(sin_theta);
+	vec3 wPrime = uAxis.scaled(-sin_theta) + wAxis.scaled(cos_theta);
+	uAxis = uPrime;
+	wAxis = wPrime;
+}
+
+void Camera::rotateX(double theta) {
+	double sin_theta = sin(theta);
+	double cos_theta = cos(theta);
+	vec3 vPrime = vAxis.scaled(cos_theta) + wAxis.scaled(sin_theta);
+	vec3 wPrime = vAxis.scaled(-sin_theta) + wAxis.scaled(cos_theta);
+	vAxis = vPrime;
+	wAxis = wPrime;
+}
+
+vec3 Camera::directionThrough(double u, double v, double d) const {
+	return wAxis.scaled(-d) + uAxis.scaled(u) + vAxis.scaled(v);
+}
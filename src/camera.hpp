@@ -0,0 +1,30 @@
+/* camera.hpp
+ *
+ * where the world is viewed from: a position and an orthonormal basis
+ *
+ * u and v are the camera's x and y axes, and the camera looks down -w.
+ * World has a camera of its own, but renders can bring their own too,
+ * so that several views of the same scene can be rendered at once
+ */
+
+#ifndef CAMERA_HEADER_WARRIOR
+#define CAMERA_HEADER_WARRIOR
+
+#include "vec3.hpp"
+
+struct Camera {
+	vec3 position;
+	vec3 uAxis;
+	vec3 vAxis;
+	vec3 wAxis;
+
+	Camera(const vec3 &pos);
+
+	void rotateY(double theta);
+	void rotateX(double theta);
+
+	// direction of the ray through (u, v) on a viewport at distance d
+	vec3 directionThrough(double u, double v, double d) const;
+};
+
+#endif
@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <cstdint>
+
+#include "coherent.hpp"
+
+#define ORIGIN_GRID 16
+
+// a hit waiting for its reflection to come back before it's shaded
+struct PendingHit {
+	ShadingPoint s;
+	int parent;		// the hit a bounce up this is the reflection of (at the top, the camera ray)
+	RGBVec reflected;
+};
+
+// the low four bits of x, two zeros after each
+static unsigned int spreadBits(unsigned int x) {
+	unsigned int spread = 0;
+	for (int b = 0; b < 4; b++)
+		spread |= ((x >> b) & 1) << (3 * b);
+	return spread;
+}
+
+static unsigned int gridCell(double x, double lo, double scale) {
+	int cell = static_cast<int>((x - lo) * scale);
+	return static_cast<unsigned int>(std::max(0, std::min(cell, ORIGIN_GRID - 1)));
+}
+
+// the order to trace the rays of a bounce in: by octant, then by cell
+static void binRays(const std::vector<Ray> &rays, std::vector<int> &order) {
+	double lo[3] = { INFINITY, INFINITY, INFINITY };
+	double hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+	for (size_t k = 0; k < rays.size(); k++) {
+		const vec3 &o = rays[k].origin;
+		const double c[3] = { o.x(), o.y(), o.z() };
+		for (int a = 0; a < 3; a++) {
+			lo[a] = std::min(lo[a], c[a]);
+			hi[a] = std::max(hi[a], c[a]);
+		}
+	}
+
+	double scale[3];
+	for (int a = 0; a < 3; a++)
+		scale[a] = hi[a] > lo[a] ? ORIGIN_GRID / (hi[a] - lo[a]) : 0.0;
+
+	// the bin goes in the top half, so rays in the same bin keep the
+	// order they came in
+	std::vector<uint64_t> keys(rays.size());
+	for (size_t k = 0; k < rays.size(); k++) {
+		const vec3 &o = rays[k].origin;
+		const vec3 &d = rays[k].direction;
+		unsigned int octant = (d.x() < 0.0) | (d.y() < 0.0) << 1 | (d.z() < 0.0) << 2;
+		unsigned int cell = spreadBits(gridCell(o.x(), lo[0], scale[0]))
+			| spreadBits(gridCell(o.y(), lo[1], scale[1])) << 1
+			| spreadBits(gridCell(o.z(), lo[2], scale[2])) << 2;
+		uint64_t bin = octant << 12 | cell;
+		keys[k] = bin << 32 | k;
+	}
+	std::sort(keys.begin(), keys.end());
+
+	order.resize(rays.size());
+	for (size_t k = 0; k < rays.size(); k++)
+		order[k] = static_cast<int>(keys[k] & 0xffffffffu);
+}
+
+void traceCoherent(World &world, const std::vector<Ray> &rays, std::vector<RGBVec> &colours) {
+	colours.assign(rays.size(), world.bg_colour);
+
+	// bounces[d] holds the hits of the rays that have bounced d times
+	std::vector<std::vector<PendingHit> > bounces;
+
+	std::vector<Ray> todo(rays);
+	std::vector<int> parents(rays.size());
+	for (size_t k = 0; k < rays.size(); k++)
+		parents[k] = static_cast<int>(k);
+
+	std::vector<int> order;
+	std::vector<Ray> sorted;
+	std::vector<IntersectionDatum> hits;
+
+	for (int depth = 0; !todo.empty(); depth++) {
+		// rays from the camera come in pixel order, which is as coherent
+		// as they get already
+		if (depth == 0) {
+			order.resize(todo.size());
+			for (size_t k = 0; k < todo.size(); k++)
+				order[k] = static_cast<int>(k);
+		}
+		else
+			binRays(todo, order);
+
+		sorted.clear();
+		for (size_t k = 0; k < order.size(); k++)
+			sorted.push_back(todo[order[k]]);
+		hits.resize(sorted.size());
+		world.testIntersections(&sorted[0], static_cast<int>(sorted.size()), depth == 0 ? 0.0 : REFLECTION_EPS, &hits[0]);
+
+		bounces.push_back(std::vector<PendingHit>());
+		std::vector<PendingHit> &here = bounces.back();
+		for (size_t k = 0; k < sorted.size(); k++) {
+			const int parent = parents[order[k]];
+			if (!hits[k].intersected) {
+				if (depth > 0)
+					bounces[depth - 1][parent].reflected = world.bg_colour;
+				continue;
+			}
+
+			const double throughput = depth == 0 ? 1.0 : bounces[depth - 1][parent].s.throughput;
+			here.push_back(PendingHit());
+			here.back().parent = parent;
+			world.prepareHit(sorted[k], hits[k], depth, throughput, here.back().s);
+		}
+
+		todo.clear();
+		parents.clear();
+		for (size_t h = 0; h < here.size(); h++) {
+			if (here[h].s.reflects) {
+				todo.push_back(here[h].s.reflected);
+				parents.push_back(static_cast<int>(h));
+			}
+		}
+	}
+
+	// every reflection is in by the time its hit is shaded, and each
+	// bounce's hits are shaded together
+	std::vector<const ShadingPoint *> points;
+	std::vector<RGBVec> reflected, shaded;
+	for (int depth = static_cast<int>(bounces.size()) - 1; depth >= 0; depth--) {
+		const std::vector<PendingHit> &here = bounces[depth];
+		points.clear();
+		reflected.clear();
+		for (size_t h = 0; h < here.size(); h++) {
+			points.push_back(&here[h].s);
+			reflected.push_back(here[h].reflected);
+		}
+		shaded.resize(here.size());
+		world.shadeHits(points.data(), reflected.data(), static_cast<int>(here.size()), shaded.data());
+
+		for (size_t h = 0; h < here.size(); h++) {
+			if (depth == 0)
+				colours[here[h].parent] = shaded[h];
+			else
+				bounces[depth - 1][here[h].parent].reflected = shaded[h];
+		}
+	}
+}
+
+void renderCoherent(RenderJob &job, const Tile &tile, RenderStats &stats) {
+	std::vector<PixelSampler> samplers;
+	for (int i = tile.x0; i < tile.x1; i++)
+		for (int j = tile.y0; j < tile.y1; j++)
+			samplers.push_back(PixelSampler(job.camera, job.viewport, job.ss_level, i, j));
+
+	// where each pixel's rays start in this round, -1 if it's done
+	std::vector<int> first(samplers.size());
+	std::vector<Ray> rays;
+	std::vector<RGBVec> colours;
+
+	for (;;) {
+		rays.clear();
+		for (size_t k = 0; k < samplers.size(); k++) {
+			first[k] = -1;
+			if (!samplers[k].done()) {
+				first[k] = static_cast<int>(rays.size());
+				samplers[k].nextRays(rays);
+			}
+		}
+		if (rays.empty())
+			break;
+
+		traceCoherent(*job.world, rays, colours);
+		for (size_t k = 0; k < samplers.size(); k++)
+			if (first[k] >= 0)
+				samplers[k].addSamples(&colours[first[k]]);
+	}
+
+	size_t k = 0;
+	for (int i = tile.x0; i < tile.x1; i++)
+		for (int j = tile.y0; j < tile.y1; j++)
+			job.store(i, j, samplers[k++].radiance(stats));
+}
@@ -0,0 +1,44 @@
+/* coherent.hpp
+ *
+ * tracing a tile's rays a bounce at a time, sorted so that rays going
+ * the same way are traced together
+ *
+ * the usual pixel loop follows each ray's reflections all the way down
+ * before it starts on the next one, and reflections off curved surfaces
+ * go every which way, so consecutive rays wander all over the
+ * hierarchy. here every ray from the camera through the tile is traced
+ * first, then all of the reflections they spawn, and so on down.
+ *
+ * the rays of each bounce are binned by the octant they head in and by
+ * the cell (of a 16 x 16 x 16 grid over where they all start) they
+ * start from, with cells in Morton order, and then traced in packets
+ * down the hierarchy (World::testIntersections), so each cluster is
+ * fetched once for all the rays of a packet that reach it. once the
+ * deepest bounce is done the hits are shaded from the bottom up.
+ *
+ * shading a hit is what traceRay does, only all the hits of a bounce
+ * are shaded together, a light at a time through shadeBatch (see
+ * material.hpp), whose approximate pow() is the one difference: the
+ * image matches the pixel loop's to well under an 8 bit step. only
+ * reflections are reordered: shadow rays are still traced as the hits
+ * are shaded.
+ */
+
+#ifndef COHERENT_HEADER_WARRIOR
+#define COHERENT_HEADER_WARRIOR
+
+#include <vector>
+
+#include "world.hpp"
+#include "renderer.hpp"
+
+// what traceRay would make of each ray from the camera (t_min 0,
+// depth 0), worked out a bounce at a time
+void traceCoherent(World &world, const std::vector<Ray> &rays, std::vector<RGBVec> &colours);
+
+// a RenderJob::tileRenderer that fills the tile as renderPixels would,
+// with each round of super-sampling across the whole tile traced by
+// traceCoherent
+void renderCoherent(RenderJob &job, const Tile &tile, RenderStats &stats);
+
+#endif
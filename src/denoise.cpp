@@ -0,0 +1,281 @@
+#include <algorithm>
+#include <cmath>
+
+#include "denoise.hpp"
+
+// images less noisy than this (a step of the 8 bit colour they're kept
+// in) are left as they are, since what's left is mostly rounding
+#define DENOISE_MIN_NOISE (1.0f / 255.0f)
+
+DenoiseOptions::DenoiseOptions() :
+	passes(5), colour_sigma(4.0f), normal_sigma(0.3f), plane_sigma(0.01f), albedo_sigma(0.1f) {}
+
+/* GBuffer implementation */
+
+GBuffer::GBuffer(int w, int h) :
+	width(w), height(h),
+	colour(3 * pixels(), 0.0f), position(3 * pixels(), 0.0f), normal(3 * pixels(), 0.0f),
+	depth(pixels(), INFINITY), albedo(3 * pixels(), 0.0f), object(pixels(), -1) {}
+
+size_t GBuffer::pixels() const {
+	return static_cast<size_t>(width) * height;
+}
+
+size_t GBuffer::index(int i, int j) const {
+	return static_cast<size_t>(j) * width + i;
+}
+
+void GBuffer::set(int i, int j, const RGBColour &c, const SurfaceInfo &s) {
+	const size_t n = pixels();
+	const size_t k = index(i, j);
+
+	for (int ch = 0; ch < 3; ch++)
+		colour[ch * n + k] = static_cast<unsigned char>(c.colour[ch]) / 255.0f;
+
+	position[k] = s.position.x();
+	position[n + k] = s.position.y();
+	position[2 * n + k] = s.position.z();
+	normal[k] = s.normal.x();
+	normal[n + k] = s.normal.y();
+	normal[2 * n + k] = s.normal.z();
+	depth[k] = s.depth;
+	albedo[k] = s.albedo.r();
+	albedo[n + k] = s.albedo.g();
+	albedo[2 * n + k] = s.albedo.b();
+	object[k] = s.object;
+}
+
+void GBuffer::writeImages(const std::string &prefix) const {
+	const size_t n = pixels();
+
+	float far = 0.0f;
+	for (size_t k = 0; k < n; k++)
+		if (object[k] >= 0)
+			far = std::max(far, depth[k]);
+
+	Image normals(width, height), depths(width, height), albedos(width, height), objects(width, height);
+	for (int i = 0; i < width; i++) {
+		for (int j = 0; j < height; j++) {
+			const size_t k = index(i, j);
+			if (object[k] < 0)
+				continue;
+
+			normals[i][j] = RGBColour(RGBVec(0.5 + 0.5 * normal[k], 0.5 + 0.5 * normal[n + k], 0.5 + 0.5 * normal[2 * n + k]));
+			double d = 1.0 - depth[k] / far;
+			depths[i][j] = RGBColour(RGBVec(d, d, d));
+			albedos[i][j] = RGBColour(RGBVec(albedo[k], albedo[n + k], albedo[2 * n + k]));
+
+			// any colour will do, as long as neighbouring ids differ
+			unsigned int h = static_cast<unsigned int>(object[k]) * 2654435761u;
+			objects[i][j] = RGBColour(RGBVec((h >> 24) / 255.0, ((h >> 16) & 0xff) / 255.0, ((h >> 8) & 0xff) / 255.0));
+		}
+	}
+
+	normals.writeToFile(prefix + ".normal.ppm");
+	depths.writeToFile(prefix + ".depth.ppm");
+	albedos.writeToFile(prefix + ".albedo.ppm");
+	objects.writeToFile(prefix + ".object.ppm");
+}
+
+void recordGBuffer(RenderJob &job, GBuffer &g) {
+	std::function<void(RenderJob &, const Tile &, RenderStats &)> render = job.tileRenderer;
+	job.tileRenderer = [&g, render](RenderJob &r, const Tile &t, RenderStats &stats) {
+		if (render)
+			render(r, t, stats);
+		else
+			renderPixels(r, t, stats);
+
+		Image &img = *r.image;
+		for (int i = t.x0; i < t.x1; i++)
+			for (int j = t.y0; j < t.y1; j++)
+				g.set(i - r.region.x0, j - r.region.y0, img[i - r.region.x0][j - r.region.y0],
+						r.world->surfaceAt(r.camera, r.viewport, i + 0.5, j + 0.5));
+	};
+}
+
+/* the filter */
+
+// e^-x for x >= 0, to about 1e-6. unlike std::exp, loops calling it
+// can be vectorised, which means no float comparisons, casts to int or
+// std::floor (gcc won't vectorise those without -fno-trapping-math)
+static inline float expNeg(float x) {
+	// non-negative floats sort the same way as their bits do, so
+	// clamping to 80 can be done on the bits
+	union { float f; int32_t i; } clamped, limit;
+	clamped.f = x;
+	limit.f = 80.0f;
+	clamped.i = std::min(clamped.i, limit.i);
+
+	// adding 1.5 * 2^23 leaves t rounded to a whole number in the bottom
+	// of the mantissa
+	const float t = clamped.f * -1.442695041f;
+	union { float f; int32_t i; } round;
+	round.f = t + 12582912.0f;
+	const int32_t whole = round.i - 0x4b400000;
+	const float f = t - whole;
+
+	// 2^f for f in [-0.5, 0.5], times 2^whole put straight into the exponent
+	const float p = 1.0f + f * (0.6931472f + f * (0.2402265f + f * (0.0555041f + f * (0.0096181f + f * 0.0013334f))));
+	union { int32_t i; float f; } scale;
+	scale.i = (whole + 127) << 23;
+	return p * scale.f;
+}
+
+static const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+// one pass over a tile (in G-buffer coordinates), from `in` to `out`
+static void filterTile(const GBuffer &g, const float *in, float *out, int step, float colour_sigma,
+		const DenoiseOptions &opts, const Tile &t) {
+	const size_t n = g.pixels();
+	const int w = g.width;
+	const int span = t.x1 - t.x0;
+
+	const float inv_c = 1.0f / (colour_sigma * colour_sigma);
+	const float inv_n = 1.0f / (opts.normal_sigma * opts.normal_sigma);
+	const float inv_p = 1.0f / (opts.plane_sigma * opts.plane_sigma);
+	const float inv_a = 1.0f / (opts.albedo_sigma * opts.albedo_sigma);
+
+	// tiles are at most RENDER_TILE_SIZE wide. the sums are kept in
+	// arrays of our own, so that the compiler can see they don't overlap
+	// the buffers and vectorise the inner loop without checking
+	float acc_r[RENDER_TILE_SIZE], acc_g[RENDER_TILE_SIZE], acc_b[RENDER_TILE_SIZE], acc_w[RENDER_TILE_SIZE];
+
+	const float *in_r = in, *in_g = in + n, *in_b = in + 2 * n;
+	const float *nx = &g.normal[0], *ny = nx + n, *nz = nx + 2 * n;
+	const float *px = &g.position[0], *py = px + n, *pz = px + 2 * n;
+	const float *ar = &g.albedo[0], *ag = ar + n, *ab = ar + 2 * n;
+	const float *depth = &g.depth[0];
+	const int32_t *object = &g.object[0];
+
+	for (int j = t.y0; j < t.y1; j++) {
+		std::fill(acc_r, acc_r + span, 0.0f);
+		std::fill(acc_g, acc_g + span, 0.0f);
+		std::fill(acc_b, acc_b + span, 0.0f);
+		std::fill(acc_w, acc_w + span, 0.0f);
+
+		for (int dy = -2; dy <= 2; dy++) {
+			const int jq = j + dy * step;
+			if (jq < 0 || jq >= g.height)
+				continue;
+
+			for (int dx = -2; dx <= 2; dx++) {
+				const int off = dx * step;
+				const int lo = std::max(t.x0, -off);
+				const int hi = std::min(t.x1, w - off);
+				const float k = kernel[dx + 2] * kernel[dy + 2];
+
+				// p is the pixel being filtered, q the tap
+				const int row_p = j * w;
+				const int row_q = jq * w + off;
+
+				for (int i = lo; i < hi; i++) {
+					const int p = row_p + i;
+					const int q = row_q + i;
+
+					const float dr = in_r[q] - in_r[p];
+					const float dg = in_g[q] - in_g[p];
+					const float db = in_b[q] - in_b[p];
+
+					const float dnx = nx[q] - nx[p];
+					const float dny = ny[q] - ny[p];
+					const float dnz = nz[q] - nz[p];
+
+					// how far q is off the plane of p's surface
+					const float plane = ((px[q] - px[p]) * nx[p] + (py[q] - py[p]) * ny[p]
+							+ (pz[q] - pz[p]) * nz[p]) / depth[p];
+
+					const float dar = ar[q] - ar[p];
+					const float dag = ag[q] - ag[p];
+					const float dab = ab[q] - ab[p];
+
+					const float e = (dr * dr + dg * dg + db * db) * inv_c
+						+ (dnx * dnx + dny * dny + dnz * dnz) * inv_n
+						+ plane * plane * inv_p
+						+ (dar * dar + dag * dag + dab * dab) * inv_a;
+					const float weight = (object[p] == object[q]) * k * expNeg(e);
+
+					const int a = i - t.x0;
+					acc_r[a] += weight * in_r[q];
+					acc_g[a] += weight * in_g[q];
+					acc_b[a] += weight * in_b[q];
+					acc_w[a] += weight;
+				}
+			}
+		}
+
+		// the centre tap always counts, so the weights never sum to 0
+		const size_t row = g.index(t.x0, j);
+		for (int a = 0; a < span; a++) {
+			out[row + a] = acc_r[a] / acc_w[a];
+			out[n + row + a] = acc_g[a] / acc_w[a];
+			out[2 * n + row + a] = acc_b[a] / acc_w[a];
+		}
+	}
+}
+
+// how noisy the image is, as a standard deviation. each pixel whose
+// four neighbours are all on its own object is compared with their
+// mean: with independent noise of deviation s in every pixel, the
+// difference has deviation s * sqrt(5/4), and the median of its size is
+// 0.6745 times that. edges, shadows and highlights are only a few of
+// the pixels, so they barely move the median, and an image that is only
+// wrong at its edges (as a regular grid of samples is) comes out almost
+// noiseless, and is left almost as it is
+static float noiseLevel(const GBuffer &g) {
+	const size_t n = g.pixels();
+	std::vector<float> diffs;
+	for (int j = 1; j + 1 < g.height; j++) {
+		for (int i = 1; i + 1 < g.width; i++) {
+			const size_t k = g.index(i, j);
+			const size_t around[4] = { k - 1, k + 1, k - g.width, k + g.width };
+			bool same = g.object[k] >= 0;
+			for (int a = 0; a < 4; a++)
+				same = same && g.object[around[a]] == g.object[k];
+			if (!same)
+				continue;
+			for (int ch = 0; ch < 3; ch++) {
+				const float *c = &g.colour[ch * n];
+				const float mean = 0.25f * (c[around[0]] + c[around[1]] + c[around[2]] + c[around[3]]);
+				diffs.push_back(std::fabs(c[k] - mean));
+			}
+		}
+	}
+	if (diffs.empty())
+		return 0.0f;
+	std::nth_element(diffs.begin(), diffs.begin() + diffs.size() / 2, diffs.end());
+	return diffs[diffs.size() / 2] / (0.6745f * std::sqrt(1.25f));
+}
+
+void denoise(RenderEngine &engine, RenderJob &job, const GBuffer &g, const DenoiseOptions &opts) {
+	std::vector<float> a(g.colour);
+	std::vector<float> b(g.colour.size());
+	const float noise = noiseLevel(g);
+	if (noise < DENOISE_MIN_NOISE)
+		return;
+
+	// each pass is a job of its own over the same region, so that its
+	// tiles are shared out between the engine's threads
+	for (int pass = 0; pass < opts.passes; pass++) {
+		const int step = 1 << pass;
+		const float colour_sigma = opts.colour_sigma * noise / step;
+		const float *in = &a[0];
+		float *out = &b[0];
+
+		RenderJob filter(*job.world, job.camera, job.viewport, job.ss_level, *job.image, job.region);
+		filter.tileRenderer = [&, in, out, step, colour_sigma](RenderJob &r, const Tile &t, RenderStats &) {
+			Tile local = { t.x0 - r.region.x0, t.y0 - r.region.y0, t.x1 - r.region.x0, t.y1 - r.region.y0 };
+			filterTile(g, in, out, step, colour_sigma, opts, local);
+		};
+		engine.render(filter);
+		a.swap(b);
+	}
+
+	const size_t n = g.pixels();
+	Image &img = *job.image;
+	for (int i = 0; i < g.width; i++) {
+		for (int j = 0; j < g.height; j++) {
+			const size_t k = g.index(i, j);
+			img[i][j] = RGBColour(RGBVec(a[k], a[n + k], a[2 * n + k]));
+		}
+	}
+}
@@ -0,0 +1,81 @@
+/* denoise.hpp
+ *
+ * an edge-avoiding à-trous filter (Dammertz et al., "Edge-Avoiding
+ * À-Trous Wavelet Transform for fast Global Illumination Filtering")
+ *
+ * while a frame is rendered, a G-buffer records what each pixel's
+ * centre ray hit first: its position, normal, depth, albedo and object.
+ * the filter then blurs the image with a 5x5 kernel whose taps spread
+ * out (1, 2, 4, 8... pixels apart) with each pass, so a few passes
+ * cover a wide area cheaply. each tap is weighted by how alike the two
+ * pixels are (colour, normal, albedo, and how far one is from the
+ * other's surface), and pixels on different objects are never mixed,
+ * so noise is smoothed away without blurring edges.
+ *
+ * how different two colours may be and still be mixed goes by how noisy
+ * the image is, which is estimated from the image itself. an image with
+ * less noise than a step of 8 bit colour (a regular grid of samples is
+ * only wrong at edges, which the G-buffer can't see) is left alone, so
+ * the filter never smooths away detail that wasn't noise.
+ *
+ * buffers are stored a plane per channel, so the inner loops run along
+ * rows of plain floats and get vectorised. passes are split into tiles
+ * and run on a RenderEngine's threads.
+ */
+
+#ifndef DENOISE_HEADER_WARRIOR
+#define DENOISE_HEADER_WARRIOR
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "world.hpp"
+#include "image.hpp"
+#include "renderer.hpp"
+
+/* GBuffer
+ *
+ * per-pixel planes, row by row from the bottom of the image. objects
+ * have to have been numbered (World::numberObjects) or the filter can't
+ * tell them apart */
+struct GBuffer {
+	int width;
+	int height;
+
+	std::vector<float> colour;	// r, g, b planes
+	std::vector<float> position;	// x, y, z planes
+	std::vector<float> normal;	// x, y, z planes
+	std::vector<float> depth;	// infinite where nothing was hit
+	std::vector<float> albedo;	// r, g, b planes
+	std::vector<int32_t> object;	// -1 where nothing was hit
+
+	GBuffer(int w, int h);
+
+	size_t pixels() const;
+	size_t index(int i, int j) const;
+	void set(int i, int j, const RGBColour &c, const SurfaceInfo &s);
+
+	// writes <prefix>.normal.ppm, .depth.ppm, .albedo.ppm and .object.ppm
+	void writeImages(const std::string &prefix) const;
+};
+
+struct DenoiseOptions {
+	int passes;
+	float colour_sigma;	// times the image's noise, halved with every pass
+	float normal_sigma;
+	float plane_sigma;	// distance from the surface, as a fraction of the depth
+	float albedo_sigma;
+
+	DenoiseOptions();
+};
+
+// makes the job fill in the G-buffer (which must be the size of the
+// job's region) once it has rendered each tile of its image, with its
+// own tileRenderer if it has one
+void recordGBuffer(RenderJob &job, GBuffer &g);
+
+// filters the image of a job that has been rendered with recordGBuffer
+void denoise(RenderEngine &engine, RenderJob &job, const GBuffer &g, const DenoiseOptions &opts);
+
+#endif
@@ -0,0 +1,763 @@
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#include "distributed.hpp"
+#include "renderer.hpp"
+#include "world.hpp"
+#include "image.hpp"
+#include "mappedfile.hpp"
+#include "sceneparser.hpp"
+
+#define DIST_TILE_SIZE 64
+#define DIST_TILES_PER_THREAD 2		// tiles a worker holds per render thread
+#define DIST_STRAGGLER_FACTOR 4.0	// how much slower than usual before a tile is copied
+#define DIST_MAX_COPIES 2		// of any one tile at once
+#define DIST_MAX_TILE_FAILURES 3	// workers a tile may take down with it
+#define DIST_RESPAWNS_PER_WORKER 2
+#define DIST_POLL_MS 100
+#define DIST_EXIT_GRACE_MS 2000		// how long workers get to leave before they're made to
+
+enum MessageType {
+	msg_scene = 1,	// coordinator -> worker: scene file bytes
+	msg_ready,	// worker -> coordinator: uint32 thread count and pid
+	msg_tile,	// coordinator -> worker: TileMessage
+	msg_result,	// worker -> coordinator: TileMessage, then the pixels
+	msg_error,	// worker -> coordinator: what went wrong
+	msg_bye		// coordinator -> worker: no more tiles
+};
+
+struct MessageHeader {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t length;	// of the payload that follows
+};
+
+// pixels follow a result column by column, 3 bytes each, in the same
+// layout as Image
+struct TileMessage {
+	int32_t index;
+	int32_t x0, y0, x1, y1;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+DistributedOptions::DistributedOptions() : local_workers(2), worker_threads(0), port(0), tile_size(DIST_TILE_SIZE) {}
+
+DistributedException::DistributedException(const std::string &msg) :
+	std::runtime_error(msg) {}
+
+static bool writeAll(int fd, const void *buf, size_t n)
+{
+	const char *p = static_cast<const char *>(buf);
+	while (n > 0) {
+		ssize_t w = write(fd, p, n);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return false;
+		p += w;
+		n -= w;
+	}
+	return true;
+}
+
+static bool readAll(int fd, void *buf, size_t n)
+{
+	char *p = static_cast<char *>(buf);
+	while (n > 0) {
+		ssize_t r = read(fd, p, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		p += r;
+		n -= r;
+	}
+	return true;
+}
+
+static bool sendMessage(int fd, uint32_t type, const void *a, size_t an, const void *b = NULL, size_t bn = 0)
+{
+	MessageHeader h;
+	h.type = type;
+	h.reserved = 0;
+	h.length = an + bn;
+	return writeAll(fd, &h, sizeof(h)) && writeAll(fd, a, an) && writeAll(fd, b, bn);
+}
+
+// blocking, for the worker side
+static bool readMessage(int fd, uint32_t &type, std::string &payload)
+{
+	MessageHeader h;
+	if (!readAll(fd, &h, sizeof(h)))
+		return false;
+	type = h.type;
+	payload.resize(h.length);
+	return h.length == 0 || readAll(fd, &payload[0], h.length);
+}
+
+static void setNoDelay(int fd)
+{
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* the coordinator */
+
+namespace {
+
+struct TileState {
+	Tile tile;
+	bool done;
+	int copies;		// workers holding it right now
+	int failures;		// workers that died holding it
+};
+
+struct WorkerLink {
+	int fd;
+	pid_t pid;		// -1 for workers that joined from elsewhere
+	std::string name;
+	bool ready;
+	int capacity;
+	std::string inbox;	// bytes received but not yet made into messages
+	std::map<int, Clock::time_point> in_flight;
+	int tiles_rendered;
+};
+
+class Coordinator {
+private:
+	const DistributedOptions &opts;
+	const std::string scene_bytes;
+	Image &image;
+
+	std::vector<TileState> tiles;
+	std::deque<int> pending;
+	int tiles_done;
+	int copies_sent;
+	int tiles_requeued;
+	double tile_seconds;	// total round trip time of finished tiles
+
+	int listen_fd;
+	std::string address;	// for local workers to connect to
+	std::vector<WorkerLink *> links;
+	std::vector<pid_t> children;	// forked workers that haven't connected yet
+	std::vector<pid_t> forked;	// every forked worker that hasn't been waited for
+	int respawns_left;
+	int threads_per_worker;
+
+	void listen()
+	{
+		listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listen_fd < 0)
+			throw DistributedException("couldn't create socket: " + std::string(strerror(errno)));
+
+		int one = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(opts.port);
+		addr.sin_addr.s_addr = htonl(opts.port ? INADDR_ANY : INADDR_LOOPBACK);
+
+		if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 || ::listen(listen_fd, 64) < 0)
+			throw DistributedException("couldn't listen on port " + std::to_string(opts.port) + ": " + strerror(errno));
+
+		socklen_t len = sizeof(addr);
+		getsockname(listen_fd, (sockaddr *)&addr, &len);
+		address = "127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+	}
+
+	void spawnWorker()
+	{
+		std::string threads = std::to_string(threads_per_worker);
+		pid_t pid = fork();
+		if (pid < 0)
+			throw DistributedException("couldn't fork a worker: " + std::string(strerror(errno)));
+		if (pid == 0) {
+			execl("/proc/self/exe", "traceify", "--worker", address.c_str(), threads.c_str(), (char *)NULL);
+			_exit(127);
+		}
+		children.push_back(pid);
+		forked.push_back(pid);
+	}
+
+	void accept()
+	{
+		sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		int fd = accept4(listen_fd, (sockaddr *)&addr, &len, SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+		setNoDelay(fd);
+
+		WorkerLink *link = new WorkerLink();
+		link->fd = fd;
+		link->pid = -1;
+		link->name = std::string(inet_ntoa(addr.sin_addr)) + ":" + std::to_string(ntohs(addr.sin_port));
+		link->ready = false;
+		link->capacity = 0;
+		link->tiles_rendered = 0;
+		links.push_back(link);
+
+		if (!sendMessage(fd, msg_scene, scene_bytes.data(), scene_bytes.size()))
+			drop(link, "couldn't send the scene");
+	}
+
+	// the worker has gone, one way or another. its tiles go back to the
+	// front of the queue, since they're the oldest ones outstanding
+	void drop(WorkerLink *link, const std::string &why)
+	{
+		std::cerr << "traceify: lost worker " << link->name << " (" << why << ")";
+		if (!link->in_flight.empty())
+			std::cerr << ", requeueing " << link->in_flight.size() << " tiles";
+		std::cerr << std::endl;
+
+		for (std::map<int, Clock::time_point>::iterator it = link->in_flight.begin(); it != link->in_flight.end(); ++it) {
+			TileState &ts = tiles[it->first];
+			ts.copies--;
+			if (ts.done)
+				continue;
+			if (++ts.failures >= DIST_MAX_TILE_FAILURES)
+				throw DistributedException("tile " + std::to_string(it->first) + " has failed on "
+						+ std::to_string(ts.failures) + " workers, giving up");
+			if (ts.copies == 0) {
+				pending.push_front(it->first);
+				tiles_requeued++;
+			}
+		}
+
+		close(link->fd);
+		link->fd = -1;
+
+		// a pid that's been waited for may belong to something else now
+		if (link->pid > 0 && std::find(forked.begin(), forked.end(), link->pid) != forked.end())
+			kill(link->pid, SIGKILL);
+	}
+
+	// local workers are matched up with the processes we forked by the
+	// pid in their ready message. a worker that fails, or sends nonsense,
+	// is dropped like one that hung up, and the others carry on
+	void handleMessage(WorkerLink *link, uint32_t type, const char *payload, size_t n)
+	{
+		if (type == msg_ready && n == 2 * sizeof(uint32_t)) {
+			uint32_t info[2];
+			memcpy(info, payload, sizeof(info));
+			link->ready = true;
+			link->capacity = DIST_TILES_PER_THREAD * std::max<uint32_t>(info[0], 1);
+
+			pid_t pid = static_cast<pid_t>(info[1]);
+			for (size_t i = 0; i < children.size(); i++) {
+				if (children[i] == pid) {
+					link->pid = pid;
+					children.erase(children.begin() + i);
+					break;
+				}
+			}
+		}
+		else if (type == msg_result && n >= sizeof(TileMessage)) {
+			TileMessage tm;
+			memcpy(&tm, payload, sizeof(tm));
+			if (tm.index < 0 || tm.index >= (int)tiles.size()) {
+				drop(link, "sent back a tile that doesn't exist");
+				return;
+			}
+
+			TileState &ts = tiles[tm.index];
+			const Tile &t = ts.tile;
+			size_t column = 3 * (t.y1 - t.y0);
+			if (tm.x0 != t.x0 || tm.y0 != t.y0 || tm.x1 != t.x1 || tm.y1 != t.y1
+					|| n != sizeof(TileMessage) + column * (t.x1 - t.x0)) {
+				drop(link, "sent back a malformed tile");
+				return;
+			}
+
+			std::map<int, Clock::time_point>::iterator it = link->in_flight.find(tm.index);
+			if (it == link->in_flight.end())
+				return;
+			double seconds = std::chrono::duration<double>(Clock::now() - it->second).count();
+			link->in_flight.erase(it);
+			ts.copies--;
+
+			if (ts.done)
+				return;
+
+			const char *pixels = payload + sizeof(TileMessage);
+			for (int i = t.x0; i < t.x1; i++)
+				memcpy(&image[i][t.y0], pixels + column * (i - t.x0), column);
+
+			ts.done = true;
+			tiles_done++;
+			tile_seconds += seconds;
+			link->tiles_rendered++;
+		}
+		else if (type == msg_error) {
+			drop(link, std::string(payload, n));
+		}
+		else {
+			drop(link, "sent a message we don't understand");
+		}
+	}
+
+	void receive(WorkerLink *link)
+	{
+		char buf[65536];
+		ssize_t r = read(link->fd, buf, sizeof(buf));
+		if (r < 0 && errno == EINTR)
+			return;
+		if (r <= 0) {
+			drop(link, r == 0 ? "hung up" : strerror(errno));
+			return;
+		}
+		link->inbox.append(buf, r);
+
+		size_t used = 0;
+		while (link->inbox.size() - used >= sizeof(MessageHeader)) {
+			MessageHeader h;
+			memcpy(&h, link->inbox.data() + used, sizeof(h));
+			if (link->inbox.size() - used - sizeof(h) < h.length)
+				break;
+			handleMessage(link, h.type, link->inbox.data() + used + sizeof(h), h.length);
+			used += sizeof(h) + h.length;
+			if (link->fd < 0)
+				return;
+		}
+		link->inbox.erase(0, used);
+	}
+
+	// a tile that's been out far longer than tiles usually take, and
+	// that this worker isn't already working on
+	int straggler(WorkerLink *link, Clock::time_point now)
+	{
+		if (tiles_done == 0)
+			return -1;
+		double usual = tile_seconds / tiles_done;
+
+		int worst = -1;
+		double worst_age = DIST_STRAGGLER_FACTOR * usual;
+		for (size_t i = 0; i < links.size(); i++) {
+			WorkerLink *other = links[i];
+			if (other == link || other->fd < 0)
+				continue;
+			for (std::map<int, Clock::time_point>::iterator it = other->in_flight.begin(); it != other->in_flight.end(); ++it) {
+				const TileState &ts = tiles[it->first];
+				double age = std::chrono::duration<double>(now - it->second).count();
+				if (!ts.done && ts.copies < DIST_MAX_COPIES && age > worst_age && !link->in_flight.count(it->first)) {
+					worst = it->first;
+					worst_age = age;
+				}
+			}
+		}
+		return worst;
+	}
+
+	void handOut()
+	{
+		Clock::time_point now = Clock::now();
+
+		for (size_t i = 0; i < links.size(); i++) {
+			WorkerLink *link = links[i];
+			while (link->fd >= 0 && link->ready && (int)link->in_flight.size() < link->capacity) {
+				int index;
+				if (!pending.empty()) {
+					index = pending.front();
+					pending.pop_front();
+				}
+				else {
+					index = straggler(link, now);
+					if (index < 0)
+						break;
+					copies_sent++;
+				}
+
+				TileState &ts = tiles[index];
+				TileMessage tm;
+				tm.index = index;
+				tm.x0 = ts.tile.x0;
+				tm.y0 = ts.tile.y0;
+				tm.x1 = ts.tile.x1;
+				tm.y1 = ts.tile.y1;
+
+				ts.copies++;
+				link->in_flight[index] = now;
+
+				if (!sendMessage(link->fd, msg_tile, &tm, sizeof(tm)))
+					drop(link, "couldn't send a tile");
+			}
+		}
+	}
+
+	// forked workers that exit before connecting never get a link, so
+	// they're noticed here. ones with links are noticed by their socket.
+	// only our own workers are waited for: whatever else the process
+	// has forked is none of our business
+	void reap()
+	{
+		for (size_t k = 0; k < forked.size(); ) {
+			pid_t pid = forked[k];
+			if (waitpid(pid, NULL, WNOHANG) != pid) {
+				k++;
+				continue;
+			}
+			forked.erase(forked.begin() + k);
+
+			std::vector<pid_t>::iterator it = std::find(children.begin(), children.end(), pid);
+			if (it != children.end()) {
+				std::cerr << "traceify: worker " << pid << " exited before connecting" << std::endl;
+				children.erase(it);
+				replace();
+			}
+		}
+	}
+
+	// waits up to ms for the forked workers to exit, forgetting the
+	// ones that do
+	void waitForWorkers(int ms)
+	{
+		const Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(ms);
+		for (;;) {
+			for (size_t k = 0; k < forked.size(); ) {
+				pid_t r = waitpid(forked[k], NULL, WNOHANG);
+				if (r == forked[k] || (r < 0 && errno == ECHILD))
+					forked.erase(forked.begin() + k);
+				else
+					k++;
+			}
+			if (forked.empty() || Clock::now() >= deadline)
+				return;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	void replace()
+	{
+		if (respawns_left > 0 && tiles_done < (int)tiles.size()) {
+			respawns_left--;
+			spawnWorker();
+		}
+	}
+
+	void prune()
+	{
+		for (size_t i = 0; i < links.size(); ) {
+			if (links[i]->fd < 0) {
+				if (links[i]->pid > 0)
+					replace();
+				delete links[i];
+				links.erase(links.begin() + i);
+			}
+			else {
+				i++;
+			}
+		}
+	}
+
+public:
+	Coordinator(const DistributedOptions &opts, const MappedFile &scene, Image &image) :
+		opts(opts), scene_bytes(scene.data(), scene.size()), image(image),
+		tiles_done(0), copies_sent(0), tiles_requeued(0), tile_seconds(0.0), listen_fd(-1),
+		respawns_left(opts.local_workers * DIST_RESPAWNS_PER_WORKER)
+	{
+		const int size = opts.tile_size > 0 ? opts.tile_size : DIST_TILE_SIZE;
+		for (int y0 = 0; y0 < image.height; y0 += size) {
+			for (int x0 = 0; x0 < image.width; x0 += size) {
+				TileState ts;
+				ts.tile.x0 = x0;
+				ts.tile.y0 = y0;
+				ts.tile.x1 = std::min(x0 + size, image.width);
+				ts.tile.y1 = std::min(y0 + size, image.height);
+				ts.done = false;
+				ts.copies = 0;
+				ts.failures = 0;
+				pending.push_back(tiles.size());
+				tiles.push_back(ts);
+			}
+		}
+
+		threads_per_worker = opts.worker_threads;
+		if (threads_per_worker <= 0 && opts.local_workers > 0) {
+			int cores = static_cast<int>(std::thread::hardware_concurrency());
+			threads_per_worker = std::max(1, cores / opts.local_workers);
+		}
+	}
+
+	~Coordinator()
+	{
+		for (size_t i = 0; i < links.size(); i++) {
+			if (links[i]->fd >= 0) {
+				sendMessage(links[i]->fd, msg_bye, NULL, 0);
+				close(links[i]->fd);
+			}
+			delete links[i];
+		}
+		if (listen_fd >= 0)
+			close(listen_fd);
+
+		// connected workers have been told to go, and the rest are asked
+		// to. whatever is still running after that is killed
+		for (size_t i = 0; i < forked.size(); i++)
+			if (std::find(children.begin(), children.end(), forked[i]) != children.end())
+				kill(forked[i], SIGTERM);
+		waitForWorkers(DIST_EXIT_GRACE_MS);
+		for (size_t i = 0; i < forked.size(); i++)
+			kill(forked[i], SIGTERM);
+		waitForWorkers(DIST_EXIT_GRACE_MS);
+		for (size_t i = 0; i < forked.size(); i++)
+			kill(forked[i], SIGKILL);
+		waitForWorkers(DIST_EXIT_GRACE_MS);
+	}
+
+	void run()
+	{
+		listen();
+		for (int i = 0; i < opts.local_workers; i++)
+			spawnWorker();
+		if (opts.port)
+			std::cerr << "traceify: waiting for workers on port " << opts.port << std::endl;
+
+		while (tiles_done < (int)tiles.size()) {
+			handOut();
+
+			std::vector<pollfd> fds(1);
+			fds[0].fd = listen_fd;
+			fds[0].events = POLLIN;
+			for (size_t i = 0; i < links.size(); i++) {
+				pollfd p;
+				p.fd = links[i]->fd;
+				p.events = POLLIN;
+				fds.push_back(p);
+			}
+
+			if (poll(&fds[0], fds.size(), DIST_POLL_MS) < 0 && errno != EINTR)
+				throw DistributedException("poll failed: " + std::string(strerror(errno)));
+
+			for (size_t i = 1; i < fds.size(); i++)
+				if (fds[i].revents && links[i - 1]->fd >= 0)
+					receive(links[i - 1]);
+			if (fds[0].revents & POLLIN)
+				accept();
+
+			reap();
+			prune();
+
+			// with a port open, remote workers may still turn up
+			if (links.empty() && children.empty() && !opts.port)
+				throw DistributedException("no workers left");
+		}
+	}
+
+	void summarise(std::ostream &os, double seconds)
+	{
+		os << "Rendered " << tiles.size() << " tiles in " << seconds << "s";
+		if (copies_sent || tiles_requeued)
+			os << " (" << copies_sent << " backup copies, " << tiles_requeued << " requeued)";
+		os << std::endl;
+		for (size_t i = 0; i < links.size(); i++)
+			os << "  " << links[i]->name << ": " << links[i]->tiles_rendered << " tiles" << std::endl;
+	}
+};
+
+}
+
+void renderDistributed(const std::string &scene_path, const std::string &out_path, const DistributedOptions &opts)
+{
+	signal(SIGPIPE, SIG_IGN);
+	const Clock::time_point start = Clock::now();
+
+	// the coordinator never renders, but it loads the scene anyway to
+	// find out how big the frame is (and to catch mistakes in it before
+	// the workers do)
+	MappedFile scene(scene_path);
+	World world(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec());
+	std::vector<std::string> refers;
+	loadScene(scene_path, world, &refers);
+
+	// only the scene file itself is sent to workers, which open the
+	// files it refers to themselves. forked workers share our working
+	// directory, but workers that join from elsewhere don't
+	if (opts.port) {
+		for (size_t i = 0; i < refers.size(); i++)
+			if (refers[i].empty() || refers[i][0] != '/')
+				throw DistributedException(scene_path + " refers to " + refers[i]
+						+ " by a relative path, which remote workers can't follow. "
+						"give its absolute path, on a filesystem every worker can see");
+	}
+
+	Image img(world.viewport.pixelsWide(), world.viewport.pixelsTall());
+	{
+		Coordinator coordinator(opts, scene, img);
+		coordinator.run();
+		coordinator.summarise(std::cout, std::chrono::duration<double>(Clock::now() - start).count());
+	}
+
+	img.writeToFile(out_path);
+}
+
+/* the worker */
+
+namespace {
+
+class Worker {
+private:
+	int fd;
+	std::mutex send_lock;
+	std::mutex jobs_lock;
+	std::condition_variable jobs_cv;
+	int outstanding;
+
+public:
+	Worker(int fd) : fd(fd), outstanding(0) {}
+
+	void send(uint32_t type, const void *a, size_t an, const void *b = NULL, size_t bn = 0)
+	{
+		std::lock_guard<std::mutex> guard(send_lock);
+		if (!sendMessage(fd, type, a, an, b, bn)) {
+			// the coordinator has gone, so there's nobody to render for
+			_exit(1);
+		}
+	}
+
+	void run(int threads)
+	{
+		uint32_t type;
+		std::string payload;
+		if (!readMessage(fd, type, payload) || type != msg_scene)
+			throw DistributedException("expected a scene from the coordinator");
+
+		World world(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec());
+		{
+			// scenes are loaded from files, so that binary ones can be
+			// mapped. this one only lives in memory, and goes away with
+			// the last descriptor or mapping of it however the worker
+			// exits, so there's never anything left to clean up
+			int mem = memfd_create("traceify-scene", MFD_CLOEXEC);
+			if (mem < 0)
+				throw DistributedException("couldn't make a file for the scene: " + std::string(strerror(errno)));
+			const std::string path = "/proc/self/fd/" + std::to_string(mem);
+			try {
+				if (!writeAll(mem, payload.data(), payload.size()))
+					throw DistributedException("couldn't write the scene: " + std::string(strerror(errno)));
+				loadScene(path, world);
+			}
+			catch (...) {
+				close(mem);
+				throw;
+			}
+			close(mem);
+		}
+		std::string().swap(payload);
+		world.buildHierarchy();
+
+		RenderEngine engine(threads);
+		uint32_t info[2] = { static_cast<uint32_t>(engine.threadCount()), static_cast<uint32_t>(getpid()) };
+		send(msg_ready, info, sizeof(info));
+
+		while (readMessage(fd, type, payload) && type == msg_tile && payload.size() == sizeof(TileMessage)) {
+			TileMessage tm;
+			memcpy(&tm, payload.data(), sizeof(tm));
+
+			Tile region;
+			region.x0 = tm.x0;
+			region.y0 = tm.y0;
+			region.x1 = tm.x1;
+			region.y1 = tm.y1;
+
+			Image *img = new Image(tm.x1 - tm.x0, tm.y1 - tm.y0);
+			RenderJob *job = new RenderJob(world, world.camera(), world.viewport, world.ss_level, *img, region);
+			job->onDone = [this, tm, img, job](RenderJob &) {
+				std::string pixels;
+				pixels.reserve(3 * img->width * img->height);
+				for (int i = 0; i < img->width; i++)
+					pixels.append(&(*img)[i][0].colour[0], 3 * img->height);
+				send(msg_result, &tm, sizeof(tm), pixels.data(), pixels.size());
+
+				delete img;
+				delete job;
+
+				std::lock_guard<std::mutex> guard(jobs_lock);
+				outstanding--;
+				jobs_cv.notify_all();
+			};
+
+			{
+				std::lock_guard<std::mutex> guard(jobs_lock);
+				outstanding++;
+			}
+			engine.submit(*job);
+		}
+
+		// bye, or the coordinator has gone. either way we're finished
+		// once the engine stops touching our jobs
+		std::unique_lock<std::mutex> guard(jobs_lock);
+		while (outstanding > 0)
+			jobs_cv.wait(guard);
+	}
+};
+
+}
+
+void runWorker(const std::string &address, int threads)
+{
+	signal(SIGPIPE, SIG_IGN);
+
+	size_t colon = address.rfind(':');
+	if (colon == std::string::npos)
+		throw DistributedException("expected <host>:<port>, got " + address);
+	std::string host = address.substr(0, colon);
+	std::string port = address.substr(colon + 1);
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *res;
+	int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+	if (err != 0)
+		throw DistributedException("couldn't look up " + address + ": " + gai_strerror(err));
+
+	int fd = -1;
+	for (addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		throw DistributedException("couldn't connect to " + address);
+	setNoDelay(fd);
+
+	Worker worker(fd);
+	try {
+		worker.run(threads);
+	}
+	catch (const std::runtime_error &e) {
+		// let the coordinator know why, rather than just hanging up
+		worker.send(msg_error, e.what(), strlen(e.what()));
+		close(fd);
+		throw;
+	}
+	close(fd);
+}
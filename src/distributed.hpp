@@ -0,0 +1,57 @@
+/* distributed.hpp
+ *
+ * rendering one frame across several worker processes
+ *
+ * the coordinator loads the scene (to find out how big the frame is),
+ * then listens on a TCP port for workers. it can fork workers of its
+ * own on this machine, and workers on other machines can join with
+ * `traceify --worker <host>:<port>`. every worker is sent the bytes of
+ * the scene file, builds the scene for itself, and then asks for tiles
+ * to render.
+ *
+ * tiles are handed out a few at a time, as workers finish them, so fast
+ * workers naturally take more of the frame than slow ones. once there
+ * are no fresh tiles left, idle workers are also given copies of tiles
+ * that have been out for much longer than usual, and whichever copy
+ * comes back first is used. tiles held by a worker that dies (or hangs
+ * up) go back in the queue, and local workers that die are replaced.
+ *
+ * pixel jitter is seeded per pixel, so the frame comes out exactly as
+ * it would from a single process. the messages are sent in host byte
+ * order, so all the machines have to agree on that. only the scene file
+ * itself is sent: files it refers to (paged sphere files, say) are
+ * opened by each worker, so they have to be wherever the workers are.
+ * with a port open, scenes that refer to files by relative paths are
+ * refused, since a remote worker would look for them somewhere else.
+ * a worker that fails (can't open one of those files, for instance) is
+ * dropped, and its tiles go to the others
+ */
+
+#ifndef DISTRIBUTED_HEADER_WARRIOR
+#define DISTRIBUTED_HEADER_WARRIOR
+
+#include <string>
+#include <stdexcept>
+
+struct DistributedOptions {
+	int local_workers;	// worker processes to fork on this machine
+	int worker_threads;	// render threads in each local worker, 0 to share out the cores
+	int port;		// 0 picks a free port and only accepts local workers
+	int tile_size;		// tiles are tile_size pixels square
+
+	DistributedOptions();
+};
+
+struct DistributedException : public std::runtime_error {
+	DistributedException(const std::string &msg);
+};
+
+// renders the scene with the help of some workers, writing the result
+// to out_path as a PPM
+void renderDistributed(const std::string &scene_path, const std::string &out_path, const DistributedOptions &opts);
+
+// connects to a coordinator at host:port and renders tiles for it until
+// it hangs up. 0 threads means one per hardware thread
+void runWorker(const std::string &address, int threads);
+
+#endif
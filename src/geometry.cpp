@@ -1,9 +1,15 @@
 #include "geometry.hpp"
 
+#include <algorithm>
+#include <mutex>
+#include <cstdint>
+
 GeometryException::GeometryException(std::string msg) : std::runtime_error(msg) {}
 
 IntersectionDatum::IntersectionDatum() : IntersectionResult(), intersectedObj(NULL) {}
 IntersectionDatum::IntersectionDatum(double t, SceneObject *objPtr) : IntersectionResult(t), intersectedObj(objPtr) {}
+IntersectionDatum::IntersectionDatum(double t, SceneObject *objPtr, int prim) : IntersectionResult(t, prim), intersectedObj(objPtr) {}
+IntersectionDatum::IntersectionDatum(const IntersectionResult &r, SceneObject *objPtr) : IntersectionResult(r), intersectedObj(objPtr) {}
 
 /* BoundingBox implementation
  *
@@ -23,24 +29,68 @@ void BoundingBox::swallow(const BoundingBox &b) {
 	if (b.z_max > z_max) z_max = b.z_max;
 }
 
+bool BoundingBox::touchesSegment(const vec3 &a, const vec3 &b, double grow) const {
+	const double lo[3] = { x_min - grow, y_min - grow, z_min - grow };
+	const double hi[3] = { x_max + grow, y_max + grow, z_max + grow };
+	const double from[3] = { a.x(), a.y(), a.z() };
+	const double to[3] = { b.x(), b.y(), b.z() };
+
+	double t0 = 0.0;
+	double t1 = 1.0;
+	for (int k = 0; k < 3; k++) {
+		double d = to[k] - from[k];
+		if (d == 0.0) {
+			if (from[k] < lo[k] || from[k] > hi[k])
+				return false;
+			continue;
+		}
+		double ta = (lo[k] - from[k]) / d;
+		double tb = (hi[k] - from[k]) / d;
+		if (ta > tb) std::swap(ta, tb);
+		t0 = std::max(t0, ta);
+		t1 = std::min(t1, tb);
+		if (t0 > t1)
+			return false;
+	}
+	return true;
+}
+
 /* SceneObject implementation
  *
  * SceneObject is a high-level abstract class which all the 
  * constructs in the scene (spheres, clusters, planes, etc.) implement.
  */
 
+SceneObject::SceneObject() : id(-1) {}
+
 // need this for the virtual destructor to compile
 SceneObject::~SceneObject() {}
 
+void SceneObject::translate(const vec3 &) {
+	throw GeometryException("Cannot move a " + tag());
+}
+
+bool SceneObject::isBounded() 		{ return true; }
+bool SceneObject::isBounded() const 	{ return true; }
+bool SceneObject::isConvex() 		{ return false; }
+bool SceneObject::isConvex() const 	{ return false; }
+
 // Used to contruct the portion of the subclassed
 // objects which is a ShadableObject
 //
 // Note that ShadableObject is still abstract
-ShadableObject::ShadableObject(Material mat) : material(mat) {}
+ShadableObject::ShadableObject(const Material &mat) : material(mat) {}
 
 bool ShadableObject::isCluster() 	{ return false; }
 bool ShadableObject::isCluster() const 	{ return false; }
 
+vec3 ShadableObject::surfaceNormalAt(const vec3 &p, const IntersectionResult &) const 	{ return surfaceNormal(p); }
+const Material &ShadableObject::materialAt(const IntersectionResult &) const 		{ return material; }
+
+bool ShadableObject::textureCoordsAt(const vec3 &, int, double, double &, double &, double &, double &) const {
+	return false;
+}
+
 // note that the `makeCopy` method is necessary to allow us
 // to make a heap-allocated copy of a SceneObject
 // without knowing its type at compile-time.
@@ -98,6 +148,24 @@ BoundingBox Sphere::getBoundBox() {
 	return const_cast<const Sphere *>(this)->getBoundBox();
 }
 
+bool Sphere::isConvex() 	{ return true; }
+bool Sphere::isConvex() const 	{ return true; }
+
+void Sphere::translate(const vec3 &offset) {
+	centre = centre + offset;
+}
+
+bool Sphere::textureCoordsAt(const vec3 &p, int, double, double &u, double &v, double &span_u, double &span_v) const {
+	vec3 d = (p - centre).scaled(1.0 / radius);
+	u = 0.5 + atan2(d.z(), d.x()) / (2.0 * M_PI);
+	v = 0.5 + asin(std::max(-1.0, std::min(1.0, d.y()))) / M_PI;
+
+	// lines of latitude shrink towards the poles
+	span_u = 2.0 * M_PI * radius * std::max(sqrt(std::max(0.0, 1.0 - d.y() * d.y())), 1e-3);
+	span_v = M_PI * radius;
+	return true;
+}
+
 // Sphere Intersection
 IntersectionResult Sphere::intersects(const Ray &ray) const {
 	vec3 e = ray.origin;
@@ -145,6 +213,34 @@ vec3 Plane::surfaceNormal() const 		{ return normal; }
 vec3 Plane::surfaceNormal(const vec3&) 		{ return normal; }
 vec3 Plane::surfaceNormal(const vec3&) const 	{ return normal; }
 
+bool Plane::isBounded() 	{ return false; }
+bool Plane::isBounded() const 	{ return false; }
+bool Plane::isConvex() 		{ return true; }
+bool Plane::isConvex() const 	{ return true; }
+
+double Plane::signedDistance(const vec3 &p) const {
+	return p.dot(normal) + k;
+}
+
+double Plane::signedDistance(const vec3 &p) {
+	return const_cast<const Plane*>(this)->signedDistance(p);
+}
+
+bool Plane::textureCoordsAt(const vec3 &p, int, double scale, double &u, double &v, double &span_u, double &span_v) const {
+	// any two axes at right angles in the plane will do, as long as
+	// they're always the same ones
+	vec3 n = normal.normalised();
+	vec3 a = fabs(n.x()) < 0.9 ? vec3(1.0, 0.0, 0.0) : vec3(0.0, 1.0, 0.0);
+	vec3 t(a.y() * n.z() - a.z() * n.y(), a.z() * n.x() - a.x() * n.z(), a.x() * n.y() - a.y() * n.x());
+	t = t.normalised();
+	vec3 b(n.y() * t.z() - n.z() * t.y(), n.z() * t.x() - n.x() * t.z(), n.x() * t.y() - n.y() * t.x());
+
+	u = p.dot(t) / scale;
+	v = p.dot(b) / scale;
+	span_u = span_v = scale;
+	return true;
+}
+
 BoundingBox Plane::getBoundBox() { 
 	throw GeometryException("Cannot get the bounding box of a plane"); 
 }
@@ -153,6 +249,11 @@ BoundingBox Plane::getBoundBox() const {
 	throw GeometryException("Cannot get the bounding box of a plane"); 
 }
 
+// every point r on the moved plane has r - offset on the old one
+void Plane::translate(const vec3 &offset) {
+	k -= offset.dot(normal);
+}
+
 // Plane Intersection
 IntersectionResult Plane::intersects(const Ray &ray) const {
 	vec3 e = ray.origin;
@@ -170,10 +271,10 @@ IntersectionResult Plane::intersects(const Ray &ray) {
 }
 
 // Cluster:
-Cluster::Cluster() {}
+Cluster::Cluster() : expanded(true), lazy_leaf_size(0) {}
 
 Cluster::Cluster(const Cluster &c)
-	: bb(c.bb) {
+	: bb(c.bb), expanded(c.expanded.load()), lazy_leaf_size(c.lazy_leaf_size) {
 	for (size_t i = 0; i < c.boundedObjects.size(); i++) {
 		boundedObjects.push_back(c.boundedObjects[i]->makeCopy());
 	}	
@@ -181,6 +282,8 @@ Cluster::Cluster(const Cluster &c)
 
 bool Cluster::isCluster()	{ return true; }
 bool Cluster::isCluster() const	{ return true; }
+bool Cluster::isGrid()		{ return false; }
+bool Cluster::isGrid() const	{ return false; }
 
 SceneObject *Cluster::makeCopy() {
 	return new Cluster(*this);
@@ -194,9 +297,16 @@ BoundingBox Cluster::getBoundBox() 	 { return bb; }
 BoundingBox Cluster::getBoundBox() const { return bb; }
 
 void Cluster::addObject(const SceneObject &obj) {
-	SceneObject *obj_ptr = obj.makeCopy();
+	adoptObject(obj.makeCopy());
+}
+
+void Cluster::adoptObject(SceneObject *obj_ptr) {
+	// the first object sets the box, otherwise we'd always include the origin
+	if (boundedObjects.empty())
+		bb = obj_ptr->getBoundBox();
+	else
+		bb.swallow(obj_ptr->getBoundBox());
 	boundedObjects.push_back(obj_ptr);
-	bb.swallow(obj_ptr->getBoundBox());
 }
 
 double max(double a, double b, double c) {
@@ -260,6 +370,109 @@ IntersectionResult Cluster::intersects(const Ray &ray) {
 	return const_cast<const Cluster *>(this)->intersects(ray);
 }
 
+void Cluster::split(Cluster *&left, Cluster *&right) {
+	std::vector<std::pair<vec3, SceneObject*> > items;
+	for (size_t i = 0; i < boundedObjects.size(); i++) {
+		BoundingBox b = boundedObjects[i]->getBoundBox();
+		vec3 centre(b.x_min + b.x_max, b.y_min + b.y_max, b.z_min + b.z_max);
+		items.push_back(std::make_pair(centre.scaled(0.5), boundedObjects[i]));
+	}
+
+	double dx = bb.x_max - bb.x_min;
+	double dy = bb.y_max - bb.y_min;
+	double dz = bb.z_max - bb.z_min;
+	int axis = (dx >= dy && dx >= dz) ? 0 : (dy >= dz ? 1 : 2);
+
+	// only the median needs to end up in the right place
+	size_t mid = items.size() / 2;
+	std::nth_element(items.begin(), items.begin() + mid, items.end(),
+		[axis](const std::pair<vec3, SceneObject*> &a, const std::pair<vec3, SceneObject*> &b) {
+			if (axis == 0) return a.first.x() < b.first.x();
+			if (axis == 1) return a.first.y() < b.first.y();
+			return a.first.z() < b.first.z();
+		});
+
+	left = new Cluster();
+	right = new Cluster();
+	for (size_t i = 0; i < items.size(); i++)
+		(i < mid ? left : right)->adoptObject(items[i].second);
+
+	// our own bounding box doesn't change
+	boundedObjects.clear();
+	boundedObjects.push_back(left);
+	boundedObjects.push_back(right);
+}
+
+void Cluster::subdivide(size_t leaf_size) {
+	for (size_t i = 0; i < boundedObjects.size(); i++) {
+		if (boundedObjects[i]->isCluster())
+			static_cast<Cluster*>(boundedObjects[i])->subdivide(leaf_size);
+	}
+
+	if (boundedObjects.size() <= leaf_size)
+		return;
+
+	Cluster *left, *right;
+	split(left, right);
+	left->subdivide(leaf_size);
+	right->subdivide(leaf_size);
+}
+
+// clusters the scene had already are put off too, all the way down
+void Cluster::subdivideLazily(size_t leaf_size, int levels) {
+	for (size_t i = 0; i < boundedObjects.size(); i++) {
+		if (boundedObjects[i]->isCluster())
+			static_cast<Cluster*>(boundedObjects[i])->subdivideLazily(leaf_size, 0);
+	}
+	splitLazily(leaf_size, levels);
+}
+
+void Cluster::splitLazily(size_t leaf_size, int levels) {
+	if (boundedObjects.size() <= leaf_size)
+		return;
+
+	if (levels <= 0) {
+		lazy_leaf_size = leaf_size;
+		expanded.store(false, std::memory_order_release);
+		return;
+	}
+
+	Cluster *left, *right;
+	split(left, right);
+	left->splitLazily(leaf_size, levels - 1);
+	right->splitLazily(leaf_size, levels - 1);
+}
+
+// there can be millions of clusters, so rather than a mutex each they
+// share a few, picked by address
+#define CLUSTER_EXPAND_LOCKS 64
+static std::mutex expand_locks[CLUSTER_EXPAND_LOCKS];
+
+// the new clusters are finished before `expanded` is set, so a thread
+// that sees it set sees them whole
+void Cluster::expand() {
+	std::lock_guard<std::mutex> guard(expand_locks[(reinterpret_cast<uintptr_t>(this) / sizeof(Cluster)) % CLUSTER_EXPAND_LOCKS]);
+	if (expanded.load(std::memory_order_relaxed))
+		return;
+
+	Cluster *left, *right;
+	split(left, right);
+	left->splitLazily(lazy_leaf_size, 0);
+	right->splitLazily(lazy_leaf_size, 0);
+	expanded.store(true, std::memory_order_release);
+}
+
+void Cluster::refit() {
+	for (size_t i = 0; i < boundedObjects.size(); i++) {
+		if (boundedObjects[i]->isCluster())
+			static_cast<Cluster*>(boundedObjects[i])->refit();
+		if (i == 0)
+			bb = boundedObjects[i]->getBoundBox();
+		else
+			bb.swallow(boundedObjects[i]->getBoundBox());
+	}
+}
+
 Cluster::~Cluster() {
 	for (size_t i = 0; i < boundedObjects.size(); i++) {
 		delete boundedObjects[i];
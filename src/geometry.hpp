@@ -7,7 +7,11 @@
  *
  */
 
+#ifndef GEOMETRY_HEADER_WARRIOR
+#define GEOMETRY_HEADER_WARRIOR
+
 #include <vector>
+#include <atomic>
 
 #include "ray.hpp"
 #include "material.hpp"
@@ -22,6 +26,10 @@ struct BoundingBox {
 
 	BoundingBox();
 	void swallow(const BoundingBox &b);
+
+	// does the segment from a to b pass within `grow` of the box? (or,
+	// near enough: the box is grown by that much on every side)
+	bool touchesSegment(const vec3 &a, const vec3 &b, double grow) const;
 };
 
 /* SceneObject
@@ -29,6 +37,11 @@ struct BoundingBox {
  * Abstract class from which all objects in the scene inherit */
 class SceneObject {
 public:
+	// lets objects be told apart by number (see EditSession), -1 if
+	// nobody has needed to
+	int id;
+
+	SceneObject();
 	virtual IntersectionResult intersects(const Ray &r) = 0;
 	virtual IntersectionResult intersects(const Ray &r) const = 0;
 	virtual SceneObject *makeCopy() = 0;
@@ -39,6 +52,17 @@ public:
 	virtual bool isCluster() const = 0;
 	virtual BoundingBox getBoundBox() = 0;
 	virtual BoundingBox getBoundBox() const = 0;
+	virtual bool isBounded();	// false if getBoundBox() would throw
+	virtual bool isBounded() const;
+
+	// a convex object can't shadow a point on itself from a light that
+	// is all in front of the point (see World::lightVisibility)
+	virtual bool isConvex();
+	virtual bool isConvex() const;
+
+	// moves the object. any clusters it's in have to be refit()ted
+	// afterwards. throws a GeometryException for objects that can't move
+	virtual void translate(const vec3 &offset);
 	virtual ~SceneObject();
 };
 
@@ -46,6 +70,8 @@ struct IntersectionDatum : public IntersectionResult {
 	SceneObject *intersectedObj;
 	IntersectionDatum();
 	IntersectionDatum(double t, SceneObject *obj);
+	IntersectionDatum(double t, SceneObject *obj, int primitive);
+	IntersectionDatum(const IntersectionResult &r, SceneObject *obj);
 };
 
 struct GeometryException : public std::runtime_error {
@@ -61,12 +87,24 @@ struct GeometryException : public std::runtime_error {
  * intersects this bounding box, and only then checking if it intersects
  * each of the individual objets in the cluster
  *
- * TODO: add hierarchical bounding boxes
+ * clusters can be nested, see subdivide()
  */
 class Cluster : public SceneObject {
 private:
 	BoundingBox bb;
 
+	// false while splitting this cluster has been put off (see
+	// subdivideLazily), until expand() splits it into two that are
+	// still to be split themselves
+	std::atomic<bool> expanded;
+	size_t lazy_leaf_size;
+
+	// moves the objects into two new clusters, either side of the
+	// median along the widest axis
+	void split(Cluster *&left, Cluster *&right);
+	void splitLazily(size_t leaf_size, int levels);
+	void expand();
+
 public:
 	std::vector<SceneObject *> boundedObjects; 
 	
@@ -86,7 +124,38 @@ public:
 	Cluster();
 	Cluster(const Cluster &);
 	void addObject(const SceneObject &);
+	void adoptObject(SceneObject *);	// takes ownership, no copy
 	~Cluster();
+
+	// true for a Grid (see grid.hpp), which has its objects binned into
+	// cells instead of split into nested clusters
+	virtual bool isGrid();
+	virtual bool isGrid() const;
+
+	// recursively splits this cluster into nested clusters of at most
+	// `leaf_size` objects (by median along the widest axis)
+	virtual void subdivide(size_t leaf_size);
+
+	// subdivide, but only `levels` deep to start with. below that, each
+	// cluster is only split (one level) the first time a ray gets into
+	// it, so parts of the scene that nothing ever looks at, like what's
+	// outside the view and not in any reflection, are never split at
+	// all. the clusters end up just as subdivide would have made them.
+	// it's safe for several threads to get into one at once
+	virtual void subdivideLazily(size_t leaf_size, int levels);
+
+	// boundedObjects, split first if splitting this cluster was put
+	// off. anything that reads a cluster's objects while rays are being
+	// traced has to go through here
+	std::vector<SceneObject *> &contents() {
+		if (!expanded.load(std::memory_order_acquire))
+			expand();
+		return boundedObjects;
+	}
+
+	// recomputes the bounding boxes of this cluster and the ones nested
+	// in it, after the objects inside have moved
+	virtual void refit();
 };
 
 /* ShadableObject
@@ -96,16 +165,28 @@ public:
 class ShadableObject : public SceneObject {
 public:
 	Material material;
-	ShadableObject(Material mat);
+	ShadableObject(const Material &mat);
 	virtual vec3 surfaceNormal(const vec3 &point) = 0;
 	virtual vec3 surfaceNormal(const vec3 &point) const = 0;
 	bool isCluster();
 	bool isCluster() const; 
+
+	// objects made up of many sub-primitives (e.g. meshes) report which
+	// one was hit in IntersectionResult::primitive, and override these
+	// to shade it. simple objects just use surfaceNormal() and material
+	virtual vec3 surfaceNormalAt(const vec3 &point, const IntersectionResult &hit) const;
+	virtual const Material &materialAt(const IntersectionResult &hit) const;
+
+	// where p is on a texture laid over the surface (see
+	// Material::texture), and how many units of the world one unit of u
+	// and of v spans there. false for surfaces that can't be textured
+	virtual bool textureCoordsAt(const vec3 &point, int primitive, double scale,
+			double &u, double &v, double &span_u, double &span_v) const;
 };
 
 class Sphere : public ShadableObject {
 private:
-	const vec3 centre;
+	vec3 centre;
 	const double radius;
 
 public:
@@ -122,12 +203,19 @@ public:
 	std::string tag() const;
 	BoundingBox getBoundBox();
 	BoundingBox getBoundBox() const;
+	bool isConvex();
+	bool isConvex() const;
+	void translate(const vec3 &offset);
+
+	// longitude and latitude, with the seam facing -x
+	bool textureCoordsAt(const vec3 &point, int primitive, double scale,
+			double &u, double &v, double &span_u, double &span_v) const;
 };
 
 class Plane : public ShadableObject {
 private:
 	const vec3 normal;
-	const double k;
+	double k;
 
 public:
 	~Plane();
@@ -145,6 +233,19 @@ public:
 	std::string tag() const;
 	BoundingBox getBoundBox();
 	BoundingBox getBoundBox() const;
+	bool isBounded();
+	bool isBounded() const;
+	bool isConvex();
+	bool isConvex() const;
+	void translate(const vec3 &offset);
+
+	// how far p is in front of the plane (negative behind it)
+	double signedDistance(const vec3 &p);
+	double signedDistance(const vec3 &p) const;
+
+	// u and v run along two axes in the plane, a whole unit every `scale`
+	bool textureCoordsAt(const vec3 &point, int primitive, double scale,
+			double &u, double &v, double &span_u, double &span_v) const;
 };
 
-
+#endif
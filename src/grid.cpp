@@ -0,0 +1,281 @@
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "grid.hpp"
+
+// objects a build thread is given at least, fewer isn't worth starting one for
+#define GRID_OBJECTS_PER_THREAD 4096
+
+// how far past its box an object is binned, in cells, so that rays
+// grazing the edge of a cell still find it
+#define GRID_BIN_EPS 1e-6
+
+static const char *accelerator_names[] = { "hierarchy", "grid", "grid2" };
+
+bool parseAccelerator(const std::string &name, Accelerator &out) {
+	for (int a = 0; a < 3; a++) {
+		if (name == accelerator_names[a]) {
+			out = static_cast<Accelerator>(a);
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *acceleratorName(Accelerator a) {
+	return accelerator_names[a];
+}
+
+static int buildThreads(size_t objects) {
+	const size_t hw = std::max(1u, std::thread::hardware_concurrency());
+	return static_cast<int>(std::min(hw, objects / GRID_OBJECTS_PER_THREAD + 1));
+}
+
+// work(begin, end) over [0, n), a slice for each thread, the first on
+// this one
+template <typename Work>
+static void inSlices(size_t n, int threads, Work work) {
+	if (threads <= 1) {
+		work(static_cast<size_t>(0), n);
+		return;
+	}
+	std::vector<std::thread> helpers;
+	for (int t = 1; t < threads; t++)
+		helpers.push_back(std::thread(work, n * t / threads, n * (t + 1) / threads));
+	work(static_cast<size_t>(0), n / threads);
+	for (size_t t = 0; t < helpers.size(); t++)
+		helpers[t].join();
+}
+
+/* Grid implementation */
+
+Grid::Grid(bool two) : two_level(two) {}
+
+// the copy's objects are copies too, so it needs binning again
+Grid::Grid(const Grid &g) : Cluster(g), two_level(g.two_level) {
+	if (!g.levels.empty())
+		build();
+}
+
+bool Grid::isGrid()		{ return true; }
+bool Grid::isGrid() const	{ return true; }
+
+SceneObject *Grid::makeCopy() {
+	return new Grid(*this);
+}
+
+SceneObject *Grid::makeCopy() const {
+	return new Grid(*this);
+}
+
+std::string Grid::tag()		{ return "Grid"; }
+std::string Grid::tag() const	{ return "Grid"; }
+
+bool Grid::twoLevel() const {
+	return two_level;
+}
+
+void Grid::subdivide(size_t leaf_size) {
+	for (size_t i = 0; i < boundedObjects.size(); i++) {
+		if (boundedObjects[i]->isCluster())
+			static_cast<Cluster*>(boundedObjects[i])->subdivide(leaf_size);
+	}
+	build();
+}
+
+// the grid itself is quick enough to build that it isn't put off, only
+// the clusters in it are
+void Grid::subdivideLazily(size_t leaf_size, int) {
+	for (size_t i = 0; i < boundedObjects.size(); i++) {
+		if (boundedObjects[i]->isCluster())
+			static_cast<Cluster*>(boundedObjects[i])->subdivideLazily(leaf_size, 0);
+	}
+	build();
+}
+
+void Grid::refit() {
+	Cluster::refit();
+	build();
+}
+
+void Grid::build() {
+	levels.clear();
+	const size_t n = boundedObjects.size();
+	if (n == 0)
+		return;
+
+	const int threads = buildThreads(n);
+	std::vector<BoundingBox> boxes(n);
+	inSlices(n, threads, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			boxes[i] = boundedObjects[i]->getBoundBox();
+	});
+
+	std::vector<uint32_t> all(n);
+	for (size_t i = 0; i < n; i++)
+		all[i] = static_cast<uint32_t>(i);
+
+	levels.push_back(Level());
+	buildLevel(levels[0], getBoundBox(), all, boxes, threads);
+	if (two_level)
+		splitDenseCells(boxes, threads);
+}
+
+namespace {
+	struct CellRange {
+		int lo[3];
+		int hi[3];
+	};
+}
+
+void Grid::buildLevel(Level &level, const BoundingBox &box, const std::vector<uint32_t> &objects,
+		const std::vector<BoundingBox> &boxes, int threads) const {
+	const size_t n = objects.size();
+	const double lo[3] = { box.x_min, box.y_min, box.z_min };
+	const double ext[3] = { box.x_max - box.x_min, box.y_max - box.y_min, box.z_max - box.z_min };
+
+	// a flat box still gets cells of some thickness
+	double largest = std::max(ext[0], std::max(ext[1], ext[2]));
+	if (!(largest > 0.0))
+		largest = 1.0;
+	double size[3], volume = 1.0;
+	for (int a = 0; a < 3; a++) {
+		size[a] = std::max(ext[a], largest * 1e-3);
+		volume *= size[a];
+	}
+
+	// GRID_DENSITY * n cells, as near to cubes as they can be
+	const double per_unit = cbrt(GRID_DENSITY * n / volume);
+	size_t cells = 1;
+	for (int a = 0; a < 3; a++) {
+		level.res[a] = std::min(std::max(static_cast<int>(size[a] * per_unit + 0.5), 1), GRID_MAX_RESOLUTION);
+		level.min[a] = lo[a];
+		level.cell[a] = size[a] / level.res[a];
+		level.inv_cell[a] = 1.0 / level.cell[a];
+		cells *= level.res[a];
+	}
+
+	// which cells each object's box covers
+	std::vector<CellRange> ranges(n);
+	std::unique_ptr<std::atomic<uint32_t>[]> counts(new std::atomic<uint32_t>[cells]);
+	inSlices(cells, threads, [&](size_t begin, size_t end) {
+		for (size_t c = begin; c < end; c++)
+			counts[c].store(0, std::memory_order_relaxed);
+	});
+
+	inSlices(n, threads, [&](size_t begin, size_t end) {
+		for (size_t k = begin; k < end; k++) {
+			const BoundingBox &b = boxes[objects[k]];
+			const double from[3] = { b.x_min, b.y_min, b.z_min };
+			const double to[3] = { b.x_max, b.y_max, b.z_max };
+			CellRange &r = ranges[k];
+			for (int a = 0; a < 3; a++) {
+				const double f = floor((from[a] - level.min[a]) * level.inv_cell[a] - GRID_BIN_EPS);
+				const double t = floor((to[a] - level.min[a]) * level.inv_cell[a] + GRID_BIN_EPS);
+				r.lo[a] = static_cast<int>(std::min(std::max(f, 0.0), level.res[a] - 1.0));
+				r.hi[a] = static_cast<int>(std::min(std::max(t, 0.0), level.res[a] - 1.0));
+			}
+			for (int z = r.lo[2]; z <= r.hi[2]; z++)
+				for (int y = r.lo[1]; y <= r.hi[1]; y++)
+					for (int x = r.lo[0]; x <= r.hi[0]; x++)
+						counts[x + level.res[0] * (y + static_cast<size_t>(level.res[1]) * z)]
+							.fetch_add(1, std::memory_order_relaxed);
+		}
+	});
+
+	// the counts become where each cell's list starts, and then (as the
+	// lists are filled) where the next object in it goes
+	level.start.resize(cells + 1);
+	uint32_t total = 0;
+	for (size_t c = 0; c < cells; c++) {
+		level.start[c] = total;
+		total += counts[c].load(std::memory_order_relaxed);
+		counts[c].store(level.start[c], std::memory_order_relaxed);
+	}
+	level.start[cells] = total;
+
+	level.items.resize(total);
+	inSlices(n, threads, [&](size_t begin, size_t end) {
+		for (size_t k = begin; k < end; k++) {
+			const CellRange &r = ranges[k];
+			for (int z = r.lo[2]; z <= r.hi[2]; z++)
+				for (int y = r.lo[1]; y <= r.hi[1]; y++)
+					for (int x = r.lo[0]; x <= r.hi[0]; x++) {
+						const size_t c = x + level.res[0] * (y + static_cast<size_t>(level.res[1]) * z);
+						level.items[counts[c].fetch_add(1, std::memory_order_relaxed)] = objects[k];
+					}
+		}
+	});
+
+	// threads fill a cell in whatever order they get to it, so put each
+	// list back in the objects' order, which is the same every time
+	if (threads > 1) {
+		inSlices(cells, threads, [&](size_t begin, size_t end) {
+			for (size_t c = begin; c < end; c++)
+				std::sort(level.items.begin() + level.start[c], level.items.begin() + level.start[c + 1]);
+		});
+	}
+
+	level.child.clear();
+}
+
+void Grid::splitDenseCells(const std::vector<BoundingBox> &boxes, int threads) {
+	std::vector<size_t> dense;
+	const size_t cells = levels[0].start.size() - 1;
+	for (size_t c = 0; c < cells; c++)
+		if (levels[0].start[c + 1] - levels[0].start[c] > GRID_SUBGRID_OBJECTS)
+			dense.push_back(c);
+	if (dense.empty())
+		return;
+
+	std::vector<Level> split(dense.size());
+	std::vector<char> worth(dense.size());
+	inSlices(dense.size(), std::min(threads, static_cast<int>(dense.size())), [&](size_t begin, size_t end) {
+		const Level &top = levels[0];
+		for (size_t k = begin; k < end; k++) {
+			const size_t c = dense[k];
+			const size_t idx[3] = { c % top.res[0], c / top.res[0] % top.res[1], c / top.res[0] / top.res[1] };
+			double lo[3];
+			for (int a = 0; a < 3; a++)
+				lo[a] = top.min[a] + idx[a] * top.cell[a];
+			BoundingBox box;
+			box.x_min = lo[0];
+			box.x_max = lo[0] + top.cell[0];
+			box.y_min = lo[1];
+			box.y_max = lo[1] + top.cell[1];
+			box.z_min = lo[2];
+			box.z_max = lo[2] + top.cell[2];
+
+			std::vector<uint32_t> objects(top.items.begin() + top.start[c], top.items.begin() + top.start[c + 1]);
+			buildLevel(split[k], box, objects, boxes, 1);
+
+			// objects as big as the cell would be in most of its cells
+			// too, and then it's cheaper to test them all than walk them
+			const size_t sub_cells = split[k].start.size() - 1;
+			worth[k] = split[k].items.size() * 2 < objects.size() * sub_cells;
+		}
+	});
+
+	levels[0].child.assign(cells, -1);
+	for (size_t k = 0; k < dense.size(); k++) {
+		if (!worth[k])
+			continue;
+		levels[0].child[dense[k]] = static_cast<int32_t>(levels.size());
+		levels.push_back(std::move(split[k]));
+	}
+}
+
+size_t Grid::cellCount() const {
+	size_t cells = 0;
+	for (size_t l = 0; l < levels.size(); l++)
+		cells += levels[l].start.size() - 1;
+	return cells;
+}
+
+size_t Grid::entryCount() const {
+	size_t entries = 0;
+	for (size_t l = 0; l < levels.size(); l++)
+		entries += levels[l].items.size();
+	return entries;
+}
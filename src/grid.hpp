@@ -0,0 +1,227 @@
+/* grid.hpp
+ *
+ * uniform grids, the other way of finding what a ray hits
+ *
+ * a Grid is a cluster whose objects are binned into a grid of equal
+ * cells over its bounding box, rather than split into nested clusters
+ * (see Cluster::subdivide). there are about GRID_DENSITY cells to each
+ * object, as near to cubes as the box allows, and each cell has a list
+ * of the objects whose boxes overlap it. building it is a counting
+ * sort: count how many objects land in each cell, add the counts up
+ * into where each cell's list starts, then drop every object into its
+ * cells. nothing is ever compared or partitioned, so it takes linear
+ * time, and the counting and filling are shared out between threads.
+ *
+ * a ray walks the cells it passes through in order (3D-DDA: from one
+ * cell to the next is a step along whichever axis has the nearest cell
+ * boundary), testing the objects in each, and stops at the first cell
+ * that has a hit before the ray leaves it. an object that overlaps
+ * several cells is only tested once per ray: a small mailbox on the
+ * stack remembers the last few objects tested, which keeps rays from
+ * writing to anything shared.
+ *
+ * a uniform grid is at its best when the objects are spread evenly and
+ * at its worst when they're bunched up, a few cells holding most of
+ * them. a two-level grid gives every cell with more than
+ * GRID_SUBGRID_OBJECTS objects a grid of its own.
+ *
+ * a scene picks what its top-level objects go in with World::accelerator,
+ * and a text scene can put a grid anywhere a cluster could go (see
+ * sceneparser.hpp). grids and clusters nest inside each other freely.
+ */
+
+#ifndef GRID_HEADER_WARRIOR
+#define GRID_HEADER_WARRIOR
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include "geometry.hpp"
+
+#define GRID_DENSITY 2.0		// cells for each object
+#define GRID_MAX_RESOLUTION 256		// cells along each axis, at most
+#define GRID_SUBGRID_OBJECTS 16		// more than this in a cell and a two-level grid splits it again
+#define GRID_MAILBOX_SIZE 64		// a power of two
+
+enum Accelerator { accelerator_hierarchy, accelerator_grid, accelerator_two_level_grid };
+
+// "hierarchy", "grid" or "grid2", false for anything else
+bool parseAccelerator(const std::string &name, Accelerator &out);
+const char *acceleratorName(Accelerator a);
+
+// the objects a ray has been tested against, some of them at least: a
+// slot for every GRID_MAILBOX_SIZE'th object
+struct GridMailbox {
+	uint32_t slot[GRID_MAILBOX_SIZE];
+
+	GridMailbox() { memset(slot, 0xff, sizeof(slot)); }
+
+	// true unless object i was the last one in its slot
+	bool fresh(uint32_t i) {
+		uint32_t &s = slot[i & (GRID_MAILBOX_SIZE - 1)];
+		if (s == i)
+			return false;
+		s = i;
+		return true;
+	}
+};
+
+class Grid : public Cluster {
+private:
+	struct Level {
+		double min[3];			// the corner the cells are counted from
+		double cell[3];			// a cell's size
+		double inv_cell[3];
+		int res[3];			// cells along each axis
+		std::vector<uint32_t> start;	// cell c's objects are items[start[c]] up to items[start[c + 1]]
+		std::vector<uint32_t> items;	// indices into boundedObjects
+		std::vector<int32_t> child;	// the level splitting each cell, -1 for none. empty if none are
+	};
+
+	bool two_level;
+	std::vector<Level> levels;	// the whole grid first, then the cells' grids
+
+	void buildLevel(Level &level, const BoundingBox &box, const std::vector<uint32_t> &objects,
+			const std::vector<BoundingBox> &boxes, int threads) const;
+	void splitDenseCells(const std::vector<BoundingBox> &boxes, int threads);
+
+	template <typename Test, typename Stop>
+	bool walkLevel(const Level &level, const Ray &ray, double t0, double t1, GridMailbox &mailbox,
+			Test &test, Stop &stop) const;
+
+public:
+	// overriden methods:
+	bool isGrid();
+	bool isGrid() const;
+	SceneObject *makeCopy();
+	SceneObject *makeCopy() const;
+	std::string tag();
+	std::string tag() const;
+	void subdivide(size_t leaf_size);
+	void subdivideLazily(size_t leaf_size, int levels);
+	void refit();
+
+	// specific methods
+	Grid(bool two_level = false);
+	Grid(const Grid &);
+
+	bool twoLevel() const;
+
+	// bins the objects into cells (clusters nested in it are built first)
+	void build();
+
+	// how many cells and how many entries in their lists, over all levels
+	size_t cellCount() const;
+	size_t entryCount() const;
+
+	// visits the objects in the cells the ray passes through between t0
+	// and t1, nearest cell first, each object once: test(SceneObject *)
+	// for each object, then stop(t) once the cell's objects are done,
+	// where t is as far along the ray as the cell goes. the walk ends as
+	// soon as stop returns true
+	template <typename Test, typename Stop>
+	void walk(const Ray &ray, double t0, double t1, Test test, Stop stop) const;
+};
+
+// where the ray is between t0 and t1 inside the box, false if it misses
+static inline bool clipToBox(const Ray &ray, const double *lo, const double *hi, double &t0, double &t1) {
+	const double o[3] = { ray.origin.x(), ray.origin.y(), ray.origin.z() };
+	const double d[3] = { ray.direction.x(), ray.direction.y(), ray.direction.z() };
+	for (int a = 0; a < 3; a++) {
+		if (d[a] == 0.0) {
+			if (o[a] < lo[a] || o[a] > hi[a])
+				return false;
+			continue;
+		}
+		double near = (lo[a] - o[a]) / d[a];
+		double far = (hi[a] - o[a]) / d[a];
+		if (near > far)
+			std::swap(near, far);
+		t0 = std::max(t0, near);
+		t1 = std::min(t1, far);
+	}
+	return t0 <= t1;
+}
+
+template <typename Test, typename Stop>
+bool Grid::walkLevel(const Level &level, const Ray &ray, double t0, double t1, GridMailbox &mailbox,
+		Test &test, Stop &stop) const {
+	double hi[3];
+	for (int a = 0; a < 3; a++)
+		hi[a] = level.min[a] + level.cell[a] * level.res[a];
+	if (!clipToBox(ray, level.min, hi, t0, t1))
+		return false;
+
+	const double o[3] = { ray.origin.x(), ray.origin.y(), ray.origin.z() };
+	const double d[3] = { ray.direction.x(), ray.direction.y(), ray.direction.z() };
+	int idx[3], step[3];
+	double next[3], delta[3];
+	for (int a = 0; a < 3; a++) {
+		const double p = o[a] + d[a] * t0;
+		idx[a] = std::min(std::max(static_cast<int>(floor((p - level.min[a]) * level.inv_cell[a])), 0), level.res[a] - 1);
+		if (d[a] > 0.0) {
+			step[a] = 1;
+			next[a] = (level.min[a] + (idx[a] + 1) * level.cell[a] - o[a]) / d[a];
+			delta[a] = level.cell[a] / d[a];
+		}
+		else if (d[a] < 0.0) {
+			step[a] = -1;
+			next[a] = (level.min[a] + idx[a] * level.cell[a] - o[a]) / d[a];
+			delta[a] = -level.cell[a] / d[a];
+		}
+		else {
+			step[a] = 0;
+			next[a] = INFINITY;
+			delta[a] = INFINITY;
+		}
+	}
+
+	double t_enter = t0;
+	for (;;) {
+		const int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+		const double t_exit = std::min(next[axis], t1);
+		const size_t c = idx[0] + static_cast<size_t>(level.res[0]) * (idx[1] + static_cast<size_t>(level.res[1]) * idx[2]);
+
+		if (!level.child.empty() && level.child[c] >= 0) {
+			if (walkLevel(levels[level.child[c]], ray, t_enter, t_exit, mailbox, test, stop))
+				return true;
+		}
+		else {
+			for (uint32_t k = level.start[c]; k < level.start[c + 1]; k++) {
+				const uint32_t i = level.items[k];
+				if (mailbox.fresh(i))
+					test(boundedObjects[i]);
+			}
+		}
+
+		if (stop(t_exit))
+			return true;
+		if (t_exit >= t1)
+			return false;
+
+		idx[axis] += step[axis];
+		if (idx[axis] < 0 || idx[axis] >= level.res[axis])
+			return false;
+		t_enter = t_exit;
+		next[axis] += delta[axis];
+	}
+}
+
+template <typename Test, typename Stop>
+void Grid::walk(const Ray &ray, double t0, double t1, Test test, Stop stop) const {
+	// not built yet, so it's just a cluster
+	if (levels.empty()) {
+		for (size_t i = 0; i < boundedObjects.size(); i++)
+			test(boundedObjects[i]);
+		stop(t1);
+		return;
+	}
+	GridMailbox mailbox;
+	walkLevel(levels[0], ray, t0, t1, mailbox, test, stop);
+}
+
+#endif
@@ -0,0 +1,774 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <thread>
+
+#include "hdr.hpp"
+
+#define SRGB_TABLE_SIZE 16384		// entries over [0, 1], so neighbouring ones are well under an 8 bit step apart
+#define STRIP_MIN_ROWS 16
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_CHAIN 16		// candidates looked at for each match
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
+HDRException::HDRException(const std::string &path, const std::string &msg) :
+	std::runtime_error(path + ": " + msg) {}
+
+/* FloatImage implementation */
+
+FloatImage::FloatImage(int w, int h) : width(w), height(h), pixels(3 * static_cast<size_t>(w) * h, 0.0f) {}
+
+float *FloatImage::at(int i, int j) {
+	return &pixels[3 * (static_cast<size_t>(j) * width + i)];
+}
+
+const float *FloatImage::at(int i, int j) const {
+	return &pixels[3 * (static_cast<size_t>(j) * width + i)];
+}
+
+void FloatImage::set(int i, int j, const RGBVec &c) {
+	float *p = at(i, j);
+	p[0] = static_cast<float>(c.r());
+	p[1] = static_cast<float>(c.g());
+	p[2] = static_cast<float>(c.b());
+}
+
+/* PFM */
+
+void writePFM(const FloatImage &img, const std::string &path) {
+	std::ofstream out(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw HDRException(path, "cannot open for writing");
+
+	// a negative scale says the floats are little-endian, as ours are
+	out << "PF\n" << img.width << " " << img.height << "\n-1.0\n";
+	out.write(reinterpret_cast<const char *>(img.pixels.data()), static_cast<std::streamsize>(img.pixels.size() * sizeof(float)));
+	if (!out)
+		throw HDRException(path, "write failed");
+}
+
+void readPFM(const std::string &path, FloatImage &img) {
+	std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+	if (!in)
+		throw HDRException(path, "cannot open");
+
+	std::string magic;
+	int w, h;
+	double scale;
+	if (!(in >> magic >> w >> h >> scale) || magic != "PF" || w <= 0 || h <= 0 || scale == 0.0)
+		throw HDRException(path, "not a colour PFM");
+	in.get();
+
+	img = FloatImage(w, h);
+	if (!in.read(reinterpret_cast<char *>(img.pixels.data()), static_cast<std::streamsize>(img.pixels.size() * sizeof(float))))
+		throw HDRException(path, "truncated PFM");
+
+	if (scale > 0.0) {
+		for (size_t k = 0; k < img.pixels.size(); k++) {
+			unsigned char *b = reinterpret_cast<unsigned char *>(&img.pixels[k]);
+			std::swap(b[0], b[3]);
+			std::swap(b[1], b[2]);
+		}
+	}
+}
+
+/* tone mapping */
+
+ToneMapOptions::ToneMapOptions() : exposure(0.0), curve(tone_clamp), srgb(false), threads(0) {}
+
+bool parseToneCurve(const std::string &name, ToneCurve &out) {
+	if (name == "clamp")
+		out = tone_clamp;
+	else if (name == "reinhard")
+		out = tone_reinhard;
+	else
+		return false;
+	return true;
+}
+
+// strip s of n covers rows [first, end) counted from the top
+static int stripStart(int height, int strips, int s) {
+	return static_cast<int>(static_cast<long>(height) * s / strips);
+}
+
+static int stripCount(int height, int threads) {
+	if (threads <= 0)
+		threads = static_cast<int>(std::thread::hardware_concurrency());
+	return std::max(1, std::min(std::max(threads, 1), height / STRIP_MIN_ROWS));
+}
+
+// calls work(strip) for each strip, the first on this thread and the
+// rest on threads of their own
+template <typename Work>
+static void eachStrip(int strips, Work work) {
+	std::vector<std::thread> helpers;
+	for (int s = 1; s < strips; s++)
+		helpers.push_back(std::thread(work, s));
+	work(0);
+	for (size_t t = 0; t < helpers.size(); t++)
+		helpers[t].join();
+}
+
+static const unsigned char *srgbTable() {
+	static unsigned char table[SRGB_TABLE_SIZE];
+	static bool built = [] {
+		for (int k = 0; k < SRGB_TABLE_SIZE; k++) {
+			const double v = static_cast<double>(k) / (SRGB_TABLE_SIZE - 1);
+			const double s = v <= 0.0031308 ? 12.92 * v : 1.055 * std::pow(v, 1.0 / 2.4) - 0.055;
+			table[k] = static_cast<unsigned char>(std::lround(s * 255.0));
+		}
+		return true;
+	}();
+	(void)built;
+	return table;
+}
+
+// one row, n floats: every loop is straight-line arithmetic over the
+// row, so each vectorises on its own
+static void toneMapRow(const float *in, float *scratch, unsigned char *out, int n, float scale, ToneCurve curve,
+		const unsigned char *srgb) {
+	for (int k = 0; k < n; k++)
+		scratch[k] = std::max(in[k] * scale, 0.0f);
+
+	if (curve == tone_reinhard) {
+		for (int k = 0; k < n; k++)
+			scratch[k] = scratch[k] / (1.0f + scratch[k]);
+	}
+	else {
+		for (int k = 0; k < n; k++)
+			scratch[k] = std::min(scratch[k], 1.0f);
+	}
+
+	if (srgb) {
+		for (int k = 0; k < n; k++)
+			out[k] = srgb[static_cast<int>(scratch[k] * (SRGB_TABLE_SIZE - 1) + 0.5f)];
+	}
+	else {
+		for (int k = 0; k < n; k++)
+			out[k] = static_cast<unsigned char>(static_cast<int>(scratch[k] * 255.0f + 0.5f));
+	}
+}
+
+void toneMap(const FloatImage &img, const ToneMapOptions &opts, std::vector<unsigned char> &out) {
+	const int n = 3 * img.width;
+	const float scale = static_cast<float>(std::pow(2.0, opts.exposure));
+	const unsigned char *srgb = opts.srgb ? srgbTable() : NULL;
+	out.resize(static_cast<size_t>(n) * img.height);
+
+	const int strips = stripCount(img.height, opts.threads);
+	eachStrip(strips, [&](int s) {
+		std::vector<float> scratch(n);
+		for (int y = stripStart(img.height, strips, s); y < stripStart(img.height, strips, s + 1); y++)
+			toneMapRow(img.at(0, img.height - 1 - y), scratch.data(), &out[static_cast<size_t>(y) * n], n, scale, opts.curve, srgb);
+	});
+}
+
+void writeToneMappedPPM(const FloatImage &img, const ToneMapOptions &opts, const std::string &path) {
+	std::vector<unsigned char> rgb;
+	toneMap(img, opts, rgb);
+
+	std::ofstream out(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw HDRException(path, "cannot open for writing");
+	out << "P6\n" << img.width << " " << img.height << "\n255\n";
+	out.write(reinterpret_cast<const char *>(rgb.data()), static_cast<std::streamsize>(rgb.size()));
+	if (!out)
+		throw HDRException(path, "write failed");
+}
+
+/* deflate, with fixed huffman codes */
+
+namespace {
+
+class BitWriter {
+private:
+	std::vector<unsigned char> &out;
+	uint64_t bits;
+	int count;
+
+public:
+	BitWriter(std::vector<unsigned char> &o) : out(o), bits(0), count(0) {}
+
+	// deflate packs bits from the least significant end
+	void put(uint32_t value, int n) {
+		bits |= static_cast<uint64_t>(value) << count;
+		count += n;
+		while (count >= 8) {
+			out.push_back(static_cast<unsigned char>(bits));
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+
+	void align() {
+		if (count > 0)
+			out.push_back(static_cast<unsigned char>(bits));
+		bits = 0;
+		count = 0;
+	}
+};
+
+struct FixedCodes {
+	uint32_t code[288];	// bit reversed, ready for BitWriter
+	int length[288];
+	uint32_t distance[30];
+
+	FixedCodes() {
+		for (int s = 0; s < 288; s++) {
+			uint32_t c;
+			if (s < 144) { c = 0x30 + s; length[s] = 8; }
+			else if (s < 256) { c = 0x190 + (s - 144); length[s] = 9; }
+			else if (s < 280) { c = s - 256; length[s] = 7; }
+			else { c = 0xc0 + (s - 280); length[s] = 8; }
+			code[s] = reverse(c, length[s]);
+		}
+		for (int d = 0; d < 30; d++)
+			distance[d] = reverse(d, 5);
+	}
+
+	static uint32_t reverse(uint32_t c, int n) {
+		uint32_t r = 0;
+		for (int b = 0; b < n; b++)
+			r |= ((c >> b) & 1) << (n - 1 - b);
+		return r;
+	}
+};
+
+const int length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const int length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const int distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537,
+	2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const int distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+const FixedCodes &fixedCodes() {
+	static const FixedCodes codes;
+	return codes;
+}
+
+void putMatch(BitWriter &bw, const FixedCodes &fc, int len, int dist) {
+	int l = 28;
+	while (length_base[l] > len)
+		l--;
+	bw.put(fc.code[257 + l], fc.length[257 + l]);
+	bw.put(len - length_base[l], length_extra[l]);
+
+	int d = 29;
+	while (distance_base[d] > dist)
+		d--;
+	bw.put(fc.distance[d], 5);
+	bw.put(dist - distance_base[d], distance_extra[d]);
+}
+
+uint32_t hash3(const unsigned char *p) {
+	return ((static_cast<uint32_t>(p[0]) << 10) ^ (static_cast<uint32_t>(p[1]) << 5) ^ p[2]) & ((1u << DEFLATE_HASH_BITS) - 1);
+}
+
+// one block, greedy matching within the data. unless it's the last,
+// it's followed by an empty stored block, which brings the stream to a
+// byte boundary so that the next strip's can follow straight on
+void deflateStrip(const unsigned char *data, size_t n, bool last, std::vector<unsigned char> &out) {
+	const FixedCodes &fc = fixedCodes();
+	BitWriter bw(out);
+	bw.put(last ? 1 : 0, 1);
+	bw.put(1, 2);
+
+	std::vector<long> head(1u << DEFLATE_HASH_BITS, -1);
+	std::vector<long> prev(DEFLATE_WINDOW, -1);
+
+	size_t i = 0;
+	while (i < n) {
+		size_t best_len = 0, best_dist = 0;
+		if (i + DEFLATE_MIN_MATCH <= n) {
+			const uint32_t h = hash3(data + i);
+			const size_t most = std::min<size_t>(DEFLATE_MAX_MATCH, n - i);
+			long cand = head[h];
+			for (int chain = 0; chain < DEFLATE_CHAIN && cand >= 0 && i - cand <= DEFLATE_WINDOW
+			     && static_cast<size_t>(cand) < i; chain++) {
+				const unsigned char *a = data + cand, *b = data + i;
+				if (a[best_len] == b[best_len]) {
+					size_t l = 0;
+					while (l < most && a[l] == b[l])
+						l++;
+					if (l > best_len) {
+						best_len = l;
+						best_dist = i - cand;
+						if (l == most)
+							break;
+					}
+				}
+				cand = prev[cand & (DEFLATE_WINDOW - 1)];
+			}
+			prev[i & (DEFLATE_WINDOW - 1)] = head[h];
+			head[h] = static_cast<long>(i);
+		}
+
+		if (best_len >= DEFLATE_MIN_MATCH) {
+			putMatch(bw, fc, static_cast<int>(best_len), static_cast<int>(best_dist));
+			for (size_t k = i + 1; k < i + best_len && k + DEFLATE_MIN_MATCH <= n; k++) {
+				const uint32_t h = hash3(data + k);
+				prev[k & (DEFLATE_WINDOW - 1)] = head[h];
+				head[h] = static_cast<long>(k);
+			}
+			i += best_len;
+		}
+		else {
+			bw.put(fc.code[data[i]], fc.length[data[i]]);
+			i++;
+		}
+	}
+	bw.put(fc.code[256], fc.length[256]);
+
+	if (!last) {
+		bw.put(0, 3);
+		bw.align();
+		const unsigned char empty[4] = { 0, 0, 0xff, 0xff };
+		out.insert(out.end(), empty, empty + 4);
+	}
+	else
+		bw.align();
+}
+
+uint32_t adler32(const unsigned char *p, size_t n) {
+	uint32_t a = 1, b = 0;
+	while (n > 0) {
+		// as many as can be summed before b could overflow
+		const size_t run = std::min<size_t>(n, 5552);
+		for (size_t k = 0; k < run; k++) {
+			a += p[k];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+		p += run;
+		n -= run;
+	}
+	return (b << 16) | a;
+}
+
+// the adler-32 of two runs of data one after the other, given each's
+// and the second's length (as zlib's adler32_combine works it out)
+uint32_t adler32Combine(uint32_t first, uint32_t second, size_t second_length) {
+	const uint32_t base = 65521;
+	const uint32_t rem = static_cast<uint32_t>(second_length % base);
+	uint32_t sum1 = first & 0xffff;
+	uint32_t sum2 = static_cast<uint32_t>((static_cast<uint64_t>(rem) * sum1) % base);
+	sum1 += (second & 0xffff) + base - 1;
+	sum2 += (first >> 16) + (second >> 16) + base - rem;
+	if (sum1 >= base) sum1 -= base;
+	if (sum1 >= base) sum1 -= base;
+	if (sum2 >= 2 * base) sum2 -= 2 * base;
+	if (sum2 >= base) sum2 -= base;
+	return sum1 | (sum2 << 16);
+}
+
+uint32_t crc32(const unsigned char *p, size_t n, uint32_t crc = 0) {
+	static uint32_t table[256];
+	static bool built = [] {
+		for (uint32_t k = 0; k < 256; k++) {
+			uint32_t c = k;
+			for (int b = 0; b < 8; b++)
+				c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[k] = c;
+		}
+		return true;
+	}();
+	(void)built;
+
+	crc = ~crc;
+	for (size_t k = 0; k < n; k++)
+		crc = table[(crc ^ p[k]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+void putBigEndian(std::vector<unsigned char> &out, uint32_t v) {
+	out.push_back(static_cast<unsigned char>(v >> 24));
+	out.push_back(static_cast<unsigned char>(v >> 16));
+	out.push_back(static_cast<unsigned char>(v >> 8));
+	out.push_back(static_cast<unsigned char>(v));
+}
+
+// wraps data up as a PNG chunk
+void chunk(const char *type, const std::vector<unsigned char> &data, std::vector<unsigned char> &out) {
+	putBigEndian(out, static_cast<uint32_t>(data.size()));
+	const size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data.begin(), data.end());
+	putBigEndian(out, crc32(&out[start], out.size() - start));
+}
+
+// PNG's filters, of which each row uses whichever leaves the smallest
+// sum of (signed) bytes: it tends to compress best
+void filterRow(const unsigned char *row, const unsigned char *above, int n, std::vector<unsigned char> &out) {
+	unsigned char best_filter = 0;
+	long best_sum = -1;
+	std::vector<unsigned char> trial(n), best(n);
+
+	for (unsigned char f = 0; f < 5; f++) {
+		long sum = 0;
+		for (int k = 0; k < n; k++) {
+			const int a = k >= 3 ? row[k - 3] : 0;
+			const int b = above ? above[k] : 0;
+			const int c = above && k >= 3 ? above[k - 3] : 0;
+			int predicted = 0;
+			switch (f) {
+			case 1: predicted = a; break;
+			case 2: predicted = b; break;
+			case 3: predicted = (a + b) / 2; break;
+			case 4: {
+				const int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+				predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+				break;
+			}
+			}
+			trial[k] = static_cast<unsigned char>(row[k] - predicted);
+			sum += std::abs(static_cast<signed char>(trial[k]));
+		}
+		if (best_sum < 0 || sum < best_sum) {
+			best_sum = sum;
+			best_filter = f;
+			best.swap(trial);
+		}
+	}
+
+	out.push_back(best_filter);
+	out.insert(out.end(), best.begin(), best.end());
+}
+
+}
+
+void writePNG(const std::vector<unsigned char> &rgb, int width, int height, int threads, const std::string &path) {
+	const int n = 3 * width;
+	const int strips = stripCount(height, threads);
+	std::vector<std::vector<unsigned char> > chunks(strips);
+	std::vector<uint32_t> adlers(strips);
+	std::vector<size_t> lengths(strips);
+
+	eachStrip(strips, [&](int s) {
+		std::vector<unsigned char> filtered, packed;
+		const int first = stripStart(height, strips, s), end = stripStart(height, strips, s + 1);
+		for (int y = first; y < end; y++)
+			filterRow(&rgb[static_cast<size_t>(y) * n], y > 0 ? &rgb[static_cast<size_t>(y - 1) * n] : NULL, n, filtered);
+
+		// the zlib header (deflate, 32K window, no preset dictionary)
+		// goes before the first strip
+		if (s == 0) {
+			packed.push_back(0x78);
+			packed.push_back(0x01);
+		}
+		deflateStrip(filtered.data(), filtered.size(), s == strips - 1, packed);
+		adlers[s] = adler32(filtered.data(), filtered.size());
+		lengths[s] = filtered.size();
+		chunk("IDAT", packed, chunks[s]);
+	});
+
+	uint32_t adler = adlers[0];
+	for (int s = 1; s < strips; s++)
+		adler = adler32Combine(adler, adlers[s], lengths[s]);
+
+	std::vector<unsigned char> header, trailer, bytes;
+	putBigEndian(header, static_cast<uint32_t>(width));
+	putBigEndian(header, static_cast<uint32_t>(height));
+	const unsigned char format[5] = { 8, 2, 0, 0, 0 };	// 8 bit rgb, deflate, adaptive filters, no interlacing
+	header.insert(header.end(), format, format + 5);
+	putBigEndian(trailer, adler);
+
+	const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	bytes.insert(bytes.end(), signature, signature + 8);
+	chunk("IHDR", header, bytes);
+	for (int s = 0; s < strips; s++)
+		bytes.insert(bytes.end(), chunks[s].begin(), chunks[s].end());
+	chunk("IDAT", trailer, bytes);
+	chunk("IEND", std::vector<unsigned char>(), bytes);
+
+	std::ofstream out(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw HDRException(path, "cannot open for writing");
+	out.write(reinterpret_cast<const char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+	if (!out)
+		throw HDRException(path, "write failed");
+}
+
+void writeToneMappedPNG(const FloatImage &img, const ToneMapOptions &opts, const std::string &path) {
+	std::vector<unsigned char> rgb;
+	toneMap(img, opts, rgb);
+	writePNG(rgb, img.width, img.height, opts.threads, path);
+}
+
+/* inflate, for reading PNGs back */
+
+namespace {
+
+struct InflateError : public std::runtime_error {
+	InflateError(const char *msg) : std::runtime_error(msg) {}
+};
+
+class BitReader {
+private:
+	const unsigned char *p;
+	const unsigned char *end;
+	uint32_t bits;
+	int count;
+
+public:
+	BitReader(const unsigned char *data, size_t n) : p(data), end(data + n), bits(0), count(0) {}
+
+	uint32_t get(int n) {
+		while (count < n) {
+			if (p == end)
+				throw InflateError("the compressed data ends early");
+			bits |= static_cast<uint32_t>(*p++) << count;
+			count += 8;
+		}
+		const uint32_t v = bits & ((1u << n) - 1);
+		bits >>= n;
+		count -= n;
+		return v;
+	}
+
+	// stored blocks start on a byte boundary
+	void align() {
+		bits = 0;
+		count = 0;
+	}
+
+	const unsigned char *&at() 	{ return p; }
+	size_t left() const 	{ return static_cast<size_t>(end - p); }
+};
+
+// a canonical huffman code, as how many codes there are of each
+// length and the symbols in code order, decoded a bit at a time
+struct Huffman {
+	int count[16];
+	int symbol[288];
+
+	Huffman(const int *lengths, int n) {
+		int offset[16];
+		std::fill(count, count + 16, 0);
+		for (int s = 0; s < n; s++)
+			count[lengths[s]]++;
+		count[0] = 0;
+		offset[1] = 0;
+		for (int len = 1; len < 15; len++)
+			offset[len + 1] = offset[len] + count[len];
+		for (int s = 0; s < n; s++)
+			if (lengths[s] != 0)
+				symbol[offset[lengths[s]]++] = s;
+	}
+
+	int decode(BitReader &br) const {
+		int code = 0, first = 0, index = 0;
+		for (int len = 1; len < 16; len++) {
+			code |= static_cast<int>(br.get(1));
+			if (code - first < count[len])
+				return symbol[index + code - first];
+			index += count[len];
+			first = (first + count[len]) << 1;
+			code <<= 1;
+		}
+		throw InflateError("a bad huffman code");
+	}
+};
+
+void inflateCodes(BitReader &br, const Huffman &lit, const Huffman &dist, std::vector<unsigned char> &out) {
+	for (;;) {
+		const int s = lit.decode(br);
+		if (s < 256)
+			out.push_back(static_cast<unsigned char>(s));
+		else if (s == 256)
+			return;
+		else {
+			if (s > 285)
+				throw InflateError("a bad length code");
+			const int len = length_base[s - 257] + static_cast<int>(br.get(length_extra[s - 257]));
+			const int d = dist.decode(br);
+			if (d > 29)
+				throw InflateError("a bad distance code");
+			const size_t back = static_cast<size_t>(distance_base[d]) + br.get(distance_extra[d]);
+			if (back > out.size())
+				throw InflateError("a match from before the start");
+			for (int k = 0; k < len; k++)
+				out.push_back(out[out.size() - back]);
+		}
+	}
+}
+
+// a zlib stream, any kind of deflate blocks (not just the fixed codes
+// we write), with its checksum checked
+void inflate(const std::vector<unsigned char> &in, std::vector<unsigned char> &out) {
+	if (in.size() < 6 || (in[0] & 0x0f) != 8 || ((in[0] << 8) | in[1]) % 31 != 0 || (in[1] & 0x20))
+		throw InflateError("not a zlib stream");
+	BitReader br(&in[2], in.size() - 2);
+
+	bool last = false;
+	while (!last) {
+		last = br.get(1) != 0;
+		const uint32_t type = br.get(2);
+		if (type == 0) {
+			br.align();
+			if (br.left() < 4)
+				throw InflateError("the compressed data ends early");
+			const unsigned char *&p = br.at();
+			const size_t len = p[0] | (p[1] << 8);
+			if ((len ^ (p[2] | (p[3] << 8))) != 0xffff)
+				throw InflateError("a stored block's length doesn't check out");
+			p += 4;
+			if (br.left() < len)
+				throw InflateError("the compressed data ends early");
+			out.insert(out.end(), p, p + len);
+			p += len;
+		}
+		else if (type == 1) {
+			static const Huffman fixed_lit = [] {
+				int lengths[288];
+				for (int s = 0; s < 288; s++)
+					lengths[s] = fixedCodes().length[s];
+				return Huffman(lengths, 288);
+			}();
+			static const Huffman fixed_dist = [] {
+				int lengths[30];
+				std::fill(lengths, lengths + 30, 5);
+				return Huffman(lengths, 30);
+			}();
+			inflateCodes(br, fixed_lit, fixed_dist, out);
+		}
+		else if (type == 2) {
+			const int nlit = static_cast<int>(br.get(5)) + 257;
+			const int ndist = static_cast<int>(br.get(5)) + 1;
+			const int nlen = static_cast<int>(br.get(4)) + 4;
+			static const int order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+			int lengths[320];
+			std::fill(lengths, lengths + 19, 0);
+			for (int k = 0; k < nlen; k++)
+				lengths[order[k]] = static_cast<int>(br.get(3));
+			const Huffman lencode(lengths, 19);
+
+			int k = 0;
+			while (k < nlit + ndist) {
+				const int sym = lencode.decode(br);
+				int repeat, value = 0;
+				if (sym < 16) {
+					lengths[k++] = sym;
+					continue;
+				}
+				else if (sym == 16) {
+					if (k == 0)
+						throw InflateError("a repeat with nothing before it");
+					value = lengths[k - 1];
+					repeat = 3 + static_cast<int>(br.get(2));
+				}
+				else if (sym == 17)
+					repeat = 3 + static_cast<int>(br.get(3));
+				else
+					repeat = 11 + static_cast<int>(br.get(7));
+				if (k + repeat > nlit + ndist)
+					throw InflateError("too many code lengths");
+				while (repeat-- > 0)
+					lengths[k++] = value;
+			}
+			inflateCodes(br, Huffman(lengths, nlit), Huffman(lengths + nlit, ndist), out);
+		}
+		else
+			throw InflateError("a bad block type");
+	}
+
+	br.align();
+	if (br.left() < 4)
+		throw InflateError("the checksum is missing");
+	const unsigned char *p = br.at();
+	const uint32_t adler = (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	if (adler != adler32(out.data(), out.size()))
+		throw InflateError("the checksum doesn't match");
+}
+
+uint32_t getBigEndian(const unsigned char *p) {
+	return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// undoes filterRow. `above` is NULL for the first row
+void unfilterRow(unsigned char filter, unsigned char *row, const unsigned char *above, int n) {
+	for (int k = 0; k < n; k++) {
+		const int a = k >= 3 ? row[k - 3] : 0;
+		const int b = above ? above[k] : 0;
+		const int c = above && k >= 3 ? above[k - 3] : 0;
+		int predicted = 0;
+		switch (filter) {
+		case 1: predicted = a; break;
+		case 2: predicted = b; break;
+		case 3: predicted = (a + b) / 2; break;
+		case 4: {
+			const int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+			predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+			break;
+		}
+		}
+		row[k] = static_cast<unsigned char>(row[k] + predicted);
+	}
+}
+
+}
+
+void readPNG(const std::string &path, int &width, int &height, std::vector<unsigned char> &rgb) {
+	std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+	if (!in)
+		throw HDRException(path, "cannot open");
+	std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+	const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	if (bytes.size() < 8 || memcmp(bytes.data(), signature, 8) != 0)
+		throw HDRException(path, "not a PNG");
+
+	std::vector<unsigned char> compressed;
+	bool header = false;
+	size_t at = 8;
+	for (;;) {
+		if (bytes.size() - at < 12)
+			throw HDRException(path, "the file ends early");
+		const uint32_t len = getBigEndian(&bytes[at]);
+		if (bytes.size() - at - 12 < len)
+			throw HDRException(path, "the file ends early");
+		const unsigned char *type = &bytes[at + 4], *data = &bytes[at + 8];
+		if (getBigEndian(data + len) != crc32(type, len + 4))
+			throw HDRException(path, "a chunk's checksum doesn't match");
+
+		if (memcmp(type, "IHDR", 4) == 0 && len == 13) {
+			width = static_cast<int>(getBigEndian(data));
+			height = static_cast<int>(getBigEndian(data + 4));
+			if (width <= 0 || height <= 0 || data[8] != 8 || data[9] != 2 || data[10] != 0 || data[11] != 0 || data[12] != 0)
+				throw HDRException(path, "only 8 bit rgb PNGs without interlacing can be read");
+			header = true;
+		}
+		else if (memcmp(type, "IDAT", 4) == 0)
+			compressed.insert(compressed.end(), data, data + len);
+		else if (memcmp(type, "IEND", 4) == 0)
+			break;
+		at += 12 + len;
+	}
+	if (!header)
+		throw HDRException(path, "no IHDR chunk");
+
+	std::vector<unsigned char> filtered;
+	try {
+		inflate(compressed, filtered);
+	}
+	catch (const InflateError &e) {
+		throw HDRException(path, e.what());
+	}
+
+	const int n = 3 * width;
+	if (filtered.size() != static_cast<size_t>(n + 1) * height)
+		throw HDRException(path, "the image data is the wrong size");
+	rgb.resize(static_cast<size_t>(n) * height);
+	for (int y = 0; y < height; y++) {
+		const unsigned char filter = filtered[static_cast<size_t>(y) * (n + 1)];
+		if (filter > 4)
+			throw HDRException(path, "a bad filter type");
+		unsigned char *row = &rgb[static_cast<size_t>(y) * n];
+		memcpy(row, &filtered[static_cast<size_t>(y) * (n + 1) + 1], n);
+		unfilterRow(filter, row, y > 0 ? row - n : NULL, n);
+	}
+}
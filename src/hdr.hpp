@@ -0,0 +1,91 @@
+/* hdr.hpp
+ *
+ * float framebuffers, and turning them into 8 bit images
+ *
+ * an Image keeps each pixel as the 8 bits RGBColour rounds it to, so
+ * once a frame is rendered its exposure can't be changed without
+ * rendering it again. a RenderJob given a FloatImage (RenderJob::hdr)
+ * also keeps every pixel as it came out of the sampler, which can be
+ * written out as a PFM (the portable float map: three floats a pixel,
+ * rows from the bottom) and read back in later to be tone mapped again.
+ *
+ * tone mapping scales by 2^exposure, applies the curve (clamp, which is
+ * what RGBColour does, or reinhard's x / (1 + x)), and optionally the
+ * sRGB transfer function, then quantises to 8 bits. PNGs are written by
+ * a deflate encoder of our own (fixed huffman codes, with a hash chain
+ * for matches) so there's nothing to link against. there's an inflater
+ * to go with it, so that 8 bit PNGs can be read back in (the perftest's
+ * reference images are kept as PNGs).
+ *
+ * both stages work a strip of rows at a time, one strip per thread: the
+ * tone mapping loops are plain float arithmetic over whole rows for the
+ * compiler to vectorise, and each strip is filtered and compressed on
+ * its own and becomes an IDAT chunk of its own. the strips' deflate
+ * streams are flushed to a byte boundary, so they join up into one
+ * zlib stream, and their adler-32 checksums are combined at the end.
+ *
+ * shading itself still clamps colours at 1 (see RGBVec), so the float
+ * image has the precision the 8 bit one throws away but no more range:
+ * lowering the exposure shows detail that rounding lost, raising it
+ * saturates what was already white.
+ */
+
+#ifndef HDR_HEADER_WARRIOR
+#define HDR_HEADER_WARRIOR
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "colour.hpp"
+
+struct HDRException : public std::runtime_error {
+	HDRException(const std::string &path, const std::string &msg);
+};
+
+struct FloatImage {
+	int width;
+	int height;
+	std::vector<float> pixels;	// r, g, b for each pixel, a row at a time from the bottom
+
+	FloatImage(int w, int h);
+
+	float *at(int i, int j);
+	const float *at(int i, int j) const;
+	void set(int i, int j, const RGBVec &c);
+};
+
+void writePFM(const FloatImage &img, const std::string &path);
+
+// reads a colour PFM of either byte order into img, resizing it
+void readPFM(const std::string &path, FloatImage &img);
+
+enum ToneCurve { tone_clamp, tone_reinhard };
+
+struct ToneMapOptions {
+	double exposure;	// in stops
+	ToneCurve curve;
+	bool srgb;		// off by default, as traceify's colours have always been written out as they are
+	int threads;		// 0 for one per hardware thread
+
+	ToneMapOptions();
+};
+
+// "clamp" or "reinhard", false for anything else
+bool parseToneCurve(const std::string &name, ToneCurve &out);
+
+// 8 bit r, g, b for each pixel, a row at a time from the top
+void toneMap(const FloatImage &img, const ToneMapOptions &opts, std::vector<unsigned char> &out);
+
+void writeToneMappedPNG(const FloatImage &img, const ToneMapOptions &opts, const std::string &path);
+
+// `rgb` as toneMap lays it out. `threads` compress a strip each, 0 for
+// one per hardware thread
+void writePNG(const std::vector<unsigned char> &rgb, int width, int height, int threads, const std::string &path);
+
+// reads an 8 bit rgb PNG (not interlaced, as all of ours are) into rgb,
+// laid out as toneMap does it
+void readPNG(const std::string &path, int &width, int &height, std::vector<unsigned char> &rgb);
+void writeToneMappedPPM(const FloatImage &img, const ToneMapOptions &opts, const std::string &path);
+
+#endif
@@ -1,20 +1,29 @@
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
 #include "image.hpp"
 
 OutOfImageException::OutOfImageException(int i) :
 	std::runtime_error("Index " + std::to_string(i) + " is out of image") {}
 
+// the pixels are one zeroed block (RGBColour() is black), rather than
+// a column at a time. calloc gets big blocks straight from the kernel
+// without writing to them, so each page lands on the NUMA node of the
+// thread that renders into it first
 Image::Image(int w, int h) : width(w), height(h) {
+	pixels = static_cast<RGBColour *>(calloc(static_cast<size_t>(std::max(width, 1)) * std::max(height, 1), sizeof(RGBColour)));
+	if (!pixels)
+		throw std::bad_alloc();
 	img = new RGBColour*[width];
 	for (int i = 0; i < width; i++) {
-		img[i] = new RGBColour[height];
+		img[i] = pixels + static_cast<size_t>(i) * height;
 	}
 }
 
 Image::~Image() {
-	for (int i = 0; i < height; i++) {
-		delete[] img[i];
-	}
 	delete[] img;
+	free(pixels);
 }
 
 RGBColour *Image::operator[](int i) {
@@ -32,13 +41,42 @@ void Image::writeToFile(std::string fname) {
 	daFile << *this;
 }
 
-std::ostream& operator<<(std::ostream& os, const Image &img_obj) {
-	os << "P6" << std::endl << img_obj.width << " " << img_obj.height << std::endl << "255" << std::endl;
-	for (int i = 0; i < img_obj.height; i++) {
-		for (int j = 0; j < img_obj.width; j++) {
-			os.write(&(img_obj[j][img_obj.height - i - 1].colour[0]), 3);
+// rows go top to bottom, so each one is gathered from every column
+void Image::encodePPM(std::vector<char> &out) const {
+	std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+	out.resize(header.size() + 3 * static_cast<size_t>(width) * height);
+	std::copy(header.begin(), header.end(), out.begin());
+
+	char *p = &out[header.size()];
+	for (int i = 0; i < height; i++) {
+		for (int j = 0; j < width; j++) {
+			const char *c = img[j][height - i - 1].colour;
+			p[0] = c[0];
+			p[1] = c[1];
+			p[2] = c[2];
+			p += 3;
 		}
-	}	
+	}
+}
+
+std::ostream& operator<<(std::ostream& os, const Image &img_obj) {
+	std::vector<char> bytes;
+	img_obj.encodePPM(bytes);
+	os.write(&bytes[0], static_cast<std::streamsize>(bytes.size()));
 	return os;
 }
 
+/* PixelBuffer implementation */
+
+PixelBuffer::PixelBuffer() : rgb(NULL), width(0), height(0), stride(0) {}
+
+PixelBuffer::PixelBuffer(unsigned char *p, int w, int h, size_t s) :
+	rgb(p), width(w), height(h), stride(s ? s : 3 * static_cast<size_t>(w)) {}
+
+unsigned char *PixelBuffer::at(int i, int j) {
+	return rgb + static_cast<size_t>(height - 1 - j) * stride + 3 * static_cast<size_t>(i);
+}
+
+const unsigned char *PixelBuffer::at(int i, int j) const {
+	return rgb + static_cast<size_t>(height - 1 - j) * stride + 3 * static_cast<size_t>(i);
+}
@@ -1,9 +1,14 @@
+#ifndef IMAGE_HEADER_WARRIOR
+#define IMAGE_HEADER_WARRIOR
+
 #include <fstream>
 #include <string>
+#include <vector>
 #include "colour.hpp"
 
 struct Image {
-	RGBColour **img;
+	RGBColour **img;	// columns, bottom to top
+	RGBColour *pixels;	// which they all point into
 	int width;
 	int height;
 
@@ -12,10 +17,36 @@ struct Image {
 	RGBColour *operator[](int i);
 	RGBColour *operator[](int i) const;
 	void writeToFile(std::string fname);
+
+	// the whole file writeToFile writes, in one buffer
+	void encodePPM(std::vector<char> &out) const;
 };
 
 std::ostream& operator<<(std::ostream& os, const Image &img);
 
+/* PixelBuffer
+ *
+ * 8 bit r, g, b pixels in memory that somebody else owns, a row at a
+ * time from the top with `stride` bytes from one row to the next. a
+ * RenderJob can render into one instead of an Image */
+struct PixelBuffer {
+	unsigned char *rgb;
+	int width;
+	int height;
+	size_t stride;
+
+	PixelBuffer();
+
+	// a stride of 0 means the rows are packed together
+	PixelBuffer(unsigned char *rgb, int w, int h, size_t stride = 0);
+
+	// pixel (i, j), counting j up from the bottom as Image does
+	unsigned char *at(int i, int j);
+	const unsigned char *at(int i, int j) const;
+};
+
 struct OutOfImageException : public std::runtime_error {
 	OutOfImageException(int i);
 };
+
+#endif
@@ -0,0 +1,250 @@
+#include <algorithm>
+
+#include "incremental.hpp"
+#include "sceneparser.hpp"
+
+// escaped rays are recorded as a point this far along them
+#define PATH_FAR 1.0e6
+
+// recorded points are floats, so boxes are grown a little to make sure
+// rays that only just touch them still count
+#define PATH_BOX_SLACK 1.0e-3
+
+/* PathRecorder implementation */
+
+void PathRecorder::hit(const vec3 &p, int object, int depth) {
+	PathVertex v;
+	v.p[0] = static_cast<float>(p.x());
+	v.p[1] = static_cast<float>(p.y());
+	v.p[2] = static_cast<float>(p.z());
+	v.object = object;
+	v.depth = depth;
+	vertices.push_back(v);
+}
+
+void PathRecorder::escaped(const Ray &r, int depth) {
+	hit(r.origin + r.direction.normalised().scaled(PATH_FAR), PATH_ESCAPED, depth);
+}
+
+/* dirty checks */
+
+// does the segment from a to b pass within `grow` of the box?
+static bool segmentHitsBox(const double a[3], const double b[3], const BoundingBox &bb, double grow) {
+	const double g = grow + PATH_BOX_SLACK;
+	const double lo[3] = { bb.x_min - g, bb.y_min - g, bb.z_min - g };
+	const double hi[3] = { bb.x_max + g, bb.y_max + g, bb.z_max + g };
+
+	double t0 = 0.0;
+	double t1 = 1.0;
+	for (int k = 0; k < 3; k++) {
+		double d = b[k] - a[k];
+		if (d == 0.0) {
+			if (a[k] < lo[k] || a[k] > hi[k])
+				return false;
+			continue;
+		}
+		double ta = (lo[k] - a[k]) / d;
+		double tb = (hi[k] - a[k]) / d;
+		if (ta > tb) std::swap(ta, tb);
+		t0 = std::max(t0, ta);
+		t1 = std::min(t1, tb);
+		if (t0 > t1)
+			return false;
+	}
+	return true;
+}
+
+static bool segmentHitsEdit(const double a[3], const double b[3], const SceneEdit &e, double grow = 0.0) {
+	return e.moved && (segmentHitsBox(a, b, e.before, grow) || segmentHitsBox(a, b, e.after, grow));
+}
+
+bool EditSession::dirty(const TileRecord &rec, size_t pixel) const {
+	const std::vector<Light> &lights = w->lights();
+	const bool shadows = w->shadows_enabled;
+
+	double prev[3];
+	for (uint32_t k = rec.starts[pixel]; k < rec.starts[pixel + 1]; k++) {
+		const PathVertex &v = rec.vertices[k];
+		const double here[3] = { v.p[0], v.p[1], v.p[2] };
+		if (v.depth == 0) {
+			prev[0] = cam.position.x();
+			prev[1] = cam.position.y();
+			prev[2] = cam.position.z();
+		}
+
+		for (size_t e = 0; e < active.size(); e++) {
+			const SceneEdit &edit = active[e];
+			if (v.object == edit.object)
+				return true;
+			if (segmentHitsEdit(prev, here, edit))
+				return true;
+
+			// point lights' shadow rays aren't cut off at the light, so
+			// anything beyond it along the same line casts a shadow too.
+			// area lights' stop at the light, but spread out to its
+			// edges on the way
+			if (shadows && v.object != PATH_ESCAPED && edit.moved) {
+				for (size_t l = 0; l < lights.size(); l++) {
+					if (lights[l].isArea()) {
+						const double centre[3] = { lights[l].pos.x(), lights[l].pos.y(), lights[l].pos.z() };
+						if (segmentHitsEdit(here, centre, edit, lights[l].extent()))
+							return true;
+						continue;
+					}
+					vec3 dir = (lights[l].pos - vec3(here[0], here[1], here[2])).normalised().scaled(PATH_FAR);
+					const double far[3] = { here[0] + dir.x(), here[1] + dir.y(), here[2] + dir.z() };
+					if (segmentHitsEdit(here, far, edit))
+						return true;
+				}
+			}
+		}
+
+		prev[0] = here[0];
+		prev[1] = here[1];
+		prev[2] = here[2];
+	}
+
+	return false;
+}
+
+/* EditSession implementation */
+
+EditSession::EditSession(const std::string &scene_path) :
+	w(new World(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec())),
+	cam(vec3(0.0, 0.0, 0.0)), vp(defaultSceneViewport()), ss(1),
+	tiles_x(0), frame_valid(false), retraced(0)
+{
+	loadScene(scene_path, *w);
+
+	// numbered before the hierarchy is built, so they keep the order
+	// of the scene file
+	w->numberObjects();
+	w->collectObjects(objects);
+	w->buildHierarchy();
+
+	setView(w->camera(), w->viewport, w->ss_level);
+}
+
+World &EditSession::world() 			{ return *w; }
+const Camera &EditSession::camera() const 	{ return cam; }
+const Viewport &EditSession::viewport() const 	{ return vp; }
+int EditSession::ssLevel() const 		{ return ss; }
+Image &EditSession::image() 			{ return *img; }
+int EditSession::objectCount() const 		{ return static_cast<int>(objects.size()); }
+long EditSession::pixelsRetraced() const 	{ return retraced; }
+
+SceneObject *EditSession::object(int id) {
+	if (id < 0 || id >= objectCount())
+		throw GeometryException("There is no object " + std::to_string(id));
+	return objects[id];
+}
+
+std::string EditSession::describe(int id) {
+	return object(id)->tag();
+}
+
+void EditSession::moveObject(int id, const vec3 &offset) {
+	SceneObject *obj = object(id);
+
+	SceneEdit e;
+	e.object = id;
+	e.moved = true;
+	e.everywhere = !obj->isBounded();
+	if (!e.everywhere)
+		e.before = obj->getBoundBox();
+
+	obj->translate(offset);
+	w->refitHierarchy();
+
+	if (!e.everywhere)
+		e.after = obj->getBoundBox();
+	pending.push_back(e);
+}
+
+void EditSession::setColour(int id, const RGBVec &colour) {
+	// every object in the list is shadable, clusters aren't numbered.
+	// paged spheres shade with a palette of their own, so this doesn't
+	// change them
+	ShadableObject *obj = static_cast<ShadableObject*>(object(id));
+	obj->material.material_colour = colour;
+
+	SceneEdit e;
+	e.object = id;
+	e.moved = false;
+	e.everywhere = false;
+	pending.push_back(e);
+}
+
+void EditSession::setView(const Camera &c, const Viewport &v, int ss_level) {
+	cam = c;
+	vp = v;
+	ss = ss_level;
+	frame_valid = false;
+
+	if (!img || img->width != vp.pixelsWide() || img->height != vp.pixelsTall())
+		img.reset(new Image(vp.pixelsWide(), vp.pixelsTall()));
+
+	tiles_x = (vp.pixelsWide() + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	int tiles_y = (vp.pixelsTall() + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	tiles.clear();
+	tiles.resize((size_t)tiles_x * tiles_y);
+}
+
+void EditSession::prepare(RenderJob &job) {
+	active.swap(pending);
+	pending.clear();
+
+	bool everything = !frame_valid;
+	for (size_t i = 0; i < active.size(); i++)
+		everything = everything || active[i].everywhere;
+
+	frame_valid = true;
+	retraced = 0;
+	job.tileRenderer = [this, everything](RenderJob &r, const Tile &t, RenderStats &stats) {
+		renderTile(r, t, stats, everything);
+	};
+}
+
+void EditSession::renderTile(RenderJob &job, const Tile &t, RenderStats &stats, bool everything) {
+	TileRecord &rec = tiles[(size_t)(t.y0 / RENDER_TILE_SIZE) * tiles_x + t.x0 / RENDER_TILE_SIZE];
+	const size_t pixels = (size_t)(t.x1 - t.x0) * (t.y1 - t.y0);
+	everything = everything || rec.starts.empty();
+
+	std::vector<bool> redo(pixels, everything);
+	bool any = everything;
+	for (size_t k = 0; k < pixels && !everything; k++) {
+		redo[k] = dirty(rec, k);
+		any = any || redo[k];
+	}
+	if (!any)
+		return;
+
+	TileRecord out;
+	out.starts.reserve(pixels + 1);
+	out.vertices.reserve(rec.vertices.size());
+	PathRecorder recorder;
+	long count = 0;
+
+	Image &img = *job.image;
+	size_t k = 0;
+	for (int i = t.x0; i < t.x1; i++) {
+		for (int j = t.y0; j < t.y1; j++, k++) {
+			out.starts.push_back(static_cast<uint32_t>(out.vertices.size()));
+			if (redo[k]) {
+				recorder.vertices.clear();
+				img[i][j] = job.world->colourForPixelAt(job.camera, job.viewport, job.ss_level, i, j, stats, &recorder);
+				out.vertices.insert(out.vertices.end(), recorder.vertices.begin(), recorder.vertices.end());
+				count++;
+			}
+			else {
+				out.vertices.insert(out.vertices.end(),
+						rec.vertices.begin() + rec.starts[k], rec.vertices.begin() + rec.starts[k + 1]);
+			}
+		}
+	}
+	out.starts.push_back(static_cast<uint32_t>(out.vertices.size()));
+
+	std::swap(rec.vertices, out.vertices);
+	std::swap(rec.starts, out.starts);
+	retraced += count;
+}
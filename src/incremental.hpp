@@ -0,0 +1,128 @@
+/* incremental.hpp
+ *
+ * re-rendering just the parts of a frame that an edit could change
+ *
+ * when a frame is rendered in an EditSession, every pixel's rays are
+ * recorded: where each camera ray and its reflections hit, and what
+ * they hit. a pixel depends on
+ *
+ * 	- the objects its rays hit (their materials, and where they are)
+ * 	- whatever is along its rays' paths (something moving into the way)
+ * 	- whatever is along the shadow rays from each hit to each light
+ *
+ * so when an object changes colour, the pixels that hit it are dirty,
+ * and when it moves, so are the pixels with a ray (camera, reflection or
+ * shadow) through its bounding box before or after the move. the next
+ * render re-traces those pixels and keeps the rest of the last frame.
+ * objects without a bounding box (planes) make the whole frame dirty.
+ *
+ * paths are kept per tile, about 20 bytes per hit, so a session costs
+ * roughly (samples per pixel * reflections) * 20 bytes per pixel on top
+ * of the image.
+ */
+
+#ifndef INCREMENTAL_HEADER_WARRIOR
+#define INCREMENTAL_HEADER_WARRIOR
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+#include "world.hpp"
+#include "image.hpp"
+#include "renderer.hpp"
+
+#define PATH_ESCAPED -1		// PathVertex::object for rays that hit nothing
+
+struct PathVertex {
+	float p[3];		// the hit, or a point far along a ray that escaped
+	int32_t object;		// SceneObject::id of what was hit
+	int32_t depth;		// 0 for camera rays, n for the nth reflection
+};
+
+/* PathRecorder
+ *
+ * passed to World::traceRay to find out where a pixel's rays went. a
+ * reflection follows the vertex it was reflected from, so a path is a
+ * camera ray vertex followed by its reflections in order */
+struct PathRecorder {
+	std::vector<PathVertex> vertices;
+
+	void hit(const vec3 &p, int object, int depth);
+	void escaped(const Ray &r, int depth);
+};
+
+struct SceneEdit {
+	int object;
+	bool moved;		// false if only its material changed
+	bool everywhere;	// it has no bounding box, so the whole frame is dirty
+	BoundingBox before;
+	BoundingBox after;
+};
+
+/* EditSession
+ *
+ * a scene that is being edited, and the last frame rendered of it.
+ * objects are numbered in the order they appear in the scene file.
+ * edits and renders mustn't overlap: the caller has to wait for one
+ * render to finish before making more edits */
+class EditSession {
+private:
+	// the paths of every pixel in a tile, pixel by pixel in the order
+	// the tile is rendered in. pixel k's vertices are [starts[k], starts[k + 1])
+	struct TileRecord {
+		std::vector<PathVertex> vertices;
+		std::vector<uint32_t> starts;
+	};
+
+	std::unique_ptr<World> w;
+	std::vector<SceneObject*> objects;
+	Camera cam;
+	Viewport vp;
+	int ss;
+	std::unique_ptr<Image> img;
+
+	std::vector<TileRecord> tiles;
+	int tiles_x;
+	bool frame_valid;	// false until the first render, and after the view changes
+
+	std::vector<SceneEdit> pending;	// since the last render
+	std::vector<SceneEdit> active;	// being rendered
+	std::atomic<long> retraced;
+
+	SceneObject *object(int id);
+	bool dirty(const TileRecord &rec, size_t pixel) const;
+	void renderTile(RenderJob &job, const Tile &t, RenderStats &stats, bool everything);
+
+public:
+	EditSession(const std::string &scene_path);
+
+	World &world();
+	const Camera &camera() const;
+	const Viewport &viewport() const;
+	int ssLevel() const;
+	Image &image();
+
+	int objectCount() const;
+	std::string describe(int id);
+
+	// these throw a GeometryException for objects that can't be edited
+	void moveObject(int id, const vec3 &offset);
+	void setColour(int id, const RGBVec &colour);
+
+	// a different view means the next render starts from scratch
+	void setView(const Camera &cam, const Viewport &vp, int ss_level);
+
+	// sets up a job (of world(), camera(), viewport() and ssLevel(),
+	// into image()) to render the frame: all of it the first time, and
+	// after that just the pixels the edits since the last render could
+	// have changed
+	void prepare(RenderJob &job);
+
+	// how many pixels the last render had to trace again
+	long pixelsRetraced() const;
+};
+
+#endif
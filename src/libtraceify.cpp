@@ -0,0 +1,135 @@
+#include "libtraceify.hpp"
+#include "coherent.hpp"
+#include "sceneparser.hpp"
+
+/* TraceifyScene implementation */
+
+TraceifyScene::TraceifyScene() : world(new World(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec())) {}
+
+// everything that's worked out lazily is worked out here, so that
+// nothing about the world changes once renders can see it
+void TraceifyScene::prepare() {
+	world->numberObjects();
+	world->buildHierarchy();
+}
+
+std::shared_ptr<const TraceifyScene> TraceifyScene::load(const std::string &path) {
+	std::shared_ptr<TraceifyScene> scene(new TraceifyScene());
+	loadScene(path, *scene->world);
+	scene->prepare();
+	return scene;
+}
+
+std::shared_ptr<const TraceifyScene> TraceifyScene::parse(const std::string &text, const std::string &source) {
+	std::shared_ptr<TraceifyScene> scene(new TraceifyScene());
+	parseScene(text.data(), text.size(), *scene->world, source);
+	scene->prepare();
+	return scene;
+}
+
+int TraceifyScene::width() const {
+	return world->viewport.pixelsWide();
+}
+
+int TraceifyScene::height() const {
+	return world->viewport.pixelsTall();
+}
+
+const Camera &TraceifyScene::camera() const {
+	return world->camera();
+}
+
+/* TraceifyRender implementation */
+
+TraceifyRenderOptions::TraceifyRenderOptions() : ss_level(0), sorted(false), camera(NULL), hdr(NULL), cancel(NULL) {}
+
+TraceifyRender::TraceifyRender(RenderEngine &e, const std::shared_ptr<const TraceifyScene> &s, const PixelBuffer &out,
+		const TraceifyRenderOptions &o) :
+	engine(e), scene(s),
+	job(*s->world, o.camera ? *o.camera : s->camera(), s->world->viewport.resized(out.width, out.height),
+		o.ss_level > 0 ? o.ss_level : s->world->ss_level, out),
+	opts(o), progress_done(0) {
+	// RenderJob::store writes wherever the pixel is in the output, so a
+	// smaller float buffer would be written past the end of
+	if (opts.hdr && (opts.hdr->width != out.width || opts.hdr->height != out.height))
+		*opts.hdr = FloatImage(out.width, out.height);
+	job.hdr = opts.hdr;
+	if (opts.sorted)
+		job.tileRenderer = renderCoherent;
+	job.onTile = [this](RenderJob &, const Tile &) { tileDone(); };
+}
+
+TraceifyRender::~TraceifyRender() {
+	cancel();
+
+	// anything a tile threw has been given to wait() already, or nobody
+	// is asking any more
+	try {
+		engine.wait(job);
+	}
+	catch (...) {}
+}
+
+// runs on the worker that rendered the tile, before the tile is counted
+// as done, so the render can't finish (and be destroyed) under it
+void TraceifyRender::tileDone() {
+	if (opts.cancel && opts.cancel->load())
+		engine.cancel(job);
+
+	if (opts.progress) {
+		std::lock_guard<std::mutex> guard(progress_lock);
+		opts.progress(++progress_done, job.tileCount());
+	}
+}
+
+void TraceifyRender::wait() {
+	engine.wait(job);
+}
+
+void TraceifyRender::cancel() {
+	engine.cancel(job);
+}
+
+bool TraceifyRender::finished() const {
+	return job.finished();
+}
+
+bool TraceifyRender::cancelled() const {
+	return job.cancelled();
+}
+
+int TraceifyRender::tilesDone() const {
+	return job.tilesDone();
+}
+
+int TraceifyRender::tileCount() const {
+	return job.tileCount();
+}
+
+const RenderStats &TraceifyRender::stats() const {
+	return job.stats;
+}
+
+/* TraceifyRenderer implementation */
+
+TraceifyRenderer::TraceifyRenderer(int threads) : engine(threads) {}
+
+int TraceifyRenderer::threadCount() const {
+	return engine.threadCount();
+}
+
+std::unique_ptr<TraceifyRender> TraceifyRenderer::start(const std::shared_ptr<const TraceifyScene> &scene,
+		const PixelBuffer &out, const TraceifyRenderOptions &opts) {
+	std::unique_ptr<TraceifyRender> render(new TraceifyRender(engine, scene, out, opts));
+	engine.submit(render->job);
+	return render;
+}
+
+RenderStats TraceifyRenderer::render(const std::shared_ptr<const TraceifyScene> &scene, const PixelBuffer &out,
+		const TraceifyRenderOptions &opts, bool *cancelled) {
+	std::unique_ptr<TraceifyRender> r = start(scene, out, opts);
+	r->wait();
+	if (cancelled)
+		*cancelled = r->cancelled();
+	return r->stats();
+}
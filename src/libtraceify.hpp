@@ -0,0 +1,146 @@
+/* libtraceify.hpp
+ *
+ * traceify as a library, for programs that render without running it
+ *
+ * a TraceifyScene is a scene loaded and set up once, and never changed
+ * again, so any number of renders on any number of threads can share
+ * it. a TraceifyRenderer owns a pool of worker threads, which all of
+ * the renders started on it share a tile at a time (see renderer.hpp).
+ * renders go straight into a PixelBuffer the caller owns, so there is
+ * no Image to copy out of, and the RenderStats of each are its own
+ * rather than the scene's.
+ *
+ * a render can report its progress, and be cancelled: the tiles being
+ * rendered at the time are finished, and no more are started.
+ *
+ * everything here is safe to use from several threads at once. `make
+ * lib` builds libtraceify.a and libtraceify.so, which have the whole of
+ * traceify except main() in them
+ */
+
+#ifndef LIBTRACEIFY_HEADER_WARRIOR
+#define LIBTRACEIFY_HEADER_WARRIOR
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "world.hpp"
+#include "image.hpp"
+#include "hdr.hpp"
+#include "renderer.hpp"
+
+class TraceifyRender;
+
+/* TraceifyScene
+ *
+ * loading throws SceneFileException or SceneParseException (see
+ * sceneparser.hpp) if the scene can't be read */
+class TraceifyScene {
+private:
+	friend class TraceifyRender;
+
+	std::unique_ptr<World> world;
+
+	TraceifyScene();
+	void prepare();
+
+public:
+	// a text or binary scene file
+	static std::shared_ptr<const TraceifyScene> load(const std::string &path);
+
+	// a scene description in memory. `source` names it in errors
+	static std::shared_ptr<const TraceifyScene> parse(const std::string &text, const std::string &source = "<text>");
+
+	// the size the scene asks to be rendered at
+	int width() const;
+	int height() const;
+
+	const Camera &camera() const;
+};
+
+struct TraceifyRenderOptions {
+	int ss_level;		// 0 for the scene's
+	bool sorted;		// trace reflections a bounce at a time (see coherent.hpp)
+	const Camera *camera;	// NULL for the scene's. copied when the render starts
+
+	// if set, also gets the pixels before rounding. it's resized to the
+	// output buffer's size when the render starts, if it isn't already
+	FloatImage *hdr;
+
+	// called after each tile with how many are done out of how many,
+	// on a worker thread, but one call at a time and with `done` going
+	// up from one call to the next
+	std::function<void(int done, int total)> progress;
+
+	// if set, checked after each tile: once it's true, the render is
+	// cancelled
+	const std::atomic<bool> *cancel;
+
+	TraceifyRenderOptions();
+};
+
+/* TraceifyRender
+ *
+ * a render under way. destroying it cancels it, and waits for the
+ * tiles being rendered to finish */
+class TraceifyRender {
+private:
+	friend class TraceifyRenderer;
+
+	RenderEngine &engine;
+	std::shared_ptr<const TraceifyScene> scene;
+	RenderJob job;
+	TraceifyRenderOptions opts;
+	std::mutex progress_lock;
+	int progress_done;	// guarded by progress_lock
+
+	TraceifyRender(RenderEngine &engine, const std::shared_ptr<const TraceifyScene> &scene, const PixelBuffer &out,
+			const TraceifyRenderOptions &opts);
+
+	void tileDone();
+
+public:
+	~TraceifyRender();
+
+	// throws whatever a tile threw (see RenderEngine::wait), once the
+	// rest of the render has been given up
+	void wait();
+	void cancel();
+
+	bool finished() const;
+	bool cancelled() const;
+
+	// how many tiles are done out of how many
+	int tilesDone() const;
+	int tileCount() const;
+
+	// valid once it's finished
+	const RenderStats &stats() const;
+};
+
+class TraceifyRenderer {
+private:
+	RenderEngine engine;
+
+public:
+	// 0 threads means one per hardware thread
+	TraceifyRenderer(int threads = 0);
+
+	int threadCount() const;
+
+	// starts rendering the scene into `out` at out's size, returning
+	// straight away. `out` (and opts.hdr) have to stay alive until the
+	// render has finished; the scene is kept alive by the render
+	std::unique_ptr<TraceifyRender> start(const std::shared_ptr<const TraceifyScene> &scene, const PixelBuffer &out,
+			const TraceifyRenderOptions &opts = TraceifyRenderOptions());
+
+	// start and wait, returning the render's stats. opts.cancel is the
+	// way to cancel it, from another thread or the progress callback
+	RenderStats render(const std::shared_ptr<const TraceifyScene> &scene, const PixelBuffer &out,
+			const TraceifyRenderOptions &opts = TraceifyRenderOptions(), bool *cancelled = NULL);
+};
+
+#endif
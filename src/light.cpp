@@ -1,8 +1,71 @@
+#include <cmath>
+#include <algorithm>
+
 #include "light.hpp"
 
-Light::Light(const vec3& position, RGBVec col)
-	: pos(position), colour(col) {}
+Light::Light(const vec3& position, RGBVec col, double r)
+	: pos(position), colour(col), range(r), shape(light_point),
+	edge_u(0.0, 0.0, 0.0), edge_v(0.0, 0.0, 0.0), radius(0.0) {}
+
+Light::Light(const vec3& centre, const vec3 &u, const vec3 &v, RGBVec col, double r)
+	: pos(centre), colour(col), range(r), shape(light_rect), edge_u(u), edge_v(v), radius(0.0) {}
+
+Light::Light(const vec3& centre, double rad, RGBVec col, double r)
+	: pos(centre), colour(col), range(r), shape(light_sphere),
+	edge_u(0.0, 0.0, 0.0), edge_v(0.0, 0.0, 0.0), radius(rad) {}
 
 vec3 Light::lVectorFromPoint(const vec3 &p) {
 	return (pos - p).normalised();
 };
+
+double Light::falloff(const vec3 &p) const {
+	if (range <= 0.0)
+		return 1.0;
+	vec3 d = pos - p;
+	return range * range / (range * range + d.dot(d));
+}
+
+bool Light::isArea() const {
+	return shape != light_point;
+}
+
+double Light::extent() const {
+	// half the longer diagonal
+	if (shape == light_rect)
+		return 0.5 * std::max((edge_u + edge_v).magnitude(), (edge_u - edge_v).magnitude());
+	if (shape == light_sphere)
+		return radius;
+	return 0.0;
+}
+
+vec3 Light::pointOn(double s, double t, const vec3 &p) const {
+	if (shape == light_rect)
+		return pos + edge_u.scaled(s - 0.5) + edge_v.scaled(t - 0.5);
+	if (shape == light_point)
+		return pos;
+
+	// a disc across the line from p to the centre. any vector that isn't
+	// parallel to that line will do to start the basis from
+	vec3 w = (pos - p).normalised();
+	vec3 up = fabs(w.x()) < 0.9 ? vec3(1.0, 0.0, 0.0) : vec3(0.0, 1.0, 0.0);
+	vec3 a = (up - w.scaled(up.dot(w))).normalised();
+	vec3 b(w.y() * a.z() - w.z() * a.y(), w.z() * a.x() - w.x() * a.z(), w.x() * a.y() - w.y() * a.x());
+
+	// sqrt keeps the points evenly spread over the disc's area
+	double r = radius * sqrt(s);
+	double phi = 2.0 * M_PI * t;
+	return pos + a.scaled(r * cos(phi)) + b.scaled(r * sin(phi));
+}
+
+vec3 Light::edgePoint(double a, const vec3 &p) const {
+	if (shape != light_rect)
+		return pointOn(1.0, a, p);
+
+	// along each side in turn, anticlockwise
+	double side = 4.0 * a;
+	int k = static_cast<int>(side) % 4;
+	double f = side - static_cast<int>(side);
+	const double s[4] = { f, 1.0, 1.0 - f, 0.0 };
+	const double t[4] = { 0.0, f, 1.0, 1.0 - f };
+	return pointOn(s[k], t[k], p);
+}
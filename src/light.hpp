@@ -3,16 +3,48 @@
 #ifndef LIGHT_HEADER_WARRIOR
 #define LIGHT_HEADER_WARRIOR
 
+enum LightShape { light_point, light_rect, light_sphere };
+
 // Light
 //
-// Point light representation
+// Point light representation, or an area light: a rectangle (centred
+// on pos, with sides edge_u and edge_v) or a sphere. area lights are
+// shaded as if they were a point at pos, but their shadows are soft
+// (see World::lightVisibility)
+//
+// a light with a range fades with distance, to half its brightness at
+// `range` away (range^2 / (range^2 + d^2)). a range of 0 means it
+// doesn't fade at all
 class Light {
 public:
 	vec3 pos;
 	RGBVec colour;
+	double range;
+	LightShape shape;
+	vec3 edge_u;	// rect lights only
+	vec3 edge_v;
+	double radius;	// sphere lights only
 
-	Light(const vec3& pos, RGBVec colour);
+	Light(const vec3& pos, RGBVec colour, double range = 0.0);
+	Light(const vec3& centre, const vec3 &edge_u, const vec3 &edge_v, RGBVec colour, double range = 0.0);
+	Light(const vec3& centre, double radius, RGBVec colour, double range = 0.0);
 	vec3 lVectorFromPoint(const vec3 &p);
+
+	// how much of the light reaches p
+	double falloff(const vec3 &p) const;
+
+	bool isArea() const;
+
+	// the furthest any part of the light is from pos
+	double extent() const;
+
+	// the point (s, t) of the light (both in [0, 1)) as seen from p.
+	// spheres look like a disc facing p
+	vec3 pointOn(double s, double t, const vec3 &p) const;
+
+	// the point a (in [0, 1)) of the way round the light's edge, as
+	// seen from p. rects start at a corner
+	vec3 edgePoint(double a, const vec3 &p) const;
 };
 
 #endif
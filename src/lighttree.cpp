@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <cmath>
+
+#include "lighttree.hpp"
+
+// how bright a light is, for weighing lights against each other
+static double power(const RGBVec &c) {
+	return 0.2126 * c.r() + 0.7152 * c.g() + 0.0722 * c.b();
+}
+
+void LightTree::build(const std::vector<Light> &lights) {
+	nodes.clear();
+	if (lights.empty())
+		return;
+
+	std::vector<int> order(lights.size());
+	for (size_t i = 0; i < lights.size(); i++)
+		order[i] = static_cast<int>(i);
+
+	nodes.reserve(2 * lights.size() - 1);
+	buildNode(lights, order, 0, order.size());
+}
+
+int LightTree::buildNode(const std::vector<Light> &lights, std::vector<int> &order, size_t lo, size_t hi) {
+	Node node;
+	node.power = 0.0;
+	node.range = 0.0;
+	node.left = node.right = node.light = -1;
+
+	for (size_t i = lo; i < hi; i++) {
+		const Light &l = lights[order[i]];
+		const double e = l.extent();
+		BoundingBox b;
+		b.x_min = l.pos.x() - e;
+		b.x_max = l.pos.x() + e;
+		b.y_min = l.pos.y() - e;
+		b.y_max = l.pos.y() + e;
+		b.z_min = l.pos.z() - e;
+		b.z_max = l.pos.z() + e;
+		if (i == lo)
+			node.bb = b;
+		else
+			node.bb.swallow(b);
+
+		node.power += power(l.colour);
+		node.range = std::max(node.range, l.range > 0.0 ? l.range : INFINITY);
+	}
+
+	const int index = static_cast<int>(nodes.size());
+	nodes.push_back(node);
+
+	if (hi - lo == 1) {
+		nodes[index].light = order[lo];
+		return index;
+	}
+
+	// split at the median along the longest side, as Cluster::subdivide does
+	double dx = node.bb.x_max - node.bb.x_min;
+	double dy = node.bb.y_max - node.bb.y_min;
+	double dz = node.bb.z_max - node.bb.z_min;
+	int axis = (dx >= dy && dx >= dz) ? 0 : (dy >= dz ? 1 : 2);
+
+	size_t mid = (lo + hi) / 2;
+	std::nth_element(order.begin() + lo, order.begin() + mid, order.begin() + hi,
+		[&lights, axis](int a, int b) {
+			if (axis == 0) return lights[a].pos.x() < lights[b].pos.x();
+			if (axis == 1) return lights[a].pos.y() < lights[b].pos.y();
+			return lights[a].pos.z() < lights[b].pos.z();
+		});
+
+	// nodes may move while the children are built, so no references
+	int left = buildNode(lights, order, lo, mid);
+	int right = buildNode(lights, order, mid, hi);
+	nodes[index].left = left;
+	nodes[index].right = right;
+	return index;
+}
+
+void LightTree::clear() {
+	nodes.clear();
+}
+
+bool LightTree::empty() const {
+	return nodes.empty();
+}
+
+double LightTree::importance(const Node &node, const vec3 &p, const vec3 &n, bool nearest) const {
+	const BoundingBox &b = node.bb;
+	vec3 centre(0.5 * (b.x_min + b.x_max), 0.5 * (b.y_min + b.y_max), 0.5 * (b.z_min + b.z_max));
+	vec3 half(0.5 * (b.x_max - b.x_min), 0.5 * (b.y_max - b.y_min), 0.5 * (b.z_max - b.z_min));
+	vec3 to = centre - p;
+	double r2 = half.dot(half);
+	double d2 = to.dot(to);
+
+	// the most light can lean towards the normal is the angle to the
+	// centre less the angle the box's bounding sphere takes up. if even
+	// that is behind the surface, none of the lights can light it
+	double cos_bound = 1.0;
+	if (d2 > r2) {
+		double d = sqrt(d2);
+		double cos_theta = n.dot(to) / d;
+		double sin_spread = sqrt(r2) / d;
+		double cos_spread = sqrt(1.0 - sin_spread * sin_spread);
+		if (cos_theta < cos_spread) {
+			double sin_theta = sqrt(std::max(0.0, 1.0 - cos_theta * cos_theta));
+			cos_bound = cos_theta * cos_spread + sin_theta * sin_spread;
+			if (cos_bound <= 0.0)
+				return 0.0;
+		}
+	}
+
+	double dist2;
+	if (nearest) {
+		double dx = std::max(std::max(b.x_min - p.x(), p.x() - b.x_max), 0.0);
+		double dy = std::max(std::max(b.y_min - p.y(), p.y() - b.y_max), 0.0);
+		double dz = std::max(std::max(b.z_min - p.z(), p.z() - b.z_max), 0.0);
+		dist2 = dx * dx + dy * dy + dz * dz;
+	}
+	else {
+		// the distance to the centre, but never so close that one
+		// nearby light makes the rest of the box look brighter than it is
+		dist2 = std::max(d2, r2);
+	}
+
+	double falloff = 1.0;
+	if (!std::isinf(node.range)) {
+		double range2 = node.range * node.range;
+		falloff = range2 / (range2 + dist2);
+	}
+
+	return node.power * falloff * cos_bound;
+}
+
+// xorshift, good enough for picking lights
+static double uniform(unsigned int &state) {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return (state >> 8) * (1.0 / 16777216.0);
+}
+
+int LightTree::select(const vec3 &p, const vec3 &n, int budget, unsigned int seed, LightSample *out) const {
+	if (nodes.empty())
+		return 0;
+	budget = std::max(1, std::min(budget, LIGHT_TREE_MAX_SAMPLES));
+
+	// the cut: nodes that between them hold every light that matters
+	int cut[LIGHT_TREE_MAX_SAMPLES];
+	double bound[LIGHT_TREE_MAX_SAMPLES];
+	int size = 0;
+
+	double root = importance(nodes[0], p, n, true);
+	if (root > 0.0) {
+		cut[0] = 0;
+		bound[0] = root;
+		size = 1;
+	}
+
+	while (size < budget) {
+		// split whichever node could add the most
+		int best = -1;
+		for (int k = 0; k < size; k++)
+			if (nodes[cut[k]].left >= 0 && (best < 0 || bound[k] > bound[best]))
+				best = k;
+		if (best < 0)
+			break;
+
+		const Node &node = nodes[cut[best]];
+		size--;
+		cut[best] = cut[size];
+		bound[best] = bound[size];
+
+		const int children[2] = { node.left, node.right };
+		for (int c = 0; c < 2; c++) {
+			double b = importance(nodes[children[c]], p, n, true);
+			if (b > 0.0) {
+				cut[size] = children[c];
+				bound[size] = b;
+				size++;
+			}
+		}
+	}
+
+	unsigned int state = seed ? seed : 1;
+	int count = 0;
+	for (int k = 0; k < size; k++) {
+		int index = cut[k];
+		double weight = 1.0;
+
+		while (weight > 0.0 && nodes[index].left >= 0) {
+			const Node &node = nodes[index];
+			double l = importance(nodes[node.left], p, n, false);
+			double r = importance(nodes[node.right], p, n, false);
+			if (l + r <= 0.0) {
+				weight = 0.0;
+				break;
+			}
+
+			double p_left = l / (l + r);
+			if (uniform(state) < p_left) {
+				index = node.left;
+				weight /= p_left;
+			}
+			else {
+				index = node.right;
+				weight /= 1.0 - p_left;
+			}
+		}
+
+		if (weight > 0.0) {
+			out[count].light = nodes[index].light;
+			out[count].weight = weight;
+			count++;
+		}
+	}
+
+	return count;
+}
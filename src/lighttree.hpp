@@ -0,0 +1,65 @@
+/* lighttree.hpp
+ *
+ * a bounding volume hierarchy over the lights, for scenes with too many
+ * of them to shade every one at every hit (after Walter et al.,
+ * "Lightcuts", and the stochastic lightcuts of Yuksel)
+ *
+ * each node bounds the positions of the lights below it and knows their
+ * total power and the furthest any of them reaches. from a shading point
+ * that's enough to bound how much a whole node could add, so the tree is
+ * cut into at most `budget` nodes, always splitting the one that could
+ * matter most. nodes that are behind the surface or out of range are
+ * dropped. a leaf in the cut is shaded as it is, anything bigger stands
+ * in for all of its lights: one of them is picked at random, in
+ * proportion to how much each is likely to add, and weighted by one over
+ * the chance of picking it, so that on average it adds what they would.
+ */
+
+#ifndef LIGHTTREE_HEADER_WARRIOR
+#define LIGHTTREE_HEADER_WARRIOR
+
+#include <vector>
+
+#include "vec3.hpp"
+#include "light.hpp"
+#include "geometry.hpp"
+
+// the most lights LightTree::select will ever pick
+#define LIGHT_TREE_MAX_SAMPLES 64
+
+struct LightSample {
+	int light;	// index into the lights the tree was built from
+	double weight;
+};
+
+class LightTree {
+private:
+	struct Node {
+		BoundingBox bb;
+		double power;	// sum of the lights' brightness
+		double range;	// the longest, infinite if any light has no falloff
+		int left;	// -1 for a leaf
+		int right;
+		int light;	// leaves only
+	};
+
+	std::vector<Node> nodes;	// the root is nodes[0]
+
+	int buildNode(const std::vector<Light> &lights, std::vector<int> &order, size_t lo, size_t hi);
+
+	// an upper bound on what the node's lights can add at p if `nearest`,
+	// otherwise a guess at it (for picking between children)
+	double importance(const Node &node, const vec3 &p, const vec3 &n, bool nearest) const;
+
+public:
+	void build(const std::vector<Light> &lights);
+	void clear();
+	bool empty() const;
+
+	// fills `out` with at most `budget` (up to LIGHT_TREE_MAX_SAMPLES)
+	// lights to shade the point p, which has normal n, with and returns
+	// how many there are. the same seed always picks the same lights
+	int select(const vec3 &p, const vec3 &n, int budget, unsigned int seed, LightSample *out) const;
+};
+
+#endif
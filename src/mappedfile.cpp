@@ -0,0 +1,61 @@
+#include "mappedfile.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+MappedFileException::MappedFileException(const std::string &path, const std::string &what) :
+	std::runtime_error(path + ": " + what) {}
+
+MappedFile::MappedFile(const std::string &fname) : path(fname), base(NULL), length(0) {
+	int fd = open(fname.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw MappedFileException(fname, strerror(errno));
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		close(fd);
+		throw MappedFileException(fname, strerror(err));
+	}
+
+	length = static_cast<size_t>(st.st_size);
+	if (length > 0) {
+		void *addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) {
+			int err = errno;
+			close(fd);
+			throw MappedFileException(fname, strerror(err));
+		}
+		base = static_cast<const char *>(addr);
+	}
+
+	// the mapping keeps the file alive, we don't need the descriptor
+	close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (base != NULL)
+		munmap(const_cast<char *>(base), length);
+}
+
+const char *MappedFile::data() const 		{ return base; }
+size_t MappedFile::size() const 		{ return length; }
+const std::string &MappedFile::name() const 	{ return path; }
+
+bool MappedFile::contains(size_t offset, size_t bytes) const {
+	return offset <= length && bytes <= length - offset;
+}
+
+uint64_t MappedFile::contentHash() const {
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(base);
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
@@ -0,0 +1,47 @@
+/* mappedfile.hpp
+ *
+ * a read-only memory mapping of a whole file
+ *
+ * the mapping is shared, so several traceify processes
+ * looking at the same file share the same physical pages
+ */
+
+#ifndef MAPPEDFILE_HEADER_WARRIOR
+#define MAPPEDFILE_HEADER_WARRIOR
+
+#include <string>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+
+struct MappedFileException : public std::runtime_error {
+	MappedFileException(const std::string &path, const std::string &what);
+};
+
+class MappedFile {
+private:
+	std::string path;
+	const char *base;
+	size_t length;
+
+	// a mapping is not copyable, share it with a shared_ptr instead
+	MappedFile(const MappedFile &);
+	void operator=(const MappedFile &);
+
+public:
+	MappedFile(const std::string &path);
+	~MappedFile();
+
+	const char *data() const;
+	size_t size() const;
+	const std::string &name() const;
+
+	// true if [offset, offset + bytes) lies inside the file
+	bool contains(size_t offset, size_t bytes) const;
+
+	// FNV-1a over the whole file, for telling whether two files
+	// (or one file at two different times) hold the same thing
+	uint64_t contentHash() const;
+};
+
+#endif
@@ -1,4 +1,7 @@
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include "material.hpp"
 #include "debug.h"
 
@@ -9,20 +12,22 @@ Material::Material(const Material& m) {
 	material_colour = m.material_colour;
 	specular_colour = m.specular_colour;
 	reflective = m.reflective;
+	texture = m.texture;
+	texture_scale = m.texture_scale;
 }
 
 // No Shader (constant colour => Full Ambient Only)
 Material::Material(const RGBVec &colour) : 
-	diffuse(false), specularity(0.0), ambient(1.0), material_colour(colour) {}
+	diffuse(false), specularity(0.0), ambient(1.0), material_colour(colour), texture_scale(1.0) {}
 
 // No Specular (Diffuse + [Ambient])
 Material::Material(const RGBVec &colour, double ambAmount) :
-	diffuse(true), specularity(0.0), ambient(ambAmount), material_colour(colour) {}
+	diffuse(true), specularity(0.0), ambient(ambAmount), material_colour(colour), texture_scale(1.0) {}
 
 // Full Shader with implicit white specular colour (Diffuse + Shader + [Ambient])
 Material::Material(const RGBVec &matcolour, double specAmount, double ambAmount) :
 	diffuse(true), specularity(specAmount), ambient(ambAmount),
-	material_colour(matcolour), specular_colour(1.0,1.0,1.0) {}
+	material_colour(matcolour), specular_colour(1.0,1.0,1.0), texture_scale(1.0) {}
 
 // Full Shader (Diffuse + Specular + [Ambient])
 Material::Material(const RGBVec &matcolour, const RGBVec &speccolour, double specAmount, double ambAmount) :
@@ -30,7 +35,8 @@ Material::Material(const RGBVec &matcolour, const RGBVec &speccolour, double spe
 	specularity(specAmount), 
 	ambient(ambAmount), 
 	material_colour(matcolour), 
-	specular_colour(speccolour) {}
+	specular_colour(speccolour),
+	texture_scale(1.0) {}
 
 // Full Shader with reflection
 Material::Material(const RGBVec &matcolour, const RGBVec &speccolour, double spec, double amb, bool reflect) :
@@ -39,13 +45,18 @@ Material::Material(const RGBVec &matcolour, const RGBVec &speccolour, double spe
 	specularity(spec),
 	ambient(amb),
 	material_colour(matcolour),
-	specular_colour(speccolour) {}
+	specular_colour(speccolour),
+	texture_scale(1.0) {}
 
 
 RGBVec Material::shade(const Light &light, const vec3 &n, const vec3 &v, const vec3 &l) const {
-	RGBVec result = material_colour.scaled(ambient);
+	return shade(light, n, v, l, material_colour);
+}
+
+RGBVec Material::shade(const Light &light, const vec3 &n, const vec3 &v, const vec3 &l, const RGBVec &colour) const {
+	RGBVec result = colour.scaled(ambient);
 	if (diffuse) 
-		result += material_colour.multiplyColour(light.colour).scaled(n.dot(l));
+		result += colour.multiplyColour(light.colour).scaled(n.dot(l));
 	if (specularity > 0.0) {
 		vec3 h = (v + l).normalised();
 		double coefficient = pow( n.dot(h), specularity );
@@ -67,5 +78,141 @@ void Material::operator=(const Material &m) {
 	material_colour = m.material_colour;
 	specular_colour = m.specular_colour;
 	reflective = m.reflective;
+	texture = m.texture;
+	texture_scale = m.texture_scale;
+}
+
+/* batch shading */
+
+#define SHADE_BATCH_CHUNK 64	// hits gathered at a time, on the stack
+
+static inline double bitsToDouble(uint64_t u) {
+	double d;
+	memcpy(&d, &u, sizeof(d));
+	return d;
+}
+
+static inline uint64_t doubleToBits(double d) {
+	uint64_t u;
+	memcpy(&u, &d, sizeof(u));
+	return u;
+}
+
+// the exponent comes from the bits (turned into a double by putting it
+// in the mantissa of 2^52, so there's no integer conversion to stop the
+// loop vectorising) and the mantissa, moved into [sqrt(1/2), sqrt(2)),
+// goes through log(m) = 2 atanh((m - 1) / (m + 1)), whose series
+// converges quickly there. subnormal x come out wrong, but tiny
+static inline double log2Approx(double x) {
+	const uint64_t bits = doubleToBits(x);
+	double e = bitsToDouble(0x4330000000000000ull | (bits >> 52)) - 4503599627370496.0 - 1023.0;
+	double m = bitsToDouble((bits & 0x000fffffffffffffull) | 0x3ff0000000000000ull);
+	const bool high = m > M_SQRT2;
+	m = high ? 0.5 * m : m;
+	e = high ? e + 1.0 : e;
+
+	// 2 / (k ln 2) for k = 1, 3, 5, ...
+	const double t = (m - 1.0) / (m + 1.0), t2 = t * t;
+	return e + t * (2.8853900817779268 + t2 * (0.9617966939259757 + t2 * (0.5770780163555853 + t2 * (0.41219858311113244
+		+ t2 * (0.3205988979753252 + t2 * (0.2623081892525388 + t2 * (0.2219530832136867 + t2 * 0.19235933878519512)))))));
+}
+
+// adding 1.5 * 2^52 rounds y to the nearest integer k, which is left in
+// the low bits, ready to become the exponent of 2^k. the rest is e^z
+// for |z| <= ln(2) / 2, from its series. y stops short of where the
+// result would be subnormal, as arithmetic on those is very slow
+static inline double exp2Approx(double y) {
+	y = y < -1000.0 ? -1000.0 : (y > 1023.0 ? 1023.0 : y);
+	const double shifted = y + 6755399441055744.0;
+	const double k = shifted - 6755399441055744.0;
+	const double z = (y - k) * M_LN2;
+	const double series = 1.0 + z * (1.0 + z * (0.5 + z * (0.16666666666666666 + z * (0.041666666666666664
+		+ z * (0.008333333333333333 + z * (0.001388888888888889 + z * (0.0001984126984126984 + z * (2.48015873015873e-05
+		+ z * (2.7557319223985893e-06 + z * (2.755731922398589e-07 + z * 2.505210838544172e-08))))))))));
+	const uint64_t scale = (doubleToBits(shifted) - 0x4338000000000000ull + 1023) << 52;
+	return series * bitsToDouble(scale);
+}
+
+double fastPow(double x, double y) {
+	return exp2Approx(y * log2Approx(x));
+}
+
+static inline double clamped(double x) {
+	return x > 1.0 ? 1.0 : (x < 0.0 ? 0.0 : x);
 }
 
+static inline double positive(double x) {
+	return x > 0.0 ? x : 0.0;
+}
+
+ShadeBatch::ShadeBatch() :
+	count(0), nx(NULL), ny(NULL), nz(NULL), vx(NULL), vy(NULL), vz(NULL), lx(NULL), ly(NULL), lz(NULL),
+	material(NULL), cr(NULL), cg(NULL), cb(NULL) {}
+
+// every step clamps to [0, 1] where shade()'s RGBVecs would, and the
+// terms a material doesn't have are multiplied by 0 rather than
+// branched round, so that the second loop is straight-line arithmetic
+void shadeBatch(const Light &light, const Material *const *materials, const ShadeBatch &batch, double *r, double *g, double *b) {
+	const double light_colour[3] = { light.colour.r(), light.colour.g(), light.colour.b() };
+
+	for (int base = 0; base < batch.count; base += SHADE_BATCH_CHUNK) {
+		const int n = std::min(SHADE_BATCH_CHUNK, batch.count - base);
+
+		double ambient[SHADE_BATCH_CHUNK], has_diffuse[SHADE_BATCH_CHUNK], exponent[SHADE_BATCH_CHUNK];
+		double has_specular[SHADE_BATCH_CHUNK], even[SHADE_BATCH_CHUNK];
+		double colour[3][SHADE_BATCH_CHUNK], specular[3][SHADE_BATCH_CHUNK];
+		for (int k = 0; k < n; k++) {
+			const Material &m = *materials[batch.material[base + k]];
+			ambient[k] = positive(m.ambient);
+			has_diffuse[k] = m.diffuse ? 1.0 : 0.0;
+			exponent[k] = m.specularity;
+			has_specular[k] = m.specularity > 0.0 ? 1.0 : 0.0;
+			// pow() of a negative number is only positive for even exponents
+			even[k] = m.specularity == 2.0 * std::floor(0.5 * m.specularity) ? 1.0 : 0.0;
+			if (batch.cr) {
+				colour[0][k] = batch.cr[base + k];
+				colour[1][k] = batch.cg[base + k];
+				colour[2][k] = batch.cb[base + k];
+			}
+			else {
+				colour[0][k] = m.material_colour.r();
+				colour[1][k] = m.material_colour.g();
+				colour[2][k] = m.material_colour.b();
+			}
+			specular[0][k] = m.specular_colour.r();
+			specular[1][k] = m.specular_colour.g();
+			specular[2][k] = m.specular_colour.b();
+		}
+
+		// results go on the stack too, so the compiler needn't worry
+		// that writing them changes the batch
+		const double *nx = batch.nx + base, *ny = batch.ny + base, *nz = batch.nz + base;
+		const double *vx = batch.vx + base, *vy = batch.vy + base, *vz = batch.vz + base;
+		const double *lx = batch.lx + base, *ly = batch.ly + base, *lz = batch.lz + base;
+		double out[3][SHADE_BATCH_CHUNK];
+		for (int k = 0; k < n; k++) {
+			const double nl = nx[k] * lx[k] + ny[k] * ly[k] + nz[k] * lz[k];
+
+			// |n.h| to the power, for h = u / |u|, is ((n.u)^2 / u.u)^(s / 2):
+			// one log2 and one exp2, and no sqrt (which, setting errno,
+			// would stop the loop vectorising). n.u only decides the sign
+			const double ux = vx[k] + lx[k], uy = vy[k] + ly[k], uz = vz[k] + lz[k];
+			const double nu = nx[k] * ux + ny[k] * uy + nz[k] * uz;
+			const double uu = ux * ux + uy * uy + uz * uz;
+			const double power = exp2Approx(0.5 * exponent[k] * log2Approx(nu * nu / uu));
+			const double coefficient = positive((nu > 0.0 || even[k] != 0.0) && uu > 0.0 ? power : 0.0) * has_specular[k];
+			const double diffuse = positive(nl) * has_diffuse[k];
+
+			for (int ch = 0; ch < 3; ch++) {
+				double result = clamped(colour[ch][k] * ambient[k]);
+				result = clamped(result + clamped(clamped(colour[ch][k] * light_colour[ch]) * diffuse));
+				result = clamped(result + clamped(clamped(specular[ch][k] * light_colour[ch]) * coefficient));
+				out[ch][k] = result;
+			}
+		}
+
+		std::copy(out[0], out[0] + n, r + base);
+		std::copy(out[1], out[1] + n, g + base);
+		std::copy(out[2], out[2] + n, b + base);
+	}
+}
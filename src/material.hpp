@@ -1,5 +1,11 @@
+#ifndef MATERIAL_HEADER_WARRIOR
+#define MATERIAL_HEADER_WARRIOR
+
+#include <memory>
+
 #include "colour.hpp"
 #include "light.hpp"
+#include "texture.hpp"
 
 struct Material {
 	bool diffuse;
@@ -11,6 +17,11 @@ struct Material {
 	RGBVec material_colour;	// diffuse (and ambient colour)
 	RGBVec specular_colour;
 
+	// if set, the diffuse colour is material_colour times the texture.
+	// planes repeat it every texture_scale units, spheres wrap it round once
+	std::shared_ptr<const Texture> texture;
+	double texture_scale;
+
 	Material(const Material&);
 
 	// No Shader (constant colour => Full Ambient Only)
@@ -31,5 +42,42 @@ struct Material {
 	RGBVec shade(const Light &light, const vec3 &n, const vec3 &v, const vec3 &l);
 	RGBVec shade(const Light &light, const vec3 &n, const vec3 &v, const vec3 &l) const;
 
+	// with `colour` (from the texture, say) in place of material_colour
+	RGBVec shade(const Light &light, const vec3 &n, const vec3 &v, const vec3 &l, const RGBVec &colour) const;
+
 	void operator=(const Material&);
 };
+
+// x^y for x > 0, as exp2(y * log2(x)) with polynomials for both, in
+// straight-line arithmetic that the compiler can vectorise. relative
+// error is around 1e-12 wherever the result is over 1e-300. below that
+// it comes out as about 1e-301
+double fastPow(double x, double y);
+
+/* ShadeBatch
+ *
+ * many hits to be shaded by the same light, each component of each
+ * vector in an array of its own, so that shadeBatch can work through
+ * them a whole SIMD register of hits at a time. every array has
+ * `count` entries */
+struct ShadeBatch {
+	int count;
+	const double *nx, *ny, *nz;	// normals
+	const double *vx, *vy, *vz;	// v, as shade() takes it
+	const double *lx, *ly, *lz;	// towards the light
+	const int *material;		// indices into shadeBatch's `materials`
+	const double *cr, *cg, *cb;	// the diffuse colours, or all NULL for each material's own
+
+	ShadeBatch();
+};
+
+// how far any channel shadeBatch gives can be from shade()'s. pow() is
+// the only thing done differently, and fastPow's error is well inside
+// this even for specularities in the hundreds
+#define SHADE_BATCH_TOLERANCE 1e-9
+
+// what shade(light, n, v, l, colour) would give for each hit of the
+// batch, written to r, g and b
+void shadeBatch(const Light &light, const Material *const *materials, const ShadeBatch &batch, double *r, double *g, double *b);
+
+#endif
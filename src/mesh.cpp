@@ -0,0 +1,396 @@
+#include "mesh.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <string>
+
+#define MESH_EPS 		0.00001
+#define MESH_LEAF_SIZE 		4
+#define MESH_SAH_BINS 		16
+#define MESH_MAX_DEPTH 		64
+#define MESH_STACK_DEPTH 	(MESH_MAX_DEPTH + 2)
+
+/* MeshData implementation */
+
+MeshData::MeshData(std::vector<MeshVertex> &verts, std::vector<MeshTriangle> &tris) :
+	vertices(NULL), triangles(NULL), nodes(NULL), num_vertices(0), num_triangles(0), num_nodes(0) {
+	owned_vertices.swap(verts);
+	owned_triangles.swap(tris);
+	buildHierarchy();
+}
+
+MeshData::MeshData(std::shared_ptr<const MappedFile> file,
+		   const MeshVertex *verts, uint32_t n_verts,
+		   const MeshTriangle *tris, uint32_t n_tris,
+		   const MeshNode *tree, uint32_t n_nodes) :
+	backing(file), vertices(verts), triangles(tris), nodes(tree),
+	num_vertices(n_verts), num_triangles(n_tris), num_nodes(n_nodes) {
+	// a file can say anything, so nothing in it is used until it's
+	// been checked
+	validate();
+	if (tree == NULL) {
+		// no prebuilt hierarchy, so we have to reorder the triangles
+		// ourselves. the vertices can still be used in place
+		owned_triangles.assign(tris, tris + n_tris);
+		buildHierarchy();
+	}
+}
+
+void MeshData::validate() const {
+	for (uint32_t i = 0; i < num_triangles; i++)
+		for (int k = 0; k < 3; k++)
+			if (triangles[i].v[k] >= num_vertices)
+				throw GeometryException("triangle " + std::to_string(i) + " has a vertex out of range");
+
+	if (nodes == NULL)
+		return;
+	if (num_nodes == 0)
+		throw GeometryException("mesh hierarchy has no nodes");
+	if (num_triangles == 0)
+		return;		// intersect() never looks past the root
+
+	// children always come after their parents, so one pass in order
+	// sees every node's depth before its children need it
+	std::vector<int> depth(num_nodes, -1);
+	depth[0] = 0;
+	for (uint32_t i = 0; i < num_nodes; i++) {
+		if (depth[i] < 0)
+			continue;	// nothing points to it, so nothing will ever read it
+		const MeshNode &node = nodes[i];
+		if (node.count > 0) {
+			if (static_cast<uint64_t>(node.offset) + node.count > num_triangles)
+				throw GeometryException("mesh node " + std::to_string(i) + " has triangles out of range");
+			continue;
+		}
+		if (i + 1 >= num_nodes || node.offset <= i + 1 || node.offset >= num_nodes)
+			throw GeometryException("mesh node " + std::to_string(i) + " has a child out of range");
+		if (depth[i] + 1 > MESH_MAX_DEPTH)
+			throw GeometryException("mesh hierarchy is deeper than " + std::to_string(MESH_MAX_DEPTH) + " levels");
+		depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+		depth[node.offset] = std::max(depth[node.offset], depth[i] + 1);
+	}
+}
+
+namespace {
+
+struct BuildBox {
+	float lo[3];
+	float hi[3];
+
+	BuildBox() {
+		for (int a = 0; a < 3; a++) {
+			lo[a] = FLT_MAX;
+			hi[a] = -FLT_MAX;
+		}
+	}
+
+	void grow(const float p[3]) {
+		for (int a = 0; a < 3; a++) {
+			if (p[a] < lo[a]) lo[a] = p[a];
+			if (p[a] > hi[a]) hi[a] = p[a];
+		}
+	}
+
+	void grow(const BuildBox &b) {
+		grow(b.lo);
+		grow(b.hi);
+	}
+
+	float area() const {
+		if (lo[0] > hi[0]) return 0.0f;
+		float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+		return 2.0f * (dx*dy + dy*dz + dz*dx);
+	}
+};
+
+static inline int binFor(float c, float lo, float scale) {
+	int b = static_cast<int>((c - lo) * scale);
+	return b >= MESH_SAH_BINS ? MESH_SAH_BINS - 1 : b;
+}
+
+struct BuildRef {
+	BuildBox box;
+	float centroid[3];
+	MeshTriangle tri;
+};
+
+// splits refs[begin, end) and appends the subtree to `nodes` depth-first,
+// so that a node's first child always follows it directly
+void buildNode(std::vector<BuildRef> &refs, std::vector<MeshNode> &nodes, uint32_t begin, uint32_t end, int depth) {
+	BuildBox bounds, centroids;
+	for (uint32_t i = begin; i < end; i++) {
+		bounds.grow(refs[i].box);
+		centroids.grow(refs[i].centroid);
+	}
+
+	uint32_t index = static_cast<uint32_t>(nodes.size());
+	nodes.push_back(MeshNode());
+	for (int a = 0; a < 3; a++) {
+		nodes[index].bb_min[a] = begin == end ? 0.0f : bounds.lo[a];
+		nodes[index].bb_max[a] = begin == end ? 0.0f : bounds.hi[a];
+	}
+
+	uint32_t n = end - begin;
+	if (n <= MESH_LEAF_SIZE) {
+		nodes[index].offset = begin;
+		nodes[index].count = n;
+		return;
+	}
+
+	// split along the longest axis of the centroids
+	int axis = 0;
+	for (int a = 1; a < 3; a++)
+		if (centroids.hi[a] - centroids.lo[a] > centroids.hi[axis] - centroids.lo[axis])
+			axis = a;
+
+	uint32_t mid = begin + n / 2;
+	float extent = centroids.hi[axis] - centroids.lo[axis];
+
+	// past a certain depth we stop trusting the heuristic and just
+	// halve the list, which bounds the traversal stack
+	if (extent > 0.0f && depth < MESH_MAX_DEPTH - 32) {
+		BuildBox bin_box[MESH_SAH_BINS];
+		uint32_t bin_count[MESH_SAH_BINS] = { 0 };
+		float scale = MESH_SAH_BINS / extent;
+
+		for (uint32_t i = begin; i < end; i++) {
+			int b = binFor(refs[i].centroid[axis], centroids.lo[axis], scale);
+			bin_box[b].grow(refs[i].box);
+			bin_count[b]++;
+		}
+
+		// sweep from the right to get the cost of each right hand side
+		float right_area[MESH_SAH_BINS];
+		uint32_t right_count[MESH_SAH_BINS];
+		BuildBox acc;
+		uint32_t cnt = 0;
+		for (int b = MESH_SAH_BINS - 1; b > 0; b--) {
+			acc.grow(bin_box[b]);
+			cnt += bin_count[b];
+			right_area[b] = acc.area();
+			right_count[b] = cnt;
+		}
+
+		float best_cost = FLT_MAX;
+		int best_split = -1;
+		acc = BuildBox();
+		cnt = 0;
+		for (int b = 1; b < MESH_SAH_BINS; b++) {
+			acc.grow(bin_box[b-1]);
+			cnt += bin_count[b-1];
+			if (cnt == 0 || right_count[b] == 0) continue;
+			float cost = acc.area() * cnt + right_area[b] * right_count[b];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_split = b;
+			}
+		}
+
+		if (best_split > 0) {
+			float lo = centroids.lo[axis];
+			BuildRef *first = &refs[0] + begin;
+			BuildRef *pivot = std::partition(first, &refs[0] + end, [&](const BuildRef &r) {
+				return binFor(r.centroid[axis], lo, scale) < best_split;
+			});
+			mid = begin + static_cast<uint32_t>(pivot - first);
+		}
+	}
+
+	if (mid == begin || mid == end) {
+		// all centroids coincide (or the heuristic gave up), so just halve the list
+		mid = begin + n / 2;
+		std::nth_element(&refs[0] + begin, &refs[0] + mid, &refs[0] + end,
+			[axis](const BuildRef &a, const BuildRef &b) { return a.centroid[axis] < b.centroid[axis]; });
+	}
+
+	buildNode(refs, nodes, begin, mid, depth + 1);
+	uint32_t right = static_cast<uint32_t>(nodes.size());
+	buildNode(refs, nodes, mid, end, depth + 1);
+
+	nodes[index].offset = right;
+	nodes[index].count = 0;
+}
+
+}
+
+// builds the hierarchy over owned_triangles (reordering them as it goes)
+// using a binned surface area heuristic
+void MeshData::buildHierarchy() {
+	const MeshVertex *vdata = owned_vertices.empty() ? vertices : &owned_vertices[0];
+
+	std::vector<BuildRef> refs(owned_triangles.size());
+	for (size_t i = 0; i < refs.size(); i++) {
+		refs[i].tri = owned_triangles[i];
+		for (int k = 0; k < 3; k++) {
+			const MeshVertex &v = vdata[refs[i].tri.v[k]];
+			float p[3] = { v.x, v.y, v.z };
+			refs[i].box.grow(p);
+		}
+		for (int a = 0; a < 3; a++)
+			refs[i].centroid[a] = 0.5f * (refs[i].box.lo[a] + refs[i].box.hi[a]);
+	}
+
+	owned_nodes.clear();
+	owned_nodes.reserve(2 * refs.size() / MESH_LEAF_SIZE + 1);
+	buildNode(refs, owned_nodes, 0, static_cast<uint32_t>(refs.size()), 0);
+
+	for (size_t i = 0; i < refs.size(); i++)
+		owned_triangles[i] = refs[i].tri;
+
+	if (!owned_vertices.empty()) {
+		vertices = &owned_vertices[0];
+		num_vertices = static_cast<uint32_t>(owned_vertices.size());
+	}
+	triangles = owned_triangles.empty() ? NULL : &owned_triangles[0];
+	num_triangles = static_cast<uint32_t>(owned_triangles.size());
+	nodes = &owned_nodes[0];
+	num_nodes = static_cast<uint32_t>(owned_nodes.size());
+}
+
+vec3 MeshData::vertex(uint32_t i) const {
+	return vec3(vertices[i].x, vertices[i].y, vertices[i].z);
+}
+
+vec3 MeshData::triangleNormal(uint32_t tri) const {
+	const MeshTriangle &t = triangles[tri];
+	vec3 a = vertex(t.v[0]);
+	vec3 e1 = vertex(t.v[1]) - a;
+	vec3 e2 = vertex(t.v[2]) - a;
+	vec3 n(e1.y()*e2.z() - e1.z()*e2.y(),
+	       e1.z()*e2.x() - e1.x()*e2.z(),
+	       e1.x()*e2.y() - e1.y()*e2.x());
+	return n.normalised();
+}
+
+BoundingBox MeshData::bounds() const {
+	BoundingBox bb;
+	bb.x_min = nodes[0].bb_min[0];
+	bb.y_min = nodes[0].bb_min[1];
+	bb.z_min = nodes[0].bb_min[2];
+	bb.x_max = nodes[0].bb_max[0];
+	bb.y_max = nodes[0].bb_max[1];
+	bb.z_max = nodes[0].bb_max[2];
+	return bb;
+}
+
+// slab test against a node's box, returns the entry distance or a
+// negative number on a miss
+static inline double nodeEntry(const MeshNode &node, const double o[3], const double inv_d[3], double t_best) {
+	double t0 = 0.0, t1 = t_best;
+	for (int a = 0; a < 3; a++) {
+		double near = (node.bb_min[a] - o[a]) * inv_d[a];
+		double far = (node.bb_max[a] - o[a]) * inv_d[a];
+		if (near > far) std::swap(near, far);
+		if (near > t0) t0 = near;
+		if (far < t1) t1 = far;
+		if (t0 > t1) return -1.0;
+	}
+	return t0;
+}
+
+// Möller-Trumbore
+static inline bool triangleHit(const vec3 &a, const vec3 &b, const vec3 &c, const Ray &ray, double &t) {
+	const vec3 &d = ray.direction;
+	vec3 e1 = b - a;
+	vec3 e2 = c - a;
+	vec3 p(d.y()*e2.z() - d.z()*e2.y(), d.z()*e2.x() - d.x()*e2.z(), d.x()*e2.y() - d.y()*e2.x());
+	double det = e1.dot(p);
+	if (det == 0.0) return false;
+	double inv_det = 1.0 / det;
+
+	vec3 s = ray.origin - a;
+	double u = s.dot(p) * inv_det;
+	if (u < 0.0 || u > 1.0) return false;
+
+	vec3 q(s.y()*e1.z() - s.z()*e1.y(), s.z()*e1.x() - s.x()*e1.z(), s.x()*e1.y() - s.y()*e1.x());
+	double v = d.dot(q) * inv_det;
+	if (v < 0.0 || u + v > 1.0) return false;
+
+	t = e2.dot(q) * inv_det;
+	return true;
+}
+
+IntersectionResult MeshData::intersect(const Ray &ray, double t_min) const {
+	if (num_triangles == 0) return IntersectionResult();
+
+	const double o[3] = { ray.origin.x(), ray.origin.y(), ray.origin.z() };
+	const double inv_d[3] = { 1.0 / ray.direction.x(), 1.0 / ray.direction.y(), 1.0 / ray.direction.z() };
+
+	double t_best = DBL_MAX;
+	int best = -1;
+
+	uint32_t stack[MESH_STACK_DEPTH];
+	int sp = 0;
+	stack[sp++] = 0;
+
+	while (sp > 0) {
+		uint32_t idx = stack[--sp];
+		const MeshNode &node = nodes[idx];
+		if (nodeEntry(node, o, inv_d, t_best) < 0.0) continue;
+
+		if (node.count > 0) {
+			for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+				const MeshTriangle &tri = triangles[i];
+				double t;
+				if (triangleHit(vertex(tri.v[0]), vertex(tri.v[1]), vertex(tri.v[2]), ray, t)
+				    && t > t_min && t < t_best) {
+					t_best = t;
+					best = static_cast<int>(i);
+				}
+			}
+		}
+		else {
+			// validate() keeps hierarchies from files shallow enough, and
+			// buildHierarchy never makes one deeper than MESH_MAX_DEPTH
+			if (sp + 2 > MESH_STACK_DEPTH)
+				throw GeometryException("mesh hierarchy too deep to traverse");
+			stack[sp++] = node.offset;
+			stack[sp++] = idx + 1;
+		}
+	}
+
+	if (best < 0) return IntersectionResult();
+	return IntersectionResult(t_best, best);
+}
+
+/* Mesh implementation */
+Mesh::~Mesh() {}
+
+Mesh::Mesh(std::shared_ptr<const MeshData> d, const Material &mat) :
+	ShadableObject(mat), data(d) {}
+
+// copies share the (immutable) triangle data
+Mesh::Mesh(const Mesh &m) :
+	ShadableObject(m.material), data(m.data) {}
+
+SceneObject *Mesh::makeCopy() 		{ return new Mesh(*this); }
+SceneObject *Mesh::makeCopy() const 	{ return new Mesh(*this); }
+
+std::string Mesh::tag() 	{ return "Mesh"; }
+std::string Mesh::tag() const 	{ return "Mesh"; }
+
+BoundingBox Mesh::getBoundBox() 	{ return data->bounds(); }
+BoundingBox Mesh::getBoundBox() const 	{ return data->bounds(); }
+
+IntersectionResult Mesh::intersects(const Ray &ray) const {
+	return data->intersect(ray, MESH_EPS);
+}
+
+IntersectionResult Mesh::intersects(const Ray &ray) {
+	return const_cast<const Mesh *>(this)->intersects(ray);
+}
+
+// a mesh has no single normal, we need to know which triangle was hit
+vec3 Mesh::surfaceNormal(const vec3 &) {
+	throw GeometryException("Cannot get the normal of a mesh without a triangle");
+}
+
+vec3 Mesh::surfaceNormal(const vec3 &) const {
+	throw GeometryException("Cannot get the normal of a mesh without a triangle");
+}
+
+vec3 Mesh::surfaceNormalAt(const vec3 &, const IntersectionResult &hit) const {
+	return data->triangleNormal(static_cast<uint32_t>(hit.primitive));
+}
+
+const MeshData &Mesh::meshData() const { return *data; }
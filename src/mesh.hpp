@@ -0,0 +1,108 @@
+/* mesh.hpp
+ *
+ * triangle meshes
+ *
+ * a Mesh is a single scene object made up of many triangles. rather
+ * than being one SceneObject each, the triangles live in flat arrays
+ * with a flattened bounding volume hierarchy over them. this keeps them
+ * compact, and means the arrays can be used straight out of a
+ * memory-mapped scene file (see scenefile.hpp) without a parse step.
+ */
+
+#ifndef MESH_HEADER_WARRIOR
+#define MESH_HEADER_WARRIOR
+
+#include <vector>
+#include <memory>
+#include <stdint.h>
+
+#include "geometry.hpp"
+#include "mappedfile.hpp"
+
+// these structs are written to disk as-is, so they must stay plain
+// old data with a fixed layout
+struct MeshVertex {
+	float x, y, z;
+};
+
+struct MeshTriangle {
+	uint32_t v[3];
+};
+
+// a node in the flattened hierarchy
+//
+// interior nodes (count == 0) have their first child immediately after
+// them and their second child at `offset`. leaves cover the triangles
+// [offset, offset + count)
+struct MeshNode {
+	float bb_min[3];
+	float bb_max[3];
+	uint32_t offset;
+	uint32_t count;
+};
+
+class MeshData {
+private:
+	std::vector<MeshVertex> owned_vertices;
+	std::vector<MeshTriangle> owned_triangles;
+	std::vector<MeshNode> owned_nodes;
+	std::shared_ptr<const MappedFile> backing;
+
+	void buildHierarchy();
+
+public:
+	const MeshVertex *vertices;
+	const MeshTriangle *triangles;
+	const MeshNode *nodes;
+	uint32_t num_vertices;
+	uint32_t num_triangles;
+	uint32_t num_nodes;
+
+	// takes the contents of the vectors and builds a hierarchy over them
+	MeshData(std::vector<MeshVertex> &verts, std::vector<MeshTriangle> &tris);
+
+	// uses arrays inside a mapped file in place. if `nodes` is NULL
+	// the triangles are copied out so that a hierarchy can be built.
+	// throws GeometryException if the arrays don't hold together (see
+	// validate())
+	MeshData(std::shared_ptr<const MappedFile> file,
+		 const MeshVertex *verts, uint32_t n_verts,
+		 const MeshTriangle *tris, uint32_t n_tris,
+		 const MeshNode *nodes, uint32_t n_nodes);
+
+	// checks that every triangle's vertices and every node's children
+	// and triangles are in range, and that the hierarchy only ever points
+	// forwards and is no deeper than intersect() can walk. throws
+	// GeometryException if not
+	void validate() const;
+
+	vec3 vertex(uint32_t i) const;
+	vec3 triangleNormal(uint32_t tri) const;
+	BoundingBox bounds() const;
+	IntersectionResult intersect(const Ray &r, double t_min) const;
+};
+
+class Mesh : public ShadableObject {
+private:
+	std::shared_ptr<const MeshData> data;
+
+public:
+	~Mesh();
+	Mesh(std::shared_ptr<const MeshData> d, const Material &mat);
+	Mesh(const Mesh &m);
+	IntersectionResult intersects(const Ray &r);
+	IntersectionResult intersects(const Ray &r) const;
+	SceneObject *makeCopy();
+	SceneObject *makeCopy() const;
+	vec3 surfaceNormal(const vec3 &point);
+	vec3 surfaceNormal(const vec3 &point) const;
+	vec3 surfaceNormalAt(const vec3 &point, const IntersectionResult &hit) const;
+	std::string tag();
+	std::string tag() const;
+	BoundingBox getBoundBox();
+	BoundingBox getBoundBox() const;
+
+	const MeshData &meshData() const;
+};
+
+#endif
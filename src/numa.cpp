@@ -0,0 +1,125 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "numa.hpp"
+#include "sceneparser.hpp"
+
+/* NumaTopology implementation */
+
+int NumaTopology::nodes() const {
+	return static_cast<int>(cpus.size());
+}
+
+// a cpulist is ranges and single CPUs separated by commas: "0-7,16-23"
+static std::vector<int> parseCpuList(const std::string &list) {
+	std::vector<int> out;
+	std::istringstream in(list);
+	std::string range;
+	while (std::getline(in, range, ',')) {
+		int lo, hi;
+		const int got = sscanf(range.c_str(), "%d-%d", &lo, &hi);
+		if (got < 1)
+			continue;
+		if (got == 1)
+			hi = lo;
+		for (int c = lo; c <= hi; c++)
+			out.push_back(c);
+	}
+	return out;
+}
+
+NumaTopology NumaTopology::detect() {
+	NumaTopology topo;
+
+	// node numbers can have gaps, so go on a little past the last one
+	for (int node = 0, missing = 0; missing < 8; node++) {
+		std::ifstream in(("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist").c_str());
+		std::string list;
+		if (!in || !std::getline(in, list)) {
+			missing++;
+			continue;
+		}
+		missing = 0;
+		std::vector<int> cpus = parseCpuList(list);
+		if (!cpus.empty())
+			topo.cpus.push_back(cpus);
+	}
+
+	if (topo.cpus.empty()) {
+		const int n = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+		topo.cpus.push_back(std::vector<int>());
+		for (int c = 0; c < n; c++)
+			topo.cpus[0].push_back(c);
+	}
+	return topo;
+}
+
+static thread_local int this_thread_node = -1;
+
+bool pinThreadToNode(const NumaTopology &topo, int node) {
+	this_thread_node = node;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	const std::vector<int> &cpus = topo.cpus[node];
+	for (size_t c = 0; c < cpus.size(); c++)
+		if (cpus[c] < CPU_SETSIZE)
+			CPU_SET(cpus[c], &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+int numaNodeOfThisThread() {
+	return this_thread_node;
+}
+
+/* SceneReplicas implementation */
+
+SceneReplicas::SceneReplicas(const std::string &scene_path, const World &like, const NumaTopology &topo) {
+	worlds.resize(topo.nodes());
+
+	// one node at a time, so a failed load throws from here
+	for (int node = 0; node < topo.nodes(); node++) {
+		std::string error;
+		std::thread loader([&, node] {
+			pinThreadToNode(topo, node);
+			try {
+				World *w = new World(like.viewport, like.camera().position, like.bg_colour);
+				worlds[node].reset(w);
+				loadScene(scene_path, *w);
+
+				// anything that was changed after loading
+				w->shadows_enabled = like.shadows_enabled;
+				w->reflections_enabled = like.reflections_enabled;
+				w->ss_level = like.ss_level;
+				w->light_samples = like.light_samples;
+				w->light_cutoff = like.light_cutoff;
+				w->max_depth = like.max_depth;
+				w->roulette_depth = like.roulette_depth;
+				w->min_throughput = like.min_throughput;
+				w->accelerator = like.accelerator;
+				w->lazy_build = like.lazy_build;
+
+				w->numberObjects();
+				w->buildHierarchy();
+			}
+			catch (const std::runtime_error &e) {
+				error = e.what();
+			}
+		});
+		loader.join();
+		if (!error.empty())
+			throw std::runtime_error(error);
+	}
+}
+
+std::vector<World *> SceneReplicas::byNode() const {
+	std::vector<World *> out;
+	for (size_t n = 0; n < worlds.size(); n++)
+		out.push_back(worlds[n].get());
+	return out;
+}
@@ -0,0 +1,64 @@
+/* numa.hpp
+ *
+ * placing render workers and their memory on multi-socket machines
+ *
+ * on a machine with more than one NUMA node, memory belongs to one node
+ * and every other node reaches it more slowly. linux puts a page on the
+ * node of the thread that first touches it, so the way to keep memory
+ * local is to pin each thread to a node and have it touch the memory it
+ * will use before anything else does. a RenderEngine asked to (see
+ * renderer.hpp) pins its workers, spread over the nodes in proportion to
+ * their CPUs, and hands each node a contiguous run of each job's tiles,
+ * so that each node first-touches its own part of the image.
+ *
+ * the scene is only ever read while rendering, so it can be copied onto
+ * every node: SceneReplicas loads it once per node, on a thread pinned
+ * there, and a RenderJob given them renders each tile with the copy on
+ * the node rendering it.
+ *
+ * the topology is read from /sys/devices/system/node. anywhere that
+ * isn't there, it's one node with every CPU, and nothing changes.
+ */
+
+#ifndef NUMA_HEADER_WARRIOR
+#define NUMA_HEADER_WARRIOR
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "world.hpp"
+
+struct NumaTopology {
+	std::vector<std::vector<int> > cpus;	// by node
+
+	int nodes() const;
+
+	// the machine's nodes, leaving out any without CPUs
+	static NumaTopology detect();
+};
+
+// pins the calling thread to the CPUs of `node`, returning false if it
+// can't be. numaNodeOfThisThread is `node` from then on either way
+bool pinThreadToNode(const NumaTopology &topo, int node);
+
+// the node the calling thread was pinned to, or -1
+int numaNodeOfThisThread();
+
+/* SceneReplicas
+ *
+ * a copy of a scene on every node, each loaded by a thread pinned there
+ * (so that first touch puts all of it on that node), and set up like
+ * `like` afterwards */
+class SceneReplicas {
+private:
+	std::vector<std::unique_ptr<World> > worlds;
+
+public:
+	SceneReplicas(const std::string &scene_path, const World &like, const NumaTopology &topo);
+
+	// for RenderJob::replicas
+	std::vector<World *> byNode() const;
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include "pagecache.hpp"
+
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+PageCacheStats::PageCacheStats() :
+	hits(0), misses(0), evictions(0), bytes_read(0), resident_bytes(0), peak_bytes(0) {}
+
+double PageCacheStats::hitRate() const {
+	uint64_t total = hits + misses;
+	return total == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(total);
+}
+
+PageCache::PageCache(size_t budget_bytes) : budget(budget_bytes) {}
+
+size_t PageCache::budgetBytes() const { return budget; }
+
+// drops the mapping's own copy of the pages we've just read, so that
+// the only resident copy is the one the cache is accounting for
+static void releaseMapping(const MappedFile &file, uint64_t offset, size_t bytes) {
+	static const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+	uint64_t start = (offset + page - 1) / page * page;
+	uint64_t end = (offset + bytes) / page * page;
+	if (end > start)
+		madvise(const_cast<char *>(file.data()) + start, end - start, MADV_DONTNEED);
+}
+
+PageBlockRef PageCache::fetch(const MappedFile &file, uint64_t offset, size_t bytes) {
+	Key key(&file, offset);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		std::map<Key, Entry>::iterator it = entries.find(key);
+		if (it != entries.end()) {
+			counters.hits++;
+			lru.splice(lru.begin(), lru, it->second.lru_pos);
+			return it->second.block;
+		}
+	}
+
+	// read outside the lock so other threads can carry on with
+	// resident blocks while we wait on the disk
+	std::shared_ptr<PageBlock> block(new PageBlock());
+	block->bytes.resize(bytes);
+	memcpy(&block->bytes[0], file.data() + offset, bytes);
+	releaseMapping(file, offset, bytes);
+
+	std::lock_guard<std::mutex> guard(lock);
+	counters.misses++;
+	counters.bytes_read += bytes;
+
+	// someone else may have read the same block in the meantime
+	std::map<Key, Entry>::iterator it = entries.find(key);
+	if (it != entries.end()) {
+		lru.splice(lru.begin(), lru, it->second.lru_pos);
+		return it->second.block;
+	}
+
+	lru.push_front(key);
+	Entry &e = entries[key];
+	e.block = block;
+	e.lru_pos = lru.begin();
+	counters.resident_bytes += bytes;
+	if (counters.resident_bytes > counters.peak_bytes)
+		counters.peak_bytes = counters.resident_bytes;
+
+	evictOverBudget();
+	return block;
+}
+
+// called with the lock held. we never evict the block we just added,
+// so a budget smaller than one block still works (just badly)
+void PageCache::evictOverBudget() {
+	while (counters.resident_bytes > budget && lru.size() > 1) {
+		Key victim = lru.back();
+		lru.pop_back();
+		std::map<Key, Entry>::iterator it = entries.find(victim);
+		counters.resident_bytes -= it->second.block->bytes.size();
+		counters.evictions++;
+		entries.erase(it);
+	}
+}
+
+PageCacheStats PageCache::stats() const {
+	std::lock_guard<std::mutex> guard(lock);
+	return counters;
+}
+
+void PageCache::summarise(std::ostream &os) const {
+	PageCacheStats s = stats();
+	const double mb = 1024.0 * 1024.0;
+	os << "--> paging (geometry and textures):" << std::endl;
+	os << "\tcache budget      : " << budget / mb << " MB" << std::endl;
+	os << "\tblock fetches     : " << s.hits + s.misses << std::endl;
+	os << "\thit rate          : " << 100.0 * s.hitRate() << "%" << std::endl;
+	os << "\tblocks read       : " << s.misses << " (" << s.bytes_read / mb << " MB)" << std::endl;
+	os << "\tevictions         : " << s.evictions << std::endl;
+	os << "\tpeak resident     : " << s.peak_bytes / mb << " MB" << std::endl;
+}
@@ -0,0 +1,75 @@
+/* pagecache.hpp
+ *
+ * a bounded cache of blocks read out of memory-mapped files
+ *
+ * used for geometry (and anything else) that is too big to keep
+ * resident: blocks are copied out of the mapping on first use, and the
+ * least recently used ones are dropped once the cache is over budget.
+ * the cache is shared between rendering threads
+ */
+
+#ifndef PAGECACHE_HEADER_WARRIOR
+#define PAGECACHE_HEADER_WARRIOR
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <iostream>
+#include <stdint.h>
+
+#include "mappedfile.hpp"
+
+// a block stays alive for as long as someone holds on to it, even if
+// the cache has already evicted it
+struct PageBlock {
+	std::vector<char> bytes;
+
+	const char *data() const { return &bytes[0]; }
+};
+
+typedef std::shared_ptr<const PageBlock> PageBlockRef;
+
+struct PageCacheStats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t bytes_read;
+	uint64_t resident_bytes;
+	uint64_t peak_bytes;
+
+	PageCacheStats();
+	double hitRate() const;
+};
+
+class PageCache {
+private:
+	typedef std::pair<const MappedFile *, uint64_t> Key;
+
+	struct Entry {
+		PageBlockRef block;
+		std::list<Key>::iterator lru_pos;
+	};
+
+	size_t budget;
+	mutable std::mutex lock;
+	std::map<Key, Entry> entries;
+	std::list<Key> lru;		// most recently used at the front
+	PageCacheStats counters;
+
+	void evictOverBudget();
+
+public:
+	PageCache(size_t budget_bytes);
+
+	// returns the `bytes` bytes at `offset` in `file`, reading them
+	// in if they aren't resident
+	PageBlockRef fetch(const MappedFile &file, uint64_t offset, size_t bytes);
+
+	size_t budgetBytes() const;
+	PageCacheStats stats() const;
+	void summarise(std::ostream &os) const;
+};
+
+#endif
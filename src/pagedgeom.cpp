@@ -0,0 +1,505 @@
+#include "pagedgeom.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <cfloat>
+#include <climits>
+#include <cstring>
+#include <cstdlib>
+
+#include "scenefile.hpp"
+
+#define PAGED_EPS 		0.00001
+#define PAGED_LEAF_SIZE 	4
+#define PAGED_MAX_DEPTH 	64
+#define PAGED_STACK_DEPTH 	(PAGED_MAX_DEPTH + 2)
+
+/* PagedSphereFile
+ *
+ * the parts of a paged sphere file that stay resident: the header,
+ * materials, the top level hierarchy and the block table */
+struct PagedSphereFile {
+	std::string path;
+	MappedFile mapping;
+	std::vector<PagedNode> top;
+	std::vector<PagedBlockRecord> blocks;
+	std::vector<Material> materials;
+	uint64_t num_spheres;
+
+	// whether each block's hierarchy has been checked yet
+	std::unique_ptr<std::atomic<bool>[]> checked;
+
+	PagedSphereFile(const std::string &path);
+};
+
+static void pagedFail(const std::string &path, const std::string &msg) {
+	throw SceneFileException(path, msg);
+}
+
+// the same checks as MeshData::validate, for the top level hierarchy
+// (whose leaves each point at one of `leaves` blocks) or a block's own
+// (whose leaves cover some of its `leaves` spheres)
+static void checkHierarchy(const std::string &path, const std::string &what,
+		const PagedNode *nodes, uint32_t num_nodes, uint64_t leaves, bool top) {
+	if (num_nodes == 0)
+		pagedFail(path, what + " hierarchy has no nodes");
+
+	std::vector<int> depth(num_nodes, -1);
+	depth[0] = 0;
+	for (uint32_t i = 0; i < num_nodes; i++) {
+		if (depth[i] < 0)
+			continue;
+		const PagedNode &node = nodes[i];
+		if (node.count > 0) {
+			if (top ? node.count != 1 || node.offset >= leaves
+				: static_cast<uint64_t>(node.offset) + node.count > leaves)
+				pagedFail(path, what + " node " + std::to_string(i) + " is out of range");
+			continue;
+		}
+		if (i + 1 >= num_nodes || node.offset <= i + 1 || node.offset >= num_nodes)
+			pagedFail(path, what + " node " + std::to_string(i) + " has a child out of range");
+		if (depth[i] + 1 > PAGED_MAX_DEPTH)
+			pagedFail(path, what + " hierarchy is deeper than " + std::to_string(PAGED_MAX_DEPTH) + " levels");
+		depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+		depth[node.offset] = std::max(depth[node.offset], depth[i] + 1);
+	}
+}
+
+PagedSphereFile::PagedSphereFile(const std::string &p) : path(p), mapping(p) {
+	if (mapping.size() < sizeof(PagedFileHeader))
+		pagedFail(path, "not a paged sphere file");
+
+	PagedFileHeader h;
+	memcpy(&h, mapping.data(), sizeof(h));
+	if (memcmp(h.magic, PAGED_FILE_MAGIC, sizeof(PAGED_FILE_MAGIC)) != 0)
+		pagedFail(path, "not a paged sphere file");
+	if (h.version != PAGED_FILE_VERSION)
+		pagedFail(path, "unsupported paged sphere file version " + std::to_string(h.version));
+	if (h.file_size != mapping.size()
+	    || !mapping.contains(h.materials_offset, h.num_materials * sizeof(SceneMaterialRecord))
+	    || !mapping.contains(h.top_nodes_offset, h.num_top_nodes * sizeof(PagedNode))
+	    || !mapping.contains(h.blocks_offset, h.num_blocks * sizeof(PagedBlockRecord))
+	    || h.num_top_nodes == 0)
+		pagedFail(path, "truncated paged sphere file");
+
+	num_spheres = h.num_spheres;
+
+	const SceneMaterialRecord *mats = reinterpret_cast<const SceneMaterialRecord *>(mapping.data() + h.materials_offset);
+	for (uint32_t i = 0; i < h.num_materials; i++) {
+		const SceneMaterialRecord &r = mats[i];
+		Material m(RGBVec(r.colour[0], r.colour[1], r.colour[2]),
+			RGBVec(r.specular_colour[0], r.specular_colour[1], r.specular_colour[2]),
+			r.specularity, r.ambient, r.reflective != 0);
+		m.diffuse = r.diffuse != 0;
+		materials.push_back(m);
+	}
+	if (materials.empty())
+		materials.push_back(Material(RGBVec(0.7, 0.7, 0.7), RGBVec(), 0.0, 0.0, false));
+
+	const PagedNode *nodes = reinterpret_cast<const PagedNode *>(mapping.data() + h.top_nodes_offset);
+	top.assign(nodes, nodes + h.num_top_nodes);
+
+	const PagedBlockRecord *recs = reinterpret_cast<const PagedBlockRecord *>(mapping.data() + h.blocks_offset);
+	blocks.assign(recs, recs + h.num_blocks);
+
+	if (blocks.empty())
+		pagedFail(path, "no blocks");
+	checkHierarchy(path, "top level", &top[0], h.num_top_nodes, blocks.size(), true);
+
+	// the blocks hold the spheres in order, with no gaps, so a hit's
+	// index is its block's first sphere plus where it is in the block.
+	// only the table is read here: reading the blocks' hierarchies would
+	// page in a good part of the file
+	uint64_t spheres = 0;
+	for (size_t i = 0; i < blocks.size(); i++) {
+		const PagedBlockRecord &b = blocks[i];
+		if (b.offset % PAGED_BLOCK_ALIGN != 0
+		    || !mapping.contains(b.offset, b.bytes)
+		    || b.bytes != b.num_nodes * sizeof(PagedNode) + b.num_spheres * sizeof(PagedSphereRecord)
+		    || b.first_sphere != spheres || b.num_spheres == 0)
+			pagedFail(path, "block " + std::to_string(i) + " is corrupt");
+		spheres += b.num_spheres;
+	}
+	if (spheres != num_spheres || num_spheres > static_cast<uint64_t>(INT_MAX))
+		pagedFail(path, "sphere count doesn't match its blocks");
+
+	checked.reset(new std::atomic<bool>[blocks.size()]);
+	for (size_t i = 0; i < blocks.size(); i++)
+		checked[i].store(false, std::memory_order_relaxed);
+}
+
+/* PagedSpheres implementation */
+
+PagedSpheres::~PagedSpheres() {}
+
+PagedSpheres::PagedSpheres(const std::string &path, std::shared_ptr<PageCache> c) :
+	ShadableObject(Material(RGBVec())), cache(c) {
+	file.reset(new PagedSphereFile(path));
+	material = file->materials[0];
+}
+
+// copies share the resident part of the file and the cache
+PagedSpheres::PagedSpheres(const PagedSpheres &p) :
+	ShadableObject(p.material), file(p.file), cache(p.cache) {}
+
+SceneObject *PagedSpheres::makeCopy() 		{ return new PagedSpheres(*this); }
+SceneObject *PagedSpheres::makeCopy() const 	{ return new PagedSpheres(*this); }
+
+std::string PagedSpheres::tag() 	{ return "PagedSpheres"; }
+std::string PagedSpheres::tag() const 	{ return "PagedSpheres"; }
+
+uint64_t PagedSpheres::sphereCount() const { return file->num_spheres; }
+
+BoundingBox PagedSpheres::getBoundBox() const {
+	const PagedNode &root = file->top[0];
+	BoundingBox bb;
+	bb.x_min = root.bb_min[0];
+	bb.y_min = root.bb_min[1];
+	bb.z_min = root.bb_min[2];
+	bb.x_max = root.bb_max[0];
+	bb.y_max = root.bb_max[1];
+	bb.z_max = root.bb_max[2];
+	return bb;
+}
+
+BoundingBox PagedSpheres::getBoundBox() {
+	return const_cast<const PagedSpheres *>(this)->getBoundBox();
+}
+
+static inline const PagedNode *blockNodes(const PageBlock &blk) {
+	return reinterpret_cast<const PagedNode *>(blk.data());
+}
+
+// the first time a block is read in, its hierarchy is checked (on the
+// cache's copy), so that traversal never has to. two threads may both
+// check it, which does no harm
+PageBlockRef PagedSpheres::fetchBlock(uint32_t block) const {
+	const PagedBlockRecord &b = file->blocks[block];
+	PageBlockRef blk = cache->fetch(file->mapping, b.offset, b.bytes);
+	if (!file->checked[block].load(std::memory_order_acquire)) {
+		checkHierarchy(file->path, "block " + std::to_string(block), blockNodes(*blk), b.num_nodes, b.num_spheres, false);
+		file->checked[block].store(true, std::memory_order_release);
+	}
+	return blk;
+}
+
+static inline const PagedSphereRecord *blockSpheres(const PageBlock &blk, uint32_t num_nodes) {
+	return reinterpret_cast<const PagedSphereRecord *>(blk.data() + num_nodes * sizeof(PagedNode));
+}
+
+// slab test, returns the entry distance or a negative number on a miss
+static inline double pagedEntry(const PagedNode &node, const double o[3], const double inv_d[3], double t_best) {
+	double t0 = 0.0, t1 = t_best;
+	for (int a = 0; a < 3; a++) {
+		double near = (node.bb_min[a] - o[a]) * inv_d[a];
+		double far = (node.bb_max[a] - o[a]) * inv_d[a];
+		if (near > far) std::swap(near, far);
+		if (near > t0) t0 = near;
+		if (far < t1) t1 = far;
+		if (t0 > t1) return -1.0;
+	}
+	return t0;
+}
+
+IntersectionResult PagedSpheres::intersects(const Ray &ray) const {
+	const vec3 &e = ray.origin;
+	const vec3 &d = ray.direction;
+	const double o[3] = { e.x(), e.y(), e.z() };
+	const double inv_d[3] = { 1.0 / d.x(), 1.0 / d.y(), 1.0 / d.z() };
+	const double d_dot_d = d.dot(d);
+
+	double t_best = DBL_MAX;
+	int64_t best = -1;
+	PagedSphereRecord best_sphere;
+
+	// walk the top level front to back, so that blocks behind the
+	// closest hit so far never get fetched
+	uint32_t stack[PAGED_STACK_DEPTH];
+	int sp = 0;
+	stack[sp++] = 0;
+
+	const std::vector<PagedNode> &top = file->top;
+
+	while (sp > 0) {
+		uint32_t idx = stack[--sp];
+		const PagedNode &node = top[idx];
+		if (pagedEntry(node, o, inv_d, t_best) < 0.0) continue;
+
+		if (node.count == 0) {
+			double t_left = pagedEntry(top[idx + 1], o, inv_d, t_best);
+			double t_right = pagedEntry(top[node.offset], o, inv_d, t_best);
+			// the top level was checked to be shallow enough when the
+			// file was opened, and each block when it was fetched
+			if (sp + 2 > PAGED_STACK_DEPTH)
+				throw GeometryException("paged hierarchy too deep to traverse");
+			if (t_left >= 0.0 && t_right >= 0.0) {
+				bool left_first = t_left <= t_right;
+				stack[sp++] = left_first ? node.offset : idx + 1;
+				stack[sp++] = left_first ? idx + 1 : node.offset;
+			}
+			else if (t_left >= 0.0) stack[sp++] = idx + 1;
+			else if (t_right >= 0.0) stack[sp++] = node.offset;
+			continue;
+		}
+
+		const PagedBlockRecord &rec = file->blocks[node.offset];
+		PageBlockRef blk = fetchBlock(node.offset);
+		const PagedNode *local = blockNodes(*blk);
+		const PagedSphereRecord *spheres = blockSpheres(*blk, rec.num_nodes);
+
+		uint32_t lstack[PAGED_STACK_DEPTH];
+		int lsp = 0;
+		lstack[lsp++] = 0;
+		while (lsp > 0) {
+			uint32_t li = lstack[--lsp];
+			const PagedNode &ln = local[li];
+			if (pagedEntry(ln, o, inv_d, t_best) < 0.0) continue;
+
+			if (ln.count == 0) {
+				if (lsp + 2 > PAGED_STACK_DEPTH)
+					throw GeometryException("paged block hierarchy too deep to traverse");
+				lstack[lsp++] = ln.offset;
+				lstack[lsp++] = li + 1;
+				continue;
+			}
+
+			for (uint32_t s = ln.offset; s < ln.offset + ln.count; s++) {
+				// same as Sphere::intersects
+				const PagedSphereRecord &sph = spheres[s];
+				vec3 ec(o[0] - sph.centre[0], o[1] - sph.centre[1], o[2] - sph.centre[2]);
+				double b = d.dot(ec);
+				double four_ac = d_dot_d * (ec.dot(ec) - static_cast<double>(sph.radius) * sph.radius);
+				double disc = b*b - four_ac;
+				if (disc < 0.0) continue;
+				double t = (-b - sqrt(disc)) / d_dot_d;
+				if (t > PAGED_EPS && t < t_best) {
+					t_best = t;
+					best = static_cast<int64_t>(rec.first_sphere + s);
+					best_sphere = sph;
+				}
+			}
+		}
+	}
+
+	if (best < 0) return IntersectionResult();
+
+	// the block may well be evicted by the time the hit is shaded
+	IntersectionResult hit(t_best, static_cast<int>(best));
+	memcpy(hit.centre, best_sphere.centre, sizeof(hit.centre));
+	hit.material = static_cast<int>(best_sphere.material < file->materials.size() ? best_sphere.material : 0);
+	return hit;
+}
+
+IntersectionResult PagedSpheres::intersects(const Ray &ray) {
+	return const_cast<const PagedSpheres *>(this)->intersects(ray);
+}
+
+vec3 PagedSpheres::surfaceNormal(const vec3 &) {
+	throw GeometryException("Cannot get the normal of a paged sphere without its index");
+}
+
+vec3 PagedSpheres::surfaceNormal(const vec3 &) const {
+	throw GeometryException("Cannot get the normal of a paged sphere without its index");
+}
+
+vec3 PagedSpheres::surfaceNormalAt(const vec3 &p, const IntersectionResult &hit) const {
+	if (hit.material < 0)
+		throw GeometryException("Cannot get the normal of a paged sphere without its hit");
+	return (p - vec3(hit.centre[0], hit.centre[1], hit.centre[2])).normalised();
+}
+
+const Material &PagedSpheres::materialAt(const IntersectionResult &hit) const {
+	if (hit.material < 0)
+		throw GeometryException("Cannot get the material of a paged sphere without its hit");
+	return file->materials[hit.material];
+}
+
+/* packing */
+
+namespace {
+
+struct PackBox {
+	float lo[3];
+	float hi[3];
+
+	PackBox() {
+		for (int a = 0; a < 3; a++) {
+			lo[a] = FLT_MAX;
+			hi[a] = -FLT_MAX;
+		}
+	}
+
+	void grow(const PagedSphereRecord &s) {
+		for (int a = 0; a < 3; a++) {
+			if (s.centre[a] - s.radius < lo[a]) lo[a] = s.centre[a] - s.radius;
+			if (s.centre[a] + s.radius > hi[a]) hi[a] = s.centre[a] + s.radius;
+		}
+	}
+};
+
+struct BlockRange {
+	size_t begin;
+	size_t end;
+};
+
+// median split hierarchy over spheres[begin, end), laid out depth first.
+// if `blocks` is non-NULL, leaves become blocks of up to leaf_size
+// spheres, otherwise leaves index the spheres relative to `base`
+void buildPacked(std::vector<PagedSphereRecord> &spheres, size_t base, size_t begin, size_t end,
+		 size_t leaf_size, std::vector<PagedNode> &nodes, std::vector<BlockRange> *blocks) {
+	PackBox box;
+	for (size_t i = begin; i < end; i++) box.grow(spheres[i]);
+
+	uint32_t index = static_cast<uint32_t>(nodes.size());
+	nodes.push_back(PagedNode());
+	memcpy(nodes[index].bb_min, box.lo, sizeof(box.lo));
+	memcpy(nodes[index].bb_max, box.hi, sizeof(box.hi));
+
+	if (end - begin <= leaf_size) {
+		if (blocks != NULL) {
+			BlockRange r = { begin, end };
+			nodes[index].offset = static_cast<uint32_t>(blocks->size());
+			nodes[index].count = 1;
+			blocks->push_back(r);
+		}
+		else {
+			nodes[index].offset = static_cast<uint32_t>(begin - base);
+			nodes[index].count = static_cast<uint32_t>(end - begin);
+		}
+		return;
+	}
+
+	int axis = 0;
+	for (int a = 1; a < 3; a++)
+		if (box.hi[a] - box.lo[a] > box.hi[axis] - box.lo[axis]) axis = a;
+
+	// for blocks, split on a multiple of the block size so they come out full
+	size_t n = end - begin;
+	size_t mid = begin + n / 2;
+	if (blocks != NULL && n > leaf_size)
+		mid = begin + std::max<size_t>(1, (n / leaf_size + 1) / 2) * leaf_size;
+
+	std::nth_element(spheres.begin() + begin, spheres.begin() + mid, spheres.begin() + end,
+		[axis](const PagedSphereRecord &a, const PagedSphereRecord &b) { return a.centre[axis] < b.centre[axis]; });
+
+	buildPacked(spheres, base, begin, mid, leaf_size, nodes, blocks);
+	uint32_t right = static_cast<uint32_t>(nodes.size());
+	buildPacked(spheres, base, mid, end, leaf_size, nodes, blocks);
+	nodes[index].offset = right;
+	nodes[index].count = 0;
+}
+
+uint64_t alignTo(uint64_t x, uint64_t a) {
+	return (x + a - 1) / a * a;
+}
+
+void writeAt(std::ofstream &out, uint64_t &pos, uint64_t target, const void *data, size_t bytes) {
+	static const char zeros[PAGED_BLOCK_ALIGN] = { 0 };
+	out.write(zeros, static_cast<std::streamsize>(target - pos));
+	out.write(static_cast<const char *>(data), static_cast<std::streamsize>(bytes));
+	pos = target + bytes;
+}
+
+}
+
+void packSpheres(const std::string &in_path, const std::string &out_path, uint32_t block_spheres) {
+	std::ifstream in(in_path.c_str());
+	if (!in)
+		throw SceneFileException(in_path, "cannot open");
+
+	if (block_spheres < PAGED_LEAF_SIZE) block_spheres = PAGED_LEAF_SIZE;
+	if (block_spheres > PAGED_MAX_BLOCK_SPHERES) block_spheres = PAGED_MAX_BLOCK_SPHERES;
+
+	std::vector<PagedSphereRecord> spheres;
+	std::string line;
+	size_t line_no = 0;
+	while (std::getline(in, line)) {
+		line_no++;
+		const char *c = line.c_str();
+		while (*c == ' ' || *c == '\t') c++;
+		if (*c == '\0' || *c == '#' || *c == '\r') continue;
+
+		char *next;
+		PagedSphereRecord s;
+		s.centre[0] = strtof(c, &next);
+		s.centre[1] = strtof(next, &next);
+		s.centre[2] = strtof(next, &next);
+		char *radius_start = next;
+		s.radius = strtof(radius_start, &next);
+		if (next == radius_start || s.radius <= 0.0f)
+			throw SceneFileException(in_path, "expected x y z radius on line " + std::to_string(line_no));
+		s.material = static_cast<uint32_t>(strtoul(next, NULL, 10));
+		spheres.push_back(s);
+	}
+
+	if (spheres.empty())
+		throw SceneFileException(in_path, "no spheres");
+	if (spheres.size() > static_cast<size_t>(INT_MAX))
+		throw SceneFileException(in_path, "too many spheres for one paged set");
+
+	// a small palette in the style of the demo scene
+	std::vector<SceneMaterialRecord> palette;
+	for (int m = 0; m < 8; m++) {
+		SceneMaterialRecord r;
+		memset(&r, 0, sizeof(r));
+		r.colour[0] = (1 + (m & 1)) / 2.0;
+		r.colour[1] = (1 + ((m >> 1) & 1)) / 2.0;
+		r.colour[2] = (1 + ((m >> 2) & 1)) / 2.0;
+		r.specular_colour[0] = r.specular_colour[1] = r.specular_colour[2] = 0.2;
+		r.diffuse = 1;
+		palette.push_back(r);
+	}
+	for (size_t i = 0; i < spheres.size(); i++)
+		spheres[i].material %= palette.size();
+
+	std::vector<PagedNode> top;
+	std::vector<BlockRange> ranges;
+	buildPacked(spheres, 0, 0, spheres.size(), block_spheres, top, &ranges);
+
+	PagedFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PAGED_FILE_MAGIC, sizeof(PAGED_FILE_MAGIC));
+	header.version = PAGED_FILE_VERSION;
+	header.num_materials = static_cast<uint32_t>(palette.size());
+	header.num_spheres = spheres.size();
+	header.num_blocks = static_cast<uint32_t>(ranges.size());
+	header.num_top_nodes = static_cast<uint32_t>(top.size());
+	header.materials_offset = alignTo(sizeof(header), 64);
+	header.top_nodes_offset = alignTo(header.materials_offset + palette.size() * sizeof(SceneMaterialRecord), 64);
+	header.blocks_offset = alignTo(header.top_nodes_offset + top.size() * sizeof(PagedNode), 64);
+
+	// lay out the blocks, building each one's local hierarchy as we go
+	std::vector<PagedBlockRecord> recs(ranges.size());
+	std::vector<std::vector<PagedNode> > local(ranges.size());
+	uint64_t pos = header.blocks_offset + recs.size() * sizeof(PagedBlockRecord);
+	for (size_t b = 0; b < ranges.size(); b++) {
+		buildPacked(spheres, ranges[b].begin, ranges[b].begin, ranges[b].end, PAGED_LEAF_SIZE, local[b], NULL);
+		recs[b].offset = alignTo(pos, PAGED_BLOCK_ALIGN);
+		recs[b].first_sphere = ranges[b].begin;
+		recs[b].num_nodes = static_cast<uint32_t>(local[b].size());
+		recs[b].num_spheres = static_cast<uint32_t>(ranges[b].end - ranges[b].begin);
+		recs[b].bytes = static_cast<uint32_t>(recs[b].num_nodes * sizeof(PagedNode) + recs[b].num_spheres * sizeof(PagedSphereRecord));
+		recs[b].reserved = 0;
+		pos = recs[b].offset + recs[b].bytes;
+	}
+	header.file_size = pos;
+
+	std::ofstream out(out_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw SceneFileException(out_path, "cannot open for writing");
+
+	uint64_t at = 0;
+	writeAt(out, at, 0, &header, sizeof(header));
+	writeAt(out, at, header.materials_offset, &palette[0], palette.size() * sizeof(SceneMaterialRecord));
+	writeAt(out, at, header.top_nodes_offset, &top[0], top.size() * sizeof(PagedNode));
+	writeAt(out, at, header.blocks_offset, &recs[0], recs.size() * sizeof(PagedBlockRecord));
+	for (size_t b = 0; b < ranges.size(); b++) {
+		writeAt(out, at, recs[b].offset, &local[b][0], local[b].size() * sizeof(PagedNode));
+		out.write(reinterpret_cast<const char *>(&spheres[ranges[b].begin]), recs[b].num_spheres * sizeof(PagedSphereRecord));
+		at += recs[b].num_spheres * sizeof(PagedSphereRecord);
+	}
+
+	if (!out)
+		throw SceneFileException(out_path, "write failed");
+}
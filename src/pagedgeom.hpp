@@ -0,0 +1,111 @@
+/* pagedgeom.hpp
+ *
+ * out-of-core geometry: sets of spheres (e.g. point clouds) that are
+ * too large to keep in memory
+ *
+ * a paged sphere file splits the spheres into spatially coherent
+ * blocks. each block holds its own small hierarchy and its spheres, and
+ * is page aligned in the file. only the top-level hierarchy over the
+ * blocks stays resident: blocks are fetched through a bounded PageCache
+ * when a ray first reaches them. opening the file only reads the block
+ * table: each block's own hierarchy is checked the first time it's
+ * fetched.
+ */
+
+#ifndef PAGEDGEOM_HEADER_WARRIOR
+#define PAGEDGEOM_HEADER_WARRIOR
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+
+#include "geometry.hpp"
+#include "mappedfile.hpp"
+#include "pagecache.hpp"
+
+#define PAGED_FILE_MAGIC 	"TRCFPGS"
+#define PAGED_FILE_VERSION 	1
+#define PAGED_BLOCK_ALIGN 	4096
+#define PAGED_BLOCK_SPHERES 	4096	// default number of spheres per block
+#define PAGED_MAX_BLOCK_SPHERES 1048576	// the most, so a block's size fits in its record
+
+struct PagedFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_materials;
+	uint64_t num_spheres;
+	uint32_t num_blocks;
+	uint32_t num_top_nodes;
+	uint64_t materials_offset;	// SceneMaterialRecord[num_materials]
+	uint64_t top_nodes_offset;	// PagedNode[num_top_nodes]
+	uint64_t blocks_offset;		// PagedBlockRecord[num_blocks]
+	uint64_t file_size;
+};
+
+// same layout as MeshNode: interior nodes have their first child
+// straight after them and their second at `offset`. leaves of the top
+// level hierarchy point at a block, leaves inside a block cover the
+// spheres [offset, offset + count) of that block
+struct PagedNode {
+	float bb_min[3];
+	float bb_max[3];
+	uint32_t offset;
+	uint32_t count;
+};
+
+// a block is PagedNode[num_nodes] followed by PagedSphereRecord[num_spheres]
+struct PagedBlockRecord {
+	uint64_t offset;
+	uint64_t first_sphere;
+	uint32_t bytes;
+	uint32_t num_nodes;
+	uint32_t num_spheres;
+	uint32_t reserved;
+};
+
+struct PagedSphereRecord {
+	float centre[3];
+	float radius;
+	uint32_t material;
+};
+
+struct PagedSphereFile;
+
+class PagedSpheres : public ShadableObject {
+private:
+	std::shared_ptr<const PagedSphereFile> file;
+	std::shared_ptr<PageCache> cache;
+
+	PageBlockRef fetchBlock(uint32_t block) const;
+
+public:
+	~PagedSpheres();
+	PagedSpheres(const std::string &path, std::shared_ptr<PageCache> cache);
+	PagedSpheres(const PagedSpheres &);
+	IntersectionResult intersects(const Ray &r);
+	IntersectionResult intersects(const Ray &r) const;
+	SceneObject *makeCopy();
+	SceneObject *makeCopy() const;
+	vec3 surfaceNormal(const vec3 &point);
+	vec3 surfaceNormal(const vec3 &point) const;
+	// hits carry a copy of their sphere (see IntersectionResult), so
+	// shading them never has to fetch its block again
+	vec3 surfaceNormalAt(const vec3 &point, const IntersectionResult &hit) const;
+	const Material &materialAt(const IntersectionResult &hit) const;
+	std::string tag();
+	std::string tag() const;
+	BoundingBox getBoundBox();
+	BoundingBox getBoundBox() const;
+
+	uint64_t sphereCount() const;
+};
+
+// reads "x y z radius [material]" lines (e.g. a point cloud turned into
+// spheres) and writes them out as a paged sphere file. materials index a
+// built-in palette. note that the spheres are sorted in memory, so the
+// conversion needs ~20 bytes per sphere of RAM even though rendering
+// doesn't. block_spheres is clamped to what a block can hold
+void packSpheres(const std::string &in_path, const std::string &out_path, uint32_t block_spheres);
+
+#endif
@@ -0,0 +1,316 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include "perftest.hpp"
+#include "hdr.hpp"
+#include "image.hpp"
+#include "incremental.hpp"
+#include "renderer.hpp"
+#include "scenefile.hpp"
+#include "scenegen.hpp"
+#include "sceneparser.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+PerfTestOptions::PerfTestOptions() : dir("perf"), references("samples/perftest"), record(false), record_references(false),
+	runs(3), time_tolerance(0.15), min_psnr(40.0) {}
+
+namespace {
+
+struct PerfCase {
+	std::string name;
+	std::string scene;	// empty for a generated one
+	SceneGenOptions gen;
+	int width, height;
+	int ss_level;
+	bool shadows, reflections;
+};
+
+struct Baseline {
+	double seconds;
+	double rays_per_second;
+};
+
+// rt_profiler's configurations of the demo, at 500 pixels wide, then
+// generated scenes about as big as a typical one
+std::vector<PerfCase> perfCases() {
+	std::vector<PerfCase> cases;
+	for (int ss = 1; ss <= 2; ss++) {
+		for (int config = 0; config < 3; config++) {
+			PerfCase c;
+			c.shadows = config >= 1;
+			c.reflections = config >= 2;
+			c.name = "demo_ss" + std::to_string(ss) + (c.shadows ? "_s+" : "_s-") + (c.reflections ? "_r+" : "_r-");
+			c.scene = "scenes/demo.scene";
+			c.width = 500;
+			c.height = 400;
+			c.ss_level = ss;
+			cases.push_back(c);
+		}
+	}
+
+	const SceneDistribution distributions[3] = { distribution_uniform, distribution_clustered, distribution_skewed };
+	for (int d = 0; d < 3; d++) {
+		PerfCase c;
+		c.name = std::string("gen_") + distributionName(distributions[d]) + "_30k";
+		c.gen.primitives = 30000;
+		c.gen.distribution = distributions[d];
+		c.gen.meshes = d == 2 ? 0.2 : 0.0;
+		c.gen.planes = 3;
+		c.width = 320;
+		c.height = 240;
+		c.ss_level = 1;
+		c.shadows = c.reflections = true;
+		cases.push_back(c);
+	}
+	return cases;
+}
+
+// everything a case's image depends on, as it's written next to the
+// references, so that one made for different parameters isn't compared
+std::string describe(const PerfCase &c) {
+	std::ostringstream out;
+	if (c.scene.empty())
+		out << "generated " << distributionName(c.gen.distribution) << " primitives=" << c.gen.primitives << " seed=" << c.gen.seed
+			<< " reflective=" << c.gen.reflective << " meshes=" << c.gen.meshes << " lights=" << c.gen.lights << " planes=" << c.gen.planes;
+	else
+		out << "scene=" << c.scene;
+	out << " size=" << c.width << "x" << c.height << " ss=" << c.ss_level
+		<< " shadows=" << (c.shadows ? "on" : "off") << " reflections=" << (c.reflections ? "on" : "off");
+	return out.str();
+}
+
+// name and description, one scene a line
+std::map<std::string, std::string> readDescriptions(const std::string &path) {
+	std::map<std::string, std::string> out;
+	std::ifstream in(path.c_str());
+	std::string line;
+	while (std::getline(in, line)) {
+		const size_t space = line.find(' ');
+		if (space != std::string::npos)
+			out[line.substr(0, space)] = line.substr(space + 1);
+	}
+	return out;
+}
+
+// name seconds rays_per_second, one scene a line
+std::map<std::string, Baseline> readBaselines(const std::string &path) {
+	std::map<std::string, Baseline> out;
+	std::ifstream in(path.c_str());
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream words(line);
+		std::string name;
+		Baseline b;
+		if (words >> name >> b.seconds >> b.rays_per_second)
+			out[name] = b;
+	}
+	return out;
+}
+
+// PSNR over every channel, and the fraction of pixels with a channel
+// more than PERFTEST_VISIBLE_STEP out. both are rgb bytes of the same size
+void compareImages(const std::vector<unsigned char> &a, const std::vector<unsigned char> &b, double &psnr, double &visible) {
+	double sum = 0.0;
+	size_t differ = 0;
+	for (size_t k = 0; k + 2 < a.size(); k += 3) {
+		int most = 0;
+		for (int ch = 0; ch < 3; ch++) {
+			const int d = a[k + ch] - b[k + ch];
+			sum += static_cast<double>(d) * d;
+			most = std::max(most, std::abs(d));
+		}
+		if (most > PERFTEST_VISIBLE_STEP)
+			differ++;
+	}
+	const size_t pixels = a.size() / 3;
+	const double mse = sum / std::max<size_t>(1, 3 * pixels);
+	psnr = mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : INFINITY;
+	visible = static_cast<double>(differ) / std::max<size_t>(1, pixels);
+}
+
+double secondsSince(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+}
+
+bool runPerfTest(const PerfTestOptions &opts) {
+	const std::string baseline_path = opts.dir + "/baseline";
+	const std::string cases_path = opts.references + "/cases";
+	std::map<std::string, Baseline> baselines;
+	std::map<std::string, std::string> descriptions;
+	std::ofstream record_out, cases_out;
+	if (opts.record) {
+		record_out.open(baseline_path.c_str(), std::ios::out | std::ios::trunc);
+		if (!record_out)
+			throw SceneFileException(baseline_path, "cannot open for writing (does " + opts.dir + " exist?)");
+	}
+	else
+		baselines = readBaselines(baseline_path);
+	if (opts.record_references) {
+		cases_out.open(cases_path.c_str(), std::ios::out | std::ios::trunc);
+		if (!cases_out)
+			throw SceneFileException(cases_path, "cannot open for writing (does " + opts.references + " exist?)");
+	}
+	else {
+		descriptions = readDescriptions(cases_path);
+		if (descriptions.empty()) {
+			std::cout << "no reference images in " << opts.references << ": record them with `make perfreferences` first" << std::endl;
+			return false;
+		}
+	}
+
+	// timings are only worth anything against this machine's own
+	const bool timed = opts.record || !baselines.empty();
+	std::cout << "---> performance regression suite: images " << (opts.record_references ? "recorded in " : "against ") << opts.references
+		<< ", timings " << (opts.record ? "recorded in " : timed ? "against " : "not checked, as there's no ") << baseline_path << " <---" << std::endl;
+
+	// generated scenes are written out here and loaded straight back
+	const ScratchFile scratch("perftest");
+
+	RenderEngine engine;
+	std::vector<std::string> failures;
+	std::vector<PerfCase> cases = perfCases();
+	for (size_t n = 0; n < cases.size(); n++) {
+		const PerfCase &c = cases[n];
+		World world(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec());
+		if (c.scene.empty()) {
+			generateSceneFile(c.gen, scratch.path());
+			loadScene(scratch.path(), world);
+		}
+		else
+			loadScene(c.scene, world);
+		world.buildHierarchy();
+		world.shadows_enabled = c.shadows;
+		world.reflections_enabled = c.reflections;
+
+		const Viewport vp = world.viewport.resized(c.width, c.height);
+		Image img(c.width, c.height);
+
+		// a path recorder sees every camera and reflection ray
+		std::atomic<long> rays(0);
+		if (timed) {
+			RenderJob count(world, world.camera(), vp, c.ss_level, img);
+			count.tileRenderer = [&rays](RenderJob &r, const Tile &t, RenderStats &stats) {
+				PathRecorder rec;
+				for (int i = t.x0; i < t.x1; i++)
+					for (int j = t.y0; j < t.y1; j++)
+						r.world->colourForPixelAt(r.camera, r.viewport, r.ss_level, i, j, stats, &rec);
+				rays += static_cast<long>(rec.vertices.size());
+			};
+			engine.render(count);
+		}
+
+		double best = INFINITY;
+		for (int run = 0; run < (timed ? std::max(1, opts.runs) : 1); run++) {
+			RenderJob job(world, world.camera(), vp, c.ss_level, img);
+			const Clock::time_point start = Clock::now();
+			engine.render(job);
+			best = std::min(best, secondsSince(start));
+		}
+		const double rays_per_second = rays / best;
+
+		// a PPM's pixels are rows from the top, as PNGs have them
+		std::vector<char> bytes;
+		img.encodePPM(bytes);
+		const std::vector<unsigned char> rgb(bytes.end() - 3 * static_cast<size_t>(c.width) * c.height, bytes.end());
+		const std::string reference_path = opts.references + "/" + c.name + ".png";
+
+		char line[200];
+		snprintf(line, sizeof(line), "%-22s %8.1f ms", c.name.c_str(), best * 1000.0);
+		std::cout << line;
+		if (timed) {
+			snprintf(line, sizeof(line), " %8.2fM rays/s", rays_per_second / 1e6);
+			std::cout << line;
+		}
+
+		std::vector<std::string> problems;
+
+		if (opts.record_references) {
+			// one strip, so the file comes out the same whatever
+			// machine writes it
+			writePNG(rgb, c.width, c.height, 1, reference_path);
+			cases_out << c.name << " " << describe(c) << std::endl;
+		}
+		else {
+			std::map<std::string, std::string>::const_iterator desc = descriptions.find(c.name);
+			std::vector<unsigned char> reference;
+			int width = 0, height = 0;
+			if (desc == descriptions.end())
+				problems.push_back("no reference image in " + cases_path);
+			else if (desc->second != describe(c))
+				problems.push_back("the reference image is of " + desc->second + ", not " + describe(c));
+			else {
+				try {
+					readPNG(reference_path, width, height, reference);
+					if (width != c.width || height != c.height)
+						problems.push_back("the reference image is a different size");
+					else {
+						double psnr, visible;
+						compareImages(rgb, reference, psnr, visible);
+						snprintf(line, sizeof(line), "  psnr %6.1f dB, %.3f%% visibly different", psnr, visible * 100.0);
+						std::cout << line;
+						if (psnr < opts.min_psnr || visible > PERFTEST_VISIBLE_FRACTION) {
+							snprintf(line, sizeof(line), "image changed: psnr %.1f dB (at least %.1f), %.3f%% of pixels visibly different (at most %.3f%%)",
+								psnr, opts.min_psnr, visible * 100.0, PERFTEST_VISIBLE_FRACTION * 100.0);
+							problems.push_back(line);
+						}
+					}
+				}
+				catch (const HDRException &e) {
+					problems.push_back(e.what());
+				}
+			}
+		}
+
+		if (opts.record)
+			record_out << c.name << " " << best << " " << rays_per_second << std::endl;
+		else if (timed) {
+			std::map<std::string, Baseline>::const_iterator base = baselines.find(c.name);
+			if (base == baselines.end())
+				problems.push_back("no baseline in " + baseline_path);
+			else {
+				const Baseline &b = base->second;
+				snprintf(line, sizeof(line), "  time %+.1f%%, rays/s %+.1f%%",
+					(best / b.seconds - 1.0) * 100.0, (rays_per_second / b.rays_per_second - 1.0) * 100.0);
+				std::cout << line;
+				if (best > b.seconds * (1.0 + opts.time_tolerance)) {
+					snprintf(line, sizeof(line), "slower: %.1f ms against %.1f ms", best * 1000.0, b.seconds * 1000.0);
+					problems.push_back(line);
+				}
+				if (rays_per_second < b.rays_per_second * (1.0 - opts.time_tolerance)) {
+					snprintf(line, sizeof(line), "fewer rays a second: %.2fM against %.2fM", rays_per_second / 1e6, b.rays_per_second / 1e6);
+					problems.push_back(line);
+				}
+			}
+		}
+
+		std::cout << (problems.empty() ? "  ok" : "  FAILED") << std::endl;
+		for (size_t p = 0; p < problems.size(); p++)
+			failures.push_back(c.name + ": " + problems[p]);
+	}
+
+	if (opts.record_references)
+		std::cout << "recorded " << cases.size() << " reference images" << std::endl;
+	if (opts.record)
+		std::cout << "recorded a baseline of " << cases.size() << " timings" << std::endl;
+	if (!timed)
+		std::cout << "record a baseline with `make perfbaseline` to check timings too" << std::endl;
+
+	if (failures.empty()) {
+		std::cout << "all " << cases.size() << " scenes passed" << std::endl;
+		return true;
+	}
+	std::cout << std::endl << failures.size() << " regression" << (failures.size() > 1 ? "s" : "") << ":" << std::endl;
+	for (size_t f = 0; f < failures.size(); f++)
+		std::cout << "\t" << failures[f] << std::endl;
+	return false;
+}
@@ -0,0 +1,56 @@
+/* perftest.hpp
+ *
+ * the performance regression suite (`make perftest`)
+ *
+ * renders a fixed set of scenes: the demo in the configurations
+ * rt_profiler goes through (x1 and x4, with and without shadows and
+ * reflections), and generated scenes (see scenegen.hpp) of 30000
+ * primitives in each distribution. each is compared with a reference
+ * image, and its time and rays a second with a baseline.
+ *
+ * the reference images are in the repository (samples/perftest, as
+ * PNGs), so a fresh checkout has something to compare with. the cases
+ * file next to them gives each one's scene, or the generator's
+ * parameters and seed, and its size and settings, and an image made
+ * for anything else is reported rather than compared. a change that's
+ * meant to change the images re-records them with `make perfreferences`.
+ *
+ * an image passes if its PSNR against the reference is at least
+ * `min_psnr` and no more than PERFTEST_VISIBLE_FRACTION of its pixels are
+ * visibly different (some channel more than PERFTEST_VISIBLE_STEP out),
+ * so that a few pixels flipping across a shadow edge don't fail it but
+ * a patch of wrong ones does. the time is the best of `runs` renders,
+ * and fails if it's more than `time_tolerance` slower than the
+ * baseline's, as do rays a second that drop by as much. rays are camera
+ * and reflection rays, counted in a separate pass that isn't timed.
+ *
+ * baselines are only worth comparing on the machine they were recorded
+ * on, so they aren't kept in the repository: `make perfbaseline` records
+ * one in perf/. without one, only the images are checked.
+ */
+
+#ifndef PERFTEST_HEADER_WARRIOR
+#define PERFTEST_HEADER_WARRIOR
+
+#include <string>
+
+#define PERFTEST_VISIBLE_STEP 8			// out of 255
+#define PERFTEST_VISIBLE_FRACTION 0.001
+
+struct PerfTestOptions {
+	std::string dir;		// where the baseline is
+	std::string references;		// where the reference images are
+	bool record;			// write a new baseline instead of comparing
+	bool record_references;		// write new reference images instead of comparing
+	int runs;			// renders of each scene, the best is taken
+	double time_tolerance;		// as a fraction of the baseline
+	double min_psnr;		// in dB
+
+	PerfTestOptions();
+};
+
+// runs the suite, printing a line for each scene and what regressed.
+// false if anything did (or there are no reference images)
+bool runPerfTest(const PerfTestOptions &opts);
+
+#endif
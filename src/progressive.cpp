@@ -0,0 +1,537 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <limits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+#include "progressive.hpp"
+#include "renderer.hpp"
+#include "world.hpp"
+#include "mappedfile.hpp"
+#include "sceneparser.hpp"
+
+#define PROGRESSIVE_MAX_PASS_SAMPLES 8	// samples per pixel in any one pass
+
+#define CHECKPOINT_MAGIC "TRCFCKP"
+#define CHECKPOINT_VERSION 1
+
+struct CheckpointHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t reserved;
+	uint64_t scene_hash;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+ProgressiveOptions::ProgressiveOptions() :
+	max_samples(256), min_samples(16), target_error(0.004), time_budget(0.0), preview_interval(5.0),
+	checkpoint_interval(60.0), resume(false), threads(0) {}
+
+CheckpointException::CheckpointException(const std::string &path, const std::string &msg) :
+	std::runtime_error(path + ": " + msg) {}
+
+/* AccumulationBuffer implementation */
+
+AccumulationBuffer::AccumulationBuffer(int width, int height) :
+	w(width), h(height), sum(3 * (size_t)width * height, 0.0f),
+	sum_sq((size_t)width * height, 0.0f), count((size_t)width * height, 0) {}
+
+size_t AccumulationBuffer::index(int i, int j) const {
+	return (size_t)j * w + i;
+}
+
+int AccumulationBuffer::width() const { return w; }
+int AccumulationBuffer::height() const { return h; }
+
+static double brightness(double r, double g, double b) {
+	return 0.2126 * r + 0.7152 * g + 0.0722 * b;
+}
+
+void AccumulationBuffer::add(int i, int j, const RGBVec &sample) {
+	size_t k = index(i, j);
+	sum[3*k] += sample.r();
+	sum[3*k + 1] += sample.g();
+	sum[3*k + 2] += sample.b();
+	double y = brightness(sample.r(), sample.g(), sample.b());
+	sum_sq[k] += y * y;
+	count[k]++;
+}
+
+unsigned int AccumulationBuffer::samples(int i, int j) const {
+	return count[index(i, j)];
+}
+
+double AccumulationBuffer::deviation(int i, int j) const {
+	size_t k = index(i, j);
+	double n = count[k];
+	if (n < 2)
+		return std::numeric_limits<double>::infinity();
+
+	double mean = brightness(sum[3*k], sum[3*k + 1], sum[3*k + 2]) / n;
+	double var = (sum_sq[k] - n * mean * mean) / (n - 1);
+	return var > 0.0 ? std::sqrt(var) : 0.0;
+}
+
+double AccumulationBuffer::standardError(int i, int j) const {
+	return deviation(i, j) / std::sqrt((double)samples(i, j));
+}
+
+RGBVec AccumulationBuffer::mean(int i, int j) const {
+	size_t k = index(i, j);
+	if (count[k] == 0)
+		return RGBVec();
+	double scale = 1.0 / count[k];
+	return RGBVec(sum[3*k] * scale, sum[3*k + 1] * scale, sum[3*k + 2] * scale);
+}
+
+void AccumulationBuffer::resolve(Image &img) const {
+	for (int i = 0; i < w; i++)
+		for (int j = 0; j < h; j++)
+			img[i][j] = RGBColour(mean(i, j));
+}
+
+void AccumulationBuffer::save(const std::string &path, uint64_t scene_hash) const {
+	CheckpointHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic));
+	hdr.version = CHECKPOINT_VERSION;
+	hdr.width = w;
+	hdr.height = h;
+	hdr.scene_hash = scene_hash;
+
+	const std::string tmp = path + ".tmp";
+	{
+		std::ofstream out(tmp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+		out.write(reinterpret_cast<const char *>(&sum[0]), sum.size() * sizeof(float));
+		out.write(reinterpret_cast<const char *>(&sum_sq[0]), sum_sq.size() * sizeof(float));
+		out.write(reinterpret_cast<const char *>(&count[0]), count.size() * sizeof(uint32_t));
+		out.close();
+		if (!out)
+			throw CheckpointException(tmp, "couldn't write checkpoint");
+	}
+
+	if (rename(tmp.c_str(), path.c_str()) != 0)
+		throw CheckpointException(path, strerror(errno));
+}
+
+void AccumulationBuffer::load(const std::string &path, uint64_t scene_hash) {
+	MappedFile file(path);
+	const size_t pixels = (size_t)w * h;
+	const size_t expected = sizeof(CheckpointHeader) + pixels * (4 * sizeof(float) + sizeof(uint32_t));
+
+	CheckpointHeader hdr;
+	if (file.size() < sizeof(hdr))
+		throw CheckpointException(path, "too short to be a checkpoint");
+	memcpy(&hdr, file.data(), sizeof(hdr));
+
+	if (memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic)) != 0)
+		throw CheckpointException(path, "not a traceify checkpoint");
+	if (hdr.version != CHECKPOINT_VERSION)
+		throw CheckpointException(path, "unsupported checkpoint version " + std::to_string(hdr.version));
+	if (hdr.scene_hash != scene_hash)
+		throw CheckpointException(path, "checkpoint is of a different scene");
+	if ((int)hdr.width != w || (int)hdr.height != h)
+		throw CheckpointException(path, "checkpoint is " + std::to_string(hdr.width) + "x" + std::to_string(hdr.height)
+				+ ", not " + std::to_string(w) + "x" + std::to_string(h));
+	if (file.size() != expected)
+		throw CheckpointException(path, "checkpoint is truncated");
+
+	const char *p = file.data() + sizeof(hdr);
+	memcpy(&sum[0], p, sum.size() * sizeof(float));
+	p += sum.size() * sizeof(float);
+	memcpy(&sum_sq[0], p, sum_sq.size() * sizeof(float));
+	p += sum_sq.size() * sizeof(float);
+	memcpy(&count[0], p, count.size() * sizeof(uint32_t));
+}
+
+/* the renderer */
+
+// a well mixed hash of a pixel (and something else about it)
+static unsigned int pixelHash(int i, int j, unsigned int salt) {
+	unsigned int hash = static_cast<unsigned int>(i) * 73856093u ^ static_cast<unsigned int>(j) * 19349663u ^ salt * 83492791u;
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3bu;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+// where sample k of a pixel goes: an R2 sequence (which spreads any
+// number of samples evenly over the pixel), shifted by a per pixel
+// offset so that neighbouring pixels don't all sample the same spots
+static void samplePosition(int i, int j, unsigned int k, double &x, double &y) {
+	unsigned int hash = pixelHash(i, j, 0);
+	double ox = (hash & 0xffff) / 65536.0;
+	double oy = (hash >> 16) / 65536.0;
+
+	double fx = ox + 0.7548776662466927 * k;
+	double fy = oy + 0.5698402909980532 * k;
+	x = i + (fx - std::floor(fx));
+	y = j + (fy - std::floor(fy));
+}
+
+static double secondsSince(Clock::time_point t) {
+	return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+static double secondsUntil(Clock::time_point t) {
+	return std::chrono::duration<double>(t - Clock::now()).count();
+}
+
+namespace {
+
+/* ProgressiveRenderer
+ *
+ * the passes themselves, and everything that happens between them.
+ * how many samples each pixel gets in a pass is up to the schedule:
+ * either until convergence, or whatever fits in the time budget */
+class ProgressiveRenderer {
+private:
+	struct PassResult {
+		long pixels;
+		long samples;
+	};
+
+	// how many samples a pixel with n samples so far gets this pass
+	typedef std::function<unsigned int(int i, int j, unsigned int n)> Plan;
+
+	const ProgressiveOptions &opts;
+	const std::string out_path;
+	std::string checkpoint;
+	World world;
+	uint64_t scene_hash;
+	std::unique_ptr<AccumulationBuffer> acc;
+	std::unique_ptr<Image> img;
+	RenderEngine engine;
+
+	Clock::time_point start;
+	Clock::time_point last_preview;
+	Clock::time_point last_checkpoint;
+	int passes;
+	double write_seconds;	// how long the last preview took to resolve and write
+
+	// time spent sampling each pixel (by this run), for working out
+	// what samples cost where. a pixel on the edge of a reflective
+	// sphere can cost many times what the background next to it does.
+	// they aren't checkpointed, since a resumed render may well be on
+	// another machine, or have a different number of threads
+	std::vector<float> pixel_seconds;
+	std::vector<uint32_t> pixel_samples;
+
+	size_t pixelIndex(int i, int j) const {
+		return (size_t)j * acc->width() + i;
+	}
+
+	double sampleCost(int i, int j) const {
+		size_t k = pixelIndex(i, j);
+		return pixel_samples[k] > 0 ? pixel_seconds[k] / pixel_samples[k] : 0.0;
+	}
+
+	// renders one pass. pixels that haven't been started by the
+	// deadline are left for next time
+	PassResult pass(const Plan &plan, Clock::time_point deadline) {
+		std::atomic<long> pixels(0);
+		std::atomic<long> samples(0);
+
+		RenderJob job(world, *img);
+		job.tileRenderer = [&](RenderJob &r, const Tile &t, RenderStats &) {
+			long busy = 0;
+			long taken = 0;
+			for (int i = t.x0; i < t.x1; i++) {
+				if (Clock::now() >= deadline)
+					break;
+				for (int j = t.y0; j < t.y1; j++) {
+					unsigned int n = acc->samples(i, j);
+					unsigned int extra = std::min(plan(i, j, n), (unsigned int)opts.max_samples - std::min(n, (unsigned int)opts.max_samples));
+					if (extra == 0)
+						continue;
+
+					const Clock::time_point pixel_start = Clock::now();
+					for (unsigned int k = n; k < n + extra; k++) {
+						double x, y;
+						samplePosition(i, j, k, x, y);
+						acc->add(i, j, r.world->sampleAt(r.camera, r.viewport, x, y));
+					}
+					pixel_seconds[pixelIndex(i, j)] += secondsSince(pixel_start);
+					pixel_samples[pixelIndex(i, j)] += extra;
+					busy++;
+					taken += extra;
+				}
+			}
+
+			pixels += busy;
+			samples += taken;
+		};
+		engine.render(job);
+
+		PassResult result;
+		result.pixels = pixels;
+		result.samples = samples;
+
+		if (result.samples > 0) {
+			passes++;
+			std::cout << "pass " << passes << ": " << result.samples << " samples over " << result.pixels << " pixels, "
+				<< secondsSince(start) << "s" << std::endl;
+
+			if (passes == 1 || secondsSince(last_preview) >= opts.preview_interval) {
+				const Clock::time_point write_start = Clock::now();
+				acc->resolve(*img);
+				img->writeToFile(out_path);
+				last_preview = Clock::now();
+				write_seconds = secondsSince(write_start);
+			}
+
+			if (opts.checkpoint_interval > 0.0 && secondsSince(last_checkpoint) >= opts.checkpoint_interval) {
+				acc->save(checkpoint, scene_hash);
+				last_checkpoint = Clock::now();
+			}
+		}
+
+		return result;
+	}
+
+	void runToConvergence() {
+		const Clock::time_point never = Clock::time_point::max();
+
+		Plan plan = [this](int i, int j, unsigned int n) -> unsigned int {
+			if (opts.target_error > 0.0 && n >= (unsigned int)opts.min_samples
+					&& acc->standardError(i, j) <= opts.target_error)
+				return 0;
+
+			// a pixel's samples double each pass, up to a limit. this
+			// only depends on how many it already has, so the same
+			// pixel always gets the same samples however the render
+			// was split up into runs
+			return std::min(std::max(n, 1u), (unsigned int)PROGRESSIVE_MAX_PASS_SAMPLES);
+		};
+
+		while (pass(plan, never).samples > 0)
+			;
+	}
+
+	/* to get the most out of the time there is, samples go where they
+	 * reduce the noise the most for what they cost. for pixels with
+	 * brightness deviation sigma and cost c per sample, the total
+	 * variance of the image for a fixed amount of time is lowest when
+	 * each pixel gets samples in proportion to sigma / sqrt(c). each
+	 * pass aims to use half of the time that's left, so that the
+	 * estimates get better as the deadline gets closer, and the pass
+	 * that runs into the deadline is cut short */
+	void runToDeadline() {
+		const Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(
+				std::chrono::duration<double>(opts.time_budget));
+
+		// everything gets one sample, however long that takes, or there
+		// wouldn't be an image at all. then a second one, so that every
+		// pixel's variance can be estimated
+		pass([](int, int, unsigned int n) -> unsigned int { return n == 0 ? 1 : 0; }, Clock::time_point::max());
+		if (Clock::now() >= deadline)
+			std::cerr << "traceify: a single sample per pixel took longer than the time budget" << std::endl;
+
+		// the final resolve and write have to fit in the budget too.
+		// the first pass wrote a preview, so we know roughly how long
+		// that takes
+		const double reserve = 2.0 * write_seconds + 0.01 * opts.time_budget;
+
+		// a resumed render has samples from before, but no idea what they
+		// cost, and the costs are what the budget is shared out by. so
+		// pixels that the first pass didn't time get a sample now too
+		const Clock::time_point cutoff = deadline - std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(reserve));
+		pass([this](int i, int j, unsigned int n) -> unsigned int {
+			if (n < 2)
+				return 2 - n;
+			return pixel_samples[pixelIndex(i, j)] == 0 ? 1 : 0;
+		}, cutoff);
+
+		const int width = acc->width();
+		const int height = acc->height();
+
+		for (unsigned int round = 1; ; round++) {
+			double remaining = secondsUntil(cutoff);
+			if (remaining <= 0.0)
+				break;
+
+			double thread_budget = 0.5 * remaining * engine.threadCount();
+
+			// what every sample so far cost, at what they cost now. that's
+			// the time spent sampling, unless some of the samples came
+			// from a checkpoint
+			double spent = 0.0;
+			for (int i = 0; i < width; i++)
+				for (int j = 0; j < height; j++)
+					spent += acc->samples(i, j) * sampleCost(i, j);
+
+			// the ideal share of all the time spent so far (and in this
+			// pass) is proportional to sigma * sqrt(c)
+			double weight = 0.0;
+			for (int i = 0; i < width; i++)
+				for (int j = 0; j < height; j++)
+					if (acc->samples(i, j) < (unsigned int)opts.max_samples)
+						weight += acc->deviation(i, j) * std::sqrt(sampleCost(i, j));
+			if (weight <= 0.0 || std::isinf(weight))
+				break;
+
+			const double total = spent + thread_budget;
+			std::vector<float> wanted(acc->width() * (size_t)acc->height(), 0.0f);
+			double shortfall = 0.0;
+			for (int i = 0; i < width; i++) {
+				for (int j = 0; j < height; j++) {
+					unsigned int n = acc->samples(i, j);
+					double c = sampleCost(i, j);
+					if (n >= (unsigned int)opts.max_samples || c <= 0.0)
+						continue;
+					double share = total * acc->deviation(i, j) / (std::sqrt(c) * weight);
+					double extra = std::min(share - n, (double)(opts.max_samples - n));
+					if (extra > 0.0) {
+						wanted[(size_t)j * width + i] = extra;
+						shortfall += extra * c;
+					}
+				}
+			}
+			if (shortfall <= 0.0)
+				break;
+
+			// pixels that already have more than their share keep it, so
+			// the rest have to be scaled down to fit in this pass. the
+			// fractions are rounded up or down at random (but repeatably)
+			const double scale = std::min(1.0, thread_budget / shortfall);
+			Plan plan = [&, scale, round](int i, int j, unsigned int) -> unsigned int {
+				double extra = wanted[(size_t)j * width + i] * scale;
+				double whole = std::floor(extra);
+				double dither = (pixelHash(i, j, round) & 0xffff) / 65536.0;
+				return (unsigned int)whole + (dither < extra - whole ? 1 : 0);
+			};
+
+			if (pass(plan, cutoff).samples == 0)
+				break;
+		}
+	}
+
+	void reportNoise() {
+		const std::string path = out_path + ".noise";
+		std::ofstream out(path.c_str());
+		out << "# x0 y0 x1 y1 mean_samples rms_error max_error" << std::endl;
+
+		double worst = 0.0;
+		double total_sq = 0.0;
+		long measured = 0;
+		long unmeasured = 0;
+		Tile worst_tile = { 0, 0, 0, 0 };
+		const int tiles_x = (acc->width() + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+		const int tiles_y = (acc->height() + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+
+		for (int ty = 0; ty < tiles_y; ty++) {
+			for (int tx = 0; tx < tiles_x; tx++) {
+				Tile t;
+				t.x0 = tx * RENDER_TILE_SIZE;
+				t.y0 = ty * RENDER_TILE_SIZE;
+				t.x1 = std::min(t.x0 + RENDER_TILE_SIZE, acc->width());
+				t.y1 = std::min(t.y0 + RENDER_TILE_SIZE, acc->height());
+
+				double samples = 0.0, sq = 0.0, max = 0.0;
+				long n = 0;
+				for (int i = t.x0; i < t.x1; i++) {
+					for (int j = t.y0; j < t.y1; j++) {
+						samples += acc->samples(i, j);
+						double e = acc->standardError(i, j);
+						if (std::isinf(e)) {
+							unmeasured++;
+							continue;
+						}
+						sq += e * e;
+						max = std::max(max, e);
+						n++;
+					}
+				}
+
+				double rms = n > 0 ? std::sqrt(sq / n) : 0.0;
+				out << t.x0 << " " << t.y0 << " " << t.x1 << " " << t.y1 << " "
+					<< samples / ((t.x1 - t.x0) * (t.y1 - t.y0)) << " " << rms << " " << max << std::endl;
+
+				total_sq += sq;
+				measured += n;
+				if (rms > worst) {
+					worst = rms;
+					worst_tile = t;
+				}
+			}
+		}
+
+		std::cout << "Noise: rms error " << (measured > 0 ? std::sqrt(total_sq / measured) : 0.0)
+			<< ", worst tile " << worst << " at (" << worst_tile.x0 << ", " << worst_tile.y0 << ")";
+		if (unmeasured > 0)
+			std::cout << ", " << unmeasured << " pixels with too few samples to tell";
+		std::cout << " (per tile in " << path << ")" << std::endl;
+	}
+
+public:
+	ProgressiveRenderer(const std::string &scene_path, const std::string &out_path, const ProgressiveOptions &opts) :
+		opts(opts), out_path(out_path),
+		world(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec()),
+		engine(opts.threads), start(Clock::now()), passes(0), write_seconds(0.0)
+	{
+		loadScene(scene_path, world);
+		world.buildHierarchy();
+		scene_hash = MappedFile(scene_path).contentHash();
+
+		const int width = world.viewport.pixelsWide();
+		const int height = world.viewport.pixelsTall();
+		checkpoint = opts.checkpoint_path.empty() ? out_path + ".ckpt" : opts.checkpoint_path;
+
+		acc.reset(new AccumulationBuffer(width, height));
+		img.reset(new Image(width, height));
+
+		pixel_seconds.assign((size_t)width * height, 0.0f);
+		pixel_samples.assign((size_t)width * height, 0);
+
+		if (opts.resume && access(checkpoint.c_str(), F_OK) == 0) {
+			acc->load(checkpoint, scene_hash);
+			std::cout << "Resuming from " << checkpoint << std::endl;
+		}
+
+		last_preview = start;
+		last_checkpoint = start;
+	}
+
+	void run() {
+		if (opts.time_budget > 0.0)
+			runToDeadline();
+		else
+			runToConvergence();
+
+		acc->resolve(*img);
+		img->writeToFile(out_path);
+
+		// the final checkpoint lets a finished render be taken further later,
+		// with a higher sample limit or a lower target error
+		if (opts.checkpoint_interval > 0.0)
+			acc->save(checkpoint, scene_hash);
+
+		unsigned long total = 0;
+		for (int i = 0; i < acc->width(); i++)
+			for (int j = 0; j < acc->height(); j++)
+				total += acc->samples(i, j);
+		std::cout << "Finished in " << secondsSince(start) << "s, " << (double)total / ((double)acc->width() * acc->height())
+			<< " samples per pixel on average" << std::endl;
+
+		reportNoise();
+	}
+};
+
+}
+
+void renderProgressive(const std::string &scene_path, const std::string &out_path, const ProgressiveOptions &opts) {
+	ProgressiveRenderer renderer(scene_path, out_path, opts);
+	renderer.run();
+}
@@ -0,0 +1,103 @@
+/* progressive.hpp
+ *
+ * progressive rendering
+ *
+ * rather than finishing each pixel before moving on, a progressive
+ * render makes passes over the whole viewport, adding a few samples to
+ * every pixel each time. samples are summed into a float accumulation
+ * buffer, so the image gets less noisy with every pass and there's
+ * always a complete (if rough) picture to look at. the first pass is a
+ * single sample per pixel, so the first preview comes out in about the
+ * time a render with supersampling off would take.
+ *
+ * a pixel stops getting samples once the standard error of its mean
+ * brightness drops below the target. the render stops once every pixel
+ * has converged, or has had the maximum number of samples.
+ *
+ * alternatively, a render can be given a time budget. it then measures
+ * what samples cost in each part of the image as it goes, and spends
+ * whatever time is left on the pixels whose noise it can bring down the
+ * most, finishing (image written) within the budget. either way, the
+ * noise left in each tile is written out alongside the image.
+ *
+ * the preview (the output file, rewritten as the render goes) and the
+ * checkpoint are written between passes, on their own timers. a
+ * checkpoint is the whole accumulation buffer, plus a hash of the scene
+ * it belongs to, so a render that was stopped (or crashed) can carry on
+ * where its last checkpoint left off. samples are placed by their index
+ * within the pixel, and the number a pixel gets in each pass depends
+ * only on how many it has already, so a resumed render comes out
+ * identical to one that never stopped.
+ */
+
+#ifndef PROGRESSIVE_HEADER_WARRIOR
+#define PROGRESSIVE_HEADER_WARRIOR
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstdint>
+
+#include "colour.hpp"
+#include "image.hpp"
+
+struct ProgressiveOptions {
+	int max_samples;		// per pixel
+	int min_samples;		// before a pixel can be called converged
+	double target_error;		// 0 to always take max_samples
+	double time_budget;		// seconds, 0 to render until converged
+	double preview_interval;	// seconds
+	double checkpoint_interval;	// seconds, 0 for no checkpoints
+	std::string checkpoint_path;	// defaults to the output path + ".ckpt"
+	bool resume;			// from the checkpoint, if there is one
+	int threads;			// 0 for one per hardware thread
+
+	ProgressiveOptions();
+};
+
+struct CheckpointException : public std::runtime_error {
+	CheckpointException(const std::string &path, const std::string &msg);
+};
+
+/* AccumulationBuffer
+ *
+ * running sums of the samples taken at each pixel: colour, the square
+ * of the brightness (for the variance) and how many there were. pixels
+ * are only ever touched by the thread rendering their tile */
+class AccumulationBuffer {
+private:
+	int w;
+	int h;
+	std::vector<float> sum;		// r, g, b per pixel
+	std::vector<float> sum_sq;	// brightness squared
+	std::vector<uint32_t> count;
+
+	size_t index(int i, int j) const;
+
+public:
+	AccumulationBuffer(int width, int height);
+
+	int width() const;
+	int height() const;
+
+	void add(int i, int j, const RGBVec &sample);
+	unsigned int samples(int i, int j) const;
+
+	// of the pixel's brightness, and of its mean brightness. both are
+	// infinite before it has two samples
+	double deviation(int i, int j) const;
+	double standardError(int i, int j) const;
+
+	RGBVec mean(int i, int j) const;
+	void resolve(Image &img) const;
+
+	// checkpoints are written to a temporary file and renamed over the
+	// old one, so a crash while saving can't lose the last checkpoint
+	void save(const std::string &path, uint64_t scene_hash) const;
+	void load(const std::string &path, uint64_t scene_hash);
+};
+
+// renders a scene progressively, rewriting out_path with the image so far
+void renderProgressive(const std::string &scene_path, const std::string &out_path, const ProgressiveOptions &opts);
+
+#endif
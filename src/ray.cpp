@@ -1,11 +1,21 @@
 #include "ray.hpp"
 
-IntersectionResult::IntersectionResult() : intersected(false) {} // default to false
-IntersectionResult::IntersectionResult(double t) : intersected(true), coefficient(t) {}
+IntersectionResult::IntersectionResult() : intersected(false), primitive(-1), centre(), material(-1) {} // default to false
+IntersectionResult::IntersectionResult(double t) : intersected(true), coefficient(t), primitive(-1), centre(), material(-1) {}
+IntersectionResult::IntersectionResult(double t, int prim) : intersected(true), coefficient(t), primitive(prim), centre(), material(-1) {}
 IntersectionResult::IntersectionResult(const IntersectionResult &ir) :
-	intersected(ir.intersected), coefficient(ir.coefficient) {}
+	intersected(ir.intersected), coefficient(ir.coefficient), primitive(ir.primitive), material(ir.material) {
+	centre[0] = ir.centre[0];
+	centre[1] = ir.centre[1];
+	centre[2] = ir.centre[2];
+}
+
+Ray::Ray(const vec3& o, const vec3& d) : origin(o), direction(d), start(0.0), spread(0.0) {}
+Ray::Ray(const vec3& o, const vec3& d, double w, double s) : origin(o), direction(d), start(w), spread(s) {}
 
-Ray::Ray(const vec3& o, const vec3& d) : origin(o), direction(d) {}
+double Ray::widthAt(double t) const {
+	return start + t * spread;
+}
 
 vec3 Ray::intersectionPoint(double t) {
 	return origin + direction.scaled(t);
@@ -6,9 +6,17 @@
 struct IntersectionResult {
 	bool intersected;
 	double coefficient;
+	int primitive;			// which sub-primitive was hit (e.g. mesh triangle), -1 if n/a
+
+	// a copy of what shading needs from the primitive that was hit, for
+	// objects whose primitives may not be resident any more by the time
+	// it's shaded (see pagedgeom.hpp). only they fill it in
+	float centre[3];
+	int material;			// -1 if there's no copy
 
 	IntersectionResult();		// default, false result
 	IntersectionResult(double); 	// true result
+	IntersectionResult(double, int);// true result on a particular sub-primitive
 	IntersectionResult(const IntersectionResult &);
 };
 
@@ -16,12 +24,20 @@ struct Ray {
 	vec3 origin;
 	vec3 direction;
 
+	// the ray stands for a cone (for picking texture detail): at t it's
+	// start + t * spread across. 0 for rays that don't care
+	double start;
+	double spread;
+
 	// t is the coefficient along the ray's line at
 	// which the intersection occurred
 	vec3 intersectionPoint(double t);
 	vec3 intersectionPoint(double t) const;
 
 	Ray(const vec3& origin, const vec3& direction);
+	Ray(const vec3& origin, const vec3& direction, double start, double spread);
+
+	double widthAt(double t) const;
 };
 
 #endif
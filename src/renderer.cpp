@@ -0,0 +1,423 @@
+#include <algorithm>
+
+#include "renderer.hpp"
+
+/* RenderJob implementation */
+
+static Tile wholeViewport(const Viewport &vp) {
+	Tile t;
+	t.x0 = 0;
+	t.y0 = 0;
+	t.x1 = vp.pixelsWide();
+	t.y1 = vp.pixelsTall();
+	return t;
+}
+
+RenderJob::RenderJob(World &w, Image &img) :
+	world(&w), camera(w.camera()), viewport(w.viewport), ss_level(w.ss_level), image(&img),
+	region(wholeViewport(w.viewport)),
+	tile_order(tile_order_hilbert), pixel_order(pixel_order_morton), hdr(NULL) {
+	setup();
+}
+
+RenderJob::RenderJob(World &w, const Camera &cam, const Viewport &vp, int ss, Image &img) :
+	world(&w), camera(cam), viewport(vp), ss_level(ss), image(&img), region(wholeViewport(vp)),
+	tile_order(tile_order_hilbert), pixel_order(pixel_order_morton), hdr(NULL) {
+	setup();
+}
+
+RenderJob::RenderJob(World &w, const Camera &cam, const Viewport &vp, int ss, Image &img, const Tile &r) :
+	world(&w), camera(cam), viewport(vp), ss_level(ss), image(&img), region(r),
+	tile_order(tile_order_hilbert), pixel_order(pixel_order_morton), hdr(NULL) {
+	setup();
+}
+
+RenderJob::RenderJob(World &w, const Camera &cam, const Viewport &vp, int ss, const PixelBuffer &out) :
+	world(&w), camera(cam), viewport(vp), ss_level(ss), image(NULL), region(wholeViewport(vp)),
+	tile_order(tile_order_hilbert), pixel_order(pixel_order_morton), hdr(NULL), buffer(out) {
+	setup();
+}
+
+// the even bits of x, packed together
+static unsigned int compactBits(unsigned int x) {
+	x &= 0x55555555;
+	x = (x | (x >> 1)) & 0x33333333;
+	x = (x | (x >> 2)) & 0x0f0f0f0f;
+	x = (x | (x >> 4)) & 0x00ff00ff;
+	x = (x | (x >> 8)) & 0x0000ffff;
+	return x;
+}
+
+// the point d of the way along a Hilbert curve filling an n x n square
+// (n a power of two)
+static void hilbertPoint(int n, int d, int &x, int &y) {
+	x = y = 0;
+	for (int s = 1; s < n; s *= 2) {
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+}
+
+void RenderJob::setup() {
+	tiles_x = (region.x1 - region.x0 + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	tiles_y = (region.y1 - region.y0 + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	next_tile = 0;
+	tiles_done = 0;
+	was_cancelled = false;
+	done_claimed = false;
+	error = std::exception_ptr();
+
+	sequence.clear();
+	if (tile_order == tile_order_snake) {
+		for (int ty = 0; ty < tiles_y; ty++)
+			for (int k = 0; k < tiles_x; k++)
+				sequence.push_back(ty * tiles_x + (ty % 2 == 0 ? k : tiles_x - 1 - k));
+		return;
+	}
+
+	// both curves fill a power of two square, of which the tiles that
+	// are really there are picked out in order
+	int n = 1;
+	while (n < tiles_x || n < tiles_y)
+		n *= 2;
+	for (int d = 0; d < n * n; d++) {
+		int tx, ty;
+		if (tile_order == tile_order_hilbert)
+			hilbertPoint(n, d, tx, ty);
+		else {
+			tx = static_cast<int>(compactBits(d));
+			ty = static_cast<int>(compactBits(d >> 1));
+		}
+		if (tx < tiles_x && ty < tiles_y)
+			sequence.push_back(ty * tiles_x + tx);
+	}
+}
+
+int RenderJob::tileCount() const {
+	return tiles_x * tiles_y;
+}
+
+// consecutive tiles (and the geometry they touch) are next to each other
+// in every order
+Tile RenderJob::tile(int index) const {
+	int ty = sequence[index] / tiles_x;
+	int tx = sequence[index] % tiles_x;
+
+	Tile t;
+	t.x0 = region.x0 + tx * RENDER_TILE_SIZE;
+	t.y0 = region.y0 + ty * RENDER_TILE_SIZE;
+	t.x1 = std::min(t.x0 + RENDER_TILE_SIZE, region.x1);
+	t.y1 = std::min(t.y0 + RENDER_TILE_SIZE, region.y1);
+	return t;
+}
+
+int RenderJob::tilesDone() const {
+	std::lock_guard<std::mutex> guard(done_lock);
+	return tiles_done;
+}
+
+bool RenderJob::finished() const {
+	return tilesDone() == tileCount();
+}
+
+bool RenderJob::cancelled() const {
+	std::lock_guard<std::mutex> guard(done_lock);
+	return was_cancelled;
+}
+
+World &RenderJob::worldHere() const {
+	const int node = numaNodeOfThisThread();
+	if (node >= 0 && node < static_cast<int>(replicas.size()) && replicas[node])
+		return *replicas[node];
+	return *world;
+}
+
+void RenderJob::store(int i, int j, const RGBVec &c) {
+	const RGBColour rgb(c);
+	if (image)
+		(*image)[i - region.x0][j - region.y0] = rgb;
+	else {
+		unsigned char *p = buffer.at(i - region.x0, j - region.y0);
+		for (int ch = 0; ch < 3; ch++)
+			p[ch] = static_cast<unsigned char>(rgb.colour[ch]);
+	}
+	if (hdr)
+		hdr->set(i - region.x0, j - region.y0, c);
+}
+
+/* RenderEngine implementation */
+
+RenderEngine::RenderEngine(int threads, bool numa) : stopping(false) {
+	if (threads <= 0)
+		threads = static_cast<int>(std::thread::hardware_concurrency());
+	if (threads <= 0)
+		threads = 1;
+
+	// worker i goes to the node with the CPU i / threads of the way
+	// through all of them, so each node gets a block of workers the
+	// size of its share of the CPUs
+	std::vector<int> nodes(threads, -1);
+	if (numa) {
+		topology = NumaTopology::detect();
+		long total = 0;
+		for (int n = 0; n < topology.nodes(); n++)
+			total += static_cast<long>(topology.cpus[n].size());
+
+		node_workers.assign(topology.nodes(), 0);
+		for (int i = 0; i < threads; i++) {
+			int n = 0;
+			long upto = static_cast<long>(topology.cpus[0].size());
+			while (n + 1 < topology.nodes() && i * total >= upto * threads)
+				upto += static_cast<long>(topology.cpus[++n].size());
+			nodes[i] = n;
+			node_workers[n]++;
+		}
+	}
+
+	for (int i = 0; i < threads; i++)
+		workers.push_back(std::thread(&RenderEngine::workerLoop, this, nodes[i]));
+}
+
+RenderEngine::~RenderEngine() {
+	// jobs still waiting for workers are cancelled, so that whoever
+	// submitted them hears they're done rather than waiting forever
+	std::vector<std::pair<RenderJob *, int> > queued;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+		for (std::list<RenderJob *>::iterator it = active.begin(); it != active.end(); ++it) {
+			RenderJob &job = **it;
+			queued.push_back(std::make_pair(&job, job.tileCount() - job.next_tile));
+			job.next_tile = job.tileCount();
+			job.node_next = job.node_end;
+		}
+		active.clear();
+	}
+	work_ready.notify_all();
+
+	for (size_t i = 0; i < queued.size(); i++)
+		finishTiles(*queued[i].first, queued[i].second, NULL, true);
+
+	// the workers finish the tiles they're on before they notice, and
+	// whichever finishes a job's last tile calls its onDone
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
+
+int RenderEngine::threadCount() const {
+	return static_cast<int>(workers.size());
+}
+
+int RenderEngine::nodeCount() const {
+	return node_workers.empty() ? 1 : static_cast<int>(node_workers.size());
+}
+
+void RenderEngine::submit(RenderJob &job) {
+	job.setup();
+	job.stats = RenderStats();
+
+	// each node's run of tiles is as long as its share of the workers
+	job.node_next.clear();
+	job.node_end.clear();
+	const int threads = threadCount();
+	for (size_t n = 0, before = 0; n < node_workers.size(); n++) {
+		job.node_next.push_back(static_cast<int>(static_cast<long>(job.tileCount()) * before / threads));
+		before += node_workers[n];
+		job.node_end.push_back(static_cast<int>(static_cast<long>(job.tileCount()) * before / threads));
+	}
+
+	if (job.tileCount() == 0) {
+		if (job.onDone) job.onDone(job);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		active.push_back(&job);
+	}
+	work_ready.notify_all();
+}
+
+void RenderEngine::wait(RenderJob &job) {
+	std::unique_lock<std::mutex> guard(job.done_lock);
+	while (job.tiles_done < job.tileCount())
+		job.done_cv.wait(guard);
+	guard.unlock();
+
+	std::unique_lock<std::mutex> engine_guard(lock);
+	while (std::find(finishing.begin(), finishing.end(), &job) != finishing.end())
+		finished.wait(engine_guard);
+	engine_guard.unlock();
+
+	guard.lock();
+	if (job.error)
+		std::rethrow_exception(job.error);
+}
+
+void RenderEngine::render(RenderJob &job) {
+	submit(job);
+	wait(job);
+}
+
+void RenderEngine::cancel(RenderJob &job) {
+	// the tiles nobody has taken yet are counted as done straight away
+	int skipped = 0;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		std::list<RenderJob *>::iterator it = std::find(active.begin(), active.end(), &job);
+		if (it != active.end()) {
+			active.erase(it);
+			skipped = job.tileCount() - job.next_tile;
+			job.next_tile = job.tileCount();
+			job.node_next = job.node_end;
+		}
+	}
+
+	finishTiles(job, skipped, NULL, true);
+}
+
+void RenderEngine::finishTiles(RenderJob &job, int tiles, const RenderStats *stats, bool cancelling) {
+	std::function<void(RenderJob &)> done;
+	{
+		std::lock_guard<std::mutex> guard(job.done_lock);
+		if (cancelling) {
+			if (job.tiles_done == job.tileCount())
+				return;
+			job.was_cancelled = true;
+		}
+		if (stats)
+			job.stats.merge(*stats);
+		job.tiles_done += tiles;
+
+		// whoever takes the count to the end calls onDone, and only
+		// them. the job goes on the finishing list before the lock is
+		// let go, so a waiter that sees the count waits for onDone too
+		if (job.tiles_done < job.tileCount() || job.done_claimed)
+			return;
+		job.done_claimed = true;
+		done = job.onDone;
+		if (done) {
+			std::lock_guard<std::mutex> engine_guard(lock);
+			finishing.push_back(&job);
+		}
+		job.done_cv.notify_all();
+	}
+	if (!done)
+		return;
+
+	done(job);
+
+	// onDone may have deleted the job, so it's only looked for, not touched
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		finishing.erase(std::find(finishing.begin(), finishing.end(), &job));
+	}
+	finished.notify_all();
+}
+
+void renderPixels(RenderJob &job, const Tile &tile, RenderStats &stats) {
+	World &world = job.worldHere();
+	if (job.pixel_order == pixel_order_columns) {
+		for (int i = tile.x0; i < tile.x1; i++) {
+			for (int j = tile.y0; j < tile.y1; j++) {
+				job.store(i, j, world.radianceForPixelAt(job.camera, job.viewport, job.ss_level, i, j, stats));
+			}
+		}
+		return;
+	}
+
+	// Morton order over the whole tile-sized square, skipping whatever
+	// falls off the edge of a smaller tile
+	const unsigned int w = tile.x1 - tile.x0;
+	const unsigned int h = tile.y1 - tile.y0;
+	for (unsigned int k = 0; k < RENDER_TILE_SIZE * RENDER_TILE_SIZE; k++) {
+		const unsigned int dx = compactBits(k);
+		const unsigned int dy = compactBits(k >> 1);
+		if (dx >= w || dy >= h)
+			continue;
+
+		const int i = tile.x0 + dx;
+		const int j = tile.y0 + dy;
+		job.store(i, j, world.radianceForPixelAt(job.camera, job.viewport, job.ss_level, i, j, stats));
+	}
+}
+
+void RenderEngine::renderTile(RenderJob &job, const Tile &tile, RenderStats &stats) {
+	if (job.tileRenderer)
+		job.tileRenderer(job, tile, stats);
+	else
+		renderPixels(job, tile, stats);
+}
+
+// called with the lock held
+int RenderEngine::takeTile(RenderJob &job, int node) {
+	job.next_tile++;
+	if (node < 0 || job.node_next.empty())
+		return job.next_tile - 1;
+
+	if (job.node_next[node] < job.node_end[node])
+		return job.node_next[node]++;
+
+	// once its own run is done, a node helps whichever has the most
+	// left, from the far end so as to keep out of its way
+	int from = node;
+	for (int n = 0; n < static_cast<int>(job.node_next.size()); n++)
+		if (job.node_end[n] - job.node_next[n] > job.node_end[from] - job.node_next[from])
+			from = n;
+	return --job.node_end[from];
+}
+
+void RenderEngine::workerLoop(int node) {
+	if (node >= 0)
+		pinThreadToNode(topology, node);
+
+	for (;;) {
+		RenderJob *job;
+		int index;
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			while (!stopping && active.empty())
+				work_ready.wait(guard);
+			if (stopping)
+				return;
+
+			// round robin: take a tile from the job at the front, then
+			// send it to the back of the queue
+			job = active.front();
+			active.pop_front();
+			index = takeTile(*job, node);
+			if (job->next_tile < job->tileCount())
+				active.push_back(job);
+		}
+
+		Tile tile = job->tile(index);
+		RenderStats stats;
+		try {
+			renderTile(*job, tile, stats);
+			if (job->onTile) job->onTile(*job, tile);
+		}
+		catch (...) {
+			// e.g. a corrupt block of paged geometry. the rest of the
+			// job is given up, and whoever waits on it gets the exception
+			{
+				std::lock_guard<std::mutex> guard(job->done_lock);
+				if (!job->error)
+					job->error = std::current_exception();
+			}
+			cancel(*job);
+		}
+
+		finishTiles(*job, 1, &stats, false);
+	}
+}
@@ -0,0 +1,200 @@
+/* renderer.hpp
+ *
+ * multi-threaded tile rendering
+ *
+ * a RenderEngine owns a pool of worker threads for as long as it
+ * lives, so they can be reused from one render to the next. renders are
+ * submitted as RenderJobs, which are split into square tiles. workers
+ * take one tile at a time from each active job in turn, so a big job
+ * can't starve the small ones that are submitted after it.
+ *
+ * tiles are handed out along a Hilbert curve by default, and the usual
+ * pixel loop walks each tile in Morton (Z) order, so that rays traced
+ * one after another start close together in both directions and keep
+ * hitting the same parts of the hierarchy while they are in cache.
+ *
+ * on multi-socket machines an engine can pin its workers to NUMA nodes
+ * (see numa.hpp). each node then gets a contiguous run of each job's
+ * tiles, so the pages of the image it renders are first touched there,
+ * and only takes tiles from other nodes' runs once its own are done.
+ */
+
+#ifndef RENDERER_HEADER_WARRIOR
+#define RENDERER_HEADER_WARRIOR
+
+#include <vector>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+#include "world.hpp"
+#include "image.hpp"
+#include "numa.hpp"
+#include "hdr.hpp"
+
+#define RENDER_TILE_SIZE 32
+
+struct Tile {
+	int x0, y0;	// bottom left pixel (inclusive)
+	int x1, y1;	// top right pixel (exclusive)
+};
+
+class RenderEngine;
+
+// the order tiles are handed out in. snake goes back and forth along
+// each row of tiles in turn
+enum TileOrder { tile_order_snake, tile_order_morton, tile_order_hilbert };
+
+// the order renderPixels visits a tile's pixels in. columns goes up
+// each column of the tile in turn, which is how Image is laid out
+enum PixelOrder { pixel_order_columns, pixel_order_morton };
+
+/* RenderJob
+ *
+ * everything needed to render one image. the world is only read from,
+ * so many jobs can share it. the callbacks run on worker threads.
+ * onDone is the last thing to touch the job, so it may delete it (as
+ * long as nobody is wait()ing on it)
+ *
+ * a job can be limited to a region of the viewport, in which case the
+ * image only has to be as big as the region: pixel (x0, y0) of the
+ * region lands in image[0][0]
+ *
+ * instead of an Image, a job can fill a PixelBuffer that its caller
+ * owns. tileRenderers that write to the image themselves need one,
+ * but renderPixels and renderCoherent go through store(), which
+ * writes to either */
+struct RenderJob {
+	World *world;
+	Camera camera;
+	Viewport viewport;
+	int ss_level;
+	Image *image;
+	Tile region;
+
+	RenderStats stats;	// valid once the job is done
+
+	TileOrder tile_order;
+	PixelOrder pixel_order;
+
+	// if set, this renders each tile instead of the usual pixel loop,
+	// for renders that do more than fill the image with colourForPixelAt
+	std::function<void(RenderJob &, const Tile &, RenderStats &)> tileRenderer;
+
+	std::function<void(RenderJob &, const Tile &)> onTile;
+	std::function<void(RenderJob &)> onDone;
+
+	// copies of the world by NUMA node (SceneReplicas::byNode), for the
+	// usual pixel loop to render with the one on its own node
+	std::vector<World *> replicas;
+
+	// if set, also gets every pixel as it was before being rounded to
+	// 8 bits. it's the size of the image, and laid out the same way
+	FloatImage *hdr;
+
+	// uses the world's own camera, viewport and ss_level
+	RenderJob(World &w, Image &img);
+	RenderJob(World &w, const Camera &cam, const Viewport &vp, int ss_level, Image &img);
+	RenderJob(World &w, const Camera &cam, const Viewport &vp, int ss_level, Image &img, const Tile &region);
+
+	// the whole viewport, into `out`, which has to be the same size
+	RenderJob(World &w, const Camera &cam, const Viewport &vp, int ss_level, const PixelBuffer &out);
+
+	int tileCount() const;
+	Tile tile(int index) const;
+	int tilesDone() const;
+	bool finished() const;
+
+	// whether RenderEngine::cancel stopped it before every tile was
+	// rendered. its tiles are all counted as done either way
+	bool cancelled() const;
+
+	// the world to render with on the calling thread
+	World &worldHere() const;
+
+	// puts pixel (i, j) of the viewport into the image (or the buffer),
+	// and hdr if set
+	void store(int i, int j, const RGBVec &c);
+
+private:
+	friend class RenderEngine;
+
+	int tiles_x;
+	int tiles_y;
+	std::vector<int> sequence;	// the tiles (y * tiles_x + x) in tile_order
+	int next_tile;		// guarded by the engine's lock
+	std::vector<int> node_next, node_end;	// each NUMA node's run of the sequence, likewise
+	int tiles_done;		// guarded by done_lock
+	bool was_cancelled;	// likewise
+	bool done_claimed;	// likewise, set by whoever calls onDone
+	std::exception_ptr error;	// likewise, the first exception a tile threw
+	PixelBuffer buffer;	// used when image is NULL
+	mutable std::mutex done_lock;
+	std::condition_variable done_cv;
+
+	void setup();
+};
+
+// the usual pixel loop: fills the tile of the job's image with
+// colourForPixelAt
+void renderPixels(RenderJob &job, const Tile &tile, RenderStats &stats);
+
+class RenderEngine {
+private:
+	std::vector<std::thread> workers;
+	std::list<RenderJob *> active;	// jobs with tiles left to hand out
+	std::mutex lock;
+	std::condition_variable work_ready;
+	bool stopping;
+	std::vector<const RenderJob *> finishing;	// jobs whose onDone is running, guarded by lock
+	std::condition_variable finished;
+
+	NumaTopology topology;
+	std::vector<int> node_workers;	// by node, empty unless workers are pinned
+
+	void workerLoop(int node);
+	void renderTile(RenderJob &job, const Tile &tile, RenderStats &stats);
+
+	// the index of the next tile of the job for a worker on `node`
+	int takeTile(RenderJob &job, int node);
+
+	// counts `tiles` of the job as done, and calls onDone if that was
+	// the last of them
+	void finishTiles(RenderJob &job, int tiles, const RenderStats *stats, bool cancelling);
+
+public:
+	// 0 threads means one per hardware thread. with `numa`, workers are
+	// pinned to NUMA nodes in proportion to the CPUs each has
+	RenderEngine(int threads = 0, bool numa = false);
+
+	// jobs that haven't been started on yet are cancelled, and the ones
+	// being rendered finish their tiles, so every job's onDone is called
+	~RenderEngine();
+
+	int threadCount() const;
+
+	// how many nodes the workers are spread over, 1 if they aren't pinned
+	int nodeCount() const;
+
+	// starts rendering the job in the background. the job must stay
+	// alive until it has finished
+	void submit(RenderJob &job);
+
+	// until every tile is done, and onDone has returned. if a tile threw,
+	// the rest of the job was cancelled, and this throws it again
+	void wait(RenderJob &job);
+
+	// submit and wait
+	void render(RenderJob &job);
+
+	// hands out no more of the job's tiles. any being rendered are
+	// finished, so the job is done once they are: onDone is called then,
+	// or from here if none were. this is safe to call from any thread,
+	// at any time until the job has finished
+	void cancel(RenderJob &job);
+};
+
+#endif
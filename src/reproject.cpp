@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <cmath>
+
+#include "reproject.hpp"
+#include "image.hpp"
+
+ReprojectionCache::Entry::Entry() : p(0.0, 0.0, 0.0), lit(0.0, 0.0, 0.0), object(-1), age(0) {}
+
+ReprojectionCache::ReprojectionCache(World &wld) :
+	world(&wld), lights(wld.lights().size()), usable(!wld.samplesLights()), fresh(true),
+	w(0), h(0), carried(0), traced(0)
+{
+	world->collectObjects(objects);
+
+	// collectObjects goes through the clusters once the hierarchy is
+	// built, so the order is put right by id
+	std::vector<SceneObject*> by_id(objects.size(), NULL);
+	for (size_t k = 0; k < objects.size(); k++)
+		if (objects[k]->id >= 0 && objects[k]->id < static_cast<int>(objects.size()))
+			by_id[objects[k]->id] = objects[k];
+	objects.swap(by_id);
+}
+
+void ReprojectionCache::resize(int width, int height) {
+	w = width;
+	h = height;
+	const size_t pixels = static_cast<size_t>(w) * h;
+	last.assign(pixels, Entry());
+	next.assign(pixels, Entry());
+	last_visible.assign(pixels * lights, 0.0);
+	next_visible.assign(pixels * lights, 0.0);
+	candidate.assign(pixels, -1);
+	trusted.assign(pixels, 0);
+	fresh = true;
+}
+
+void ReprojectionCache::invalidate() {
+	std::fill(last.begin(), last.end(), Entry());
+	fresh = true;
+}
+
+// visibilities are carried over from the hit a pixel last saw, not the
+// one it sees now. that's only safe away from the edges of shadows, so
+// hits next to one that can see a different amount of some light aren't
+// carried over
+bool ReprojectionCache::nearShadowEdge(int i, int j) const {
+	const size_t at = static_cast<size_t>(i) * h + j;
+	const double *here = last_visible.data() + at * lights;
+
+	for (int n = 0; n < 9; n++) {
+		const int ni = i + n % 3 - 1, nj = j + n / 3 - 1;
+		if (ni < 0 || ni >= w || nj < 0 || nj >= h)
+			continue;
+		const size_t there = static_cast<size_t>(ni) * h + nj;
+		if (last[there].object < 0)
+			continue;
+		if (!std::equal(here, here + lights, last_visible.data() + there * lights))
+			return true;
+	}
+	return false;
+}
+
+void ReprojectionCache::beginFrame(const Camera &cam, const Viewport &vp) {
+	if (vp.pixelsWide() != w || vp.pixelsTall() != h)
+		resize(vp.pixelsWide(), vp.pixelsTall());
+
+	const double d = vp.getViewingDistance();
+	const double u0 = vp.uAt(0.0), du = vp.uAt(1.0) - u0;
+	const double v0 = vp.vAt(0.0), dv = vp.vAt(1.0) - v0;
+
+	// every hit that can still be carried over lands on the pixel it's
+	// now seen through, and the nearest one there wins
+	std::vector<double> depth(last.size(), INFINITY);
+	std::fill(candidate.begin(), candidate.end(), -1);
+	for (size_t k = 0; usable && k < last.size(); k++) {
+		const Entry &e = last[k];
+		if (e.object < 0 || e.object >= static_cast<int>(objects.size()) || !objects[e.object]
+		    || e.age >= REPROJECT_MAX_AGE || nearShadowEdge(static_cast<int>(k) / h, static_cast<int>(k) % h))
+			continue;
+
+		const vec3 to = e.p - cam.position;
+		const double z = -to.dot(cam.wAxis);
+		if (z <= 0.0)
+			continue;
+		const double x = (to.dot(cam.uAxis) * d / z - u0) / du;
+		const double y = (to.dot(cam.vAxis) * d / z - v0) / dv;
+		if (!(x >= 0.0 && x < w && y >= 0.0 && y < h))
+			continue;
+
+		const size_t at = static_cast<size_t>(x) * h + static_cast<size_t>(y);
+		if (z < depth[at]) {
+			depth[at] = z;
+			candidate[at] = static_cast<int>(k);
+		}
+	}
+
+	// a hit that lands among hits on the same object at about the same
+	// depth is in the middle of a surface that was in view and still is.
+	// anything that has come into view in front of it would have to have
+	// come out from behind something nearer, next to it, or in from the
+	// edge of the frame, so those are the only ones that get a
+	// validation ray
+	std::vector<int> landed(candidate);
+	std::fill(trusted.begin(), trusted.end(), 0);
+	for (int i = REPROJECT_BORDER; i < w - REPROJECT_BORDER; i++) {
+		for (int j = REPROJECT_BORDER; j < h - REPROJECT_BORDER; j++) {
+			const size_t at = static_cast<size_t>(i) * h + j;
+			if (landed[at] < 0)
+				continue;
+
+			bool same = true;
+			for (int n = 0; n < 9 && same; n++) {
+				const size_t there = static_cast<size_t>(i + n % 3 - 1) * h + (j + n / 3 - 1);
+				same = landed[there] < 0 || (last[landed[there]].object == last[landed[at]].object
+					&& std::fabs(depth[there] - depth[at]) <= REPROJECT_DEPTH_TOLERANCE * depth[at]);
+			}
+			trusted[at] = same;
+		}
+	}
+
+	// pixels nothing landed on borrow the nearest of their neighbours'.
+	// where the surface has grown, it's likely to be the same object
+	for (int i = 0; i < w; i++) {
+		for (int j = 0; j < h; j++) {
+			const size_t at = static_cast<size_t>(i) * h + j;
+			if (landed[at] >= 0)
+				continue;
+
+			const int ni[4] = { i - 1, i + 1, i, i };
+			const int nj[4] = { j, j, j - 1, j + 1 };
+			double nearest = INFINITY;
+			for (int n = 0; n < 4; n++) {
+				if (ni[n] < 0 || ni[n] >= w || nj[n] < 0 || nj[n] >= h)
+					continue;
+				const size_t there = static_cast<size_t>(ni[n]) * h + nj[n];
+				if (landed[there] >= 0 && depth[there] < nearest) {
+					nearest = depth[there];
+					candidate[at] = landed[there];
+				}
+			}
+		}
+	}
+}
+
+// so that the pixels of a frame traced in full don't all need tracing
+// again in the same later frame
+static uint8_t staggeredAge(int i, int j) {
+	return static_cast<uint8_t>((static_cast<unsigned int>(i) * 73856093u ^ static_cast<unsigned int>(j) * 19349663u)
+		% REPROJECT_MAX_AGE);
+}
+
+bool ReprojectionCache::carryOver(const Ray &ray, const Entry &old, bool check, IntersectionDatum &hit) {
+	SceneObject *obj = objects[old.object];
+	IntersectionResult r = obj->intersects(ray);
+	if (!r.intersected || r.coefficient <= 0.0)
+		return false;
+
+	// the visibilities are only good near where they were worked out,
+	// and each frame the hit can move a little further from there
+	const vec3 drift = ray.intersectionPoint(r.coefficient) - old.lit;
+	const double reach = REPROJECT_DRIFT * ray.widthAt(r.coefficient);
+	if (drift.dot(drift) > reach * reach)
+		return false;
+
+	// the validation ray: anything at all in front of the hit means obj
+	// isn't what the ray sees first any more
+	if (check && world->blocked(ray, r.coefficient * (1.0 - 1e-9)))
+		return false;
+
+	hit = IntersectionDatum(r, obj);
+	return true;
+}
+
+void ReprojectionCache::renderTile(RenderJob &job, const Tile &tile, RenderStats &) {
+	Image &img = *job.image;
+	long tile_carried = 0, tile_traced = 0;
+
+	for (int i = tile.x0; i < tile.x1; i++) {
+		for (int j = tile.y0; j < tile.y1; j++) {
+			const size_t k = static_cast<size_t>(i) * h + j;
+			const Ray ray = World::pixelRay(job.camera, job.viewport, i, j);
+			Entry &e = next[k];
+			double *visible = next_visible.data() + k * lights;
+
+			IntersectionDatum hit;
+			RGBVec c;
+			const int from = candidate[k];
+			if (from >= 0 && carryOver(ray, last[from], !trusted[k], hit)) {
+				const Entry &old = last[from];
+				std::copy(last_visible.begin() + from * lights, last_visible.begin() + (from + 1) * lights, visible);
+				c = world->shadeCameraHit(ray, hit, visible, true);
+				e.p = ray.intersectionPoint(hit.coefficient);
+				e.lit = old.lit;
+				e.object = old.object;
+				e.age = old.age + 1;
+				tile_carried++;
+			}
+			else {
+				c = world->traceCameraRay(ray, hit, visible);
+				e.object = hit.intersected && usable ? hit.intersectedObj->id : -1;
+				if (hit.intersected) {
+					e.p = ray.intersectionPoint(hit.coefficient);
+					e.lit = e.p;
+				}
+				e.age = fresh ? staggeredAge(i, j) : 0;
+				tile_traced++;
+			}
+
+			img[i - job.region.x0][j - job.region.y0] = RGBColour(c);
+		}
+	}
+
+	carried += tile_carried;
+	traced += tile_traced;
+}
+
+void ReprojectionCache::endFrame() {
+	last.swap(next);
+	last_visible.swap(next_visible);
+	fresh = false;
+}
+
+long ReprojectionCache::pixelsCarried() const {
+	return carried;
+}
+
+long ReprojectionCache::pixelsTraced() const {
+	return traced;
+}
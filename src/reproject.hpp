@@ -0,0 +1,112 @@
+/* reproject.hpp
+ *
+ * carrying first hits over from one frame to the next while the camera
+ * moves
+ *
+ * between two frames of a fly-through most pixels still see the same
+ * surface, just from a little further round. the cache keeps, for every
+ * pixel of the last frame, the point its ray hit, what it hit, and how
+ * much of each light could be seen from there. at the start of the next
+ * frame those points are projected into the new view, nearest first,
+ * and each pixel takes the object that lands on it (or on a pixel next
+ * to it, for surfaces that have grown). the pixel's ray is then only
+ * tested against that object. if it landed in the middle of the object,
+ * among hits on it at about the same depth, and away from the edge of
+ * the frame, that's the hit. otherwise (next to a silhouette, where
+ * things come out from behind each other) a validation ray checks that
+ * nothing else is in front of it.
+ *
+ * either way the hit is shaded without any shadow rays, using the light
+ * visibilities that came with it. the specular highlight is worked out
+ * for the new view and reflections are traced again, since those change
+ * as the camera moves. hits on the edge of a shadow aren't carried over,
+ * as the new point could be on the other side of it.
+ *
+ * pixels nothing landed on (ones that have just come into view, round
+ * the edge of the frame or from behind something), and ones whose
+ * object is missed or hidden, are traced as usual. so is every pixel
+ * once its hit has been carried over REPROJECT_MAX_AGE times, or has
+ * slid more than REPROJECT_DRIFT pixels across the surface from where
+ * its visibilities were worked out, so that they stay close to right.
+ * ages start out staggered, so the refresh is spread across frames.
+ *
+ * the cache renders previews: one ray through the middle of each pixel,
+ * whatever the ss_level. it only works for camera moves: once objects
+ * move, invalidate() it. scenes that pick lights from a light tree are
+ * always traced in full.
+ */
+
+#ifndef REPROJECT_HEADER_WARRIOR
+#define REPROJECT_HEADER_WARRIOR
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+#include "world.hpp"
+#include "renderer.hpp"
+
+#define REPROJECT_MAX_AGE 16
+#define REPROJECT_BORDER 2			// pixels round the frame that are always validated
+#define REPROJECT_DEPTH_TOLERANCE 0.05		// how much nearby hits' depths can differ, relatively
+#define REPROJECT_DRIFT 2			// how far (in pixels) a hit can get from where its visibilities are from
+
+class ReprojectionCache {
+private:
+	// one pixel's first hit
+	struct Entry {
+		vec3 p;
+		vec3 lit;	// where its light visibilities were worked out
+		int32_t object;		// index into objects, -1 if there's nothing to carry over
+		uint8_t age;		// frames it's been carried over for
+
+		Entry();
+	};
+
+	World *world;
+	std::vector<SceneObject*> objects;	// by SceneObject::id
+	size_t lights;
+	bool usable;
+	bool fresh;		// there's no last frame to carry anything over from
+
+	int w, h;
+	std::vector<Entry> last, next;		// pixel (i, j) is at i * h + j, as in Image
+	std::vector<double> last_visible, next_visible;		// `lights` per pixel
+	std::vector<int> candidate;		// for each pixel of the new frame, the entry of last to try
+	std::vector<uint8_t> trusted;		// true if the candidate doesn't need a validation ray
+
+	std::atomic<long> carried;
+	std::atomic<long> traced;
+
+	void resize(int width, int height);
+	bool nearShadowEdge(int i, int j) const;
+
+	// where the ray hits what old hit, if the hit can be carried over
+	// from it. `check` asks for a validation ray
+	bool carryOver(const Ray &ray, const Entry &old, bool check, IntersectionDatum &hit);
+
+public:
+	// the world's objects must be numbered (World::numberObjects), and
+	// stay put until invalidate() is called
+	ReprojectionCache(World &world);
+
+	// forgets the last frame, so the next is traced in full
+	void invalidate();
+
+	// projects the last frame's hits into the view of the next one
+	void beginFrame(const Camera &cam, const Viewport &vp);
+
+	// a RenderJob::tileRenderer for the frame begun, whose jobs have to
+	// cover the whole viewport. only the job's camera and viewport
+	// count, it's always one ray per pixel
+	void renderTile(RenderJob &job, const Tile &tile, RenderStats &stats);
+
+	// the frame just rendered becomes the one to carry hits over from
+	void endFrame();
+
+	// pixels carried over and traced in full, over every frame so far
+	long pixelsCarried() const;
+	long pixelsTraced() const;
+};
+
+#endif
@@ -0,0 +1,380 @@
+#include "scenefile.hpp"
+
+#include <fstream>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+#include <cfloat>
+
+SceneFileException::SceneFileException(const std::string &path, const std::string &msg) :
+	std::runtime_error(path + ": " + msg) {}
+
+static uint64_t alignUp(uint64_t x) {
+	return (x + SCENE_FILE_ALIGN - 1) & ~static_cast<uint64_t>(SCENE_FILE_ALIGN - 1);
+}
+
+/* SceneFileWriter implementation */
+
+SceneFileWriter::SceneFileWriter() {
+	memset(&settings, 0, sizeof(settings));
+	settings.width = 1000;
+	settings.height = 800;
+	settings.camera_width = 0.1;
+	settings.viewing_distance = 0.25;
+	settings.shadows = 1;
+	settings.reflections = 1;
+	settings.ss_level = 2;
+}
+
+uint32_t SceneFileWriter::addMaterial(const Material &mat) {
+	SceneMaterialRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.colour[0] = mat.material_colour.r();
+	rec.colour[1] = mat.material_colour.g();
+	rec.colour[2] = mat.material_colour.b();
+	rec.specular_colour[0] = mat.specular_colour.r();
+	rec.specular_colour[1] = mat.specular_colour.g();
+	rec.specular_colour[2] = mat.specular_colour.b();
+	rec.specularity = mat.specularity;
+	rec.ambient = mat.ambient;
+	rec.diffuse = mat.diffuse;
+	rec.reflective = mat.reflective;
+	materials.push_back(rec);
+	return static_cast<uint32_t>(materials.size() - 1);
+}
+
+void SceneFileWriter::addLight(const Light &light) {
+	SceneLightRecord rec;
+	rec.pos[0] = light.pos.x();
+	rec.pos[1] = light.pos.y();
+	rec.pos[2] = light.pos.z();
+	rec.colour[0] = light.colour.r();
+	rec.colour[1] = light.colour.g();
+	rec.colour[2] = light.colour.b();
+	lights.push_back(rec);
+}
+
+void SceneFileWriter::addMesh(const MeshData &mesh, uint32_t material, uint32_t cluster, bool with_hierarchy) {
+	SceneMeshRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.num_vertices = mesh.num_vertices;
+	rec.num_triangles = mesh.num_triangles;
+	rec.num_nodes = with_hierarchy ? mesh.num_nodes : 0;
+	rec.material = material;
+	rec.cluster = cluster;
+	meshes.push_back(rec);
+	mesh_data.push_back(&mesh);
+	mesh_prebuilt.push_back(with_hierarchy);
+}
+
+template <typename T>
+static void addSection(std::vector<SceneSection> &table, uint32_t type, const std::vector<T> &recs) {
+	SceneSection s;
+	s.type = type;
+	s.count = static_cast<uint32_t>(recs.size());
+	s.offset = 0;
+	s.bytes = recs.size() * sizeof(T);
+	table.push_back(s);
+}
+
+static void writePadded(std::ofstream &out, const void *data, uint64_t bytes, uint64_t &pos) {
+	static const char zeros[SCENE_FILE_ALIGN] = { 0 };
+	uint64_t start = alignUp(pos);
+	out.write(zeros, static_cast<std::streamsize>(start - pos));
+	if (bytes > 0)
+		out.write(static_cast<const char *>(data), static_cast<std::streamsize>(bytes));
+	pos = start + bytes;
+}
+
+void SceneFileWriter::write(const std::string &path) {
+	std::vector<SceneSection> table;
+	std::vector<SceneSettingsRecord> settings_vec(1, settings);
+	addSection(table, section_settings, settings_vec);
+	addSection(table, section_materials, materials);
+	addSection(table, section_lights, lights);
+	addSection(table, section_spheres, spheres);
+	addSection(table, section_planes, planes);
+	addSection(table, section_meshes, meshes);
+
+	// lay everything out: header, section table, records, mesh arrays
+	uint64_t pos = sizeof(SceneFileHeader) + table.size() * sizeof(SceneSection);
+	for (size_t i = 0; i < table.size(); i++) {
+		pos = alignUp(pos);
+		table[i].offset = pos;
+		pos += table[i].bytes;
+	}
+
+	for (size_t i = 0; i < meshes.size(); i++) {
+		const MeshData &m = *mesh_data[i];
+		pos = alignUp(pos);
+		meshes[i].vertex_offset = pos;
+		pos += m.num_vertices * sizeof(MeshVertex);
+		pos = alignUp(pos);
+		meshes[i].triangle_offset = pos;
+		pos += m.num_triangles * sizeof(MeshTriangle);
+		pos = alignUp(pos);
+		meshes[i].node_offset = mesh_prebuilt[i] ? pos : 0;
+		if (mesh_prebuilt[i])
+			pos += m.num_nodes * sizeof(MeshNode);
+	}
+
+	SceneFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC));
+	header.version = SCENE_FILE_VERSION;
+	header.num_sections = static_cast<uint32_t>(table.size());
+	header.file_size = pos;
+
+	std::ofstream out(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw SceneFileException(path, "cannot open for writing");
+
+	uint64_t at = 0;
+	writePadded(out, &header, sizeof(header), at);
+	out.write(reinterpret_cast<const char *>(&table[0]), table.size() * sizeof(SceneSection));
+	at += table.size() * sizeof(SceneSection);
+
+	writePadded(out, &settings, sizeof(settings), at);
+	writePadded(out, materials.empty() ? NULL : &materials[0], table[1].bytes, at);
+	writePadded(out, lights.empty() ? NULL : &lights[0], table[2].bytes, at);
+	writePadded(out, spheres.empty() ? NULL : &spheres[0], table[3].bytes, at);
+	writePadded(out, planes.empty() ? NULL : &planes[0], table[4].bytes, at);
+	writePadded(out, meshes.empty() ? NULL : &meshes[0], table[5].bytes, at);
+
+	for (size_t i = 0; i < meshes.size(); i++) {
+		const MeshData &m = *mesh_data[i];
+		writePadded(out, m.vertices, m.num_vertices * sizeof(MeshVertex), at);
+		writePadded(out, m.triangles, m.num_triangles * sizeof(MeshTriangle), at);
+		if (mesh_prebuilt[i])
+			writePadded(out, m.nodes, m.num_nodes * sizeof(MeshNode), at);
+	}
+
+	if (!out)
+		throw SceneFileException(path, "write failed");
+}
+
+/* loading */
+
+// looks up a section and checks it fits in the file
+template <typename T>
+static const T *findSection(const MappedFile &file, const SceneSection *table, uint32_t n, uint32_t type, uint32_t &count) {
+	for (uint32_t i = 0; i < n; i++) {
+		if (table[i].type != type) continue;
+		if (table[i].bytes != static_cast<uint64_t>(table[i].count) * sizeof(T)
+		    || !file.contains(table[i].offset, table[i].bytes)
+		    || table[i].offset % SCENE_FILE_ALIGN != 0)
+			throw SceneFileException(file.name(), "corrupt section table");
+		count = table[i].count;
+		return reinterpret_cast<const T *>(file.data() + table[i].offset);
+	}
+	count = 0;
+	return NULL;
+}
+
+static Material materialFromRecord(const SceneMaterialRecord &r) {
+	Material m(RGBVec(r.colour[0], r.colour[1], r.colour[2]),
+		   RGBVec(r.specular_colour[0], r.specular_colour[1], r.specular_colour[2]),
+		   r.specularity, r.ambient, r.reflective != 0);
+	m.diffuse = r.diffuse != 0;
+	return m;
+}
+
+static Cluster *clusterFor(std::map<uint32_t, Cluster *> &clusters, uint32_t id) {
+	Cluster *&c = clusters[id];
+	if (c == NULL) c = new Cluster();
+	return c;
+}
+
+void loadSceneFile(const std::string &path, World &world) {
+	std::shared_ptr<const MappedFile> file(new MappedFile(path));
+
+	if (file->size() < sizeof(SceneFileHeader))
+		throw SceneFileException(path, "not a traceify scene file");
+
+	const SceneFileHeader *header = reinterpret_cast<const SceneFileHeader *>(file->data());
+	if (memcmp(header->magic, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC)) != 0)
+		throw SceneFileException(path, "not a traceify scene file");
+	if (header->version != SCENE_FILE_VERSION)
+		throw SceneFileException(path, "unsupported scene file version " + std::to_string(header->version));
+	if (header->file_size != file->size()
+	    || !file->contains(sizeof(SceneFileHeader), header->num_sections * sizeof(SceneSection)))
+		throw SceneFileException(path, "truncated scene file");
+
+	const SceneSection *table = reinterpret_cast<const SceneSection *>(file->data() + sizeof(SceneFileHeader));
+	uint32_t n_sections = header->num_sections;
+
+	uint32_t n_settings, n_materials, n_lights, n_spheres, n_planes, n_meshes;
+	const SceneSettingsRecord *settings = findSection<SceneSettingsRecord>(*file, table, n_sections, section_settings, n_settings);
+	const SceneMaterialRecord *mats = findSection<SceneMaterialRecord>(*file, table, n_sections, section_materials, n_materials);
+	const SceneLightRecord *lights = findSection<SceneLightRecord>(*file, table, n_sections, section_lights, n_lights);
+	const SceneSphereRecord *spheres = findSection<SceneSphereRecord>(*file, table, n_sections, section_spheres, n_spheres);
+	const ScenePlaneRecord *planes = findSection<ScenePlaneRecord>(*file, table, n_sections, section_planes, n_planes);
+	const SceneMeshRecord *meshes = findSection<SceneMeshRecord>(*file, table, n_sections, section_meshes, n_meshes);
+
+	if (n_settings == 1) {
+		const SceneSettingsRecord &s = *settings;
+		if (s.width < 1 || s.height < 1 || s.width > SCENE_FILE_MAX_SIZE || s.height > SCENE_FILE_MAX_SIZE
+		    || s.ss_level < 1 || s.ss_level > 4)
+			throw SceneFileException(path, "corrupt settings");
+		world.viewport = Viewport(s.width, s.height, s.camera_width, s.viewing_distance);
+		world.setCameraPosition(vec3(s.camera_pos[0], s.camera_pos[1], s.camera_pos[2]));
+		world.cameraRotateY(s.rotate_y);
+		world.cameraRotateX(s.rotate_x);
+		world.bg_colour = RGBVec(s.background[0], s.background[1], s.background[2]);
+		world.shadows_enabled = s.shadows != 0;
+		world.reflections_enabled = s.reflections != 0;
+		world.ss_level = s.ss_level;
+	}
+
+	std::vector<Material> materials;
+	for (uint32_t i = 0; i < n_materials; i++)
+		materials.push_back(materialFromRecord(mats[i]));
+	if (materials.empty())
+		materials.push_back(Material(RGBVec(0.7, 0.7, 0.7), RGBVec(), 0.0, 0.0, false));
+
+	for (uint32_t i = 0; i < n_lights; i++) {
+		const SceneLightRecord &l = lights[i];
+		world.addLight(Light(vec3(l.pos[0], l.pos[1], l.pos[2]), RGBVec(l.colour[0], l.colour[1], l.colour[2])));
+	}
+
+	// out of range material indices fall back to the first material
+	#define SCENE_MATERIAL(idx) (materials[(idx) < materials.size() ? (idx) : 0])
+
+	std::map<uint32_t, Cluster *> clusters;
+
+	for (uint32_t i = 0; i < n_planes; i++) {
+		const ScenePlaneRecord &p = planes[i];
+		world.adoptObject(new Plane(vec3(p.normal[0], p.normal[1], p.normal[2]), p.k, SCENE_MATERIAL(p.material)));
+	}
+
+	for (uint32_t i = 0; i < n_spheres; i++) {
+		const SceneSphereRecord &s = spheres[i];
+		Sphere *sphere = new Sphere(vec3(s.centre[0], s.centre[1], s.centre[2]), s.radius, SCENE_MATERIAL(s.material));
+		if (s.cluster == SCENE_NO_CLUSTER)
+			world.adoptObject(sphere);
+		else
+			clusterFor(clusters, s.cluster)->adoptObject(sphere);
+	}
+
+	for (uint32_t i = 0; i < n_meshes; i++) {
+		const SceneMeshRecord &m = meshes[i];
+		if (!file->contains(m.vertex_offset, m.num_vertices * sizeof(MeshVertex))
+		    || !file->contains(m.triangle_offset, m.num_triangles * sizeof(MeshTriangle))
+		    || (m.num_nodes > 0 && !file->contains(m.node_offset, m.num_nodes * sizeof(MeshNode))))
+			throw SceneFileException(path, "mesh " + std::to_string(i) + " lies outside the file");
+		if (m.vertex_offset % SCENE_FILE_ALIGN != 0 || m.triangle_offset % SCENE_FILE_ALIGN != 0
+		    || (m.num_nodes > 0 && m.node_offset % SCENE_FILE_ALIGN != 0))
+			throw SceneFileException(path, "mesh " + std::to_string(i) + " is misaligned");
+
+		const char *base = file->data();
+		std::shared_ptr<const MeshData> data;
+		try {
+			data.reset(new MeshData(file,
+				reinterpret_cast<const MeshVertex *>(base + m.vertex_offset), m.num_vertices,
+				reinterpret_cast<const MeshTriangle *>(base + m.triangle_offset), m.num_triangles,
+				m.num_nodes > 0 ? reinterpret_cast<const MeshNode *>(base + m.node_offset) : NULL, m.num_nodes));
+		}
+		catch (const GeometryException &e) {
+			throw SceneFileException(path, "mesh " + std::to_string(i) + ": " + e.what());
+		}
+
+		Mesh *mesh = new Mesh(data, SCENE_MATERIAL(m.material));
+		if (m.cluster == SCENE_NO_CLUSTER)
+			world.adoptObject(mesh);
+		else
+			clusterFor(clusters, m.cluster)->adoptObject(mesh);
+	}
+
+	#undef SCENE_MATERIAL
+
+	for (std::map<uint32_t, Cluster *>::iterator it = clusters.begin(); it != clusters.end(); it++)
+		world.adoptObject(it->second);
+}
+
+/* OBJ conversion */
+
+// resolves a (possibly negative, i.e. relative) OBJ index
+static bool objIndex(const char *tok, size_t n_verts, uint32_t &out) {
+	long idx = strtol(tok, NULL, 10);
+	if (idx < 0) idx += static_cast<long>(n_verts) + 1;
+	if (idx < 1 || static_cast<size_t>(idx) > n_verts) return false;
+	out = static_cast<uint32_t>(idx - 1);
+	return true;
+}
+
+void convertObjToSceneFile(const std::string &obj_path, const std::string &scene_path) {
+	std::ifstream in(obj_path.c_str());
+	if (!in)
+		throw SceneFileException(obj_path, "cannot open");
+
+	std::vector<MeshVertex> verts;
+	std::vector<MeshTriangle> tris;
+	std::vector<uint32_t> face;
+	std::string line;
+	size_t line_no = 0;
+
+	while (std::getline(in, line)) {
+		line_no++;
+		const char *c = line.c_str();
+		while (*c == ' ' || *c == '\t') c++;
+
+		if (c[0] == 'v' && (c[1] == ' ' || c[1] == '\t')) {
+			char *end;
+			MeshVertex v;
+			v.x = strtof(c + 2, &end);
+			v.y = strtof(end, &end);
+			v.z = strtof(end, &end);
+			verts.push_back(v);
+		}
+		else if (c[0] == 'f' && (c[1] == ' ' || c[1] == '\t')) {
+			// faces look like "f 1 2 3" or "f 1/1/1 2/2/2 3/3/3",
+			// we only care about the vertex index
+			face.clear();
+			c += 2;
+			while (*c) {
+				while (*c == ' ' || *c == '\t' || *c == '\r') c++;
+				if (!*c) break;
+				uint32_t idx;
+				if (!objIndex(c, verts.size(), idx))
+					throw SceneFileException(obj_path, "bad face index on line " + std::to_string(line_no));
+				face.push_back(idx);
+				while (*c && *c != ' ' && *c != '\t') c++;
+			}
+			for (size_t k = 2; k < face.size(); k++) {
+				MeshTriangle t = { { face[0], face[k-1], face[k] } };
+				tris.push_back(t);
+			}
+		}
+	}
+
+	if (tris.empty())
+		throw SceneFileException(obj_path, "no faces found");
+
+	MeshData mesh(verts, tris);
+	BoundingBox bb = mesh.bounds();
+
+	SceneFileWriter writer;
+
+	// frame the mesh: the default viewport sees about 0.2 units across
+	// for each unit in front of the camera, so back off far enough to
+	// fit the larger of the mesh's width and height
+	double cx = 0.5 * (bb.x_min + bb.x_max);
+	double cy = 0.5 * (bb.y_min + bb.y_max);
+	double w = bb.x_max - bb.x_min;
+	double h = bb.y_max - bb.y_min;
+	double size = w > h ? w : h;
+	double back_off = size * 0.5 / (0.5 * writer.settings.camera_width / writer.settings.viewing_distance) * 1.1;
+
+	writer.settings.camera_pos[0] = cx;
+	writer.settings.camera_pos[1] = cy;
+	writer.settings.camera_pos[2] = bb.z_min - back_off;
+
+	Material mat(RGBVec(0.7, 0.7, 0.75), RGBVec(0.2, 0.2, 0.2), 20.0, 0.1, false);
+	uint32_t mat_idx = writer.addMaterial(mat);
+
+	writer.addLight(Light(vec3(cx - size, bb.y_max + size, bb.z_min - back_off), RGBVec(0.9, 0.9, 0.9)));
+	writer.addLight(Light(vec3(cx + size, cy, bb.z_min - size), RGBVec(0.3, 0.3, 0.3)));
+
+	writer.addMesh(mesh, mat_idx, SCENE_NO_CLUSTER, true);
+	writer.write(scene_path);
+}
@@ -0,0 +1,162 @@
+/* scenefile.hpp
+ *
+ * traceify's binary scene format
+ *
+ * a scene file is a header and a table of sections, followed by
+ * fixed-layout records. the file is memory-mapped when it is loaded and
+ * the big arrays (mesh vertices, triangles and their hierarchies) are
+ * used in place, so there is no parse step: opening even a very large
+ * scene only costs the page faults for the parts that rays actually
+ * touch, and processes rendering the same scene share those pages.
+ *
+ * everything is stored in native (little-endian) layout. bump
+ * SCENE_FILE_VERSION whenever a record changes shape
+ */
+
+#ifndef SCENEFILE_HEADER_WARRIOR
+#define SCENEFILE_HEADER_WARRIOR
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <stdint.h>
+
+#include "world.hpp"
+#include "mesh.hpp"
+
+#define SCENE_FILE_MAGIC 	"TRCFSCN"
+#define SCENE_FILE_VERSION 	1
+#define SCENE_FILE_ALIGN 	64
+
+// the largest viewport a scene file can ask for, either way
+#define SCENE_FILE_MAX_SIZE 	65536
+
+// records with no cluster go straight into the world
+#define SCENE_NO_CLUSTER 	0
+
+enum SceneSectionType {
+	section_settings = 1,
+	section_materials,
+	section_lights,
+	section_spheres,
+	section_planes,
+	section_meshes
+};
+
+struct SceneFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_sections;
+	uint64_t file_size;
+};
+
+struct SceneSection {
+	uint32_t type;
+	uint32_t count;
+	uint64_t offset;
+	uint64_t bytes;
+};
+
+// camera, viewport and render settings
+//
+// the camera is positioned and then rotated with cameraRotateY
+// followed by cameraRotateX, just like in render_demo
+struct SceneSettingsRecord {
+	int32_t width;
+	int32_t height;
+	double camera_width;
+	double viewing_distance;
+	double camera_pos[3];
+	double rotate_y;
+	double rotate_x;
+	double background[3];
+	int32_t shadows;
+	int32_t reflections;
+	int32_t ss_level;
+	int32_t reserved;
+};
+
+struct SceneMaterialRecord {
+	double colour[3];
+	double specular_colour[3];
+	double specularity;
+	double ambient;
+	int32_t diffuse;
+	int32_t reflective;
+};
+
+struct SceneLightRecord {
+	double pos[3];
+	double colour[3];
+};
+
+struct SceneSphereRecord {
+	double centre[3];
+	double radius;
+	uint32_t material;
+	uint32_t cluster;
+};
+
+struct ScenePlaneRecord {
+	double normal[3];
+	double k;
+	uint32_t material;
+	uint32_t reserved;
+};
+
+// the arrays of a mesh live elsewhere in the file, at the given
+// (SCENE_FILE_ALIGN aligned) offsets. num_nodes is 0 if the hierarchy
+// wasn't prebuilt, in which case it is built when the scene is loaded
+struct SceneMeshRecord {
+	uint64_t vertex_offset;
+	uint64_t triangle_offset;
+	uint64_t node_offset;
+	uint32_t num_vertices;
+	uint32_t num_triangles;
+	uint32_t num_nodes;
+	uint32_t material;
+	uint32_t cluster;
+	uint32_t reserved;
+};
+
+struct SceneFileException : public std::runtime_error {
+	SceneFileException(const std::string &path, const std::string &msg);
+};
+
+/* SceneFileWriter
+ *
+ * collects records and writes them out as a scene file */
+class SceneFileWriter {
+private:
+	std::vector<const MeshData *> mesh_data;
+	std::vector<bool> mesh_prebuilt;
+
+public:
+	SceneSettingsRecord settings;
+	std::vector<SceneMaterialRecord> materials;
+	std::vector<SceneLightRecord> lights;
+	std::vector<SceneSphereRecord> spheres;
+	std::vector<ScenePlaneRecord> planes;
+	std::vector<SceneMeshRecord> meshes;
+
+	SceneFileWriter();
+
+	uint32_t addMaterial(const Material &mat);
+	void addLight(const Light &light);
+
+	// the mesh data must outlive the call to write()
+	void addMesh(const MeshData &mesh, uint32_t material, uint32_t cluster, bool with_hierarchy);
+
+	void write(const std::string &path);
+};
+
+// maps `path` and adds everything in it to `world`, including the
+// camera, viewport and render settings
+void loadSceneFile(const std::string &path, World &world);
+
+// converts a Wavefront OBJ file to a scene file with a camera and light
+// set up to frame the mesh. only geometry (v and f lines) is used,
+// polygons are split into triangle fans
+void convertObjToSceneFile(const std::string &obj_path, const std::string &scene_path);
+
+#endif
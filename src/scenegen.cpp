@@ -0,0 +1,289 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "scenegen.hpp"
+#include "scenefile.hpp"
+
+#include <unistd.h>
+
+#define SCENEGEN_SPACING 2.0		// between neighbouring objects, on average, as in the demo scene
+#define SCENEGEN_MATERIALS 8		// of each kind, diffuse and reflective
+
+SceneGenOptions::SceneGenOptions() : primitives(10000), distribution(distribution_uniform), seed(1),
+	reflective(0.25), meshes(0.0), lights(2), planes(1) {}
+
+static const char *distribution_names[] = { "uniform", "clustered", "skewed" };
+
+bool parseDistribution(const std::string &name, SceneDistribution &out) {
+	for (int k = 0; k < 3; k++) {
+		if (name == distribution_names[k]) {
+			out = static_cast<SceneDistribution>(k);
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *distributionName(SceneDistribution d) {
+	return distribution_names[d];
+}
+
+/* ScratchFile implementation */
+
+ScratchFile::ScratchFile(const std::string &name) {
+	// mkstemp fills in the Xs in place
+	const std::string pattern = "/tmp/traceify_" + name + "_XXXXXX";
+	std::vector<char> buf(pattern.begin(), pattern.end());
+	buf.push_back('\0');
+	const int fd = mkstemp(&buf[0]);
+	if (fd < 0)
+		throw SceneFileException(pattern, "cannot create");
+	close(fd);
+	file = &buf[0];
+}
+
+ScratchFile::~ScratchFile() {
+	remove(file.c_str());
+}
+
+const std::string &ScratchFile::path() const {
+	return file;
+}
+
+namespace {
+
+/* SceneRandom
+ *
+ * mt19937_64's output is fixed by the standard, but what the standard
+ * library's distributions make of it isn't, so a seed would give a
+ * different scene with each library. turning the raw output into
+ * numbers here keeps generated scenes the same everywhere */
+class SceneRandom {
+private:
+	std::mt19937_64 rng;
+	double spare;		// Box-Muller makes normals in pairs
+	bool have_spare;
+
+public:
+	SceneRandom(uint64_t seed) : rng(seed), spare(0.0), have_spare(false) {}
+
+	// in [0, 1), from the top 53 bits
+	double unit() {
+		return static_cast<double>(rng() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	// mean 0, standard deviation 1
+	double normal() {
+		if (have_spare) {
+			have_spare = false;
+			return spare;
+		}
+		const double r = std::sqrt(-2.0 * std::log(1.0 - unit()));	// 1 - unit() is never 0
+		const double theta = 2.0 * M_PI * unit();
+		spare = r * std::sin(theta);
+		have_spare = true;
+		return r * std::cos(theta);
+	}
+};
+
+/* Scatter
+ *
+ * picks where each object goes and how big it is. the box is `side`
+ * across, sitting on y = 0 and centred on the y axis */
+class Scatter {
+private:
+	SceneDistribution distribution;
+	double side;
+	std::vector<double> clumps;		// x, y, z of each
+	double clump_size;
+	SceneRandom &random;
+
+public:
+	Scatter(SceneDistribution d, double box_side, long count, SceneRandom &random)
+		: distribution(d), side(box_side), clump_size(0.0), random(random) {
+		if (distribution == distribution_clustered) {
+			const long n = std::max(1L, std::lround(std::cbrt(static_cast<double>(count))));
+			for (long k = 0; k < n; k++) {
+				clumps.push_back((random.unit() - 0.5) * side);
+				clumps.push_back(random.unit() * side);
+				clumps.push_back((random.unit() - 0.5) * side);
+			}
+			clump_size = side / (4.0 * std::cbrt(static_cast<double>(n)));
+		}
+	}
+
+	void next(double centre[3], double &radius) {
+		switch (distribution) {
+		case distribution_uniform:
+			centre[0] = (random.unit() - 0.5) * side;
+			centre[1] = random.unit() * side;
+			centre[2] = (random.unit() - 0.5) * side;
+			radius = SCENEGEN_SPACING * (0.2 + 0.2 * random.unit());
+			break;
+
+		case distribution_clustered: {
+			// clumps are about 0.6 times as far between neighbours
+			// as the uniform distribution
+			const size_t k = static_cast<size_t>(random.unit() * (clumps.size() / 3)) * 3;
+			for (int c = 0; c < 3; c++)
+				centre[c] = clumps[k + c] + random.normal() * clump_size;
+			radius = SCENEGEN_SPACING * 0.6 * (0.2 + 0.2 * random.unit());
+			break;
+		}
+
+		case distribution_skewed: {
+			// a random direction from the middle of the box, and a
+			// distance weighted heavily towards it
+			double dir[3], len = 0.0;
+			for (int c = 0; c < 3; c++) {
+				dir[c] = random.normal();
+				len += dir[c] * dir[c];
+			}
+			const double u = random.unit();
+			const double dist = 0.5 * side * u * u * u / std::max(std::sqrt(len), 1e-12);
+			centre[0] = dir[0] * dist;
+			centre[1] = 0.5 * side + dir[1] * dist;
+			centre[2] = dir[2] * dist;
+			radius = SCENEGEN_SPACING * 0.5 * std::exp(-std::log(300.0) * random.unit());
+			break;
+		}
+		}
+	}
+};
+
+// a lumpy ball: an octahedron subdivided `level` times and pushed out to
+// a radius that varies with direction. the lumps only depend on where a
+// vertex is, so the triangles either side of an edge still meet along it
+void addTriangle(std::vector<MeshVertex> &verts, std::vector<MeshTriangle> &tris,
+		const double centre[3], double radius, const vec3 &a, const vec3 &b, const vec3 &c, int level) {
+	if (level > 0) {
+		const vec3 ab = (a + b).normalised(), bc = (b + c).normalised(), ca = (c + a).normalised();
+		addTriangle(verts, tris, centre, radius, a, ab, ca, level - 1);
+		addTriangle(verts, tris, centre, radius, ab, b, bc, level - 1);
+		addTriangle(verts, tris, centre, radius, ca, bc, c, level - 1);
+		addTriangle(verts, tris, centre, radius, ab, bc, ca, level - 1);
+		return;
+	}
+
+	const vec3 corners[3] = { a, b, c };
+	MeshTriangle t;
+	for (int k = 0; k < 3; k++) {
+		const vec3 &d = corners[k];
+		const double r = radius * (1.0 + 0.15 * std::sin(3.0 * d.x()) * std::sin(3.0 * d.y() + 1.0) * std::sin(3.0 * d.z() + 2.0));
+		MeshVertex v = { static_cast<float>(centre[0] + d.x() * r), static_cast<float>(centre[1] + d.y() * r),
+			static_cast<float>(centre[2] + d.z() * r) };
+		t.v[k] = static_cast<uint32_t>(verts.size());
+		verts.push_back(v);
+	}
+	tris.push_back(t);
+}
+
+MeshData *makeRock(const double centre[3], double radius) {
+	std::vector<MeshVertex> verts;
+	std::vector<MeshTriangle> tris;
+	const vec3 axes[6] = { vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1), vec3(-1, 0, 0), vec3(0, -1, 0), vec3(0, 0, -1) };
+	for (int f = 0; f < 8; f++) {
+		const vec3 &x = axes[f & 1 ? 3 : 0], &y = axes[f & 2 ? 4 : 1], &z = axes[f & 4 ? 5 : 2];
+		// keep every face wound the same way round
+		if (((f & 1) + ((f >> 1) & 1) + ((f >> 2) & 1)) % 2)
+			addTriangle(verts, tris, centre, radius, x, z, y, SCENEGEN_MESH_LEVEL);
+		else
+			addTriangle(verts, tris, centre, radius, x, y, z, SCENEGEN_MESH_LEVEL);
+	}
+	return new MeshData(verts, tris);
+}
+
+}
+
+void generateSceneFile(const SceneGenOptions &opts, const std::string &path) {
+	SceneRandom random(opts.seed);
+
+	const long per_mesh = 8L << (2 * SCENEGEN_MESH_LEVEL);
+	const long num_meshes = static_cast<long>(opts.primitives * std::min(std::max(opts.meshes, 0.0), 1.0)) / per_mesh;
+	const long num_spheres = std::max(0L, opts.primitives - num_meshes * per_mesh);
+	const long objects = std::max(1L, num_spheres + num_meshes);
+	const double side = SCENEGEN_SPACING * std::cbrt(static_cast<double>(objects));
+
+	SceneFileWriter writer;
+
+	// back off far enough for the box to fill most of the frame, and
+	// look down on it a little
+	const double half_view = 0.5 * writer.settings.camera_width / writer.settings.viewing_distance;
+	const double back_off = 0.5 * side / half_view * 1.1;
+	writer.settings.camera_pos[0] = 0.0;
+	writer.settings.camera_pos[1] = 0.9 * side;
+	writer.settings.camera_pos[2] = -0.5 * side - back_off;
+	writer.settings.rotate_x = -std::atan2(0.4 * side, 0.5 * side + back_off);
+
+	// diffuse materials first, then reflective ones
+	for (int m = 0; m < 2 * SCENEGEN_MATERIALS; m++) {
+		const double f = static_cast<double>(m % SCENEGEN_MATERIALS) / SCENEGEN_MATERIALS;
+		const bool reflective = m >= SCENEGEN_MATERIALS;
+		writer.addMaterial(Material(RGBVec(0.3 + 0.6 * f, 0.5, 0.9 - 0.6 * f), RGBVec(0.2, 0.2, 0.2),
+			reflective ? 40.0 : 10.0, 0.05, reflective));
+	}
+	const uint32_t floor_mat = writer.addMaterial(Material(RGBVec(0.6, 0.6, 0.7), RGBVec(0.1, 0.1, 0.1), 0.0, 0.05, false));
+
+	// one light up behind the camera, the rest scattered above the box
+	const int lights = std::max(1, opts.lights);
+	const RGBVec light_colour = RGBVec(0.9, 0.9, 0.9).scaled(1.0 / std::sqrt(static_cast<double>(lights)));
+	writer.addLight(Light(vec3(0.3 * side, 2.0 * side, -0.5 * side - 0.5 * back_off), light_colour));
+	for (int l = 1; l < lights; l++)
+		writer.addLight(Light(vec3((random.unit() - 0.5) * 2.0 * side, (2.0 + 0.5 * random.unit()) * side,
+			(random.unit() - 0.5) * 2.0 * side), light_colour));
+
+	// the floor, then walls facing into the box: back, left, right,
+	// ceiling, and one behind the camera
+	const double wall = side;
+	const double planes[SCENEGEN_MAX_PLANES][4] = {
+		{ 0, 1, 0, SCENEGEN_SPACING },
+		{ 0, 0, -1, wall },
+		{ 1, 0, 0, wall },
+		{ -1, 0, 0, wall },
+		{ 0, -1, 0, 2.5 * side + wall },
+		{ 0, 0, 1, 0.5 * side + back_off + wall },
+	};
+	for (int p = 0; p < std::min(opts.planes, SCENEGEN_MAX_PLANES); p++) {
+		ScenePlaneRecord rec;
+		for (int c = 0; c < 3; c++)
+			rec.normal[c] = planes[p][c];
+		rec.k = planes[p][3];
+		rec.material = floor_mat;
+		rec.reserved = 0;
+		writer.planes.push_back(rec);
+	}
+
+	// each object is reflective or not, then one of that kind's materials
+	Scatter scatter(opts.distribution, side, objects, random);
+	const auto pickMaterial = [&]() -> uint32_t {
+		const bool reflective = random.unit() < opts.reflective;
+		const uint32_t m = static_cast<uint32_t>(random.unit() * SCENEGEN_MATERIALS) % SCENEGEN_MATERIALS;
+		return reflective ? SCENEGEN_MATERIALS + m : m;
+	};
+
+	writer.spheres.reserve(num_spheres);
+	for (long s = 0; s < num_spheres; s++) {
+		SceneSphereRecord rec;
+		scatter.next(rec.centre, rec.radius);
+		rec.material = pickMaterial();
+		rec.cluster = SCENE_NO_CLUSTER;
+		writer.spheres.push_back(rec);
+	}
+
+	// the writer only keeps pointers to the meshes
+	std::vector<std::unique_ptr<MeshData> > rocks;
+	for (long m = 0; m < num_meshes; m++) {
+		double centre[3], radius;
+		scatter.next(centre, radius);
+		rocks.push_back(std::unique_ptr<MeshData>(makeRock(centre, 2.0 * radius)));
+		writer.addMesh(*rocks.back(), pickMaterial(), SCENE_NO_CLUSTER, true);
+	}
+
+	writer.write(path);
+}
@@ -0,0 +1,71 @@
+/* scenegen.hpp
+ *
+ * procedural scenes, for seeing how traceify copes as scenes grow
+ *
+ * a generated scene is `primitives` spheres (and mesh triangles, if
+ * asked for) in a box that grows with them, so that however many there
+ * are they're about as crowded. the camera, floor and lights are set up
+ * to frame the box. the same options and seed always give the same
+ * scene, whichever standard library traceify was built with.
+ *
+ * the distributions are:
+ *
+ * 	uniform		spread evenly over the box, all about the same size
+ * 	clustered	in tight clumps (about the cube root of the number of
+ * 			primitives of them) spread over the box
+ * 	skewed		most of them tiny and packed round the middle of the
+ * 			box, thinning out towards its edges, with sizes over
+ * 			a few orders of magnitude: the teapot in a stadium
+ *
+ * scenes are written as binary scene files (see scenefile.hpp), so that
+ * even one with ten million spheres loads without a parse.
+ */
+
+#ifndef SCENEGEN_HEADER_WARRIOR
+#define SCENEGEN_HEADER_WARRIOR
+
+#include <string>
+
+#define SCENEGEN_MAX_PLANES 6
+#define SCENEGEN_MESH_LEVEL 3		// times each mesh's octahedron is subdivided, 8 * 4^level triangles
+
+enum SceneDistribution { distribution_uniform, distribution_clustered, distribution_skewed };
+
+struct SceneGenOptions {
+	long primitives;		// spheres and mesh triangles
+	SceneDistribution distribution;
+	unsigned int seed;
+	double reflective;		// the fraction of objects that are reflective
+	double meshes;			// the fraction of primitives that are triangles, in rock-like meshes
+	int lights;
+	int planes;			// the floor first, then walls round the box, up to SCENEGEN_MAX_PLANES
+
+	SceneGenOptions();
+};
+
+// "uniform", "clustered" or "skewed", false for anything else
+bool parseDistribution(const std::string &name, SceneDistribution &out);
+const char *distributionName(SceneDistribution d);
+
+// generates a scene and writes it out as a scene file
+void generateSceneFile(const SceneGenOptions &opts, const std::string &path);
+
+// an empty file in /tmp to generate a scene into (or write anything else
+// out to), removed again when it goes out of scope, exception or not.
+// throws SceneFileException if it can't be made
+class ScratchFile {
+private:
+	std::string file;
+
+	ScratchFile(const ScratchFile &);
+	ScratchFile &operator=(const ScratchFile &);
+
+public:
+	// `name` goes in the file's name, to tell whose it is
+	explicit ScratchFile(const std::string &name);
+	~ScratchFile();
+
+	const std::string &path() const;
+};
+
+#endif
@@ -0,0 +1,501 @@
+#include "sceneparser.hpp"
+
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+
+#include "mappedfile.hpp"
+#include "scenefile.hpp"
+#include "pagedgeom.hpp"
+#include "texture.hpp"
+
+#define DEFAULT_PAGING_CACHE_MB 256
+
+SceneParseException::SceneParseException(const std::string &source, size_t line, const std::string &msg) :
+	std::runtime_error(source + ":" + std::to_string(line) + ": " + msg) {}
+
+namespace {
+
+// powers of ten that are exactly representable as doubles
+const double exact_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// character classes, looked up rather than compared for since the
+// scanning loops run once per byte of the file
+enum {
+	CHAR_BLANK = 1,		// space, tab, \r
+	CHAR_WORD_END = 2,	// blanks, newline and #
+	CHAR_DIGIT = 4
+};
+
+struct CharClasses {
+	unsigned char of[256];
+
+	CharClasses() {
+		memset(of, 0, sizeof(of));
+		of[static_cast<unsigned char>(' ')] = of[static_cast<unsigned char>('\t')] = of[static_cast<unsigned char>('\r')] = CHAR_BLANK | CHAR_WORD_END;
+		of[static_cast<unsigned char>('\n')] = of[static_cast<unsigned char>('#')] = CHAR_WORD_END;
+		for (char d = '0'; d <= '9'; d++)
+			of[static_cast<unsigned char>(d)] = CHAR_DIGIT;
+	}
+};
+
+const CharClasses char_classes;
+
+inline bool hasClass(char c, unsigned char cls) 	{ return (char_classes.of[static_cast<unsigned char>(c)] & cls) != 0; }
+inline bool isDigit(char c) 	{ return hasClass(c, CHAR_DIGIT); }
+inline bool isBlank(char c) 	{ return hasClass(c, CHAR_BLANK); }
+inline bool isWordEnd(char c) 	{ return hasClass(c, CHAR_WORD_END); }
+
+// adds the digits at p to mantissa, advancing p past them. two at a
+// time where it can, which halves the multiply chain
+inline void readDigits(const char *&p, const char *end, uint64_t &mantissa) {
+	while (end - p >= 2 && isDigit(p[0]) && isDigit(p[1])) {
+		mantissa = mantissa * 100 + static_cast<unsigned>((p[0] - '0') * 10 + (p[1] - '0'));
+		p += 2;
+	}
+	if (p < end && isDigit(*p))
+		mantissa = mantissa * 10 + static_cast<unsigned>(*p++ - '0');
+}
+
+// parses a decimal number at p, advancing p past it
+//
+// when the digits fit in a 53 bit mantissa and the power of ten is
+// exact, mantissa * 10^exp is correctly rounded (this covers everything
+// a scene file normally contains). anything else goes to strtod
+bool parseDouble(const char *&p, const char *end, double &out) {
+	const char *start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+
+	// digits past the 19th overflow the mantissa, but then we
+	// use strtod anyway
+	uint64_t mantissa = 0;
+	const char *int_start = p;
+	readDigits(p, end, mantissa);
+	int num_digits = static_cast<int>(p - int_start);
+	int exp10 = 0;
+
+	if (p < end && *p == '.') {
+		const char *frac_start = ++p;
+		readDigits(p, end, mantissa);
+		num_digits += static_cast<int>(p - frac_start);
+		exp10 = -static_cast<int>(p - frac_start);
+	}
+
+	if (num_digits == 0) return false;
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		bool exp_negative = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			exp_negative = *p == '-';
+			p++;
+		}
+		if (p >= end || !isDigit(*p)) return false;
+		int e = 0;
+		for (; p < end && isDigit(*p); p++)
+			if (e < 100000) e = e * 10 + (*p - '0');
+		exp10 += exp_negative ? -e : e;
+	}
+
+	if (num_digits <= 19 && mantissa < (static_cast<uint64_t>(1) << 53) && exp10 >= -22 && exp10 <= 22) {
+		double value = static_cast<double>(mantissa);
+		value = exp10 < 0 ? value / exact_pow10[-exp10] : value * exact_pow10[exp10];
+		out = negative ? -value : value;
+	}
+	else {
+		// strtod needs the token terminated. long ones (all those
+		// digits are allowed) are rare enough to copy to the heap
+		char buf[64];
+		size_t n = static_cast<size_t>(p - start);
+		if (n < sizeof(buf)) {
+			memcpy(buf, start, n);
+			buf[n] = '\0';
+			out = strtod(buf, NULL);
+		}
+		else
+			out = strtod(std::string(start, n).c_str(), NULL);
+	}
+
+	return true;
+}
+
+struct NamedMaterial {
+	std::string name;
+	Material material;
+
+	NamedMaterial(const char *n, size_t len, const Material &m) : name(n, len), material(m) {}
+};
+
+struct NamedTexture {
+	std::string name;
+	std::shared_ptr<const Texture> texture;
+
+	NamedTexture(const char *n, size_t len, std::shared_ptr<const Texture> t) : name(n, len), texture(t) {}
+};
+
+class SceneReader {
+private:
+	const char *c;
+	const char *end;
+	size_t line;
+	World &world;
+	const std::string &source;
+	std::vector<std::string> *files;	// where the files the scene refers to go, if anywhere
+
+	std::vector<NamedMaterial> materials;
+	std::vector<NamedTexture> textures;
+	std::vector<Cluster *> open_clusters;
+
+	void fail(const std::string &msg) {
+		throw SceneParseException(source, line, msg);
+	}
+
+	// skips spaces and comments but not newlines
+	void skipBlank() {
+		while (c < end) {
+			if (isBlank(*c)) c++;
+			else if (*c == '#') {
+				while (c < end && *c != '\n') c++;
+			}
+			else break;
+		}
+	}
+
+	void endLine() {
+		skipBlank();
+		if (c < end && *c != '\n')
+			fail("unexpected '" + std::string(c, wordEnd() - c) + "'");
+		if (c < end) {
+			c++;
+			line++;
+		}
+	}
+
+	const char *wordEnd() {
+		const char *p = c;
+		while (p < end && !isWordEnd(*p)) p++;
+		return p;
+	}
+
+	// reads a bare word, returning false at the end of the line
+	bool word(const char *&start, size_t &len) {
+		skipBlank();
+		if (c >= end || *c == '\n') return false;
+		start = c;
+		c = wordEnd();
+		len = static_cast<size_t>(c - start);
+		return true;
+	}
+
+	void expectWord(const char *&start, size_t &len, const char *what) {
+		if (!word(start, len))
+			fail(std::string("expected ") + what);
+	}
+
+	void refersTo(const char *path, size_t len) {
+		if (files)
+			files->push_back(std::string(path, len));
+	}
+
+	double number() {
+		skipBlank();
+		double v;
+		const char *start = c;
+		if (!parseDouble(c, end, v) || (c < end && !isWordEnd(*c))) {
+			c = start;
+			fail("expected a number, got '" + std::string(start, wordEnd() - start) + "'");
+		}
+		return v;
+	}
+
+	// for optional numbers at the end of a line
+	bool moreOnLine() {
+		skipBlank();
+		return c < end && *c != '\n';
+	}
+
+	vec3 triple() {
+		double x = number();
+		double y = number();
+		double z = number();
+		return vec3(x, y, z);
+	}
+
+	bool onOff() {
+		const char *w;
+		size_t n;
+		expectWord(w, n, "on or off");
+		if (is(w, n, "on") || is(w, n, "true") || is(w, n, "1")) return true;
+		if (is(w, n, "off") || is(w, n, "false") || is(w, n, "0")) return false;
+		fail("expected on or off");
+		return false;
+	}
+
+	static bool is(const char *w, size_t n, const char *keyword) {
+		return strncmp(w, keyword, n) == 0 && keyword[n] == '\0';
+	}
+
+	// scenes only have a handful of materials, so a linear search is
+	// cheaper than hashing the name
+	const Material &materialRef() {
+		const char *w;
+		size_t n;
+		expectWord(w, n, "a material name");
+		for (size_t i = 0; i < materials.size(); i++) {
+			const std::string &name = materials[i].name;
+			if (name.size() == n && memcmp(name.data(), w, n) == 0)
+				return materials[i].material;
+		}
+		fail("unknown material '" + std::string(w, n) + "'");
+		return materials[0].material;
+	}
+
+	std::shared_ptr<const Texture> textureRef() {
+		const char *w;
+		size_t n;
+		expectWord(w, n, "a texture name");
+		for (size_t i = 0; i < textures.size(); i++) {
+			const std::string &name = textures[i].name;
+			if (name.size() == n && memcmp(name.data(), w, n) == 0)
+				return textures[i].texture;
+		}
+		fail("unknown texture '" + std::string(w, n) + "'");
+		return textures[0].texture;
+	}
+
+	// paged geometry and textures share one cache, made with the
+	// default budget if the scene didn't ask for one
+	std::shared_ptr<PageCache> pagingCache() {
+		if (!world.pageCache)
+			world.pageCache.reset(new PageCache(static_cast<size_t>(DEFAULT_PAGING_CACHE_MB) * 1024 * 1024));
+		return world.pageCache;
+	}
+
+	void add(SceneObject *obj) {
+		if (open_clusters.empty())
+			world.adoptObject(obj);
+		else
+			open_clusters.back()->adoptObject(obj);
+	}
+
+	void directive(const char *w, size_t n) {
+		if (is(w, n, "sphere")) {
+			vec3 centre = triple();
+			double radius = number();
+			add(new Sphere(centre, radius, materialRef()));
+		}
+		else if (is(w, n, "plane")) {
+			vec3 normal = triple();
+			double k = number();
+			if (!open_clusters.empty())
+				fail("planes are unbounded and can't go in a cluster");
+			add(new Plane(normal, k, materialRef()));
+		}
+		else if (is(w, n, "cluster") || is(w, n, "grid")) {
+			const bool grid = is(w, n, "grid");
+			const char *brace;
+			size_t bn;
+			expectWord(brace, bn, "{");
+			bool two_level = false;
+			if (grid && is(brace, bn, "two_level")) {
+				two_level = true;
+				expectWord(brace, bn, "{");
+			}
+			if (!is(brace, bn, "{")) fail("expected {");
+			open_clusters.push_back(grid ? new Grid(two_level) : new Cluster());
+		}
+		else if (is(w, n, "accelerator")) {
+			const char *name;
+			size_t nn;
+			expectWord(name, nn, "an accelerator");
+			if (!parseAccelerator(std::string(name, nn), world.accelerator))
+				fail("unknown accelerator '" + std::string(name, nn) + "' (hierarchy, grid or grid2)");
+		}
+		else if (is(w, n, "}")) {
+			if (open_clusters.empty()) fail("} without a cluster");
+			Cluster *done = open_clusters.back();
+			open_clusters.pop_back();
+			if (done->boundedObjects.empty())
+				delete done;
+			else
+				add(done);
+		}
+		else if (is(w, n, "paging_cache")) {
+			double mb = number();
+			if (mb <= 0.0) fail("the paging cache needs a positive size");
+			if (world.pageCache) fail("paging_cache must come before any paged geometry or textures");
+			world.pageCache.reset(new PageCache(static_cast<size_t>(mb * 1024.0 * 1024.0)));
+		}
+		else if (is(w, n, "paged_spheres")) {
+			const char *path;
+			size_t pn;
+			expectWord(path, pn, "a paged sphere file");
+			refersTo(path, pn);
+			add(new PagedSpheres(std::string(path, pn), pagingCache()));
+		}
+		else if (is(w, n, "texture")) {
+			const char *name, *path;
+			size_t nn, pn;
+			expectWord(name, nn, "a texture name");
+			expectWord(path, pn, "a texture file");
+			refersTo(path, pn);
+			std::shared_ptr<const Texture> t(new Texture(std::string(path, pn), pagingCache()));
+			textures.push_back(NamedTexture(name, nn, t));
+		}
+		else if (is(w, n, "material")) {
+			const char *name;
+			size_t nn;
+			expectWord(name, nn, "a material name");
+			vec3 colour = triple();
+			vec3 spec_colour = triple();
+			double specularity = number();
+			double ambient = number();
+			bool reflective = false;
+			std::shared_ptr<const Texture> texture;
+			double texture_scale = 1.0;
+			const char *flag;
+			size_t fn;
+			while (word(flag, fn)) {
+				if (is(flag, fn, "reflective"))
+					reflective = true;
+				else if (is(flag, fn, "texture")) {
+					texture = textureRef();
+					skipBlank();
+					if (c < end && *c != '\n' && (isDigit(*c) || *c == '.'))
+						texture_scale = number();
+					if (texture_scale <= 0.0) fail("a texture's scale has to be positive");
+				}
+				else
+					fail("expected reflective or texture");
+			}
+			Material m(RGBVec(colour), RGBVec(spec_colour), specularity, ambient, reflective);
+			m.texture = texture;
+			m.texture_scale = texture_scale;
+			materials.push_back(NamedMaterial(name, nn, m));
+		}
+		else if (is(w, n, "light")) {
+			vec3 pos = triple();
+			vec3 colour = triple();
+			double range = moreOnLine() ? number() : 0.0;
+			if (range < 0.0) fail("a light's range can't be negative");
+			world.addLight(Light(pos, RGBVec(colour), range));
+		}
+		else if (is(w, n, "rect_light")) {
+			vec3 centre = triple();
+			vec3 u = triple();
+			vec3 v = triple();
+			vec3 colour = triple();
+			double range = moreOnLine() ? number() : 0.0;
+			if (range < 0.0) fail("a light's range can't be negative");
+			world.addLight(Light(centre, u, v, RGBVec(colour), range));
+		}
+		else if (is(w, n, "sphere_light")) {
+			vec3 centre = triple();
+			double radius = number();
+			vec3 colour = triple();
+			double range = moreOnLine() ? number() : 0.0;
+			if (radius <= 0.0) fail("a sphere light needs a positive radius");
+			if (range < 0.0) fail("a light's range can't be negative");
+			world.addLight(Light(centre, radius, RGBVec(colour), range));
+		}
+		else if (is(w, n, "shadow_samples")) {
+			double first = number();
+			double most = number();
+			if (first < 1 || most < 1 || most > MAX_SHADOW_SAMPLES)
+				fail("shadow samples must be between 1 and " + std::to_string(MAX_SHADOW_SAMPLES));
+			world.shadow_samples_first = static_cast<int>(first);
+			world.shadow_samples_most = static_cast<int>(most);
+		}
+		else if (is(w, n, "reflection_depth")) {
+			double most = number();
+			if (most < 0) fail("reflection depth can't be negative");
+			world.max_depth = static_cast<int>(most);
+			if (moreOnLine()) world.roulette_depth = static_cast<int>(number());
+			if (moreOnLine()) world.min_throughput = number();
+		}
+		else if (is(w, n, "light_sampling")) {
+			double samples = number();
+			if (samples < 0 || samples > LIGHT_TREE_MAX_SAMPLES)
+				fail("light sampling must be between 0 and " + std::to_string(LIGHT_TREE_MAX_SAMPLES) + " lights");
+			world.light_samples = static_cast<int>(samples);
+			if (moreOnLine()) world.light_cutoff = number();
+		}
+		else if (is(w, n, "viewport")) {
+			double width = number();
+			double height = number();
+			double camera_width = number();
+			double viewing_distance = number();
+			if (width < 1 || height < 1) fail("viewport must be at least one pixel");
+			world.viewport = Viewport(static_cast<int>(width), static_cast<int>(height), camera_width, viewing_distance);
+		}
+		else if (is(w, n, "camera")) 		world.setCameraPosition(triple());
+		else if (is(w, n, "rotate_y")) 		world.cameraRotateY(number());
+		else if (is(w, n, "rotate_x")) 		world.cameraRotateX(number());
+		else if (is(w, n, "background")) 	world.bg_colour = RGBVec(triple());
+		else if (is(w, n, "shadows")) 		world.shadows_enabled = onOff();
+		else if (is(w, n, "reflections")) 	world.reflections_enabled = onOff();
+		else if (is(w, n, "lazy_build")) 	world.lazy_build = onOff();
+		else if (is(w, n, "supersampling")) {
+			double level = number();
+			if (level < 1 || level > 4) fail("supersampling level must be between 1 and 4");
+			world.ss_level = static_cast<int>(level);
+		}
+		else fail("unknown directive '" + std::string(w, n) + "'");
+	}
+
+public:
+	SceneReader(const char *text, size_t length, World &w, const std::string &src, std::vector<std::string> *f) :
+		c(text), end(text + length), line(1), world(w), source(src), files(f) {}
+
+	~SceneReader() {
+		// only non-empty if we bailed out with an exception
+		for (size_t i = 0; i < open_clusters.size(); i++)
+			delete open_clusters[i];
+	}
+
+	void parse() {
+		while (c < end) {
+			const char *w;
+			size_t n;
+			if (word(w, n))
+				directive(w, n);
+			endLine();
+		}
+
+		if (!open_clusters.empty())
+			fail("unterminated cluster");
+	}
+};
+
+}
+
+Viewport defaultSceneViewport() {
+	return Viewport(SCENE_DEFAULT_WIDTH, SCENE_DEFAULT_HEIGHT, SCENE_DEFAULT_CAMERA_WIDTH, SCENE_DEFAULT_VIEWING_DISTANCE);
+}
+
+void parseScene(const char *text, size_t length, World &world, const std::string &source,
+		std::vector<std::string> *files) {
+	SceneReader reader(text, length, world, source, files);
+	reader.parse();
+}
+
+void loadSceneText(const std::string &path, World &world, std::vector<std::string> *files) {
+	MappedFile file(path);
+	parseScene(file.data(), file.size(), world, path, files);
+}
+
+void loadScene(const std::string &path, World &world, std::vector<std::string> *files) {
+	MappedFile file(path);
+	if (file.size() >= sizeof(SCENE_FILE_MAGIC) && memcmp(file.data(), SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC)) == 0)
+		loadSceneFile(path, world);
+	else
+		parseScene(file.data(), file.size(), world, path, files);
+}
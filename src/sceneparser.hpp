@@ -0,0 +1,80 @@
+/* sceneparser.hpp
+ *
+ * traceify's text scene description format
+ *
+ * a scene is a list of directives, one per line. `#` starts a comment.
+ * materials are named so that objects can refer to them, everything
+ * else is positional:
+ *
+ * 	viewport <pixels wide> <pixels tall> <camera width> <viewing distance>
+ * 	camera <x> <y> <z>
+ * 	rotate_y <theta>		(World::cameraRotateY)
+ * 	rotate_x <theta>		(World::cameraRotateX)
+ * 	background <r> <g> <b>
+ * 	shadows on|off
+ * 	reflections on|off
+ * 	reflection_depth <most> [roulette from] [min throughput]	(see World::max_depth)
+ * 	supersampling <ss_level>
+ * 	light <x> <y> <z> <r> <g> <b> [range]	(see Light)
+ * 	rect_light <x> <y> <z> <ux> <uy> <uz> <vx> <vy> <vz> <r> <g> <b> [range]
+ * 	sphere_light <x> <y> <z> <radius> <r> <g> <b> [range]
+ * 	light_sampling <lights per hit> [cutoff]	(see World::light_samples)
+ * 	shadow_samples <first> <most>	(for area lights, see World::shadow_samples_first)
+ * 	material <name> <r> <g> <b> <spec r> <spec g> <spec b> <specularity> <ambient> [reflective]
+ * 		[texture <texture> [scale]]	(see Material::texture)
+ * 	sphere <x> <y> <z> <radius> <material>
+ * 	plane <nx> <ny> <nz> <k> <material>
+ * 	paging_cache <megabytes>	(resident budget for paged geometry and textures)
+ * 	paged_spheres <path>		(see pagedgeom.hpp)
+ * 	texture <name> <path>		(a packed texture file, see texture.hpp)
+ * 	cluster {
+ * 		... objects (and nested clusters) ...
+ * 	}
+ * 	grid [two_level] {	(a cluster binned into a grid, see grid.hpp)
+ * 		... objects (and nested clusters) ...
+ * 	}
+ * 	accelerator hierarchy|grid|grid2	(see World::accelerator)
+ * 	lazy_build on|off		(split clusters as rays reach them, see World::lazy_build)
+ *
+ * the parser makes a single pass over the (memory-mapped) text and
+ * builds objects straight into the World: it doesn't allocate per token
+ * or keep any intermediate representation of the scene
+ */
+
+#ifndef SCENEPARSER_HEADER_WARRIOR
+#define SCENEPARSER_HEADER_WARRIOR
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstddef>
+
+#include "world.hpp"
+
+struct SceneParseException : public std::runtime_error {
+	SceneParseException(const std::string &source, size_t line, const std::string &msg);
+};
+
+// what a scene's viewport is if it doesn't have a viewport line
+#define SCENE_DEFAULT_WIDTH 1000
+#define SCENE_DEFAULT_HEIGHT 800
+#define SCENE_DEFAULT_CAMERA_WIDTH 0.1
+#define SCENE_DEFAULT_VIEWING_DISTANCE 0.25
+
+Viewport defaultSceneViewport();
+
+// parses a scene held in memory and adds it to `world`.
+// `source` is only used in error messages. if `files` is set, the paths
+// of the paged sphere sets and textures it loads are added to it, as
+// they're written in the scene
+void parseScene(const char *text, size_t length, World &world, const std::string &source,
+		std::vector<std::string> *files = NULL);
+
+// maps a text scene file and parses it
+void loadSceneText(const std::string &path, World &world, std::vector<std::string> *files = NULL);
+
+// loads either kind of scene file, binary scene files are recognised
+// by their magic number. binary ones never refer to other files
+void loadScene(const std::string &path, World &world, std::vector<std::string> *files = NULL);
+
+#endif
@@ -0,0 +1,744 @@
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "server.hpp"
+#include "renderer.hpp"
+#include "world.hpp"
+#include "image.hpp"
+#include "sceneparser.hpp"
+#include "incremental.hpp"
+
+#define SERVER_MAX_DIMENSION 16384
+#define SERVER_MAX_SS_LEVEL 4
+#define SERVER_PROGRESS_STEPS 10	// progress lines per job
+#define SERVER_POOLED_IMAGES 8
+
+ServerOptions::ServerOptions() : threads(0), numa(false), scene_cache_size(8) {}
+
+/* ServerError
+ *
+ * a request that can't be carried out. it goes back to the client as
+ * an error line, and the server carries on */
+struct ServerError : public std::runtime_error {
+	ServerError(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+/* SceneCache
+ *
+ * compiled scenes keyed on the scene file's path. each one remembers
+ * the size and modification time of its file and of every file the
+ * scene refers to (paged spheres and textures), and is loaded again if
+ * any of them has changed. looking a scene up only stats the files, so
+ * it costs the same however big they are. scenes are handed out as
+ * shared_ptrs, so evicting one doesn't pull it out from under a job
+ * that is still rendering it */
+class SceneCache {
+private:
+	struct FileStamp {
+		std::string path;
+		int64_t size;		// -1 if it couldn't be stat'ed
+		int64_t mtime_ns;
+
+		FileStamp(const std::string &p) : path(p), size(-1), mtime_ns(0)
+		{
+			struct stat st;
+			if (stat(p.c_str(), &st) == 0) {
+				size = st.st_size;
+				mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+			}
+		}
+
+		bool unchanged() const
+		{
+			FileStamp now(path);
+			return now.size == size && now.mtime_ns == mtime_ns;
+		}
+	};
+
+	struct Entry {
+		std::shared_ptr<World> world;
+		std::vector<FileStamp> files;	// the scene file first
+		unsigned long last_used;
+	};
+
+	std::map<std::string, Entry> entries;
+	std::mutex lock;
+	size_t capacity;
+	unsigned long clock;
+
+public:
+	std::atomic<unsigned long> hits;
+	std::atomic<unsigned long> misses;
+
+	SceneCache(size_t capacity) : capacity(capacity), clock(0), hits(0), misses(0) {}
+
+	std::shared_ptr<World> get(const std::string &path)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			std::map<std::string, Entry>::iterator it = entries.find(path);
+			if (it != entries.end()) {
+				const std::vector<FileStamp> &files = it->second.files;
+				bool fresh = true;
+				for (size_t i = 0; i < files.size() && fresh; i++)
+					fresh = files[i].unchanged();
+				if (fresh) {
+					it->second.last_used = ++clock;
+					hits++;
+					return it->second.world;
+				}
+			}
+			misses++;
+		}
+
+		// loaded without the lock held, so other connections can carry
+		// on with the scenes they already have. if two connections ask
+		// for the same new scene at once, both load it and the second
+		// one replaces the first in the cache. the scene file is stamped
+		// before it's read, so an edit made while loading is noticed
+		// next time
+		std::vector<FileStamp> files(1, FileStamp(path));
+		std::vector<std::string> refers;
+		std::shared_ptr<World> world(new World(defaultSceneViewport(), vec3(0.0, 0.0, 0.0), RGBVec()));
+		loadScene(path, *world, &refers);
+		world->buildHierarchy();
+		for (size_t i = 0; i < refers.size(); i++)
+			files.push_back(FileStamp(refers[i]));
+
+		std::lock_guard<std::mutex> guard(lock);
+		Entry &e = entries[path];
+		e.world = world;
+		e.files = files;
+		e.last_used = ++clock;
+
+		while (entries.size() > capacity) {
+			std::map<std::string, Entry>::iterator oldest = entries.begin();
+			for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+				if (it->second.last_used < oldest->second.last_used)
+					oldest = it;
+			entries.erase(oldest);
+		}
+
+		return world;
+	}
+
+	size_t size()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return entries.size();
+	}
+};
+
+/* ImagePool
+ *
+ * finished jobs hand their images back here, so the next job of the
+ * same size can skip allocating one */
+class ImagePool {
+private:
+	std::list<Image *> free_images;
+	std::mutex lock;
+
+public:
+	~ImagePool()
+	{
+		for (std::list<Image *>::iterator it = free_images.begin(); it != free_images.end(); ++it)
+			delete *it;
+	}
+
+	Image *acquire(int w, int h)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			for (std::list<Image *>::iterator it = free_images.begin(); it != free_images.end(); ++it) {
+				if ((*it)->width == w && (*it)->height == h) {
+					Image *img = *it;
+					free_images.erase(it);
+					return img;
+				}
+			}
+		}
+
+		return new Image(w, h);
+	}
+
+	void release(Image *img)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		free_images.push_front(img);
+		if (free_images.size() > SERVER_POOLED_IMAGES) {
+			delete free_images.back();
+			free_images.pop_back();
+		}
+	}
+};
+
+/* Connection
+ *
+ * one client. replies for a job are written from whichever render
+ * thread finishes it, so all writes go through send() */
+class Connection {
+private:
+	int in_fd;
+	int out_fd;
+	std::string pending;	// read but not yet split into lines
+	std::mutex write_lock;
+	std::mutex jobs_lock;
+	std::condition_variable jobs_cv;
+	int outstanding;
+	bool broken;
+
+public:
+	Connection(int in_fd, int out_fd) : in_fd(in_fd), out_fd(out_fd), outstanding(0), broken(false) {}
+
+	bool readLine(std::string &line)
+	{
+		for (;;) {
+			size_t nl = pending.find('\n');
+			if (nl != std::string::npos) {
+				line.assign(pending, 0, nl);
+				pending.erase(0, nl + 1);
+				if (!line.empty() && line[line.size() - 1] == '\r')
+					line.erase(line.size() - 1);
+				return true;
+			}
+
+			char buf[4096];
+			ssize_t n = read(in_fd, buf, sizeof(buf));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				// a last line without a newline still counts
+				if (pending.empty())
+					return false;
+				line.swap(pending);
+				pending.clear();
+				return true;
+			}
+			pending.append(buf, n);
+		}
+	}
+
+	void send(const std::string &header, const std::string &body = std::string())
+	{
+		std::lock_guard<std::mutex> guard(write_lock);
+		if (broken)
+			return;
+
+		std::string out = header + "\n" + body;
+		size_t written = 0;
+		while (written < out.size()) {
+			ssize_t n = write(out_fd, out.data() + written, out.size() - written);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				// the client has gone away. its jobs still finish, but
+				// there's nobody to tell
+				broken = true;
+				return;
+			}
+			written += n;
+		}
+	}
+
+	void jobStarted()
+	{
+		std::lock_guard<std::mutex> guard(jobs_lock);
+		outstanding++;
+	}
+
+	void jobFinished()
+	{
+		std::lock_guard<std::mutex> guard(jobs_lock);
+		outstanding--;
+		jobs_cv.notify_all();
+	}
+
+	// the connection can't be torn down until its jobs stop using it
+	void waitForJobs()
+	{
+		std::unique_lock<std::mutex> guard(jobs_lock);
+		while (outstanding > 0)
+			jobs_cv.wait(guard);
+	}
+};
+
+class Server;
+
+/* Session
+ *
+ * an EditSession opened by a client. edits are refused while it is
+ * rendering, since the render threads are reading the scene */
+struct Session {
+	EditSession edit;
+	bool busy;	// guarded by the server's session lock
+
+	Session(const std::string &scene_path) : edit(scene_path), busy(false) {}
+};
+
+/* ServerJob
+ *
+ * a RenderJob plus everything needed to report on it. it keeps its
+ * scene (or session) alive, and deletes itself once the reply has been
+ * sent. session jobs render into the session's own image rather than
+ * one from the pool */
+struct ServerJob {
+	Server *server;
+	Connection *conn;
+	std::shared_ptr<World> world;
+	std::shared_ptr<Session> session;
+	std::string id;
+	std::string out_path;	// "-" to send the image back down the connection
+	Image *image;
+	RenderJob render;
+	std::atomic<int> tiles_done;
+	std::chrono::steady_clock::time_point started;
+
+	ServerJob(Server *server, Connection *conn, std::shared_ptr<World> world, const std::string &id,
+			const std::string &out_path, Image *image, const Camera &cam, const Viewport &vp, int ss_level)
+		: server(server), conn(conn), world(world), id(id), out_path(out_path), image(image),
+		  render(*world, cam, vp, ss_level, *image), tiles_done(0),
+		  started(std::chrono::steady_clock::now()) {}
+
+	ServerJob(Server *server, Connection *conn, std::shared_ptr<Session> session, const std::string &id,
+			const std::string &out_path)
+		: server(server), conn(conn), session(session), id(id), out_path(out_path),
+		  image(&session->edit.image()),
+		  render(session->edit.world(), session->edit.camera(), session->edit.viewport(),
+				  session->edit.ssLevel(), *image),
+		  tiles_done(0), started(std::chrono::steady_clock::now()) {}
+};
+
+class Server {
+private:
+	SceneCache scenes;
+	ImagePool images;
+	RenderEngine engine;
+	std::atomic<unsigned long> next_job;
+	std::atomic<unsigned long> jobs_done;
+
+	std::map<std::string, std::shared_ptr<Session> > sessions;
+	std::mutex sessions_lock;
+
+	static double parseNumber(const std::string &key, const std::string &value)
+	{
+		char *end;
+		double d = strtod(value.c_str(), &end);
+		if (value.empty() || *end != '\0')
+			throw ServerError("bad value for " + key + ": " + value);
+		return d;
+	}
+
+	static int parseInt(const std::string &key, const std::string &value, int lo, int hi)
+	{
+		double d = parseNumber(key, value);
+		if (d != (int)d || d < lo || d > hi)
+			throw ServerError(key + " must be a whole number from " + std::to_string(lo) + " to " + std::to_string(hi));
+		return (int)d;
+	}
+
+	static std::map<std::string, std::string> parseOptions(const std::vector<std::string> &args, size_t first)
+	{
+		std::map<std::string, std::string> opts;
+		for (size_t i = first; i < args.size(); i++) {
+			size_t eq = args[i].find('=');
+			if (eq == std::string::npos)
+				throw ServerError("expected key=value, got " + args[i]);
+			opts[args[i].substr(0, eq)] = args[i].substr(eq + 1);
+		}
+		return opts;
+	}
+
+	// the view options (width, height, ss, camera and the rotations),
+	// applied on top of the scene's own view. `others` are the keys the
+	// caller deals with itself, anything else is an error
+	static void parseView(std::map<std::string, std::string> &opts, const std::vector<std::string> &others,
+			const World &world, Camera &cam, Viewport &vp, int &ss_level)
+	{
+		int width = world.viewport.pixelsWide();
+		int height = world.viewport.pixelsTall();
+		ss_level = world.ss_level;
+		cam = world.camera();
+
+		for (std::map<std::string, std::string>::iterator it = opts.begin(); it != opts.end(); ++it) {
+			const std::string &key = it->first;
+			const std::string &value = it->second;
+
+			if (std::find(others.begin(), others.end(), key) != others.end())
+				continue;
+			else if (key == "width")
+				width = parseInt(key, value, 1, SERVER_MAX_DIMENSION);
+			else if (key == "height")
+				height = parseInt(key, value, 1, SERVER_MAX_DIMENSION);
+			else if (key == "ss")
+				ss_level = parseInt(key, value, 1, SERVER_MAX_SS_LEVEL);
+			else if (key == "camera") {
+				double xyz[3];
+				std::string rest = value;
+				for (int k = 0; k < 3; k++) {
+					size_t comma = rest.find(',');
+					if ((comma == std::string::npos) != (k == 2))
+						throw ServerError("camera wants x,y,z");
+					xyz[k] = parseNumber(key, rest.substr(0, comma));
+					if (comma != std::string::npos)
+						rest.erase(0, comma + 1);
+				}
+				cam.position = vec3(xyz[0], xyz[1], xyz[2]);
+			}
+			else if (key != "rotate_y" && key != "rotate_x")
+				throw ServerError("unknown option " + key);
+		}
+
+		// rotations are relative to the scene's camera, y first
+		if (opts.count("rotate_y"))
+			cam.rotateY(parseNumber("rotate_y", opts["rotate_y"]));
+		if (opts.count("rotate_x"))
+			cam.rotateX(parseNumber("rotate_x", opts["rotate_x"]));
+
+		vp = world.viewport.resized(width, height);
+	}
+
+	void submit(Connection &conn, ServerJob *job)
+	{
+		job->render.onTile = [job](RenderJob &r, const Tile &) {
+			int total = r.tileCount();
+			int done = ++job->tiles_done;
+			int step = total / SERVER_PROGRESS_STEPS;
+			if (step > 0 && done % step == 0 && done < total)
+				job->conn->send("progress " + job->id + " " + std::to_string(done) + " " + std::to_string(total));
+		};
+		job->render.onDone = [job](RenderJob &) {
+			job->server->finish(job);
+		};
+
+		conn.jobStarted();
+		conn.send("accepted " + job->id);
+		engine.submit(job->render);
+	}
+
+	void startRender(Connection &conn, const std::vector<std::string> &args, std::string &id)
+	{
+		if (args.size() < 2)
+			throw ServerError("render needs a scene");
+
+		std::map<std::string, std::string> opts = parseOptions(args, 2);
+		id = opts.count("id") ? opts["id"] : "job" + std::to_string(next_job++);
+		std::string out_path = opts.count("out") ? opts["out"] : id + ".ppm";
+
+		std::shared_ptr<World> world = scenes.get(args[1]);
+
+		Camera cam(vec3(0.0, 0.0, 0.0));
+		Viewport vp = world->viewport;
+		int ss_level;
+		parseView(opts, std::vector<std::string>{ "id", "out" }, *world, cam, vp, ss_level);
+
+		submit(conn, new ServerJob(this, &conn, world, id, out_path,
+				images.acquire(vp.pixelsWide(), vp.pixelsTall()), cam, vp, ss_level));
+	}
+
+	/* edit sessions */
+
+	std::shared_ptr<Session> findSession(const std::string &name)
+	{
+		std::lock_guard<std::mutex> guard(sessions_lock);
+		std::map<std::string, std::shared_ptr<Session> >::iterator it = sessions.find(name);
+		if (it == sessions.end())
+			throw ServerError("no session called " + name);
+		return it->second;
+	}
+
+	// sessions can only be edited between renders. the caller has to
+	// call release() when it's done
+	std::shared_ptr<Session> claimSession(const std::string &name)
+	{
+		std::shared_ptr<Session> s = findSession(name);
+		std::lock_guard<std::mutex> guard(sessions_lock);
+		if (s->busy)
+			throw ServerError(name + " is still rendering");
+		s->busy = true;
+		return s;
+	}
+
+	void release(Session &s)
+	{
+		std::lock_guard<std::mutex> guard(sessions_lock);
+		s.busy = false;
+	}
+
+	void openSession(Connection &conn, const std::vector<std::string> &args, std::string &id)
+	{
+		if (args.size() < 2)
+			throw ServerError("open needs a scene");
+
+		std::map<std::string, std::string> opts = parseOptions(args, 2);
+		id = opts.count("id") ? opts["id"] : "session" + std::to_string(next_job++);
+
+		// sessions are edited, so they get a scene of their own rather
+		// than one from the cache
+		std::shared_ptr<Session> s(new Session(args[1]));
+
+		Camera cam(vec3(0.0, 0.0, 0.0));
+		Viewport vp = s->edit.world().viewport;
+		int ss_level;
+		parseView(opts, std::vector<std::string>{ "id" }, s->edit.world(), cam, vp, ss_level);
+		s->edit.setView(cam, vp, ss_level);
+
+		{
+			std::lock_guard<std::mutex> guard(sessions_lock);
+			if (sessions.count(id))
+				throw ServerError("there's already a session called " + id);
+			sessions[id] = s;
+		}
+		conn.send("opened " + id + " " + std::to_string(s->edit.objectCount()));
+	}
+
+	void editSession(Connection &conn, const std::vector<std::string> &args)
+	{
+		const std::string &command = args[0];
+		if (args.size() != 6)
+			throw ServerError(command + (command == "move" ? " wants <session> <object> <dx> <dy> <dz>"
+					: " wants <session> <object> <r> <g> <b>"));
+
+		double v[3];
+		for (int k = 0; k < 3; k++)
+			v[k] = parseNumber(command, args[3 + k]);
+
+		std::shared_ptr<Session> s = claimSession(args[1]);
+		try {
+			int obj = parseInt("object", args[2], 0, s->edit.objectCount() - 1);
+			if (command == "move")
+				s->edit.moveObject(obj, vec3(v[0], v[1], v[2]));
+			else
+				s->edit.setColour(obj, RGBVec(v[0], v[1], v[2]));
+		}
+		catch (...) {
+			release(*s);
+			throw;
+		}
+		release(*s);
+		conn.send("ok " + args[1]);
+	}
+
+	void startRerender(Connection &conn, const std::vector<std::string> &args)
+	{
+		std::map<std::string, std::string> opts = parseOptions(args, 2);
+		std::string out_path = args[1] + ".ppm";
+		for (std::map<std::string, std::string>::iterator it = opts.begin(); it != opts.end(); ++it) {
+			if (it->first != "out")
+				throw ServerError("unknown option " + it->first);
+			out_path = it->second;
+		}
+
+		std::shared_ptr<Session> s = claimSession(args[1]);
+		ServerJob *job = NULL;
+		try {
+			job = new ServerJob(this, &conn, s, args[1], out_path);
+			s->edit.prepare(job->render);
+		}
+		catch (...) {
+			// nothing was started, so the session is free for the next request
+			delete job;
+			release(*s);
+			throw;
+		}
+		submit(conn, job);
+	}
+
+	void finish(ServerJob *job)
+	{
+		Connection *conn = job->conn;
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - job->started).count();
+
+		if (job->out_path == "-") {
+			std::ostringstream ppm;
+			ppm << *job->image;
+			conn->send("image " + job->id + " " + std::to_string(ppm.str().size()), ppm.str());
+		}
+		else {
+			std::ofstream out(job->out_path.c_str());
+			out << *job->image;
+			out.close();
+			// session renders also say how many pixels they retraced
+			std::string extra;
+			if (job->session)
+				extra = " " + std::to_string(job->session->edit.pixelsRetraced());
+			if (out)
+				conn->send("done " + job->id + " " + std::to_string((long)ms) + " " + job->out_path + extra);
+			else
+				conn->send("error " + job->id + " couldn't write " + job->out_path);
+		}
+
+		if (job->session)
+			release(*job->session);
+		else
+			images.release(job->image);
+		jobs_done++;
+		delete job;
+		conn->jobFinished();
+	}
+
+public:
+	Server(const ServerOptions &opts)
+		: scenes(opts.scene_cache_size), engine(opts.threads, opts.numa), next_job(1), jobs_done(0) {}
+
+	// returns false when the client is finished with the connection
+	bool handle(Connection &conn, const std::string &line)
+	{
+		std::vector<std::string> args;
+		std::istringstream words(line);
+		std::string word;
+		while (words >> word)
+			args.push_back(word);
+
+		if (args.empty() || args[0][0] == '#')
+			return true;
+
+		if (args[0] == "quit")
+			return false;
+
+		if (args[0] == "stats") {
+			conn.send("stats threads=" + std::to_string(engine.threadCount())
+					+ " scenes=" + std::to_string(scenes.size())
+					+ " scene_hits=" + std::to_string(scenes.hits.load())
+					+ " scene_misses=" + std::to_string(scenes.misses.load())
+					+ " jobs_done=" + std::to_string(jobs_done.load()));
+			return true;
+		}
+
+		if (args[0] == "render") {
+			std::string id = "-";
+			try {
+				startRender(conn, args, id);
+			}
+			catch (const std::runtime_error &e) {
+				conn.send("error " + id + " " + e.what());
+			}
+			return true;
+		}
+
+		if (args[0] == "open") {
+			std::string id = "-";
+			try {
+				openSession(conn, args, id);
+			}
+			catch (const std::runtime_error &e) {
+				conn.send("error " + id + " " + e.what());
+			}
+			return true;
+		}
+
+		if (args[0] == "objects" || args[0] == "move" || args[0] == "colour"
+				|| args[0] == "rerender" || args[0] == "close") {
+			const std::string id = args.size() > 1 ? args[1] : "-";
+			try {
+				if (args.size() < 2)
+					throw ServerError(args[0] + " needs a session");
+
+				if (args[0] == "objects") {
+					std::shared_ptr<Session> s = findSession(id);
+					for (int i = 0; i < s->edit.objectCount(); i++)
+						conn.send("object " + id + " " + std::to_string(i) + " " + s->edit.describe(i));
+				}
+				else if (args[0] == "move" || args[0] == "colour")
+					editSession(conn, args);
+				else if (args[0] == "rerender")
+					startRerender(conn, args);
+				else {
+					// a render that's still going keeps the session alive
+					// until it's done
+					std::lock_guard<std::mutex> guard(sessions_lock);
+					if (!sessions.erase(id))
+						throw ServerError("no session called " + id);
+					conn.send("closed " + id);
+				}
+			}
+			catch (const std::runtime_error &e) {
+				conn.send("error " + id + " " + e.what());
+			}
+			return true;
+		}
+
+		conn.send("error - unknown command " + args[0]);
+		return true;
+	}
+
+	void serve(Connection &conn)
+	{
+		std::string line;
+		while (conn.readLine(line))
+			if (!handle(conn, line))
+				break;
+		conn.waitForJobs();
+	}
+};
+
+void serveStdio(const ServerOptions &opts)
+{
+	signal(SIGPIPE, SIG_IGN);
+
+	Server server(opts);
+	Connection conn(STDIN_FILENO, STDOUT_FILENO);
+	server.serve(conn);
+}
+
+void serveSocket(const std::string &path, const ServerOptions &opts)
+{
+	signal(SIGPIPE, SIG_IGN);
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("socket path too long: " + path);
+	strcpy(addr.sun_path, path.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		throw std::runtime_error("couldn't create socket: " + std::string(strerror(errno)));
+
+	unlink(path.c_str());
+	if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+		std::string err = strerror(errno);
+		close(fd);
+		throw std::runtime_error("couldn't listen on " + path + ": " + err);
+	}
+
+	Server server(opts);
+	std::cerr << "traceify: serving on " << path << std::endl;
+
+	for (;;) {
+		int client = accept(fd, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			std::string err = strerror(errno);
+			close(fd);
+			throw std::runtime_error("accept failed: " + err);
+		}
+
+		std::thread([&server, client]() {
+			Connection conn(client, client);
+			server.serve(conn);
+			close(client);
+		}).detach();
+	}
+}
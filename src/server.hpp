@@ -0,0 +1,72 @@
+/* server.hpp
+ *
+ * a long-running render server
+ *
+ * the server keeps compiled scenes (parsed, with their hierarchies
+ * built) cached by path, reloading one when it or a file it refers to
+ * changes. it keeps its render threads and image buffers around
+ * between jobs too, so that lots of short renders (thumbnails, camera
+ * variants) don't pay for startup and scene building every time.
+ *
+ * requests are lines of text, on stdin or on a unix domain socket:
+ *
+ * 	render <scene> [out=<file>|-] [id=<name>] [width=<n>] [height=<n>]
+ * 	       [ss=<level>] [camera=<x>,<y>,<z>] [rotate_y=<theta>] [rotate_x=<theta>]
+ * 	stats
+ * 	quit
+ *
+ * the camera options replace the scene's camera position, and rotate it
+ * further. a scene can also be opened for editing, in which case only
+ * the parts of the frame an edit could change are re-rendered (see
+ * incremental.hpp):
+ *
+ * 	open <scene> [id=<name>] [width=<n>] ...	(the same view options)
+ * 	objects <name>
+ * 	move <name> <object> <dx> <dy> <dz>
+ * 	colour <name> <object> <r> <g> <b>
+ * 	rerender <name> [out=<file>|-]
+ * 	close <name>
+ *
+ * replies are lines too:
+ *
+ * 	accepted <id>
+ * 	progress <id> <tiles done> <tiles>
+ * 	done <id> <milliseconds> <file>
+ * 	image <id> <bytes>		(followed by that many bytes of PPM)
+ * 	stats <key>=<value> ...
+ * 	opened <name> <objects>
+ * 	object <name> <object> <tag>
+ * 	ok <name>			(an edit was made)
+ * 	closed <name>
+ * 	error <id> <message>
+ *
+ * a rerender is accepted and reports progress like a render, and its
+ * done line ends with the number of pixels that were traced again. edits
+ * while a session is rendering are errors.
+ *
+ * jobs from every connection run at the same time, sharing the render
+ * threads fairly (see renderer.hpp)
+ */
+
+#ifndef SERVER_HEADER_WARRIOR
+#define SERVER_HEADER_WARRIOR
+
+#include <string>
+#include <cstddef>
+
+struct ServerOptions {
+	int threads;			// 0 for one per hardware thread
+	bool numa;			// pin the threads to NUMA nodes (see numa.hpp)
+	size_t scene_cache_size;	// how many compiled scenes to keep
+
+	ServerOptions();
+};
+
+// serves requests from stdin until it closes (or says quit)
+void serveStdio(const ServerOptions &opts);
+
+// listens on a unix domain socket, serving connections side by side
+// until the process is killed
+void serveSocket(const std::string &path, const ServerOptions &opts);
+
+#endif
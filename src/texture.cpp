@@ -0,0 +1,259 @@
+#include "texture.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cctype>
+#include <fstream>
+
+#include "scenefile.hpp"
+
+#define TEXTURE_HELD_TILES 4
+
+static void textureFail(const std::string &path, const std::string &msg) {
+	throw SceneFileException(path, msg);
+}
+
+/* Texture implementation */
+
+// the last few tiles a lookup has used, so that the texels of one
+// lookup (which are nearly always in the same tile or two) only go
+// through the cache's lock once
+struct Texture::TileHolder {
+	int level[TEXTURE_HELD_TILES];
+	uint32_t tile[TEXTURE_HELD_TILES];
+	PageBlockRef block[TEXTURE_HELD_TILES];
+	int next;
+
+	TileHolder() : next(0) {
+		for (int k = 0; k < TEXTURE_HELD_TILES; k++)
+			level[k] = -1;
+	}
+};
+
+Texture::Texture(const std::string &path, std::shared_ptr<PageCache> c) : file(new MappedFile(path)), cache(c) {
+	if (file->size() < sizeof(TextureFileHeader))
+		textureFail(path, "not a texture file");
+
+	TextureFileHeader h;
+	memcpy(&h, file->data(), sizeof(h));
+	if (memcmp(h.magic, TEXTURE_FILE_MAGIC, sizeof(TEXTURE_FILE_MAGIC)) != 0)
+		textureFail(path, "not a texture file");
+	if (h.version != TEXTURE_FILE_VERSION)
+		textureFail(path, "unsupported texture file version " + std::to_string(h.version));
+	if (h.file_size != file->size() || h.num_levels == 0 || h.tile_size == 0
+	    || !file->contains(h.levels_offset, h.num_levels * sizeof(TextureLevelRecord)))
+		textureFail(path, "truncated texture file");
+
+	tile_size = h.tile_size;
+	tile_bytes = 3 * static_cast<size_t>(tile_size) * tile_size;
+
+	const TextureLevelRecord *recs = reinterpret_cast<const TextureLevelRecord *>(file->data() + h.levels_offset);
+	levels.assign(recs, recs + h.num_levels);
+
+	for (size_t i = 0; i < levels.size(); i++) {
+		const TextureLevelRecord &l = levels[i];
+		if (l.width == 0 || l.height == 0
+		    || l.tiles_x != (l.width + tile_size - 1) / tile_size
+		    || l.tiles_y != (l.height + tile_size - 1) / tile_size
+		    || !file->contains(l.offset, static_cast<size_t>(l.tiles_x) * l.tiles_y * tile_bytes))
+			textureFail(path, "level " + std::to_string(i) + " is corrupt");
+	}
+}
+
+int Texture::width() const 	{ return static_cast<int>(levels[0].width); }
+int Texture::height() const 	{ return static_cast<int>(levels[0].height); }
+int Texture::levelCount() const { return static_cast<int>(levels.size()); }
+
+vec3 Texture::texel(int level, int x, int y, TileHolder &holder) const {
+	const TextureLevelRecord &l = levels[level];
+	const int w = static_cast<int>(l.width);
+	const int h = static_cast<int>(l.height);
+	x %= w;
+	y %= h;
+	if (x < 0) x += w;
+	if (y < 0) y += h;
+
+	const int ts = static_cast<int>(tile_size);
+	const uint32_t tile = static_cast<uint32_t>(y / ts) * l.tiles_x + static_cast<uint32_t>(x / ts);
+
+	int k = 0;
+	while (k < TEXTURE_HELD_TILES && (holder.level[k] != level || holder.tile[k] != tile))
+		k++;
+	if (k == TEXTURE_HELD_TILES) {
+		k = holder.next;
+		holder.next = (holder.next + 1) % TEXTURE_HELD_TILES;
+		holder.block[k] = cache->fetch(*file, l.offset + tile * tile_bytes, tile_bytes);
+		holder.level[k] = level;
+		holder.tile[k] = tile;
+	}
+
+	const unsigned char *t = reinterpret_cast<const unsigned char *>(holder.block[k]->data())
+		+ 3 * ((y % ts) * ts + x % ts);
+	return vec3(t[0], t[1], t[2]).scaled(1.0 / 255.0);
+}
+
+// texel centres are at half-integers, as with pixels
+vec3 Texture::bilinear(int level, double u, double v, TileHolder &holder) const {
+	const double x = u * levels[level].width - 0.5;
+	const double y = v * levels[level].height - 0.5;
+	const double fx = x - std::floor(x);
+	const double fy = y - std::floor(y);
+	const int x0 = static_cast<int>(std::floor(x));
+	const int y0 = static_cast<int>(std::floor(y));
+
+	vec3 bottom = texel(level, x0, y0, holder).scaled(1.0 - fx) + texel(level, x0 + 1, y0, holder).scaled(fx);
+	vec3 top = texel(level, x0, y0 + 1, holder).scaled(1.0 - fx) + texel(level, x0 + 1, y0 + 1, holder).scaled(fx);
+	return bottom.scaled(1.0 - fy) + top.scaled(fy);
+}
+
+RGBVec Texture::sample(double u, double v, double du, double dv) const {
+	u -= std::floor(u);
+	v -= std::floor(v);
+
+	// the level where the footprint is a texel across, between the two
+	// nearest levels
+	const double texels = std::max(du * levels[0].width, dv * levels[0].height);
+	double lod = texels > 1.0 ? std::log2(texels) : 0.0;
+	lod = std::min(lod, static_cast<double>(levels.size() - 1));
+	const int level = static_cast<int>(lod);
+	const double f = lod - level;
+
+	TileHolder holder;
+	vec3 c = bilinear(level, u, v, holder);
+	if (f > 0.0 && level + 1 < static_cast<int>(levels.size()))
+		c = c.scaled(1.0 - f) + bilinear(level + 1, u, v, holder).scaled(f);
+	return RGBVec(c);
+}
+
+/* packing */
+
+// the next number in a PPM header, skipping comments
+static bool ppmNumber(std::istream &in, uint32_t &out) {
+	int c;
+	while ((c = in.peek()) != EOF) {
+		if (c == '#') {
+			std::string comment;
+			std::getline(in, comment);
+		}
+		else if (isspace(c))
+			in.get();
+		else
+			break;
+	}
+	return static_cast<bool>(in >> out);
+}
+
+// texels, row by row from the bottom
+static void readPPM(const std::string &path, uint32_t &width, uint32_t &height, std::vector<unsigned char> &texels) {
+	std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+	if (!in)
+		textureFail(path, "cannot open");
+
+	char magic[2];
+	uint32_t maxval;
+	if (!in.read(magic, 2) || magic[0] != 'P' || magic[1] != '6')
+		textureFail(path, "not a binary PPM");
+	if (!ppmNumber(in, width) || !ppmNumber(in, height) || !ppmNumber(in, maxval) || width == 0 || height == 0)
+		textureFail(path, "bad PPM header");
+	if (maxval != 255)
+		textureFail(path, "only 8 bit PPMs are supported");
+	in.get();
+
+	texels.resize(3 * static_cast<size_t>(width) * height);
+	const size_t row = 3 * static_cast<size_t>(width);
+	for (uint32_t y = height; y-- > 0; )
+		if (!in.read(reinterpret_cast<char *>(&texels[y * row]), static_cast<std::streamsize>(row)))
+			textureFail(path, "truncated PPM");
+}
+
+// the next level down: each texel the average of the 2x2 above it (or
+// fewer, at the edge of an odd-sized level)
+static void halve(uint32_t w, uint32_t h, const std::vector<unsigned char> &in,
+		uint32_t &nw, uint32_t &nh, std::vector<unsigned char> &out) {
+	nw = std::max(1u, w / 2);
+	nh = std::max(1u, h / 2);
+	out.resize(3 * static_cast<size_t>(nw) * nh);
+	for (uint32_t y = 0; y < nh; y++) {
+		for (uint32_t x = 0; x < nw; x++) {
+			const uint32_t xs[2] = { 2 * x, std::min(2 * x + 1, w - 1) };
+			const uint32_t ys[2] = { 2 * y, std::min(2 * y + 1, h - 1) };
+			for (int ch = 0; ch < 3; ch++) {
+				unsigned sum = 0;
+				for (int a = 0; a < 2; a++)
+					for (int b = 0; b < 2; b++)
+						sum += in[3 * (static_cast<size_t>(ys[b]) * w + xs[a]) + ch];
+				out[3 * (static_cast<size_t>(y) * nw + x) + ch] = static_cast<unsigned char>((sum + 2) / 4);
+			}
+		}
+	}
+}
+
+static uint64_t alignUp(uint64_t x, uint64_t a) {
+	return (x + a - 1) / a * a;
+}
+
+void packTexture(const std::string &in_path, const std::string &out_path, uint32_t tile_size) {
+	if (tile_size == 0)
+		tile_size = TEXTURE_TILE_SIZE;
+
+	std::vector<std::vector<unsigned char> > chain(1);
+	std::vector<TextureLevelRecord> recs(1);
+	readPPM(in_path, recs[0].width, recs[0].height, chain[0]);
+	while (recs.back().width > 1 || recs.back().height > 1) {
+		TextureLevelRecord next;
+		chain.push_back(std::vector<unsigned char>());
+		halve(recs.back().width, recs.back().height, chain[chain.size() - 2], next.width, next.height, chain.back());
+		recs.push_back(next);
+	}
+
+	const size_t tile_bytes = 3 * static_cast<size_t>(tile_size) * tile_size;
+
+	TextureFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TEXTURE_FILE_MAGIC, sizeof(TEXTURE_FILE_MAGIC));
+	header.version = TEXTURE_FILE_VERSION;
+	header.width = recs[0].width;
+	header.height = recs[0].height;
+	header.tile_size = tile_size;
+	header.num_levels = static_cast<uint32_t>(recs.size());
+	header.levels_offset = alignUp(sizeof(header), 64);
+
+	uint64_t pos = alignUp(header.levels_offset + recs.size() * sizeof(TextureLevelRecord), TEXTURE_TILE_ALIGN);
+	for (size_t i = 0; i < recs.size(); i++) {
+		recs[i].tiles_x = (recs[i].width + tile_size - 1) / tile_size;
+		recs[i].tiles_y = (recs[i].height + tile_size - 1) / tile_size;
+		recs[i].offset = pos;
+		pos += static_cast<uint64_t>(recs[i].tiles_x) * recs[i].tiles_y * tile_bytes;
+	}
+	header.file_size = pos;
+
+	std::ofstream out(out_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!out)
+		textureFail(out_path, "cannot open for writing");
+
+	std::vector<char> front(recs[0].offset, 0);
+	memcpy(&front[0], &header, sizeof(header));
+	memcpy(&front[header.levels_offset], &recs[0], recs.size() * sizeof(TextureLevelRecord));
+	out.write(&front[0], static_cast<std::streamsize>(front.size()));
+
+	std::vector<unsigned char> tile(tile_bytes);
+	for (size_t i = 0; i < recs.size(); i++) {
+		const TextureLevelRecord &l = recs[i];
+		for (uint32_t ty = 0; ty < l.tiles_y; ty++) {
+			for (uint32_t tx = 0; tx < l.tiles_x; tx++) {
+				std::fill(tile.begin(), tile.end(), 0);
+				for (uint32_t y = 0; y < tile_size && ty * tile_size + y < l.height; y++) {
+					const uint32_t x0 = tx * tile_size;
+					const uint32_t n = std::min(tile_size, l.width - x0);
+					memcpy(&tile[3 * static_cast<size_t>(y) * tile_size],
+						&chain[i][3 * (static_cast<size_t>(ty * tile_size + y) * l.width + x0)], 3 * n);
+				}
+				out.write(reinterpret_cast<const char *>(&tile[0]), static_cast<std::streamsize>(tile_bytes));
+			}
+		}
+	}
+
+	if (!out)
+		textureFail(out_path, "write failed");
+}
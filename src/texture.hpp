@@ -0,0 +1,88 @@
+/* texture.hpp
+ *
+ * image textures, read a tile at a time through the scene's PageCache
+ *
+ * a texture file holds a whole mip chain (the image, then halved again
+ * and again down to 1x1), each level cut into square tiles of RGB
+ * texels. only the header and level table stay resident: tiles are
+ * fetched through the same bounded, shared cache as paged geometry the
+ * first time a lookup needs them, so a scene can have far more texture
+ * than memory and the budget covers both.
+ *
+ * lookups are trilinear. the level is picked from the lookup's
+ * footprint, how much of the texture one sample covers, which comes
+ * from the width of the ray's cone where it hits (see Ray). distant and
+ * grazing surfaces read the small levels, so they don't alias and only
+ * pull in a few tiles.
+ */
+
+#ifndef TEXTURE_HEADER_WARRIOR
+#define TEXTURE_HEADER_WARRIOR
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+
+#include "colour.hpp"
+#include "mappedfile.hpp"
+#include "pagecache.hpp"
+
+#define TEXTURE_FILE_MAGIC 	"TRCFTEX"
+#define TEXTURE_FILE_VERSION 	1
+#define TEXTURE_TILE_SIZE 	64	// default texels along each side of a tile
+#define TEXTURE_TILE_ALIGN 	4096
+
+struct TextureFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t width;		// of level 0
+	uint32_t height;
+	uint32_t tile_size;
+	uint32_t num_levels;
+	uint32_t reserved;
+	uint64_t levels_offset;	// TextureLevelRecord[num_levels]
+	uint64_t file_size;
+};
+
+// a level's tiles are tiles_x * tiles_y blocks of tile_size^2 RGB
+// texels, row by row from the bottom, starting at `offset`. tiles at
+// the right and top edges are padded out to full size
+struct TextureLevelRecord {
+	uint32_t width;
+	uint32_t height;
+	uint32_t tiles_x;
+	uint32_t tiles_y;
+	uint64_t offset;
+};
+
+class Texture {
+private:
+	std::shared_ptr<const MappedFile> file;
+	std::shared_ptr<PageCache> cache;
+	uint32_t tile_size;
+	size_t tile_bytes;
+	std::vector<TextureLevelRecord> levels;
+
+	struct TileHolder;
+	vec3 texel(int level, int x, int y, TileHolder &holder) const;
+	vec3 bilinear(int level, double u, double v, TileHolder &holder) const;
+
+public:
+	Texture(const std::string &path, std::shared_ptr<PageCache> cache);
+
+	int width() const;
+	int height() const;
+	int levelCount() const;
+
+	// the colour at (u, v), where the texture covers [0, 1) both ways
+	// and repeats outside that. du and dv are the footprint of the
+	// lookup, in the same units
+	RGBVec sample(double u, double v, double du, double dv) const;
+};
+
+// reads a binary PPM (as Image::writeToFile writes them) and writes
+// it out as a tiled, mip-mapped texture file
+void packTexture(const std::string &in_path, const std::string &out_path, uint32_t tile_size);
+
+#endif
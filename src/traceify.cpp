@@ -1,12 +1,31 @@
 #include <iostream>
 #include <string>
 #include <fstream>
-#include <ctime>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
 
 #include "colour.hpp"
 #include "vec3.hpp"
 #include "world.hpp"
 #include "image.hpp"
+#include "scenefile.hpp"
+#include "sceneparser.hpp"
+#include "benchmarks.hpp"
+#include "pagedgeom.hpp"
+#include "renderer.hpp"
+#include "server.hpp"
+#include "distributed.hpp"
+#include "progressive.hpp"
+#include "denoise.hpp"
+#include "coherent.hpp"
+#include "texture.hpp"
+#include "animation.hpp"
+#include "scenegen.hpp"
+#include "perftest.hpp"
+#include "numa.hpp"
+#include "hdr.hpp"
 
 #define IMG_WIDTH 1000
 #define IMG_HEIGHT 800
@@ -14,6 +33,157 @@
 #define VIEWING_DISTANCE 0.25
 #define SPHERE_RADIUS 0.4
 
+// wall clock time: clock() counts CPU time over every render thread
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// `coherent` traces each tile a bounce at a time (see coherent.hpp)
+void render_to_image(World &world, Image &img, bool coherent = false)
+{
+	RenderEngine engine;
+	RenderJob job(world, img);
+	if (coherent)
+		job.tileRenderer = renderCoherent;
+	engine.render(job);
+	world.renderStats.merge(job.stats);
+}
+
+// the float outputs of a render, if any (see hdr.hpp)
+struct HDROutputs {
+	std::string pfm_path;
+	std::string png_path;
+	ToneMapOptions tone;
+
+	bool wanted() const { return !pfm_path.empty() || !png_path.empty(); }
+};
+
+// with `denoise`, the image is filtered using a G-buffer recorded
+// alongside it. with `gbuffer`, the G-buffer is written out too. `numa`
+// pins the render threads to NUMA nodes, and `replicate` also loads a
+// copy of the scene on each node. `accel` overrides the scene's
+// accelerator, if it isn't NULL, and `lazy` has the clusters split as
+// rays reach them
+void render_scene_file(const std::string &scene_path, const std::string &out_path, bool do_denoise, bool write_gbuffer,
+		bool coherent, bool numa, bool replicate, const HDROutputs &hdr_out, const Accelerator *accel, bool lazy)
+{
+	World world(Viewport(IMG_WIDTH, IMG_HEIGHT, CAMERA_WIDTH, VIEWING_DISTANCE), vec3(0.0, 0.0, 0.0), RGBVec());
+
+	const Clock::time_point load_t = Clock::now();
+	loadScene(scene_path, world);
+	if (accel)
+		world.accelerator = *accel;
+	if (lazy)
+		world.lazy_build = true;
+	world.numberObjects();
+	world.buildHierarchy();
+	std::cout << "Loaded " << scene_path << " in " << 1000.0 * secondsSince(load_t) << "ms" << std::endl;
+
+	std::unique_ptr<SceneReplicas> replicas;
+	if (replicate) {
+		const NumaTopology topo = NumaTopology::detect();
+		replicas.reset(new SceneReplicas(scene_path, world, topo));
+		std::cout << "Replicated the scene on " << topo.nodes() << " NUMA node" << (topo.nodes() > 1 ? "s" : "") << std::endl;
+	}
+
+	Image img(world.viewport.pixelsWide(), world.viewport.pixelsTall());
+	RenderEngine engine(0, numa || replicate);
+	RenderJob job(world, img);
+	if (coherent)
+		job.tileRenderer = renderCoherent;
+	if (replicas)
+		job.replicas = replicas->byNode();
+	std::unique_ptr<FloatImage> hdr;
+	if (hdr_out.wanted()) {
+		hdr.reset(new FloatImage(img.width, img.height));
+		job.hdr = hdr.get();
+	}
+
+	if (do_denoise || write_gbuffer) {
+		GBuffer g(img.width, img.height);
+		recordGBuffer(job, g);
+		engine.render(job);
+		world.renderStats.merge(job.stats);
+
+		if (write_gbuffer)
+			g.writeImages(out_path);
+		if (do_denoise)
+			denoise(engine, job, g, DenoiseOptions());
+	}
+	else {
+		engine.render(job);
+		world.renderStats.merge(job.stats);
+	}
+
+	world.renderStats.summarise();
+	if (world.pageCache)
+		world.pageCache->summarise(std::cout);
+	img.writeToFile(out_path);
+
+	if (!hdr_out.pfm_path.empty())
+		writePFM(*hdr, hdr_out.pfm_path);
+	if (!hdr_out.png_path.empty()) {
+		const Clock::time_point png_t = Clock::now();
+		writeToneMappedPNG(*hdr, hdr_out.tone, hdr_out.png_path);
+		std::cout << "Wrote " << hdr_out.png_path << " in " << 1000.0 * secondsSince(png_t) << "ms" << std::endl;
+	}
+}
+
+// a whole number between lo and hi and nothing else, false for anything
+// atoi would have quietly turned into 0 or cut short
+bool parse_count(const char *arg, long lo, long hi, long &out)
+{
+	char *end;
+	errno = 0;
+	const long n = strtol(arg, &end, 10);
+	if (end == arg || *end != '\0' || errno == ERANGE || n < lo || n > hi)
+		return false;
+	out = n;
+	return true;
+}
+
+// exposure=, tonemap= and srgb, for --scene and --tonemap
+bool parse_tone_option(const char *arg, ToneMapOptions &opts)
+{
+	if (strcmp(arg, "srgb") == 0) {
+		opts.srgb = true;
+		return true;
+	}
+	const char *eq = strchr(arg, '=');
+	if (!eq)
+		return false;
+	const std::string key(arg, eq - arg);
+	const char *value = eq + 1;
+	if (key == "exposure")
+		opts.exposure = atof(value);
+	else if (key == "tonemap")
+		return parseToneCurve(value, opts.curve);
+	else
+		return false;
+	return true;
+}
+
+// traceify --tonemap <in.pfm> <out.png|out.ppm> [exposure=stops] [tonemap=clamp|reinhard] [srgb]
+bool tonemap_file(int argc, char **argv)
+{
+	if (argc < 4)
+		return false;
+	ToneMapOptions opts;
+	for (int i = 4; i < argc; i++)
+		if (!parse_tone_option(argv[i], opts))
+			return false;
+
+	FloatImage img(0, 0);
+	readPFM(argv[2], img);
+	const std::string out_path = argv[3];
+	if (out_path.size() >= 4 && out_path.compare(out_path.size() - 4, 4, ".ppm") == 0)
+		writeToneMappedPPM(img, opts, out_path);
+	else
+		writeToneMappedPNG(img, opts, out_path);
+	return true;
+}
 
 void render_demo(int num_spheres, int ss_level, bool do_shadows, bool do_reflections, bool profiling)
 {
@@ -88,11 +258,7 @@ void render_demo(int num_spheres, int ss_level, bool do_shadows, bool do_reflect
 
 	world.addObject(sphereGroup);
 
-	for (int i = 0; i < world.viewport.pixelsWide(); i++) {
-		for (int j = 0; j < world.viewport.pixelsTall(); j++) {
-			img[i][j] = world.colourForPixelAt(i,j);
-		}
-	}
+	render_to_image(world, img);
 
 
 	if (profiling) {
@@ -113,9 +279,9 @@ void profile_with_params(int ss, bool shadows, bool reflections)
 	for (int i = 1; i <= 27; i++) {
 		std::cout << i << "\t";
 
-		const clock_t begin_t = clock();
+		const Clock::time_point begin_t = Clock::now();
 		render_demo(i, ss, shadows, reflections, true);
-		std::cout << float( clock() - begin_t )/CLOCKS_PER_SEC << std::endl;
+		std::cout << secondsSince(begin_t) << std::endl;
 	}	
 }
 
@@ -144,8 +310,412 @@ void rt_profiler()
 
 }
 
-int main()
+// options after the paths are key=value pairs, or just "resume"
+bool render_progressive(int argc, char **argv)
+{
+	ProgressiveOptions opts;
+	std::string out_path = "render.ppm";
+
+	for (int i = 3; i < argc; i++) {
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		std::string key = arg.substr(0, eq);
+		const char *value = eq == std::string::npos ? "" : argv[i] + eq + 1;
+
+		if (eq == std::string::npos && key == "resume")
+			opts.resume = true;
+		else if (eq == std::string::npos && i == 3)
+			out_path = arg;
+		else if (key == "samples")
+			opts.max_samples = atoi(value);
+		else if (key == "min_samples")
+			opts.min_samples = atoi(value);
+		else if (key == "error")
+			opts.target_error = atof(value);
+		else if (key == "budget")
+			opts.time_budget = atof(value);
+		else if (key == "preview")
+			opts.preview_interval = atof(value);
+		else if (key == "checkpoint")
+			opts.checkpoint_interval = atof(value);
+		else if (key == "checkpoint_file")
+			opts.checkpoint_path = value;
+		else if (key == "threads")
+			opts.threads = atoi(value);
+		else
+			return false;
+	}
+
+	if (opts.max_samples < 1 || opts.min_samples < 1)
+		return false;
+
+	renderProgressive(argv[2], out_path, opts);
+	return true;
+}
+
+// options after the paths are key=value pairs, frames=a-b or frames=n
+bool render_animation(int argc, char **argv)
+{
+	AnimationOptions opts;
+	std::string out_prefix = "frame";
+
+	for (int i = 4; i < argc; i++) {
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		std::string key = arg.substr(0, eq);
+		const char *value = eq == std::string::npos ? "" : argv[i] + eq + 1;
+
+		if (eq == std::string::npos && i == 4)
+			out_prefix = arg;
+		else if (key == "frames") {
+			const char *dash = strchr(value, '-');
+			opts.first_frame = atoi(value);
+			opts.last_frame = dash ? atoi(dash + 1) : opts.first_frame;
+		}
+		else if (key == "threads")
+			opts.threads = atoi(value);
+		else if (key == "pipeline")
+			opts.pipelined = strcmp(value, "off") != 0;
+		else if (key == "reproject")
+			opts.reproject = strcmp(value, "on") == 0;
+		else
+			return false;
+	}
+
+	renderAnimation(argv[2], argv[3], out_prefix, opts);
+	return true;
+}
+
+// one key=value option of the scene generator, false if it isn't one
+bool parse_generator_option(const std::string &key, const char *value, SceneGenOptions &opts)
+{
+	if (key == "primitives")
+		opts.primitives = atol(value);
+	else if (key == "distribution")
+		return parseDistribution(value, opts.distribution);
+	else if (key == "seed")
+		opts.seed = static_cast<unsigned int>(strtoul(value, NULL, 10));
+	else if (key == "reflective")
+		opts.reflective = atof(value);
+	else if (key == "meshes")
+		opts.meshes = atof(value);
+	else if (key == "lights")
+		opts.lights = atoi(value);
+	else if (key == "planes")
+		opts.planes = atoi(value);
+	else
+		return false;
+	return true;
+}
+
+bool generate_scene(int argc, char **argv)
+{
+	SceneGenOptions opts;
+	for (int i = 3; i < argc; i++) {
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		if (eq == std::string::npos || !parse_generator_option(arg.substr(0, eq), argv[i] + eq + 1, opts))
+			return false;
+	}
+	if (opts.primitives < 0)
+		return false;
+
+	generateSceneFile(opts, argv[2]);
+	return true;
+}
+
+// the largest scene comes first, if it's given, then generator options
+// and width=n height=n
+bool bench_scaling_with_options(int argc, char **argv)
+{
+	SceneGenOptions opts;
+	long max_primitives = 1000000;
+	int width = 320, height = 240;
+	for (int i = 2; i < argc; i++) {
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		std::string key = arg.substr(0, eq);
+		const char *value = eq == std::string::npos ? "" : argv[i] + eq + 1;
+
+		if (eq == std::string::npos && i == 2)
+			max_primitives = atol(argv[i]);
+		else if (key == "width")
+			width = atoi(value);
+		else if (key == "height")
+			height = atoi(value);
+		else if (eq == std::string::npos || !parse_generator_option(key, value, opts))
+			return false;
+	}
+	if (width < 1 || height < 1)
+		return false;
+
+	bench_scaling(opts, max_primitives, width, height);
+	return true;
+}
+
+// the baseline's directory comes first, if it's given, then "record",
+// "record_references" and key=value options
+bool perftest_options(int argc, char **argv, PerfTestOptions &opts)
+{
+	for (int i = 2; i < argc; i++) {
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		std::string key = arg.substr(0, eq);
+		const char *value = eq == std::string::npos ? "" : argv[i] + eq + 1;
+
+		if (eq == std::string::npos && key == "record")
+			opts.record = true;
+		else if (eq == std::string::npos && key == "record_references")
+			opts.record_references = true;
+		else if (eq == std::string::npos && i == 2)
+			opts.dir = arg;
+		else if (key == "references")
+			opts.references = value;
+		else if (key == "runs")
+			opts.runs = atoi(value);
+		else if (key == "time")
+			opts.time_tolerance = atof(value);
+		else if (key == "psnr")
+			opts.min_psnr = atof(value);
+		else
+			return false;
+	}
+	return !opts.dir.empty() && !opts.references.empty();
+}
+
+void usage()
 {
+	std::cerr << "usage: traceify                          render the demo scene to render.ppm" << std::endl;
+	std::cerr << "       traceify --profile                run the profiler over the demo scene" << std::endl;
+	std::cerr << "       traceify --scene <file> [out.ppm] [denoise] [gbuffer] [sorted] [numa] [replicate]" << std::endl;
+	std::cerr << "                                         render a scene (text or binary), optionally denoised," << std::endl;
+	std::cerr << "                                         or with reflections traced a bounce at a time. numa pins" << std::endl;
+	std::cerr << "                                         threads to NUMA nodes, replicate copies the scene onto each" << std::endl;
+	std::cerr << "                [hdr=out.pfm] [png=out.png] [exposure=stops] [tonemap=clamp|reinhard] [srgb]" << std::endl;
+	std::cerr << "                                         also write the unrounded pixels, or a PNG tone mapped from them" << std::endl;
+	std::cerr << "                [accel=hierarchy|grid|grid2] [lazy]" << std::endl;
+	std::cerr << "                                         what to put the scene in: nested clusters, or a one or two-level grid," << std::endl;
+	std::cerr << "                                         and whether clusters are only split once rays reach them" << std::endl;
+	std::cerr << "       traceify --tonemap <in.pfm> <out.png|out.ppm> [exposure=stops] [tonemap=clamp|reinhard] [srgb]" << std::endl;
+	std::cerr << "                                         re-expose a float image without rendering it again" << std::endl;
+	std::cerr << "       traceify --progressive <file> [out.ppm] [resume] [samples=n] [min_samples=n] [error=e] [budget=secs]" << std::endl;
+	std::cerr << "                [preview=secs] [checkpoint=secs] [checkpoint_file=path] [threads=n]" << std::endl;
+	std::cerr << "                                         render a scene progressively, with checkpoints" << std::endl;
+	std::cerr << "       traceify --animate <file> <animation> [out_prefix] [frames=a-b] [threads=n] [pipeline=off]" << std::endl;
+	std::cerr << "                [reproject=on]           render a sequence of frames, writing each while the next traces," << std::endl;
+	std::cerr << "                                         or previews carrying first hits over from frame to frame" << std::endl;
+	std::cerr << "       traceify --obj2scene <obj> <file> convert an OBJ mesh to a binary scene file" << std::endl;
+	std::cerr << "       traceify --generate <file> [primitives=n] [distribution=uniform|clustered|skewed] [seed=n]" << std::endl;
+	std::cerr << "                [reflective=f] [meshes=f] [lights=n] [planes=n]" << std::endl;
+	std::cerr << "                                         generate a scene file procedurally" << std::endl;
+	std::cerr << "       traceify --bench-parser [n]       time parsing a scene with n spheres" << std::endl;
+	std::cerr << "       traceify --bench-denoise [file] [width height]" << std::endl;
+	std::cerr << "                                         compare x4 + denoising with x16 and x64" << std::endl;
+	std::cerr << "       traceify --bench-order [n] [width height]" << std::endl;
+	std::cerr << "                                         compare tile and pixel orders on a scene with n spheres" << std::endl;
+	std::cerr << "       traceify --bench-sort [n] [width height]" << std::endl;
+	std::cerr << "                                         compare sorted bounces with the pixel loop on n mirrored spheres" << std::endl;
+	std::cerr << "       traceify --bench-shade [hits]     compare batch shading with Material::shade, hit by hit" << std::endl;
+	std::cerr << "       traceify --bench-encode [file] [width height]" << std::endl;
+	std::cerr << "                                         time tone mapping and PNG encoding against the render" << std::endl;
+	std::cerr << "       traceify --bench-numa [n] [width height]" << std::endl;
+	std::cerr << "                                         compare free, NUMA-pinned and replicated threads as they scale" << std::endl;
+	std::cerr << "       traceify --bench-grid [n] [width height]" << std::endl;
+	std::cerr << "                                         compare grids with the hierarchy on uniform and clustered scenes" << std::endl;
+	std::cerr << "       traceify --bench-lazy [n] [width height]" << std::endl;
+	std::cerr << "                                         compare time to first pixel with lazy and full hierarchy builds" << std::endl;
+	std::cerr << "       traceify --bench-scaling [max] [width=n] [height=n] [generator options]" << std::endl;
+	std::cerr << "                                         time and measure generated scenes of 10 to max primitives" << std::endl;
+	std::cerr << "       traceify --perftest [dir] [record] [record_references] [references=dir] [runs=n] [time=fraction] [psnr=dB]" << std::endl;
+	std::cerr << "                                         check renders against reference images and timings" << std::endl;
+	std::cerr << "                                         against a baseline in dir (make perftest)" << std::endl;
+	std::cerr << "       traceify --pack-spheres <in> <out> [block]" << std::endl;
+	std::cerr << "                                         pack \"x y z r [material]\" lines into a paged sphere file" << std::endl;
+	std::cerr << "       traceify --pack-texture <in.ppm> <out> [tile]" << std::endl;
+	std::cerr << "                                         pack an image into a tiled, mip-mapped texture file" << std::endl;
+	std::cerr << "       traceify --distribute <file> [out.ppm] [workers] [port]" << std::endl;
+	std::cerr << "                                         render a scene across worker processes" << std::endl;
+	std::cerr << "       traceify --worker <host:port> [threads]" << std::endl;
+	std::cerr << "                                         render tiles for a coordinator" << std::endl;
+	std::cerr << "       traceify --serve [socket] [threads] [numa]" << std::endl;
+	std::cerr << "                                         serve render requests on a unix socket (or stdin)" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1) {
+		try {
+			if (strcmp(argv[1], "--profile") == 0) {
+				rt_profiler();
+			}
+			else if (strcmp(argv[1], "--scene") == 0 && argc >= 3) {
+				std::string out_path = "render.ppm";
+				bool do_denoise = false, write_gbuffer = false, coherent = false, numa = false, replicate = false, lazy = false;
+				HDROutputs hdr_out;
+				Accelerator accel = accelerator_hierarchy;
+				bool set_accel = false;
+				for (int i = 3; i < argc; i++) {
+					if (strncmp(argv[i], "accel=", 6) == 0) {
+						if (!parseAccelerator(argv[i] + 6, accel)) {
+							usage();
+							return 1;
+						}
+						set_accel = true;
+					}
+					else if (strncmp(argv[i], "hdr=", 4) == 0)
+						hdr_out.pfm_path = argv[i] + 4;
+					else if (strncmp(argv[i], "png=", 4) == 0)
+						hdr_out.png_path = argv[i] + 4;
+					else if (parse_tone_option(argv[i], hdr_out.tone))
+						continue;
+					else if (strcmp(argv[i], "denoise") == 0)
+						do_denoise = true;
+					else if (strcmp(argv[i], "numa") == 0)
+						numa = true;
+					else if (strcmp(argv[i], "replicate") == 0)
+						replicate = true;
+					else if (strcmp(argv[i], "gbuffer") == 0)
+						write_gbuffer = true;
+					else if (strcmp(argv[i], "sorted") == 0)
+						coherent = true;
+					else if (strcmp(argv[i], "lazy") == 0)
+						lazy = true;
+					else if (i == 3)
+						out_path = argv[i];
+					else {
+						usage();
+						return 1;
+					}
+				}
+				// the float image is of the render before it's denoised
+				if (do_denoise && hdr_out.wanted()) {
+					usage();
+					return 1;
+				}
+				render_scene_file(argv[2], out_path, do_denoise, write_gbuffer, coherent, numa, replicate, hdr_out,
+						set_accel ? &accel : NULL, lazy);
+			}
+			else if (strcmp(argv[1], "--progressive") == 0 && argc >= 3) {
+				if (!render_progressive(argc, argv)) {
+					usage();
+					return 1;
+				}
+			}
+			else if (strcmp(argv[1], "--animate") == 0 && argc >= 4) {
+				if (!render_animation(argc, argv)) {
+					usage();
+					return 1;
+				}
+			}
+			else if (strcmp(argv[1], "--obj2scene") == 0 && argc == 4) {
+				convertObjToSceneFile(argv[2], argv[3]);
+			}
+			else if (strcmp(argv[1], "--pack-spheres") == 0 && argc >= 4) {
+				long block = PAGED_BLOCK_SPHERES;
+				if (argc >= 5 && !parse_count(argv[4], 1, PAGED_MAX_BLOCK_SPHERES, block)) {
+					usage();
+					return 1;
+				}
+				packSpheres(argv[2], argv[3], static_cast<uint32_t>(block));
+			}
+			else if (strcmp(argv[1], "--pack-texture") == 0 && argc >= 4) {
+				packTexture(argv[2], argv[3], argc >= 5 ? atoi(argv[4]) : TEXTURE_TILE_SIZE);
+			}
+			else if (strcmp(argv[1], "--distribute") == 0 && argc >= 3) {
+				DistributedOptions opts;
+				if (argc >= 5)
+					opts.local_workers = atoi(argv[4]);
+				if (argc >= 6)
+					opts.port = atoi(argv[5]);
+				renderDistributed(argv[2], argc >= 4 ? argv[3] : "render.ppm", opts);
+			}
+			else if (strcmp(argv[1], "--worker") == 0 && argc >= 3) {
+				runWorker(argv[2], argc >= 4 ? atoi(argv[3]) : 0);
+			}
+			else if (strcmp(argv[1], "--serve") == 0) {
+				ServerOptions opts;
+				if (argc >= 4)
+					opts.threads = atoi(argv[3]);
+				opts.numa = argc >= 5 && strcmp(argv[4], "numa") == 0;
+				if (argc >= 3 && strcmp(argv[2], "-") != 0)
+					serveSocket(argv[2], opts);
+				else
+					serveStdio(opts);
+			}
+			else if (strcmp(argv[1], "--generate") == 0 && argc >= 3) {
+				if (!generate_scene(argc, argv)) {
+					usage();
+					return 1;
+				}
+			}
+			else if (strcmp(argv[1], "--bench-parser") == 0) {
+				bench_parser(argc >= 3 ? atoi(argv[2]) : 1000000);
+			}
+			else if (strcmp(argv[1], "--bench-denoise") == 0) {
+				bench_denoise(argc >= 3 ? argv[2] : "scenes/demo.scene",
+						argc >= 5 ? atoi(argv[3]) : 200, argc >= 5 ? atoi(argv[4]) : 160);
+			}
+			else if (strcmp(argv[1], "--bench-order") == 0) {
+				bench_order(argc >= 3 ? atoi(argv[2]) : 200000,
+						argc >= 5 ? atoi(argv[3]) : 320, argc >= 5 ? atoi(argv[4]) : 240);
+			}
+			else if (strcmp(argv[1], "--bench-sort") == 0) {
+				bench_sort(argc >= 3 ? atoi(argv[2]) : 1000,
+						argc >= 5 ? atoi(argv[3]) : 320, argc >= 5 ? atoi(argv[4]) : 240);
+			}
+			else if (strcmp(argv[1], "--tonemap") == 0) {
+				if (!tonemap_file(argc, argv)) {
+					usage();
+					return 1;
+				}
+			}
+			else if (strcmp(argv[1], "--bench-shade") == 0) {
+				bench_shade(argc >= 3 ? atoi(argv[2]) : 1000000);
+			}
+			else if (strcmp(argv[1], "--bench-encode") == 0) {
+				bench_encode(argc >= 3 ? argv[2] : "scenes/demo.scene",
+						argc >= 5 ? atoi(argv[3]) : 1920, argc >= 5 ? atoi(argv[4]) : 1080);
+			}
+			else if (strcmp(argv[1], "--bench-numa") == 0) {
+				bench_numa(argc >= 3 ? atol(argv[2]) : 100000,
+						argc >= 5 ? atoi(argv[3]) : 640, argc >= 5 ? atoi(argv[4]) : 480);
+			}
+			else if (strcmp(argv[1], "--bench-lazy") == 0) {
+				bench_lazy(argc >= 3 ? atol(argv[2]) : 1000000,
+						argc >= 5 ? atoi(argv[3]) : 320, argc >= 5 ? atoi(argv[4]) : 240);
+			}
+			else if (strcmp(argv[1], "--bench-grid") == 0) {
+				bench_grid(argc >= 3 ? atol(argv[2]) : 100000,
+						argc >= 5 ? atoi(argv[3]) : 640, argc >= 5 ? atoi(argv[4]) : 480);
+			}
+			else if (strcmp(argv[1], "--bench-scaling") == 0) {
+				if (!bench_scaling_with_options(argc, argv)) {
+					usage();
+					return 1;
+				}
+			}
+			else if (strcmp(argv[1], "--perftest") == 0) {
+				PerfTestOptions opts;
+				if (!perftest_options(argc, argv, opts)) {
+					usage();
+					return 1;
+				}
+				if (!runPerfTest(opts))
+					return 1;
+			}
+			else {
+				usage();
+				return 1;
+			}
+		}
+		catch (const std::runtime_error &e) {
+			std::cerr << "traceify: " << e.what() << std::endl;
+			return 1;
+		}
+
+		return 0;
+	}
+
 	// render demo scene with
 	//  - 27 spheres
 	//  - x4 supersampling (non-adaptive)
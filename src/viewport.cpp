@@ -1,5 +1,6 @@
 #include "viewport.hpp"
 #include <random>
+#include <cstdlib>
 #include "debug.h"
 
 // this constructor is a shorthand to create a square viewport
@@ -27,26 +28,51 @@ Viewport::Viewport(int pixWidth, int pixHeight, double camera_across, double vie
 }
 
 double Viewport::uAmount(int i, int ss_level, int ss_iter, bool introduceJitter) {
-	
+	return uAmount(i, ss_level, ss_iter, introduceJitter, NULL);
+}
+
+double Viewport::vAmount(int j, int ss_level, int ss_iter, bool introduceJitter) {
+	return vAmount(j, ss_level, ss_iter, introduceJitter, NULL);
+}
+
+// a NULL seed falls back to one kept per thread, rather than the global
+// rand(), whose state every render in the process would share
+static double jitterAmount(int ss_level, unsigned int *seed) {
+	static thread_local unsigned int thread_seed = 1;
+	int r = rand_r(seed ? seed : &thread_seed);
+	return ((((double)r / (double)RAND_MAX) - 0.5)) / (2*(double)ss_level);
+}
+
+double Viewport::uAmount(int i, int ss_level, int ss_iter, bool introduceJitter, unsigned int *seed) const {
 	double across_pixel = (double)i + ((double)ss_iter + 0.5)/(double)ss_level;	
-	if (introduceJitter) {
-		double jitter = ((((double)rand() / (double)RAND_MAX) - 0.5)) / (2*(double)ss_level);
-		across_pixel += jitter;
-	}
+	if (introduceJitter)
+		across_pixel += jitterAmount(ss_level, seed);
 	return l + uSpread * across_pixel; 
 }
 
-double Viewport::vAmount(int j, int ss_level, int ss_iter, bool introduceJitter) {
+double Viewport::vAmount(int j, int ss_level, int ss_iter, bool introduceJitter, unsigned int *seed) const {
 	double up_pixel = (double)j + ((double)ss_iter + 0.5)/(double)ss_level;	
-	if (introduceJitter) {
-		double jitter = ((((double)rand() / (double)RAND_MAX) - 0.5)) / (2*(double)ss_level);
-		up_pixel += jitter;
-	}
+	if (introduceJitter)
+		up_pixel += jitterAmount(ss_level, seed);
 	return b + vSpread * up_pixel; 
 }
 
+double Viewport::uAt(double across) const {
+	return l + uSpread * across;
+}
+
+double Viewport::vAt(double up) const {
+	return b + vSpread * up;
+}
+
+Viewport Viewport::resized(int pixWidth, int pixHeight) const {
+	return Viewport(pixWidth, pixHeight, r - l, d);
+}
+
 double Viewport::getViewingDistance() { return d; }
 double Viewport::getViewingDistance() const { return d; }
 
 int Viewport::pixelsWide() { return n_x; }
 int Viewport::pixelsTall() { return n_y; }
+int Viewport::pixelsWide() const { return n_x; }
+int Viewport::pixelsTall() const { return n_y; }
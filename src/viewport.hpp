@@ -1,3 +1,6 @@
+#ifndef VIEWPORT_HEADER_WARRIOR
+#define VIEWPORT_HEADER_WARRIOR
+
 class Viewport {
 private:
 	int n_x; 		// number of pixels wide
@@ -26,9 +29,26 @@ public:
 	double uAmount(int i, int ss_level, int ss_iter, bool jitter);
 	double vAmount(int j, int ss_level, int ss_iter, bool jitter);
 
+	// these take their jitter from `seed` (with rand_r), so the same
+	// seed gives the same jitter whichever thread it's used on
+	double uAmount(int i, int ss_level, int ss_iter, bool jitter, unsigned int *seed) const;
+	double vAmount(int j, int ss_level, int ss_iter, bool jitter, unsigned int *seed) const;
+
+	// the u and v positions of a point given in pixels, where pixel
+	// (i, j) covers [i, i + 1) x [j, j + 1)
+	double uAt(double across) const;
+	double vAt(double up) const;
+
 	double getViewingDistance();
 	double getViewingDistance() const; 
 
 	int pixelsWide();
 	int pixelsTall();
+	int pixelsWide() const;
+	int pixelsTall() const;
+
+	// the same view (width across and viewing distance) at a different resolution
+	Viewport resized(int pixWidth, int pixHeight) const;
 };
+
+#endif
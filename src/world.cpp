@@ -1,13 +1,33 @@
 #include "world.hpp"
+#include "incremental.hpp"
 #include "debug.h"
 
-#define REFLECTION_EPS 	0.00001
-#define SHADOW_EPS 	0.00001
-#define MAX_TRACE_DEPTH 3
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <unordered_map>
+
+#define CLUSTER_LEAF_SIZE 4
+#define CLUSTER_EAGER_LEVELS 6		// levels of clusters split straight away with lazy_build
+
+SurfaceInfo::SurfaceInfo() :
+	hit(false), position(0.0, 0.0, 0.0), normal(0.0, 0.0, 0.0), depth(INFINITY), object(-1) {}
+
+ShadingPoint::ShadingPoint() :
+	ray(vec3(0.0, 0.0, 0.0), vec3(0.0, 0.0, 0.0)), obj(NULL), material(NULL),
+	p(0.0, 0.0, 0.0), n(0.0, 0.0, 0.0), depth(0), seed(0),
+	reflects(false), reflected(vec3(0.0, 0.0, 0.0), vec3(0.0, 0.0, 0.0)), throughput(0.0), survive(1.0) {}
 
 RenderStats::RenderStats() :
 	ss_x4(0), ss_x16(0), ss_x64(0) {}
 
+void RenderStats::merge(const RenderStats &other) {
+	ss_x4 += other.ss_x4;
+	ss_x16 += other.ss_x16;
+	ss_x64 += other.ss_x64;
+}
+
 void RenderStats::summarise() {
 	std::cout << "--- traceify rendering statistics ---" << std::endl << std::endl;
 	std::cout << "--> super-sampling:" << std::endl;
@@ -23,10 +43,16 @@ World::World(Viewport vp, const vec3 &camPos, const RGBVec &bg) :
 	reflections_enabled(true), 
 	ss_level(2),
 	ss_mode(ss_adaptive),
-	uAxis(1.0,0.0,0.0), // set up camera basis
-	vAxis(0.0,1.0,0.0),
-	wAxis(0.0,0.0,-1.0),
-	cameraPosition(camPos) {}
+	light_samples(DEFAULT_LIGHT_SAMPLES),
+	light_cutoff(DEFAULT_LIGHT_CUTOFF),
+	shadow_samples_first(DEFAULT_SHADOW_SAMPLES_FIRST),
+	shadow_samples_most(DEFAULT_SHADOW_SAMPLES_MOST),
+	max_depth(DEFAULT_MAX_DEPTH),
+	roulette_depth(DEFAULT_ROULETTE_DEPTH),
+	min_throughput(DEFAULT_MIN_THROUGHPUT),
+	accelerator(accelerator_hierarchy),
+	lazy_build(false),
+	view(camPos) {}
 
 
 World::~World() {
@@ -40,124 +66,608 @@ void World::addObject(const SceneObject &s) {
 	scenery.push_back(obj);
 }
 
+void World::adoptObject(SceneObject *obj) {
+	scenery.push_back(obj);
+}
+
 void World::addLight(const Light &l) {
 	lighting.push_back(l);
 }
 
 // Camera stuff
+void World::setCameraPosition(const vec3 &pos) {
+	view.position = pos;
+}
+
 void World::cameraRotateY(double theta) {
-	double sin_theta = sin(theta);
-	double cos_theta = cos(theta);
-	vec3 uPrime = uAxis.scaled(cos_theta) + wAxis.scaled(sin_theta);
-	vec3 wPrime = uAxis.scaled(-sin_theta) + wAxis.scaled(cos_theta);
-	uAxis = uPrime;
-	wAxis = wPrime;
+	view.rotateY(theta);
 }
 
 void World::cameraRotateX(double theta) {
-	double sin_theta = sin(theta);
-	double cos_theta = cos(theta);
-	vec3 vPrime = vAxis.scaled(cos_theta) + wAxis.scaled(sin_theta);
-	vec3 wPrime = vAxis.scaled(-sin_theta) + wAxis.scaled(cos_theta);
-	vAxis = vPrime;
-	wAxis = wPrime;
+	view.rotateX(theta);
+}
+
+const Camera &World::camera() const {
+	return view;
+}
+
+void World::subdivideCluster(Cluster *cluster) {
+	if (lazy_build)
+		cluster->subdivideLazily(CLUSTER_LEAF_SIZE, CLUSTER_EAGER_LEVELS);
+	else
+		cluster->subdivide(CLUSTER_LEAF_SIZE);
+}
+
+void World::buildHierarchy() {
+	// bounded objects at the top level get a cluster of their own,
+	// unbounded ones (planes) have to stay where they are
+	std::vector<SceneObject*> top;
+	Cluster *loose = accelerator == accelerator_hierarchy ? new Cluster() : new Grid(accelerator == accelerator_two_level_grid);
+	for (size_t i = 0; i < scenery.size(); i++) {
+		if (scenery[i]->isCluster())
+			subdivideCluster(static_cast<Cluster*>(scenery[i]));
+		if (scenery[i]->isBounded())
+			loose->adoptObject(scenery[i]);
+		else
+			top.push_back(scenery[i]);
+	}
+
+	if (loose->boundedObjects.size() > 1) {
+		subdivideCluster(loose);
+		top.push_back(loose);
+	}
+	else {
+		top.insert(top.end(), loose->boundedObjects.begin(), loose->boundedObjects.end());
+		loose->boundedObjects.clear();
+		delete loose;
+	}
+
+	scenery.swap(top);
+
+	if (light_samples > 0 && lighting.size() > static_cast<size_t>(light_samples))
+		lightTree.build(lighting);
+	else
+		lightTree.clear();
+}
+
+
+void World::refitHierarchy() {
+	for (size_t i = 0; i < scenery.size(); i++)
+		if (scenery[i]->isCluster())
+			static_cast<Cluster*>(scenery[i])->refit();
+}
+
+static void collectLeaves(std::vector<SceneObject*> &objects, std::vector<SceneObject*> &out) {
+	for (size_t i = 0; i < objects.size(); i++) {
+		if (objects[i]->isCluster())
+			collectLeaves(static_cast<Cluster*>(objects[i])->boundedObjects, out);
+		else
+			out.push_back(objects[i]);
+	}
+}
+
+void World::collectObjects(std::vector<SceneObject*> &out) {
+	collectLeaves(scenery, out);
+}
+
+void World::numberObjects() {
+	std::vector<SceneObject*> objects;
+	collectObjects(objects);
+	for (size_t i = 0; i < objects.size(); i++)
+		objects[i]->id = static_cast<int>(i);
+}
+
+const std::vector<Light> &World::lights() const {
+	return lighting;
+}
+
+// true if obj (or anything in it, if it's a cluster) is in the way
+bool World::occludes(const Ray &ray, SceneObject *obj, double t_max) {
+	IntersectionResult iResult = obj->intersects(ray);
+	if (!iResult.intersected)
+		return false;
+	if (!obj->isCluster())
+		return iResult.coefficient > SHADOW_EPS && iResult.coefficient < t_max;
+
+	Cluster *cluster = static_cast<Cluster*>(obj);
+	if (cluster->isGrid())
+		return gridOccludes(ray, *static_cast<Grid*>(cluster), t_max);
+	return traceShadowRay(ray, cluster->contents(), t_max);
 }
 
+bool World::gridOccludes(const Ray &ray, const Grid &grid, double t_max) {
+	bool hit = false;
+	grid.walk(ray, 0.0, t_max,
+		[&](SceneObject *obj) { hit = hit || occludes(ray, obj, t_max); },
+		[&](double) { return hit; });
+	return hit;
+}
 
 // returns true if under shadow
-bool World::traceShadowRay(const Ray &ray, std::vector<SceneObject*> &objSpace) {
+bool World::traceShadowRay(const Ray &ray, std::vector<SceneObject*> &objSpace, double t_max) {
 	for (std::vector<SceneObject*>::iterator it = objSpace.begin(); it != objSpace.end(); it++) {
-		SceneObject *obj = *it;
-		IntersectionResult iResult = obj->intersects(ray);
-		if (iResult.intersected) {
-			if (!obj->isCluster()) {
-				if (iResult.coefficient > SHADOW_EPS)
-					return true;
-			}
-			else {
-				Cluster *cluster = static_cast<Cluster*>(obj);
-				if (traceShadowRay(ray, cluster->boundedObjects))
-					return true;
-			}
-		}
+		if (occludes(ray, *it, t_max))
+			return true;
 	}
 
 	return false;
 }
 
+// keeps obj's hit (or the first hit inside it, if it's a cluster) in
+// best if it's the closest yet
+void World::closerHit(const Ray &ray, double t_min, SceneObject *obj, IntersectionDatum &best) {
+	IntersectionResult iResult = obj->intersects(ray);
+	if (!iResult.intersected)
+		return;
+
+	if (obj->isCluster()) {
+		Cluster *cluster = static_cast<Cluster*>(obj);
+		IntersectionDatum ir = cluster->isGrid() ? gridIntersection(ray, t_min, *static_cast<Grid*>(cluster))
+			: testIntersection(ray, t_min, cluster->contents());
+		if (ir.intersected && ir.coefficient > t_min && (!best.intersected || ir.coefficient < best.coefficient))
+			best = ir;
+	}
+	else if (iResult.coefficient > t_min && (!best.intersected || iResult.coefficient < best.coefficient))
+		best = IntersectionDatum(iResult, obj);
+}
+
+// every hit is kept, even one past the cell it was found in, so once the
+// best is inside the cell just walked nothing further on can beat it
+IntersectionDatum World::gridIntersection(const Ray &ray, double t_min, const Grid &grid) {
+	IntersectionDatum best;
+	grid.walk(ray, t_min, INFINITY,
+		[&](SceneObject *obj) { closerHit(ray, t_min, obj, best); },
+		[&](double t_exit) { return best.intersected && best.coefficient <= t_exit; });
+	return best;
+}
+
 IntersectionDatum World::testIntersection(const Ray &ray, double t_min, std::vector<SceneObject*> &objectSpace) {
-	SceneObject *closestObject = NULL;
-	double t = 0.0;
-
-	for (std::vector<SceneObject*>::iterator it = objectSpace.begin(); it != objectSpace.end(); it++) {
-		SceneObject *scene_obj = *it;
-		IntersectionResult iResult = scene_obj->intersects(ray);
-		if (iResult.intersected) {
-			if (scene_obj->isCluster()) {
-				Cluster *cluster = static_cast<Cluster*>(scene_obj);
-				IntersectionDatum ir = testIntersection(ray, t_min, cluster->boundedObjects);
-				if (ir.intersected) {
-					if (ir.coefficient > t_min && (closestObject == NULL || ir.coefficient < t)) {
-						closestObject = ir.intersectedObj;
-						t = ir.coefficient;
-					}
-				}
-			}	
-			else if (iResult.coefficient > t_min && (closestObject == NULL || iResult.coefficient < t)) {
-				closestObject = scene_obj;
-				t = iResult.coefficient;
-			}
+	IntersectionDatum best;
+	for (std::vector<SceneObject*>::iterator it = objectSpace.begin(); it != objectSpace.end(); it++)
+		closerHit(ray, t_min, *it, best);
+	return best;
+}
+
+// a point's seed only depends on where it is, so the same lights are
+// picked for it whichever thread shades it
+static unsigned int pointSeed(const vec3 &p, int depth) {
+	const double c[3] = { p.x(), p.y(), p.z() };
+	uint64_t h = static_cast<uint64_t>(depth) * 0x9e3779b97f4a7c15ull;
+	for (int k = 0; k < 3; k++) {
+		uint64_t bits;
+		memcpy(&bits, &c[k], sizeof(bits));
+		h = (h ^ bits) * 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+	}
+	return static_cast<unsigned int>(h);
+}
+
+// each light gets a different set of samples at the same point
+static unsigned int lightSeed(unsigned int seed, long light) {
+	return seed ^ (static_cast<unsigned int>(light) + 1) * 2654435761u;
+}
+
+// is there nothing between p and the point q on a light? unlike a
+// point light's, these shadow rays stop at the light
+bool World::reaches(const vec3 &p, const vec3 &q) {
+	vec3 to = q - p;
+	double dist = to.magnitude();
+	return !traceShadowRay(Ray(p, to.scaled(1.0 / dist)), scenery, dist);
+}
+
+// points over the light are spread out so that each of the n samples
+// gets a 1/n slice of the light both ways (a latin hypercube), so even
+// a few cover all of it. otherwise, one goes to the centre and the rest
+// are spaced evenly round the edge
+int World::litSamples(const Light &light, const vec3 &p, int n, bool edge, unsigned int &seed) {
+	int lit = 0;
+	if (edge) {
+		double start = rand_r(&seed) / (RAND_MAX + 1.0) / n;
+		for (int k = 0; k < n - 1; k++)
+			if (reaches(p, light.edgePoint(start + static_cast<double>(k) / (n - 1), p)))
+				lit++;
+		if (reaches(p, light.pos))
+			lit++;
+		return lit;
+	}
+
+	int order[MAX_SHADOW_SAMPLES];
+	n = std::min(n, MAX_SHADOW_SAMPLES);
+	for (int k = 0; k < n; k++)
+		order[k] = k;
+	for (int k = n - 1; k > 0; k--)
+		std::swap(order[k], order[rand_r(&seed) % (k + 1)]);
+
+	for (int k = 0; k < n; k++) {
+		double s = (k + rand_r(&seed) / (RAND_MAX + 1.0)) / n;
+		double t = (order[k] + rand_r(&seed) / (RAND_MAX + 1.0)) / n;
+		if (reaches(p, light.pointOn(s, t, p)))
+			lit++;
+	}
+	return lit;
+}
+
+// a cheap test for points that are fully lit: every shadow ray to the
+// light stays within its extent of the line to its centre, so if no
+// bounding box comes that close, none of the rays can be blocked
+bool World::nothingBetween(const Light &light, const vec3 &p, const vec3 &n, const SceneObject *self,
+		std::vector<SceneObject*> &objSpace) {
+	const double extent = light.extent();
+
+	for (size_t i = 0; i < objSpace.size(); i++) {
+		SceneObject *obj = objSpace[i];
+		if (obj == self && obj->isConvex()) {
+			if (n.dot(light.pos - p) > extent)
+				continue;
+			return false;
 		}
+
+		if (!obj->isBounded()) {
+			// planes only get in the way of lights on their other side
+			Plane *plane = dynamic_cast<Plane*>(obj);
+			if (plane == NULL)
+				return false;
+			double here = plane->signedDistance(p);
+			double there = plane->signedDistance(light.pos);
+			if (here > 0.0 ? there - extent > 0.0 : there + extent < 0.0)
+				continue;
+			return false;
+		}
+
+		if (!obj->getBoundBox().touchesSegment(p, light.pos, extent))
+			continue;
+		// a grid's cells aren't much use for this, so it's given up on
+		if (!obj->isCluster() || static_cast<Cluster*>(obj)->isGrid())
+			return false;
+		if (!nothingBetween(light, p, n, self, static_cast<Cluster*>(obj)->contents()))
+			return false;
 	}
+	return true;
+}
 
-	if (closestObject == NULL)
-		return IntersectionDatum();
-	else
-		return IntersectionDatum(t, closestObject);
+double World::lightVisibility(const Light &light, const vec3 &p, const vec3 &n, const vec3 &l,
+		const SceneObject *self, unsigned int seed) {
+	if (!light.isArea())
+		return traceShadowRay(Ray(p, l), scenery) ? 0.0 : 1.0;
+
+	if (nothingBetween(light, p, n, self, scenery))
+		return 1.0;
+
+	// a convex occluder that hides the whole edge hides all of the
+	// light. one that hides none of the edge could still be in front of
+	// the middle of it, which is what the ray to the centre is for
+	int lit = litSamples(light, p, shadow_samples_first, true, seed);
+	if (lit == 0 || lit == shadow_samples_first)
+		return lit == 0 ? 0.0 : 1.0;
+
+	// the edge is partly hidden, so we're somewhere in the penumbra
+	return static_cast<double>(litSamples(light, p, shadow_samples_most, false, seed)) / shadow_samples_most;
 }
 
+// the same comparisons, in the same order, as testIntersection makes
+// for each ray, so the same hits win. a cluster's hits are compared
+// with the best so far as they're found rather than after, which comes
+// to the same thing
+void World::packetIntersections(const Ray *rays, const int *active, int count, double t_min,
+		std::vector<SceneObject*> &objSpace, IntersectionDatum *out) {
+	int inside[RAY_PACKET_SIZE];
+
+	for (size_t o = 0; o < objSpace.size(); o++) {
+		SceneObject *obj = objSpace[o];
+		const bool cluster = obj->isCluster();
+		int entering = 0;
+
+		for (int k = 0; k < count; k++) {
+			const int r = active[k];
+			IntersectionResult iResult = obj->intersects(rays[r]);
+			if (!iResult.intersected)
+				continue;
+
+			if (cluster)
+				inside[entering++] = r;
+			else if (iResult.coefficient > t_min && (!out[r].intersected || iResult.coefficient < out[r].coefficient))
+				out[r] = IntersectionDatum(iResult, obj);
+		}
 
-RGBVec World::traceRay(const Ray &ray, double t_min, int depth) {
-	IntersectionDatum idat = testIntersection(ray, t_min, scenery);
-	
-	if (!idat.intersected)
-		return bg_colour; 
+		if (entering == 0)
+			continue;
 
-	RGBVec result_vec;
+		// rays walk a grid's cells one at a time
+		Cluster *c = static_cast<Cluster*>(obj);
+		if (!c->isGrid()) {
+			packetIntersections(rays, inside, entering, t_min, c->contents(), out);
+			continue;
+		}
+		for (int k = 0; k < entering; k++) {
+			const int r = inside[k];
+			IntersectionDatum ir = gridIntersection(rays[r], t_min, *static_cast<Grid*>(c));
+			if (ir.intersected && ir.coefficient > t_min && (!out[r].intersected || ir.coefficient < out[r].coefficient))
+				out[r] = ir;
+		}
+	}
+}
 
-	ShadableObject *obj = static_cast<ShadableObject *>(idat.intersectedObj);
-	double t = idat.coefficient;	
+void World::testIntersections(const Ray *rays, int count, double t_min, IntersectionDatum *out) {
+	int active[RAY_PACKET_SIZE];
+
+	for (int first = 0; first < count; first += RAY_PACKET_SIZE) {
+		const int size = std::min(count - first, RAY_PACKET_SIZE);
+		for (int k = 0; k < size; k++) {
+			active[k] = first + k;
+			out[first + k] = IntersectionDatum();
+		}
+		packetIntersections(rays, active, size, t_min, scenery, out);
+	}
+}
+
+// the diffuse colour at p. a texture is looked up over the width of
+// the ray's cone where it hits, stretched out the more the surface
+// slants away from it
+static RGBVec surfaceColour(const Ray &ray, double t, const ShadableObject *obj, int primitive,
+		const Material &material, const vec3 &p, const vec3 &n) {
+	double u, v, span_u, span_v;
+	if (!material.texture || !obj->textureCoordsAt(p, primitive, material.texture_scale, u, v, span_u, span_v))
+		return material.material_colour;
+
+	double slant = fabs(n.dot(ray.direction)) / ray.direction.magnitude();
+	double footprint = ray.widthAt(t) / std::max(slant, 0.05);
+	return material.texture->sample(u, v, footprint / span_u, footprint / span_v).multiplyColour(material.material_colour);
+}
+
+void World::prepareHit(const Ray &ray, const IntersectionDatum &idat, int depth, double throughput, ShadingPoint &s) {
+	s.ray = ray;
+	s.obj = static_cast<ShadableObject *>(idat.intersectedObj);
+	s.material = &s.obj->materialAt(idat);
+	s.p = ray.intersectionPoint(idat.coefficient);
+	s.n = s.obj->surfaceNormalAt(s.p, idat);
+	s.colour = surfaceColour(ray, idat.coefficient, s.obj, idat.primitive, *s.material, s.p, s.n);
+	s.depth = depth;
+	s.seed = pointSeed(s.p, depth);
+	s.reflects = false;
+
+	const Material &material = *s.material;
+	if (!reflections_enabled || !material.reflective || depth >= max_depth || lighting.empty())
+		return;
+
+	const RGBVec &k_m = material.specular_colour;
+	double next = throughput * std::max(k_m.r(), std::max(k_m.g(), k_m.b())) * lighting.size();
+
+	// russian roulette: rays that survive stand in for the ones that
+	// don't, so on average the reflection comes out the same
+	double survive = 1.0;
+	if (depth + 1 > roulette_depth && next < 1.0) {
+		unsigned int roll = s.seed ^ 0x9e3779b9u;
+		survive = next;
+		if (rand_r(&roll) / (RAND_MAX + 1.0) >= survive)
+			next = 0.0;
+	}
+
+	if (next >= min_throughput) {
+		vec3 d = ray.direction;
+		s.reflects = true;
+		s.reflected = Ray(s.p, d - s.n.scaled(2 * d.dot(s.n)), ray.widthAt(idat.coefficient), ray.spread);
+		s.throughput = std::min(next / survive, 1.0);
+		s.survive = survive;
+	}
+}
+
+// the reflected ray is the same for every light, so it's traced once
+// (and added along with each light, as it always has been)
+static RGBVec reflectionTerm(const ShadingPoint &s, const RGBVec &reflected) {
+	RGBVec reflection;
+	if (s.reflects) {
+		reflection = reflected.multiplyColour(s.material->specular_colour);
+		if (s.survive < 1.0)
+			reflection = reflection.scaled(1.0 / s.survive);
+	}
+	return reflection;
+}
+
+// what one light adds at s, visible being how much of it can be seen
+static RGBVec lightTerm(const ShadingPoint &s, const Light &light, const vec3 &l, double visible) {
+	if (visible <= 0.0)
+		return RGBVec();
+
+	vec3 v = (s.ray.origin - light.pos).normalised();
+	RGBVec shading = s.material->shade(light, s.n, v, l, s.colour);
+	if (visible < 1.0)
+		shading = shading.scaled(visible);
+	return light.range > 0.0 ? shading.scaled(light.falloff(s.p)) : shading;
+}
+
+RGBVec World::shadeHit(const ShadingPoint &s, const RGBVec &reflected) {
+	RGBVec reflection = reflectionTerm(s, reflected);
+
+	if (!lightTree.empty())
+		return sampleLights(s.ray, *s.material, s.colour, s.p, s.n, s.obj, reflection, s.seed);
+
+	RGBVec result_vec;
 
 	// compute lighting/shading
-	for (std::vector<Light>::iterator lptr = lighting.begin(); lptr != lighting.end(); lptr++) {
-		vec3 p = ray.intersectionPoint(t);
-		vec3 n = obj->surfaceNormal(p);
-		vec3 v = (ray.origin - lptr->pos).normalised();
-		vec3 l = (lptr->pos - p).normalised();
+	for (size_t k = 0; k < lighting.size(); k++) {
+		const Light &light = lighting[k];
+		vec3 l = (light.pos - s.p).normalised();
+		double visible = shadows_enabled ? lightVisibility(light, s.p, s.n, l, s.obj, lightSeed(s.seed, k)) : 1.0;
 
-		Ray shadowRay(p,l);
+		result_vec += lightTerm(s, light, l, visible);
+		result_vec += reflection;
+	}
 	
-		// if we're not in shadow w.r.t this light
-		if (!shadows_enabled || !traceShadowRay(shadowRay, scenery)) {
-			result_vec += obj->material.shade(*lptr, n, v, l); 
+	return result_vec; 
+}
+
+void World::shadeHits(const ShadingPoint *const *points, const RGBVec *reflected, int count, RGBVec *out) {
+	// lights picked from the tree are different for every hit
+	if (count == 0 || !lightTree.empty()) {
+		for (int h = 0; h < count; h++)
+			out[h] = shadeHit(*points[h], reflected[h]);
+		return;
+	}
+
+	std::vector<const Material *> materials;
+	std::unordered_map<const Material *, int> material_index;
+	std::vector<int> material(count);
+	std::vector<double> n[3], v[3], l[3], colour[3], shaded[3];
+	for (int a = 0; a < 3; a++) {
+		n[a].resize(count);
+		v[a].resize(count);
+		l[a].resize(count);
+		colour[a].resize(count);
+		shaded[a].resize(count);
+	}
+	std::vector<RGBVec> reflection(count);
+	for (int h = 0; h < count; h++) {
+		const ShadingPoint &s = *points[h];
+		std::pair<std::unordered_map<const Material *, int>::iterator, bool> added =
+			material_index.insert(std::make_pair(s.material, static_cast<int>(materials.size())));
+		if (added.second)
+			materials.push_back(s.material);
+		material[h] = added.first->second;
+
+		n[0][h] = s.n.x();
+		n[1][h] = s.n.y();
+		n[2][h] = s.n.z();
+		colour[0][h] = s.colour.r();
+		colour[1][h] = s.colour.g();
+		colour[2][h] = s.colour.b();
+		reflection[h] = reflectionTerm(s, reflected[h]);
+		out[h] = RGBVec();
+	}
+
+	ShadeBatch batch;
+	batch.count = count;
+	batch.nx = &n[0][0];
+	batch.ny = &n[1][0];
+	batch.nz = &n[2][0];
+	batch.vx = &v[0][0];
+	batch.vy = &v[1][0];
+	batch.vz = &v[2][0];
+	batch.lx = &l[0][0];
+	batch.ly = &l[1][0];
+	batch.lz = &l[2][0];
+	batch.material = &material[0];
+	batch.cr = &colour[0][0];
+	batch.cg = &colour[1][0];
+	batch.cb = &colour[2][0];
+
+	// the same sums as shadeHit's, in the same order, a light at a time
+	std::vector<double> visible(count);
+	for (size_t k = 0; k < lighting.size(); k++) {
+		const Light &light = lighting[k];
+		for (int h = 0; h < count; h++) {
+			const ShadingPoint &s = *points[h];
+			const vec3 to_light = (light.pos - s.p).normalised();
+			const vec3 from_light = (s.ray.origin - light.pos).normalised();
+			l[0][h] = to_light.x();
+			l[1][h] = to_light.y();
+			l[2][h] = to_light.z();
+			v[0][h] = from_light.x();
+			v[1][h] = from_light.y();
+			v[2][h] = from_light.z();
+			visible[h] = shadows_enabled ? lightVisibility(light, s.p, s.n, to_light, s.obj, lightSeed(s.seed, k)) : 1.0;
 		}
 
-		if (reflections_enabled && obj->material.reflective && depth < MAX_TRACE_DEPTH) {
-			// recursively trace reflection rays:
-			
-			vec3 d = ray.direction;
-			Ray reflected(p, d - n.scaled(2 * d.dot(n)));
-			RGBVec reflectedColour = traceRay(reflected, REFLECTION_EPS, depth + 1);
-			if (reflectedColour.r() == 0.0 && reflectedColour.g() == 0.0 && reflectedColour.b() == 0.0) continue;
-			RGBVec k_m = obj->material.specular_colour;
-			result_vec += reflectedColour.multiplyColour(k_m);
+		shadeBatch(light, &materials[0], batch, &shaded[0][0], &shaded[1][0], &shaded[2][0]);
+
+		for (int h = 0; h < count; h++) {
+			if (visible[h] > 0.0) {
+				RGBVec shading(shaded[0][h], shaded[1][h], shaded[2][h]);
+				if (visible[h] < 1.0)
+					shading = shading.scaled(visible[h]);
+				out[h] += light.range > 0.0 ? shading.scaled(light.falloff(points[h]->p)) : shading;
+			}
+			out[h] += reflection[h];
 		}
+	}
+}
 
+RGBVec World::shadeCameraHit(const Ray &ray, const IntersectionDatum &hit, double *visible, bool known) {
+	ShadingPoint s;
+	prepareHit(ray, hit, 0, 1.0, s);
+
+	RGBVec reflected;
+	if (s.reflects)
+		reflected = traceRay(s.reflected, REFLECTION_EPS, 1, NULL, s.throughput);
+	RGBVec reflection = reflectionTerm(s, reflected);
+
+	RGBVec result_vec;
+	for (size_t k = 0; k < lighting.size(); k++) {
+		const Light &light = lighting[k];
+		vec3 l = (light.pos - s.p).normalised();
+		if (!known)
+			visible[k] = shadows_enabled ? lightVisibility(light, s.p, s.n, l, s.obj, lightSeed(s.seed, k)) : 1.0;
+
+		result_vec += lightTerm(s, light, l, visible[k]);
+		result_vec += reflection;
 	}
+
+	return result_vec;
+}
+
+RGBVec World::traceCameraRay(const Ray &ray, IntersectionDatum &hit, double *visible) {
+	hit = testIntersection(ray, 0.0, scenery);
+	if (!hit.intersected)
+		return bg_colour;
+	return shadeCameraHit(ray, hit, visible, false);
+}
+
+bool World::blocked(const Ray &ray, double t_max) {
+	return traceShadowRay(ray, scenery, t_max);
+}
+
+bool World::samplesLights() const {
+	return !lightTree.empty();
+}
+
+RGBVec World::traceRay(const Ray &ray, double t_min, int depth, PathRecorder *rec, double throughput) {
+	IntersectionDatum idat = testIntersection(ray, t_min, scenery);
 	
-	return result_vec; 
+	if (!idat.intersected) {
+		if (rec) rec->escaped(ray, depth);
+		return bg_colour; 
+	}
+
+	if (rec) rec->hit(ray.intersectionPoint(idat.coefficient), idat.intersectedObj->id, depth);
+
+	ShadingPoint s;
+	prepareHit(ray, idat, depth, throughput, s);
+
+	RGBVec reflected;
+	if (s.reflects)
+		reflected = traceRay(s.reflected, REFLECTION_EPS, depth + 1, rec, s.throughput);
+
+	return shadeHit(s, reflected);
 }	
 
+RGBVec World::sampleLights(const Ray &ray, const Material &material, const RGBVec &colour, const vec3 &p, const vec3 &n,
+		const SceneObject *self, const RGBVec &reflection, unsigned int seed) {
+	LightSample picked[LIGHT_TREE_MAX_SAMPLES];
+	int count = lightTree.select(p, n, light_samples, seed, picked);
+
+	// weights can be well over 1, so the sum is kept unclamped until
+	// the end. it stands in for every light in the scene, so it adds the
+	// reflection that many times, like the loop in traceRay
+	vec3 sum(0.0, 0.0, 0.0);
+	for (int k = 0; k < count; k++) {
+		const Light &light = lighting[picked[k].light];
+		vec3 v = (ray.origin - light.pos).normalised();
+		vec3 l = (light.pos - p).normalised();
+
+		RGBVec shading = material.shade(light, n, v, l, colour);
+		if (light.range > 0.0)
+			shading = shading.scaled(light.falloff(p));
+		RGBVec term = shading.scaled(picked[k].weight);
+
+		// too faint to be worth a shadow ray: it's counted as lit
+		bool dim = 0.2126 * term.r() + 0.7152 * term.g() + 0.0722 * term.b() < light_cutoff;
+		double visible = (!shadows_enabled || dim) ? 1.0 : lightVisibility(light, p, n, l, self, lightSeed(seed, picked[k].light));
+		sum += shading.getVector().scaled(picked[k].weight * visible);
+	}
+
+	sum += vec3(reflection.r(), reflection.g(), reflection.b()).scaled(static_cast<double>(lighting.size()));
+	return RGBVec(sum);
+}
+
 // this is not optimal but we don't care
 // for tiny n
 int int_pow(int x, int n) {
@@ -165,63 +675,157 @@ int int_pow(int x, int n) {
 	return x * int_pow(x, n-1);
 }
 
-// TODO: implement adaptive supersampling
+// a ray from the camera through (u, v), as wide as `across` of the
+// viewport where it goes through it
+static Ray cameraRay(const Camera &cam, double u, double v, double d, double across) {
+	vec3 direction = cam.directionThrough(u, v, d);
+	return Ray(cam.position, direction, 0.0, across / d * direction.magnitude());
+}
+
+static double pixelWidth(const Viewport &vp) {
+	return vp.uAt(1.0) - vp.uAt(0.0);
+}
+
+Ray World::pixelRay(const Camera &cam, const Viewport &vp, int i, int j) {
+	return cameraRay(cam, vp.uAt(i + 0.5), vp.vAt(j + 0.5), vp.getViewingDistance(), pixelWidth(vp));
+}
+
+RGBVec World::sampleAt(const Camera &cam, const Viewport &vp, double x, double y) {
+	Ray theRay = cameraRay(cam, vp.uAt(x), vp.vAt(y), vp.getViewingDistance(), pixelWidth(vp));
+	return traceRay(theRay, 0.0, 0);
+}
+
+SurfaceInfo World::surfaceAt(const Camera &cam, const Viewport &vp, double x, double y) {
+	Ray theRay = cameraRay(cam, vp.uAt(x), vp.vAt(y), vp.getViewingDistance(), pixelWidth(vp));
+	const vec3 &direction = theRay.direction;
+
+	SurfaceInfo s;
+	IntersectionDatum idat = testIntersection(theRay, 0.0, scenery);
+	if (!idat.intersected)
+		return s;
+
+	ShadableObject *obj = static_cast<ShadableObject *>(idat.intersectedObj);
+	s.hit = true;
+	s.position = theRay.intersectionPoint(idat.coefficient);
+	s.normal = obj->surfaceNormalAt(s.position, idat);
+	if (s.normal.dot(direction) > 0.0)
+		s.normal = s.normal.scaled(-1.0);
+	s.depth = idat.coefficient * direction.magnitude();
+	s.albedo = surfaceColour(theRay, idat.coefficient, obj, idat.primitive, obj->materialAt(idat), s.position, s.normal);
+	s.object = obj->id;
+	return s;
+}
+
 RGBColour World::colourForPixelAt(int i, int j) {
-	double d = viewport.getViewingDistance();
+	return colourForPixelAt(view, viewport, ss_level, i, j, renderStats);
+}
 
-	if (ss_level == 1) {
-		// no super-sampling
-		double uValue = viewport.uAmount(i, 1, 0, false);
-		double vValue = viewport.vAmount(j, 1, 0, false);
-		vec3 direction = wAxis.scaled(-d) + uAxis.scaled(uValue) + vAxis.scaled(vValue);
-		Ray theRay(cameraPosition, direction);
+// jitter is seeded per pixel, so a pixel comes out the same no
+// matter which thread renders it, or in what order
+static unsigned int pixelSeed(int i, int j) {
+	return static_cast<unsigned int>(i) * 73856093u ^ static_cast<unsigned int>(j) * 19349663u;
+}
+
+RGBColour World::colourForPixelAt(const Camera &cam, const Viewport &vp, int ss_level, int i, int j, RenderStats &stats,
+		PathRecorder *rec) {
+	return RGBColour(radianceForPixelAt(cam, vp, ss_level, i, j, stats, rec));
+}
 
-		return RGBColour(traceRay(theRay, 0.0, 0));
+RGBVec World::radianceForPixelAt(const Camera &cam, const Viewport &vp, int ss_level, int i, int j, RenderStats &stats,
+		PathRecorder *rec) {
+	PixelSampler sampler(cam, vp, ss_level, i, j);
+	std::vector<Ray> rays;
+	std::vector<RGBVec> samples;
+
+	while (!sampler.done()) {
+		rays.clear();
+		sampler.nextRays(rays);
+		samples.resize(rays.size());
+		for (size_t k = 0; k < rays.size(); k++)
+			samples[k] = traceRay(rays[k], 0.0, 0, rec);
+		sampler.addSamples(&samples[0]);
 	}
 
-	// 0.01 => x16, 1.2 => x64
-	double thresholds[2] = {0.01, 1.2}; 
+	return sampler.radiance(stats);
+}
 
+/* PixelSampler implementation */
 
-	double var = 0.0;
-	int lvl_log = 2;
+PixelSampler::PixelSampler(const Camera &c, const Viewport &v, int ss, int pi, int pj) :
+	cam(&c), vp(&v), ss_level(ss), i(pi), j(pj), seed(pixelSeed(pi, pj)), lvl_log(2), var(0.0),
+	finished(ss != 1 && ss < 2) {}
 
-	RGBVec pixelColour;
+bool PixelSampler::done() const {
+	return finished;
+}
 
-	while (lvl_log <= ss_level) {
-		pixelColour = RGBVec(0.0,0.0,0.0);
+void PixelSampler::nextRays(std::vector<Ray> &out) {
+	double d = vp->getViewingDistance();
 
-		int lvl = int_pow(2, lvl_log - 1); 
+	if (ss_level == 1) {
+		// no super-sampling
+		double uValue = vp->uAmount(i, 1, 0, false, &seed);
+		double vValue = vp->vAmount(j, 1, 0, false, &seed);
+		out.push_back(cameraRay(*cam, uValue, vValue, d, pixelWidth(*vp)));
+		return;
+	}
+
+	int lvl = int_pow(2, lvl_log - 1); 
+	for (int a = 0; a < lvl; a++) {
+		for (int b = 0; b < lvl; b++) {
+			// samples are spread over a lvl x lvl grid across the pixel
+			double uValue = vp->uAmount(i, lvl, a, lvl_log > 2, &seed);
+			double vValue = vp->vAmount(j, lvl, b, lvl_log > 2, &seed);
+			out.push_back(cameraRay(*cam, uValue, vValue, d, pixelWidth(*vp) / lvl));
+		}
+	}
+}
 
-		double scale_factor = 1.0 / static_cast<double>(lvl*lvl);
+void PixelSampler::addSamples(const RGBVec *samples) {
+	if (ss_level == 1) {
+		pixelColour = samples[0];
+		finished = true;
+		return;
+	}
 
-		vec3 sum_x_sq(0.0,0.0,0.0);
+	// 0.01 => x16, 1.2 => x64
+	double thresholds[2] = {0.01, 1.2}; 
 
-		for (int a = 0; a < lvl; a++) {
-			for (int b = 0; b < lvl; b++) {
-				double uValue = viewport.uAmount(i, ss_level, a, lvl_log > 2);
-				double vValue = viewport.vAmount(j, ss_level, b, lvl_log > 2);
-				vec3 direction = wAxis.scaled(-d) + uAxis.scaled(uValue) + vAxis.scaled(vValue);	
-				Ray theRay(cameraPosition, direction);
-				RGBVec sample = traceRay(theRay, 0.0, 0).scaled(scale_factor);
-				pixelColour += sample;
-				if (ss_level > 2) sum_x_sq += sample.getVector().pointwise(sample.getVector());
-			}
-		}		
+	int lvl = int_pow(2, lvl_log - 1); 
+	double scale_factor = 1.0 / static_cast<double>(lvl*lvl);
 
-		if (lvl_log == 2 && ss_level > 2) {
-			vec3 varvec = sum_x_sq.scaled(scale_factor) - pixelColour.getVector().pointwise(pixelColour.getVector());
-			var = varvec.magnitude();
-			if (i % 100 == 0 && j % 100 == 0) std::cout << "var: " << var << std::endl;
-		}
+	pixelColour = RGBVec(0.0,0.0,0.0);
+	vec3 sum_x_sq(0.0,0.0,0.0);
 
-		if (var < thresholds[lvl_log - 2] || lvl_log == ss_level) break;
-		lvl_log++;
+	for (int k = 0; k < lvl * lvl; k++) {
+		RGBVec sample = samples[k].scaled(scale_factor);
+		pixelColour += sample;
+		if (ss_level > 2) sum_x_sq += sample.getVector().pointwise(sample.getVector());
 	}
 
-	if (lvl_log == 2) renderStats.ss_x4++;
-       	else if (lvl_log == 3) renderStats.ss_x16++;
-	else if (lvl_log == 4) renderStats.ss_x64++;
+	if (lvl_log == 2 && ss_level > 2) {
+		vec3 varvec = sum_x_sq.scaled(scale_factor) - pixelColour.getVector().pointwise(pixelColour.getVector());
+		var = varvec.magnitude();
+		D( if (i % 100 == 0 && j % 100 == 0) std::cerr << "var: " << var << std::endl; )
+	}
 
-	return RGBColour(pixelColour);
-}	
+	if (lvl_log == ss_level || var < thresholds[lvl_log - 2])
+		finished = true;
+	else
+		lvl_log++;
+}
+
+RGBVec PixelSampler::radiance(RenderStats &stats) const {
+	if (ss_level == 1)
+		return pixelColour;
+
+	if (lvl_log == 2) stats.ss_x4++;
+       	else if (lvl_log == 3) stats.ss_x16++;
+	else if (lvl_log == 4) stats.ss_x64++;
+
+	return pixelColour;
+}
+
+RGBColour PixelSampler::colour(RenderStats &stats) const {
+	return RGBColour(radiance(stats));
+}
@@ -4,28 +4,121 @@
  * and all the world-like things (scene objects, for example)
  * */
 
+#ifndef WORLD_HEADER_WARRIOR
+#define WORLD_HEADER_WARRIOR
+
 #include <vector>
 #include <string>
 #include <cmath>
 
 #include "ray.hpp"
+#include "camera.hpp"
 #include "viewport.hpp"
 #include "colour.hpp"
 #include "light.hpp"
 #include "geometry.hpp"
+#include "grid.hpp"
+#include "lighttree.hpp"
+#include "pagecache.hpp"
 #include "debug.h"
 
+struct PathRecorder;	// see incremental.hpp
+
 enum SuperSamplingMode { ss_off, ss_on, ss_adaptive }; 
 
+#define DEFAULT_LIGHT_SAMPLES 8
+#define DEFAULT_LIGHT_CUTOFF (1.0 / 512.0)
+#define DEFAULT_SHADOW_SAMPLES_FIRST 5
+#define DEFAULT_SHADOW_SAMPLES_MOST 16
+#define MAX_SHADOW_SAMPLES 256
+#define DEFAULT_MAX_DEPTH 3
+#define DEFAULT_ROULETTE_DEPTH 3
+#define DEFAULT_MIN_THROUGHPUT (1.0 / 512.0)
+
+#define REFLECTION_EPS 	0.00001
+#define SHADOW_EPS 	0.00001
+
+// the most rays World::testIntersections takes down the hierarchy at once
+#define RAY_PACKET_SIZE 64
+
+// what the ray through a point of the viewport hits first, for filters
+// that need to know where the edges in the image are (see denoise.hpp)
+struct SurfaceInfo {
+	bool hit;
+	vec3 position;
+	vec3 normal;		// facing the camera
+	double depth;		// distance from the camera
+	RGBVec albedo;		// the diffuse colour of the material
+	int object;		// SceneObject::id, -1 if nothing was hit
+
+	SurfaceInfo();
+};
+
+// a ray's first hit, with all that's needed to shade it once the ray
+// reflected from it (if there is one) has been traced. traceRay does
+// that straight away, coherent.hpp a whole bounce of rays at a time
+struct ShadingPoint {
+	Ray ray;
+	ShadableObject *obj;
+	const Material *material;
+	vec3 p;
+	vec3 n;
+	RGBVec colour;		// diffuse, from the texture if there is one
+	int depth;
+	unsigned int seed;
+
+	bool reflects;		// the rest are only set if it does
+	Ray reflected;
+	double throughput;	// the reflected ray's
+	double survive;		// its chance of surviving russian roulette
+
+	ShadingPoint();
+};
+
 struct RenderStats {
 	int ss_x4;
 	int ss_x16;
 	int ss_x64;
 
 	RenderStats();
+	void merge(const RenderStats &other);
 	void summarise();
 };
 
+/* PixelSampler
+ *
+ * the adaptive super-sampling of one pixel, as colourForPixelAt does
+ * it, split into rounds so that the rays of many pixels can be traced
+ * together. each round hands out a batch of rays and is given back the
+ * colours they came back with, until the pixel is done */
+class PixelSampler {
+private:
+	const Camera *cam;
+	const Viewport *vp;
+	int ss_level;
+	int i, j;
+	unsigned int seed;
+	int lvl_log;
+	double var;		// of the first round, which decides how far to go
+	bool finished;
+	RGBVec pixelColour;
+
+public:
+	PixelSampler(const Camera &cam, const Viewport &vp, int ss_level, int i, int j);
+
+	bool done() const;
+
+	// appends the rays for the next round to `out`
+	void nextRays(std::vector<Ray> &out);
+
+	// what those rays came back with, in the same order
+	void addSamples(const RGBVec *samples);
+
+	// the pixel, once it's done. counts it in `stats`
+	RGBVec radiance(RenderStats &stats) const;
+	RGBColour colour(RenderStats &stats) const;
+};
+
 class World {
 public:
 	Viewport viewport;
@@ -36,23 +129,175 @@ public:
 	int ss_level;
 	int ss_mode;
 
+	// scenes with more lights than light_samples only shade that many
+	// at each hit, picked from a LightTree (see lighttree.hpp). 0 always
+	// shades every light. picked lights adding less than light_cutoff
+	// (in brightness) don't get a shadow ray
+	int light_samples;
+	double light_cutoff;
+
+	// shadow rays to each area light at each hit. unless nothing can
+	// possibly be in the way, the first few go to the light's centre and
+	// points round its edge: if they all agree the point is taken to be
+	// fully lit or in shadow, otherwise it's in the penumbra and
+	// shadow_samples_most more are spread over the light
+	int shadow_samples_first;
+	int shadow_samples_most;
+
+	// reflections are traced to at most max_depth bounces. each ray
+	// carries its throughput, the most it can add to the pixel: a bounce
+	// that could add less than min_throughput isn't traced, and ones
+	// deeper than roulette_depth only carry on with a chance of their
+	// throughput (and count for that much more if they do)
+	int max_depth;
+	int roulette_depth;
+	double min_throughput;
+
+	// what buildHierarchy puts the bounded top-level objects in: nested
+	// clusters, or a grid (see grid.hpp)
+	Accelerator accelerator;
+
+	// with lazy_build, buildHierarchy only splits the top few levels of
+	// clusters, and the rest are split as rays first reach them (see
+	// Cluster::subdivideLazily). the first pixels come out sooner, and
+	// the parts of a big scene a render never sees are never split.
+	// either way the clusters, and so the image, come out the same
+	bool lazy_build;
+
+	// shared by all out-of-core geometry in the scene, NULL if there isn't any
+	std::shared_ptr<PageCache> pageCache;
+
 	~World();
 	World(Viewport, const vec3 &cameraPos, const RGBVec &bg_colour); 
 	void addObject(const SceneObject&);
+	void adoptObject(SceneObject *);	// takes ownership, no copy
 	void addLight(const Light&);
 	IntersectionDatum testIntersection(const Ray &r, double t_min, std::vector<SceneObject*> &objSpace);
-	RGBVec traceRay(const Ray &r, double t_min, int depth);
-	bool traceShadowRay(const Ray &r, std::vector<SceneObject*> &objspace);
+	// if `rec` isn't NULL, it's told where the ray and its reflections
+	// went. throughput is how much of the ray's colour reaches the pixel
+	RGBVec traceRay(const Ray &r, double t_min, int depth, PathRecorder *rec = NULL, double throughput = 1.0);
+
+	// the first hits of `count` rays, as testIntersection against the
+	// whole scene would find them. the rays are taken down the hierarchy
+	// RAY_PACKET_SIZE at a time, so rays that go the same way share the
+	// work of getting each cluster into cache
+	void testIntersections(const Ray *rays, int count, double t_min, IntersectionDatum *out);
+
+	// traceRay in two halves: the first fills in s for a ray that hit
+	// something, and decides whether to follow its reflection. the second
+	// shades it, given what the reflected ray came back with
+	void prepareHit(const Ray &r, const IntersectionDatum &hit, int depth, double throughput, ShadingPoint &s);
+	RGBVec shadeHit(const ShadingPoint &s, const RGBVec &reflected);
+
+	// shadeHit for `count` hits at once, each light going through
+	// shadeBatch (see material.hpp) for all of them together. the
+	// results are within SHADE_BATCH_TOLERANCE a term of shadeHit's
+	void shadeHits(const ShadingPoint *const *points, const RGBVec *reflected, int count, RGBVec *out);
+	// anything past t_max along the ray doesn't count
+	bool traceShadowRay(const Ray &r, std::vector<SceneObject*> &objspace, double t_max = INFINITY);
+
+	// how much of the light can be seen from p, which is on `self`
+	// with normal n (l points from p to the light's centre): 0 or 1 for
+	// point lights, a fraction for area lights. the seed picks where
+	// area lights are sampled
+	double lightVisibility(const Light &light, const vec3 &p, const vec3 &n, const vec3 &l,
+			const SceneObject *self, unsigned int seed);
 	RGBColour colourForPixelAt(int i, int j);
 
+	// renders a pixel as seen from an arbitrary camera and viewport
+	// without touching any state in the world, so it is safe to call
+	// from several threads at once
+	RGBColour colourForPixelAt(const Camera &cam, const Viewport &vp, int ss_level, int i, int j, RenderStats &stats,
+			PathRecorder *rec = NULL);
+
+	// the same, before it's rounded to 8 bits
+	RGBVec radianceForPixelAt(const Camera &cam, const Viewport &vp, int ss_level, int i, int j, RenderStats &stats,
+			PathRecorder *rec = NULL);
+
+	// a single sample through the point (x, y) of the viewport,
+	// measured in pixels. like colourForPixelAt, this is thread safe
+	RGBVec sampleAt(const Camera &cam, const Viewport &vp, double x, double y);
+
+	// the first hit of the ray through (x, y), without any shading
+	SurfaceInfo surfaceAt(const Camera &cam, const Viewport &vp, double x, double y);
+
+	void setCameraPosition(const vec3 &pos);
 	void cameraRotateY(double theta);
 	void cameraRotateX(double theta);
+	const Camera &camera() const;
+
+	// groups the scenery into nested clusters (or bins it into a grid,
+	// see accelerator) so that rays only have to look at a handful of
+	// objects at each level, and builds the light tree if there are
+	// enough lights to need one
+	void buildHierarchy();
+
+	// fixes up the clusters' bounding boxes after objects have moved
+	void refitHierarchy();
+
+	// every object that isn't a cluster, in the order they were added
+	// (as long as the hierarchy hasn't been built yet)
+	void collectObjects(std::vector<SceneObject*> &out);
+
+	// gives those objects ids 0, 1, 2... in the same order
+	void numberObjects();
+
+	const std::vector<Light> &lights() const;
+
+	// true if hits are shaded with lights picked from a LightTree,
+	// rather than every light
+	bool samplesLights() const;
+
+	// the ray through the middle of pixel (i, j), the one colourForPixelAt
+	// traces with super-sampling off
+	static Ray pixelRay(const Camera &cam, const Viewport &vp, int i, int j);
+
+	// for ReprojectionCache, in scenes that shade every light: traceRay
+	// for a camera ray, handing back what it hit first (hit.intersected
+	// is false if nothing) and how much of each light (in the order of
+	// lights()) could be seen from there
+	RGBVec traceCameraRay(const Ray &r, IntersectionDatum &hit, double *visible);
+
+	// the rest of traceCameraRay, once the hit is known. visible is
+	// filled in unless it's already `known`, in which case no shadow rays
+	// are cast. reflections are traced either way
+	RGBVec shadeCameraHit(const Ray &r, const IntersectionDatum &hit, double *visible, bool known);
+
+	// true if anything in the scene is along the ray before t_max
+	bool blocked(const Ray &r, double t_max);
 
 private:
 	std::vector<SceneObject*> scenery;
 	std::vector<Light> lighting;
-	vec3 uAxis;
-	vec3 vAxis;
-	vec3 wAxis;
-	vec3 cameraPosition;
+	LightTree lightTree;	// empty unless lights are being sampled
+	Camera view;
+
+	// shades a hit with the lights picked from the light tree
+	RGBVec sampleLights(const Ray &r, const Material &material, const RGBVec &colour, const vec3 &p, const vec3 &n,
+			const SceneObject *self, const RGBVec &reflection, unsigned int seed);
+
+	// how many of n shadow rays from p to points spread over the light
+	// (or round its edge) get there
+	int litSamples(const Light &light, const vec3 &p, int n, bool edge, unsigned int &seed);
+	bool reaches(const vec3 &p, const vec3 &q);
+
+	// tests the rays numbered in `active` against objSpace, and keeps
+	// whichever hit is closer, the one already in `out` or a new one
+	void packetIntersections(const Ray *rays, const int *active, int count, double t_min,
+			std::vector<SceneObject*> &objSpace, IntersectionDatum *out);
+
+	void subdivideCluster(Cluster *cluster);
+
+	// testIntersection and traceShadowRay for a single object, and for
+	// the objects in the cells of a grid that a ray passes through
+	void closerHit(const Ray &r, double t_min, SceneObject *obj, IntersectionDatum &best);
+	bool occludes(const Ray &r, SceneObject *obj, double t_max);
+	IntersectionDatum gridIntersection(const Ray &r, double t_min, const Grid &grid);
+	bool gridOccludes(const Ray &r, const Grid &grid, double t_max);
+
+	// true if nothing in objSpace can be in the way of the light
+	bool nothingBetween(const Light &light, const vec3 &p, const vec3 &n, const SceneObject *self,
+			std::vector<SceneObject*> &objSpace);
 };
+
+#endif